@@ -0,0 +1,256 @@
+#pragma once
+#ifndef GRICS_ARTICULATION_H
+#define GRICS_ARTICULATION_H
+
+#include "body.h"
+#include <vector>
+
+namespace Grics {
+
+    /**
+     * An articulation is a tree of links, each joined to its parent
+     * (or to the world) by a joint with one degree of freedom, such as
+     * a robot arm, a crane or a ragdoll. Rather than holding each link
+     * as a free body kept in place by constraints, it holds only the
+     * position and rate of each joint, so the links can't drift apart,
+     * and it finds the joint accelerations exactly with Featherstone's
+     * articulated body algorithm, in time proportional to the number
+     * of links. A long chain costs no more iterations than a short
+     * one.
+     *
+     * Each link has a rigid body, which holds its mass and inertia,
+     * takes forces and gravity as usual, and is what the collision
+     * geometry is attached to. The articulation moves the bodies to
+     * match the joints; they must not be added to the world's bodies
+     * as well, or they will be integrated twice.
+     *
+     * Contacts with the links are solved by the world's contact
+     * resolver (or solver) as for any other body. Afterwards the
+     * articulation takes the changes the resolver made to each link's
+     * velocity and position, works out the impulses that made them,
+     * and applies those impulses to the whole articulation. The
+     * resolver only sees each link's own mass, so a contact may be
+     * left a little short of resolved, which later frames take up.
+     *
+     * A root link (one with no parent) may instead be floating, free
+     * to move in all six directions, which suits ragdolls and
+     * vehicles.
+     */
+    class Articulation
+    {
+    public:
+        /**
+         * Identifies the kind of joint a link has to its parent.
+         */
+        enum JointType
+        {
+            /** Turns about an axis through the anchor. */
+            REVOLUTE,
+
+            /** Slides along an axis, without turning. */
+            PRISMATIC,
+
+            /** Moves freely. Only a root link can be floating. */
+            FLOATING
+        };
+
+        Articulation();
+
+        /**
+         * Adds a link, returning its index. The joint is set up from
+         * the current positions of the bodies, so place the body
+         * where the joint is at zero first. The parent is the index
+         * of a link added earlier, or -1 to join the link to the
+         * world. The anchor and axis are in world space, and are
+         * ignored for floating links.
+         */
+        unsigned addLink(RigidBody* body, int parent, JointType type,
+            const Vector3& anchor = Vector3(),
+            const Vector3& axis = Vector3());
+
+        unsigned getLinkCount() const;
+
+        RigidBody* getLinkBody(unsigned link) const;
+
+        /**
+         * Gets and sets the position of a link's joint: its angle in
+         * radians for a revolute joint, or its distance along the
+         * axis for a prismatic one. Call updateLinks after setting
+         * positions or rates, to move the bodies.
+         */
+        real getJointPosition(unsigned link) const;
+        void setJointPosition(unsigned link, real position);
+
+        /**
+         * Gets and sets the rate a link's joint is moving at.
+         */
+        real getJointRate(unsigned link) const;
+        void setJointRate(unsigned link, real rate);
+
+        /**
+         * Adds a torque (or force, for a prismatic joint) to a link's
+         * joint for the next integration step only, acting on the link
+         * and equally and oppositely on its parent. This is how a
+         * motor drives the joint.
+         */
+        void addJointForce(unsigned link, real force);
+
+        /**
+         * Sets the fastest any joint may move. The joints are
+         * integrated one step at a time, as the bodies are, and a
+         * fast whip at the end of a long chain can otherwise gain
+         * energy until it blows up.
+         */
+        void setMaxJointRate(real maxJointRate);
+
+        /**
+         * Moves the link bodies to match the joints.
+         */
+        void updateLinks();
+
+        /**
+         * Integrates the articulation forward by the given duration,
+         * applying the gravity and forces on each link's body, and
+         * moves the bodies. The forces are cleared afterwards, unless
+         * keepForces is set, as for RigidBody::integrate.
+         */
+        void integrate(real duration, bool keepForces = false);
+
+        /**
+         * Takes up any changes made to the link bodies' velocities
+         * and positions since the last integration (by the contact
+         * resolver, say), applying them to the joints, then moves the
+         * bodies to match.
+         */
+        void applyBodyChanges();
+
+    protected:
+        /**
+         * Holds a spatial motion or force: the angular and linear
+         * parts, both measured at the articulation's origin.
+         */
+        struct SpatialVector
+        {
+            Vector3 angular;
+            Vector3 linear;
+        };
+
+        /**
+         * Holds a spatial inertia, taking spatial motions to spatial
+         * forces. The angular part comes first.
+         */
+        struct SpatialMatrix
+        {
+            real data[6][6];
+        };
+
+        struct Link
+        {
+            RigidBody* body;
+
+            /** The index of the parent link, or -1 for the world. */
+            int parent;
+
+            JointType type;
+
+            /**
+             * Holds the anchor in the parent's space (or the world's),
+             * and in the link's.
+             */
+            Vector3 parentAnchor;
+            Vector3 childAnchor;
+
+            /** Holds the joint axis in the parent's space. */
+            Vector3 axis;
+
+            /**
+             * Holds the orientation of the link relative to its
+             * parent when the joint is at zero.
+             */
+            Quaternion relativeOrientation;
+
+            /** The joint position, rate and the force on it. */
+            real position;
+            real rate;
+            real jointForce;
+
+            /** Holds the state of a floating link. */
+            Vector3 rootPosition;
+            Quaternion rootOrientation;
+            Vector3 rootVelocity;
+            Vector3 rootRotation;
+
+            /** Holds the mass and the inertia tensor in body space. */
+            real mass;
+            Matrix3 inertiaTensor;
+
+            /**
+             * Holds what the link's body was last set to, to find the
+             * changes made to it since.
+             */
+            Vector3 centre;
+            Quaternion orientation;
+            Vector3 velocity;
+            Vector3 rotation;
+
+            /** Holds the centre measured from the origin. */
+            Vector3 arm;
+
+            /**
+             * Holds the joint's motion for a unit rate, the link's
+             * velocity, the acceleration that follows from the joint
+             * moving with the link, and the link's spatial inertia,
+             * all worked out from the joints.
+             */
+            SpatialVector motion;
+            SpatialVector spatialVelocity;
+            SpatialVector biasAcceleration;
+            SpatialMatrix inertia;
+
+            /**
+             * Holds the force applied to the link, then the inertia
+             * and bias force of the link together with everything
+             * beyond it, and the inertia and force along the joint.
+             */
+            SpatialVector force;
+            SpatialMatrix articulatedInertia;
+            SpatialVector articulatedForce;
+            SpatialVector inertiaMotion;
+            real jointInertia;
+            real jointBias;
+
+            /** Holds the accelerations found. */
+            SpatialVector acceleration;
+            real jointAcceleration;
+        };
+
+        std::vector<Link> links;
+
+        /**
+         * Holds the fastest any joint may move.
+         */
+        real maxJointRate;
+
+        /**
+         * Holds the point the spatial quantities are measured at,
+         * which moves with the first link.
+         */
+        Vector3 origin;
+
+        /**
+         * Works out each link's place, velocity and inertia from the
+         * joints, and sets its body to match.
+         */
+        void calculateKinematics();
+
+        /**
+         * Finds the acceleration of each link and joint from the
+         * forces on the links. For impulses, the velocity terms and
+         * joint forces are left out, and the results are changes in
+         * velocity.
+         */
+        void calculateAccelerations(bool impulses);
+    };
+}
+
+#endif
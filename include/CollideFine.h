@@ -13,6 +13,10 @@
 #define GRICS_COLLISION_FINE_H
 
 #include "Contacts.h"
+#include <unordered_map>
+#include <utility>
+#include <mutex>
+#include "Workers.h"
 
 namespace Grics {
 
@@ -34,6 +38,20 @@ namespace Grics {
         friend class IntersectionTests;
         friend class CollisionDetector;
 
+        /**
+         * Identifies the kind of primitive, so that collision tests
+         * can be chosen without knowing it in advance.
+         */
+        enum Type
+        {
+            SPHERE,
+            BOX,
+            CAPSULE,
+            CONVEX,
+            COMPOUND,
+            TYPE_COUNT
+        };
+
         /**
          * The rigid body that is represented by this primitive.
          */
@@ -45,10 +63,17 @@ namespace Grics {
         Matrix4 offset;
 
         /**
-         * Calculates the internals for the primitive.
+         * Calculates the internals for the primitive. For a compound
+         * this also calculates the internals of all its children.
          */
         void calculateInternals();
 
+        /**
+         * Finds the world space box that bounds the primitive, using
+         * the transform from the last call to calculateInternals.
+         */
+        void getBounds(Vector3* min, Vector3* max) const;
+
         /**
          * This is a convenience function to allow access to the
          * axis vectors in the transform for this primitive.
@@ -69,14 +94,32 @@ namespace Grics {
             return transform;
         }
 
+        /**
+         * Returns the kind of primitive this is.
+         */
+        Type getType() const
+        {
+            return type;
+        }
+
 
     protected:
+        /**
+         * Primitives can only be created as one of the kinds above.
+         */
+        CollisionPrimitive(Type type) : type(type) {}
+
         /**
          * The resultant transform of the primitive. This is
          * calculated by combining the offset of the primitive
          * with the transform of the rigid body.
          */
         Matrix4 transform;
+
+        /**
+         * The kind of primitive this is.
+         */
+        Type type;
     };
 
     /**
@@ -86,12 +129,87 @@ namespace Grics {
     class CollisionSphere : public CollisionPrimitive
     {
     public:
+        CollisionSphere() : CollisionPrimitive(SPHERE) {}
+
         /**
          * The radius of the sphere.
          */
         real radius;
     };
 
+    /**
+     * Holds many spheres packed into separate arrays of centre
+     * coordinates and radii, for the batch sphere tests. Scenes made
+     * mostly of spheres can test them in groups this way, rather than
+     * one pair at a time through each sphere's transform. The arrays
+     * are padded to a whole number of groups, so the tests can always
+     * read a full group.
+     */
+    class CollisionSphereArray
+    {
+    public:
+        /**
+         * The number of spheres the batch tests work on at once.
+         */
+        enum { GROUP_SIZE = 8 };
+
+        CollisionSphereArray() : count(0) {}
+
+        /**
+         * Adds a sphere at the given centre, returning its index.
+         */
+        unsigned add(RigidBody* body, const Vector3& centre, real radius);
+
+        /**
+         * Adds a collision sphere at its current position, returning
+         * its index.
+         */
+        unsigned add(const CollisionSphere& sphere)
+        {
+            return add(sphere.body, sphere.getAxis(3), sphere.radius);
+        }
+
+        /**
+         * Moves the sphere with the given index.
+         */
+        void setCentre(unsigned index, const Vector3& centre)
+        {
+            x[index] = centre.x;
+            y[index] = centre.y;
+            z[index] = centre.z;
+        }
+
+        /**
+         * Removes all the spheres.
+         */
+        void clear();
+
+        /**
+         * Returns the number of spheres.
+         */
+        unsigned getCount() const
+        {
+            return count;
+        }
+
+        /**
+         * The centre coordinates and radii of the spheres, each
+         * padded to a multiple of GROUP_SIZE.
+         */
+        std::vector<real> x;
+        std::vector<real> y;
+        std::vector<real> z;
+        std::vector<real> radius;
+
+        /**
+         * The body of each sphere, used for the contacts.
+         */
+        std::vector<RigidBody*> body;
+
+    protected:
+        unsigned count;
+    };
+
     /**
      * The plane is not a primitive: it doesn't represent another
      * rigid body. It is used for contacts with the immovable
@@ -111,6 +229,31 @@ namespace Grics {
         real offset;
     };
 
+    /**
+     * A ray is not a primitive either: it is used to query the
+     * primitives, for example for line of sight or picking.
+     */
+    class CollisionRay
+    {
+    public:
+        /**
+         * The start of the ray.
+         */
+        Vector3 origin;
+
+        /**
+         * The direction of the ray. This should be a unit vector, so
+         * that distances along the ray are real distances.
+         */
+        Vector3 direction;
+
+        /**
+         * The length of the ray. Hits further away than this are
+         * ignored.
+         */
+        real length;
+    };
+
     /**
      * Represents a rigid body that can be treated as an aligned bounding
      * box for collision detection.
@@ -118,6 +261,8 @@ namespace Grics {
     class CollisionBox : public CollisionPrimitive
     {
     public:
+        CollisionBox() : CollisionPrimitive(BOX) {}
+
         /**
          * Holds the half-sizes of the box along each of its local axes.
          */
@@ -125,171 +270,1609 @@ namespace Grics {
     };
 
     /**
-     * A wrapper class that holds fast intersection tests. These
-     * can be used to drive the coarse collision detection system or
-     * as an early out in the full collision tests below.
+     * Represents a rigid body that can be treated as a capsule for
+     * collision detection. A capsule is every point within a radius
+     * of a line segment, which runs along the primitive's local Y
+     * axis. It is the cheapest shape for characters and limbs.
      */
-    class IntersectionTests
+    class CollisionCapsule : public CollisionPrimitive
     {
     public:
+        CollisionCapsule() : CollisionPrimitive(CAPSULE) {}
 
-        static bool sphereAndHalfSpace(
-            const CollisionSphere& sphere,
-            const CollisionPlane& plane);
-
-        static bool sphereAndSphere(
-            const CollisionSphere& one,
-            const CollisionSphere& two);
+        /**
+         * The radius of the capsule.
+         */
+        real radius;
 
-        static bool boxAndBox(
-            const CollisionBox& one,
-            const CollisionBox& two);
+        /**
+         * Half the length of the central segment, not including the
+         * hemispherical caps.
+         */
+        real halfHeight;
 
         /**
-         * Does an intersection test on an arbitrarily aligned box and a
-         * half-space.
-         *
-         * The box is given as a transform matrix, including
-         * position, and a vector of half-sizes for the extend of the
-         * box along each local axis.
-         *
-         * The half-space is given as a direction (i.e. unit) vector and the
-         * offset of the limiting plane from the origin, along the given
-         * direction.
+         * Returns the world position of one end of the central
+         * segment: the positive Y end for index 0, otherwise the
+         * negative Y end.
          */
-        static bool boxAndHalfSpace(
-            const CollisionBox& box,
-            const CollisionPlane& plane);
+        Vector3 getEnd(unsigned index) const
+        {
+            Vector3 end = getAxis(1) * halfHeight;
+            return index == 0 ? getAxis(3) + end : getAxis(3) - end;
+        }
     };
 
-
     /**
-     * A helper structure that contains information for the detector to use
-     * in building its contact data.
+     * A single triangle of static geometry, in world space, as used
+     * by the triangle mesh and heightfield tests. Along with its
+     * vertices it records which of its edges are real edges of the
+     * surface, so that objects sliding across the seam between two
+     * triangles of a flat or concave surface don't catch on it.
      */
-    struct CollisionData
+    class CollisionTriangle
     {
+    public:
         /**
-         * Holds the base of the collision data: the first contact
-         * in the array. This is used so that the contact pointer (below)
-         * can be incremented each time a contact is detected, while
-         * this pointer points to the first contact found.
+         * The vertices of the triangle, wound anticlockwise when seen
+         * from the front.
          */
-        Contact* contactArray;
+        Vector3 vertex[3];
 
-        /** Holds the contact array to write into. */
-        Contact* contacts;
+        /**
+         * The unit normal of the triangle's front face. Triangles are
+         * one sided: objects behind them are pushed out of the front.
+         */
+        Vector3 normal;
 
-        /** Holds the maximum number of contacts the array can take. */
-        int contactsLeft;
+        /**
+         * Holds one bit per edge (bit i for the edge from vertex i to
+         * vertex i+1), set if the edge is convex or on the boundary
+         * of the surface. Contacts with an edge that isn't set, or a
+         * vertex with neither of its edges set, use the face normal.
+         */
+        unsigned convexEdges;
 
-        /** Holds the number of contacts found so far. */
-        unsigned contactCount;
+        /**
+         * Feature codes returned by closestPoint: the face, edge i
+         * (from vertex i to vertex i+1) or vertex i.
+         */
+        enum Feature
+        {
+            FACE = 0,
+            EDGE = 1,
+            VERTEX = 4
+        };
 
-        /** Holds the friction value to write into any collisions. */
-        real friction;
+        /**
+         * Returns the point on the triangle closest to the given
+         * point, and sets the feature it lies on.
+         */
+        Vector3 closestPoint(const Vector3& point, unsigned* feature) const;
 
-        /** Holds the restitution value to write into any collisions. */
-        real restitution;
+        /**
+         * Checks if the given feature is inside a smooth or concave
+         * part of the surface, in which case contacts with it should
+         * use the face normal rather than the direction to the
+         * feature.
+         */
+        bool isInternalFeature(unsigned feature) const;
+    };
 
+    /**
+     * A mesh of triangles for static level geometry. Like the plane
+     * it isn't a primitive, since it has no rigid body: it is fixed
+     * in world space. The triangles are held in a bounding volume
+     * hierarchy of their own, so tests only visit the few triangles
+     * near the object.
+     */
+    class CollisionTriangleMesh
+    {
+    public:
         /**
-         * Holds the collision tolerance, even uncolliding objects this
-         * close should have collisions generated.
+         * Creates an empty mesh.
          */
-        real tolerance;
+        CollisionTriangleMesh();
 
         /**
-         * Checks if there are more contacts available in the contact
-         * data.
+         * Builds the mesh from the given vertices and indices, three
+         * per triangle. The data is copied, so it can be freed
+         * afterwards. Any previous contents are replaced.
          */
-        bool hasMoreContacts()
+        void build(const Vector3* vertices, unsigned vertexCount,
+            const unsigned* indices, unsigned triangleCount);
+
+        /**
+         * Returns the number of triangles in the mesh.
+         */
+        unsigned getTriangleCount() const
         {
-            return contactsLeft > 0;
+            return (unsigned)triangles.size();
         }
 
         /**
-         * Resets the data so that it has no used contacts recorded.
+         * Fills in the given triangle from the mesh.
          */
-        void reset(unsigned maxContacts)
+        void getTriangle(unsigned index, CollisionTriangle* triangle) const;
+
+        /**
+         * Finds the triangles whose bounds overlap the given box,
+         * writing their indices into the given array (up to the given
+         * limit). Returns the number of triangles written. If some
+         * overlapping triangles were left out, truncated (if given)
+         * is set.
+         */
+        unsigned query(const Vector3& min, const Vector3& max,
+            unsigned* results, unsigned limit,
+            bool* truncated = NULL) const;
+
+    protected:
+        /**
+         * A triangle as stored in the mesh.
+         */
+        struct Triangle
         {
-            contactsLeft = maxContacts;
-            contactCount = 0;
-            contacts = contactArray;
-        }
+            unsigned vertex[3];
+            Vector3 normal;
+            unsigned convexEdges;
+        };
 
         /**
-         * Notifies the data that the given number of contacts have
-         * been added.
+         * A node of the hierarchy. Nodes are stored depth first, so
+         * an internal node's first child is the next node and only
+         * the second child's index is stored. A leaf holds a run of
+         * triangles instead.
          */
-        void addContacts(unsigned count)
+        struct Node
         {
-            // Reduce the number of contacts remaining, add number used
-            contactsLeft -= count;
-            contactCount += count;
+            real min[3];
+            real max[3];
 
-            // Move the array forward
-            contacts += count;
-        }
+            /**
+             * For a leaf, the first triangle; otherwise the index of
+             * the second child.
+             */
+            unsigned index;
+
+            /**
+             * The number of triangles in a leaf, or zero for an
+             * internal node.
+             */
+            unsigned count;
+        };
+
+        std::vector<Vector3> vertices;
+        std::vector<Triangle> triangles;
+        std::vector<Node> nodes;
+
+        /**
+         * Builds the hierarchy over the given range of triangles,
+         * reordering them so each leaf's are together, and returns
+         * the index of the new node.
+         */
+        unsigned buildNode(std::vector<Vector3>& centres,
+            unsigned start, unsigned count);
+
+        /**
+         * Finds which edges of each triangle are convex, using the
+         * triangle on the other side of the edge.
+         */
+        void findConvexEdges();
     };
 
     /**
-     * A wrapper class that holds the fine grained collision detection
-     * routines.
-     *
-     * Each of the functions has the same format: it takes the details
-     * of two objects, and a pointer to a contact array to fill. It
-     * returns the number of contacts it wrote into the array.
+     * A heightfield for terrain. It is a grid of heights over the XZ
+     * plane, each cell split into two triangles, and like the mesh it
+     * is fixed in world space. The heights are quantized to 16 bits
+     * between the lowest and highest given, so a large terrain takes
+     * little memory, and tests find the cells under an object
+     * directly rather than searching for them.
      */
-    class CollisionDetector
+    class CollisionHeightfield
     {
     public:
+        /**
+         * The world position of the first sample, at the lowest X
+         * and Z of the grid, with the heights added to its Y.
+         */
+        Vector3 origin;
 
-        static unsigned sphereAndHalfSpace(
-            const CollisionSphere& sphere,
-            const CollisionPlane& plane,
-            CollisionData* data
-        );
+        /**
+         * The spacing of the samples along both X and Z.
+         */
+        real cellSize;
 
-        static unsigned sphereAndTruePlane(
-            const CollisionSphere& sphere,
-            const CollisionPlane& plane,
-            CollisionData* data
-        );
+        /**
+         * Creates an empty heightfield with unit cells.
+         */
+        CollisionHeightfield();
 
-        static unsigned sphereAndSphere(
-            const CollisionSphere& one,
-            const CollisionSphere& two,
-            CollisionData* data
-        );
+        /**
+         * Builds the heightfield from the given heights, stored a row
+         * (along X) at a time. There must be at least two columns and
+         * two rows. Any previous contents are replaced.
+         */
+        void build(const real* heights, unsigned columns, unsigned rows);
 
         /**
-         * Does a collision test on a collision box and a plane representing
-         * a half-space (i.e. the normal of the plane
-         * points out of the half-space).
+         * Returns the number of samples along X.
          */
-        static unsigned boxAndHalfSpace(
-            const CollisionBox& box,
-            const CollisionPlane& plane,
-            CollisionData* data
-        );
+        unsigned getColumns() const
+        {
+            return columns;
+        }
 
-        static unsigned boxAndBox(
-            const CollisionBox& one,
-            const CollisionBox& two,
-            CollisionData* data
-        );
+        /**
+         * Returns the number of samples along Z.
+         */
+        unsigned getRows() const
+        {
+            return rows;
+        }
 
-        static unsigned boxAndPoint(
-            const CollisionBox& box,
-            const Vector3& point,
-            CollisionData* data
-        );
+        /**
+         * Returns the height of the given sample, relative to the
+         * origin.
+         */
+        real getHeight(unsigned column, unsigned row) const
+        {
+            return heightOffset + heightScale * samples[row * columns + column];
+        }
 
-        static unsigned boxAndSphere(
-            const CollisionBox& box,
-            const CollisionSphere& sphere,
-            CollisionData* data
-        );
+        /**
+         * Returns the world position of the given sample.
+         */
+        Vector3 getPoint(unsigned column, unsigned row) const
+        {
+            return Vector3(origin.x + cellSize * column,
+                origin.y + getHeight(column, row),
+                origin.z + cellSize * row);
+        }
+
+        /**
+         * Fills in one of the two triangles (half 0 or 1) of the cell
+         * whose lowest corner is the given sample.
+         */
+        void getTriangle(unsigned column, unsigned row, unsigned half,
+            CollisionTriangle* triangle) const;
+
+        /**
+         * Finds the cells under the given world space box, returning
+         * false if there are none. The cells are given by the sample
+         * at their lowest corner, and the ranges are inclusive.
+         */
+        bool getCellRange(const Vector3& min, const Vector3& max,
+            unsigned* firstColumn, unsigned* firstRow,
+            unsigned* lastColumn, unsigned* lastRow) const;
+
+        /**
+         * Returns the highest point of the given cell, relative to
+         * the origin.
+         */
+        real getCellTop(unsigned column, unsigned row) const;
+
+    protected:
+        unsigned columns;
+        unsigned rows;
+
+        /**
+         * Holds the height that a sample of zero stands for, and the
+         * height of each step of the samples.
+         */
+        real heightOffset;
+        real heightScale;
+
+        std::vector<unsigned short> samples;
+    };
+
+    /**
+     * A signed distance field for complex static geometry. Distances
+     * are sampled on a regular grid in world space, negative inside
+     * the geometry, and looked up with trilinear interpolation, so a
+     * query costs the same however detailed the geometry is. The
+     * normal is the gradient of the interpolated distance.
+     *
+     * The grid is split into bricks of BRICK_SIZE samples along each
+     * axis, neighbouring bricks sharing their border samples. Only
+     * bricks near the surface hold samples; the others hold a single
+     * distance, which is enough to show that nothing there touches.
+     */
+    class CollisionSDF
+    {
+    public:
+        /**
+         * The number of samples along each edge of a brick.
+         */
+        enum { BRICK_SIZE = 8 };
+
+        /**
+         * The world position of the first sample, at the lowest
+         * corner of the grid.
+         */
+        Vector3 origin;
+
+        /**
+         * The spacing of the samples along each axis.
+         */
+        real voxelSize;
+
+        /**
+         * Creates an empty field with unit voxels.
+         */
+        CollisionSDF();
+
+        /**
+         * Bakes the field from a closed triangle mesh, given as for
+         * CollisionTriangleMesh::build. The grid covers the mesh with
+         * a margin, and bricks are filled where the surface is within
+         * the given band. The triangles needn't be wound
+         * consistently; the winding is fixed before baking. This is
+         * slow, so it is meant to be done offline or at load time.
+         */
+        void bake(const Vector3* vertices, unsigned vertexCount,
+            const unsigned* indices, unsigned triangleCount,
+            real voxelSize, real bandWidth);
+
+        /**
+         * Returns the distance from the given world point to the
+         * surface, negative inside.
+         */
+        real getDistance(const Vector3& point) const;
+
+        /**
+         * Finds the distance from the given world point to the
+         * surface and the normal there. Returns false if the point
+         * is in a brick without samples, in which case only the
+         * distance is filled in.
+         */
+        bool sample(const Vector3& point,
+            real* distance, Vector3* normal) const;
+
+        /**
+         * Returns the number of bricks that hold samples.
+         */
+        unsigned getBrickCount() const
+        {
+            return (unsigned)(samples.size() / (BRICK_SIZE * BRICK_SIZE * BRICK_SIZE));
+        }
+
+        /**
+         * Returns the number of bricks along each axis.
+         */
+        unsigned getBricks(unsigned axis) const
+        {
+            return bricks[axis];
+        }
+
+    protected:
+        unsigned bricks[3];
+
+        /**
+         * Holds, for each brick, the index of its samples, or
+         * EMPTY_BRICK if it has none.
+         */
+        std::vector<unsigned> brickSamples;
+
+        /**
+         * Holds the distance at the centre of each brick.
+         */
+        std::vector<real> brickDistance;
+
+        /**
+         * Holds the samples of the bricks that have them, with X
+         * changing fastest.
+         */
+        std::vector<real> samples;
+
+        enum { EMPTY_BRICK = 0xffffffff };
+
+        /**
+         * Finds the brick holding the given world point and the
+         * cell within it, returning the index of the brick or
+         * EMPTY_BRICK if the point is outside the grid.
+         */
+        unsigned findCell(const Vector3& point,
+            unsigned cell[3], real fraction[3]) const;
+    };
+
+    /**
+     * A convex hull stored as half-edges, so each face knows its
+     * edges and each edge knows the faces on either side of it. Hulls
+     * are built from point clouds with Quickhull, so colliders can be
+     * made straight from the vertices of imported meshes. Coplanar
+     * triangles are merged, so a face can have any number of edges.
+     *
+     * Because the hull knows which vertices are neighbours, the
+     * vertex furthest in a direction can be found by walking uphill
+     * from any vertex, which for a vertex near the answer takes only
+     * a few steps.
+     */
+    class ConvexHull
+    {
+    public:
+        /**
+         * One side of an edge, running anticlockwise around its face
+         * when seen from outside.
+         */
+        struct HalfEdge
+        {
+            /** The vertex this half-edge starts from. */
+            unsigned vertex;
+
+            /** The other side of the same edge. */
+            unsigned twin;
+
+            /** The next half-edge around the face. */
+            unsigned next;
+
+            /** The face this half-edge belongs to. */
+            unsigned face;
+        };
+
+        /**
+         * A face of the hull, with its outward normal and its
+         * distance from the origin along the normal.
+         */
+        struct Face
+        {
+            /** One of the half-edges around the face. */
+            unsigned edge;
+
+            Vector3 normal;
+            real offset;
+        };
+
+        /**
+         * Builds the hull of the given points, replacing any previous
+         * contents. Points inside the hull are dropped, so the hull's
+         * vertices are a subset of the points, in a new order.
+         * Returns false, leaving the hull empty, if the points are
+         * all on one plane.
+         */
+        bool build(const Vector3* points, unsigned pointCount);
+
+        /**
+         * Builds the hull of points given as an array of reals,
+         * three per point, such as a mesh's vertex buffer.
+         */
+        bool build(const real* coordinates, unsigned pointCount);
+
+        /**
+         * Removes the contents of the hull.
+         */
+        void clear();
+
+        /**
+         * Returns the index of the vertex furthest along the given
+         * direction, in the hull's space. The search climbs from the
+         * given vertex to whichever neighbour is further along, until
+         * none is.
+         */
+        unsigned getSupportIndex(const Vector3& direction,
+            unsigned start = 0) const;
+
+        unsigned getVertexCount() const
+        {
+            return (unsigned)vertices.size();
+        }
+
+        const Vector3* getVertices() const
+        {
+            return vertices.empty() ? NULL : &vertices[0];
+        }
+
+        unsigned getEdgeCount() const
+        {
+            return (unsigned)edges.size();
+        }
+
+        const HalfEdge& getEdge(unsigned index) const
+        {
+            return edges[index];
+        }
+
+        /**
+         * Returns one of the half-edges leaving the given vertex. The
+         * others are found by going to the twin and then next.
+         */
+        unsigned getVertexEdge(unsigned index) const
+        {
+            return vertexEdges[index];
+        }
+
+        unsigned getFaceCount() const
+        {
+            return (unsigned)faces.size();
+        }
+
+        const Face& getFace(unsigned index) const
+        {
+            return faces[index];
+        }
+
+    protected:
+        std::vector<Vector3> vertices;
+        std::vector<HalfEdge> edges;
+        std::vector<Face> faces;
+        std::vector<unsigned> vertexEdges;
+    };
+
+    /**
+     * Represents a rigid body that can be treated as an arbitrary
+     * convex shape for collision detection. The shape is the convex
+     * hull of a set of vertices given in the primitive's local space.
+     * It is only ever queried through its support function (the
+     * vertex furthest in a given direction), so vertices inside the
+     * hull do no harm other than slowing the queries down.
+     */
+    class CollisionConvex : public CollisionPrimitive
+    {
+    public:
+        CollisionConvex() : CollisionPrimitive(CONVEX), hull(NULL) {}
+
+        /**
+         * Holds the vertices of the shape in local space. The array
+         * is not owned by the primitive, so many primitives can share
+         * the same vertex data.
+         */
+        const Vector3* vertices;
+
+        /**
+         * Holds the number of vertices in the array.
+         */
+        unsigned vertexCount;
+
+        /**
+         * Holds the hull the vertices came from, if any. With a hull
+         * the support function climbs between neighbouring vertices
+         * rather than checking every vertex.
+         */
+        const ConvexHull* hull;
+
+        /**
+         * Uses the vertices of the given hull, which must outlive the
+         * primitive.
+         */
+        void setHull(const ConvexHull* convexHull)
+        {
+            hull = convexHull;
+            vertices = convexHull->getVertices();
+            vertexCount = convexHull->getVertexCount();
+        }
+
+        /**
+         * Returns the index of the vertex furthest along the given
+         * world space direction. If the primitive has a hull, the
+         * search starts from the given vertex, so passing the answer
+         * to a similar query (such as last frame's) makes it quick.
+         */
+        unsigned getSupportIndex(const Vector3& direction,
+            unsigned start = 0) const;
+
+        /**
+         * Returns the world space position of the given vertex.
+         */
+        Vector3 getVertex(unsigned index) const
+        {
+            return transform.transform(vertices[index]);
+        }
+    };
+
+    /**
+     * A primitive made of many child primitives, each at a fixed
+     * offset from the compound, so that one rigid body can have a
+     * complex shape without being split into jointed bodies. The
+     * children are kept in a small hierarchy of bounding boxes in the
+     * compound's space, and the collision tests only run on the
+     * children that overlap the other primitive.
+     *
+     * The children aren't owned by the compound. Their body and
+     * offset are set by the compound, so they shouldn't be set
+     * directly.
+     */
+    class CollisionCompound : public CollisionPrimitive
+    {
+    public:
+        CollisionCompound() : CollisionPrimitive(COMPOUND) {}
+
+        /**
+         * Adds a child primitive at the given offset from the
+         * compound. Call build once all the children are added.
+         */
+        void add(CollisionPrimitive* child, const Matrix4& childOffset);
+
+        /**
+         * Builds the hierarchy over the children. Child shapes
+         * shouldn't change size after this without building again.
+         */
+        void build();
+
+        /**
+         * Removes all the children.
+         */
+        void clear();
+
+        /**
+         * Returns the number of children.
+         */
+        unsigned getChildCount() const
+        {
+            return (unsigned)children.size();
+        }
+
+        /**
+         * Returns the child with the given index. Building reorders
+         * the children, so indices are only fixed after build.
+         */
+        CollisionPrimitive* getChild(unsigned index) const
+        {
+            return children[index].primitive;
+        }
+
+        /**
+         * Finds the box that bounds all the children, in the
+         * compound's space.
+         */
+        void getLocalBounds(Vector3* min, Vector3* max) const;
+
+        /**
+         * Finds the children whose bounds overlap the given world
+         * space box, writing their indices into the given array (up
+         * to the given limit). Returns the number of children written.
+         * If some overlapping children were left out, truncated (if
+         * given) is set.
+         */
+        unsigned query(const Vector3& min, const Vector3& max,
+            unsigned* results, unsigned limit,
+            bool* truncated = NULL) const;
+
+    protected:
+        friend class CollisionPrimitive;
+
+        /**
+         * Places each child on the compound's body and calculates its
+         * internals, once the compound's own transform is known.
+         */
+        void calculateChildInternals();
+
+        /**
+         * A child as stored in the compound, with its bounds in the
+         * compound's space.
+         */
+        struct Child
+        {
+            CollisionPrimitive* primitive;
+            Matrix4 offset;
+            Vector3 min;
+            Vector3 max;
+        };
+
+        /**
+         * A node of the hierarchy, laid out as for the triangle
+         * mesh: depth first, with a leaf holding a run of children.
+         */
+        struct Node
+        {
+            real min[3];
+            real max[3];
+            unsigned index;
+            unsigned count;
+        };
+
+        std::vector<Child> children;
+        std::vector<Node> nodes;
+
+        /**
+         * Builds the hierarchy over the given range of children,
+         * reordering them so each leaf's are together, and returns
+         * the index of the new node.
+         */
+        unsigned buildNode(unsigned start, unsigned count);
+    };
+
+    /**
+     * A wrapper class that holds fast intersection tests. These
+     * can be used to drive the coarse collision detection system or
+     * as an early out in the full collision tests below.
+     */
+    class IntersectionTests
+    {
+    public:
+
+        static bool sphereAndHalfSpace(
+            const CollisionSphere& sphere,
+            const CollisionPlane& plane);
+
+        static bool sphereAndSphere(
+            const CollisionSphere& one,
+            const CollisionSphere& two);
+
+        static bool boxAndBox(
+            const CollisionBox& one,
+            const CollisionBox& two);
+
+        /**
+         * Does an intersection test on an arbitrarily aligned box and a
+         * half-space.
+         *
+         * The box is given as a transform matrix, including
+         * position, and a vector of half-sizes for the extend of the
+         * box along each local axis.
+         *
+         * The half-space is given as a direction (i.e. unit) vector and the
+         * offset of the limiting plane from the origin, along the given
+         * direction.
+         */
+        static bool boxAndHalfSpace(
+            const CollisionBox& box,
+            const CollisionPlane& plane);
+
+        /**
+         * Does an intersection test on two convex shapes using GJK.
+         * This returns as soon as a separating direction is found,
+         * so it is cheaper than finding the distance.
+         */
+        static bool convexAndConvex(
+            const CollisionConvex& one,
+            const CollisionConvex& two);
+
+        /**
+         * Casts a ray against a capsule. If the ray hits within its
+         * length, this returns true and fills in the distance along
+         * the ray and the surface normal at the hit, if they are
+         * given. A ray starting inside the capsule hits at distance
+         * zero.
+         */
+        static bool capsuleAndRay(
+            const CollisionCapsule& capsule,
+            const CollisionRay& ray,
+            real* distance = NULL,
+            Vector3* normal = NULL);
+
+        /**
+         * Casts a ray against the front of a heightfield, in the same
+         * way as capsuleAndRay. The ray walks the cells it passes
+         * over in order, so it stops at the first hit.
+         */
+        static bool heightfieldAndRay(
+            const CollisionHeightfield& heightfield,
+            const CollisionRay& ray,
+            real* distance = NULL,
+            Vector3* normal = NULL);
+    };
+
+    /**
+     * Holds data about pairs of primitives that is kept from one frame
+     * to the next. Objects move little between frames, so the result
+     * of last frame's test is a very good starting point for this
+     * frame's. Entries are created on demand, and dropped when they
+     * haven't been used for a few frames.
+     */
+    class CollisionCache
+    {
+    public:
+        /**
+         * Holds the data kept for one pair of primitives.
+         */
+        struct Entry
+        {
+            /**
+             * Holds the number of vertices in the final GJK simplex
+             * for this pair last time it was tested.
+             */
+            unsigned simplexCount;
+
+            /**
+             * Holds the support indices on each primitive that made
+             * up the simplex. The simplex is rebuilt from these using
+             * the primitives' current transforms.
+             */
+            unsigned simplexIndex[4][2];
+
+            /**
+             * Holds the axis that separated this pair of boxes last
+             * time it was tested, numbered as in
+             * CollisionDetector::boxAndBox, or NO_AXIS if they were
+             * touching. It is tried first the next time, since most
+             * pairs stay apart along the same axis.
+             */
+            unsigned separatingAxis;
+
+            enum { NO_AXIS = 0xffff };
+
+            /**
+             * Holds the frame this entry was last used in.
+             */
+            unsigned lastFrame;
+        };
+
+        /**
+         * Holds entries as they were before a run of tests found
+         * them, in the order they were found, so the run can be
+         * undone by putting them back in reverse order.
+         */
+        typedef std::vector<std::pair<Entry*, Entry> > Journal;
+
+    protected:
+        typedef std::pair<const CollisionPrimitive*,
+            const CollisionPrimitive*> Key;
+
+        struct KeyHash
+        {
+            size_t operator()(const Key& key) const;
+        };
+
+        /**
+         * Holds the entries, keyed by the pair of primitives in the
+         * order they were given to the collision test.
+         */
+        std::unordered_map<Key, Entry, KeyHash> entries;
+
+        /**
+         * Holds the current frame number.
+         */
+        unsigned frame;
+
+        /**
+         * Entries not used for more than this many frames are
+         * removed by newFrame.
+         */
+        unsigned maxAge;
+
+        /**
+         * Guards the entries while they are found, so several
+         * threads can run collision tests with the same cache.
+         */
+        std::mutex findLock;
+
+    public:
+        /**
+         * Creates an empty cache that keeps entries for the given
+         * number of unused frames.
+         */
+        CollisionCache(unsigned maxAge = 4);
+
+        /**
+         * Returns the entry for the given pair of primitives, creating
+         * an empty one if the pair hasn't been seen before. This can
+         * be called from several threads at once, as long as no two
+         * of them use the same pair. The entry stays where it is until
+         * newFrame or clear removes it, so it can be found once and
+         * used from another thread without the lock.
+         */
+        Entry* find(const CollisionPrimitive* one,
+            const CollisionPrimitive* two);
+
+        /**
+         * Moves the cache on to the next frame, removing any stale
+         * entries. Call this once per frame, before collision
+         * detection.
+         */
+        void newFrame();
+
+        /**
+         * Removes all entries.
+         */
+        void clear();
+
+        /**
+         * Returns the number of pairs currently cached.
+         */
+        unsigned getEntryCount() const
+        {
+            return (unsigned)entries.size();
+        }
+    };
+
+
+    /**
+     * A helper structure that contains information for the detector to use
+     * in building its contact data.
+     */
+    struct CollisionData
+    {
+        /**
+         * Holds the base of the collision data: the first contact
+         * in the array. This is used so that the contact pointer (below)
+         * can be incremented each time a contact is detected, while
+         * this pointer points to the first contact found.
+         */
+        Contact* contactArray;
+
+        /** Holds the contact array to write into. */
+        Contact* contacts;
+
+        /** Holds the maximum number of contacts the array can take. */
+        int contactsLeft;
+
+        /** Holds the number of contacts found so far. */
+        unsigned contactCount;
+
+        /** Holds the friction value to write into any collisions. */
+        real friction;
+
+        /** Holds the restitution value to write into any collisions. */
+        real restitution;
+
+        /**
+         * Holds the collision tolerance, even uncolliding objects this
+         * close should have collisions generated.
+         */
+        real tolerance;
+
+        /**
+         * Holds the cache of per-pair data kept between frames, or
+         * NULL if the tests should work without one.
+         */
+        CollisionCache* cache;
+
+        /**
+         * Holds the duration of the step the contacts are for. If it
+         * is non-zero, pairs that are apart but could meet within the
+         * step at their current velocities are given speculative
+         * contacts. These have a negative penetration (the gap
+         * between the pair), and the resolver only stops the pair
+         * closing faster than would take up the gap, so fast bodies
+         * can't pass through thin objects between steps.
+         */
+        real duration;
+
+        /**
+         * Holds the number of tests since the last reset that found
+         * more triangles than they could test, and so left some out.
+         */
+        unsigned truncatedQueries;
+
+        /**
+         * Holds a journal that each cache entry is recorded in before
+         * a test uses it, or NULL if entries needn't be recorded.
+         */
+        CollisionCache::Journal* cacheJournal;
+
+        /**
+         * Holds a cache entry found before the test was run, and the
+         * pair it belongs to, so the test can use it without locking
+         * the cache. The entry is NULL if none was found.
+         */
+        CollisionCache::Entry* pairEntry;
+        const CollisionPrimitive* pairEntryOne;
+        const CollisionPrimitive* pairEntryTwo;
+
+        /**
+         * Creates empty collision data with no contact array and no
+         * cache.
+         */
+        CollisionData()
+            : contactArray(NULL), contacts(NULL), contactsLeft(0),
+            contactCount(0), friction(0), restitution(0), tolerance(0),
+            cache(NULL), duration(0), truncatedQueries(0),
+            cacheJournal(NULL), pairEntry(NULL), pairEntryOne(NULL),
+            pairEntryTwo(NULL)
+        {
+        }
+
+        /**
+         * Returns the cache entry for the given pair of primitives,
+         * recording it in the journal if there is one, or NULL if
+         * there is no cache. The entry found before the test is used
+         * if it is for this pair, and the cache is searched for any
+         * other (such as the children of a compound).
+         */
+        CollisionCache::Entry* findCacheEntry(
+            const CollisionPrimitive* one, const CollisionPrimitive* two)
+        {
+            if (!cache) return NULL;
+
+            CollisionCache::Entry* entry = pairEntry;
+            if (!entry || one != pairEntryOne || two != pairEntryTwo)
+            {
+                entry = cache->find(one, two);
+            }
+            if (cacheJournal)
+            {
+                cacheJournal->push_back(std::make_pair(entry, *entry));
+            }
+            return entry;
+        }
+
+        /**
+         * Returns how far apart the given bodies can be and still be
+         * given a contact: the tolerance, plus the distance their
+         * relative velocity covers in the duration. Either body may
+         * be NULL for the scenery. Without a duration the contacts
+         * aren't speculative, and a pair that is apart (and so would
+         * get a negative penetration) gets no contact, so this is
+         * zero.
+         */
+        real getMargin(RigidBody* one, RigidBody* two) const
+        {
+            if (duration <= 0) return 0;
+
+            Vector3 velocity;
+            if (one) velocity += one->getVelocity();
+            if (two) velocity -= two->getVelocity();
+            return tolerance + velocity.magnitude() * duration;
+        }
+
+        /**
+         * Checks if there are more contacts available in the contact
+         * data.
+         */
+        bool hasMoreContacts()
+        {
+            return contactsLeft > 0;
+        }
+
+        /**
+         * Resets the data so that it has no used contacts recorded.
+         */
+        void reset(unsigned maxContacts)
+        {
+            contactsLeft = maxContacts;
+            contactCount = 0;
+            contacts = contactArray;
+            truncatedQueries = 0;
+        }
+
+        /**
+         * Notifies the data that the given number of contacts have
+         * been added.
+         */
+        void addContacts(unsigned count)
+        {
+            // Reduce the number of contacts remaining, add number used
+            contactsLeft -= count;
+            contactCount += count;
+
+            // Move the array forward
+            contacts += count;
+        }
+
+        /**
+         * Notifies the data that the last given number of contacts
+         * added have been discarded.
+         */
+        void removeContacts(unsigned count)
+        {
+            contactsLeft += count;
+            contactCount -= count;
+            contacts -= count;
+        }
+    };
+
+    /**
+     * A wrapper class that holds the fine grained collision detection
+     * routines.
+     *
+     * Each of the functions has the same format: it takes the details
+     * of two objects, and a pointer to a contact array to fill. It
+     * returns the number of contacts it wrote into the array.
+     */
+    class CollisionDetector
+    {
+    public:
+
+        static unsigned sphereAndHalfSpace(
+            const CollisionSphere& sphere,
+            const CollisionPlane& plane,
+            CollisionData* data
+        );
+
+        static unsigned sphereAndTruePlane(
+            const CollisionSphere& sphere,
+            const CollisionPlane& plane,
+            CollisionData* data
+        );
+
+        static unsigned sphereAndSphere(
+            const CollisionSphere& one,
+            const CollisionSphere& two,
+            CollisionData* data
+        );
+
+        /**
+         * Does a collision test on many pairs of spheres at once. The
+         * pairs are given as indices into the sphere array, two to a
+         * pair, and are tested a group at a time. The contacts are
+         * the same as sphereAndSphere gives, written one after another
+         * in the order of the pairs.
+         */
+        static unsigned sphereAndSphereBatch(
+            const CollisionSphereArray& spheres,
+            const unsigned* pairs,
+            unsigned pairCount,
+            CollisionData* data
+        );
+
+        /**
+         * Does a collision test on every sphere in the array and a
+         * half-space, a group of spheres at a time. The contacts are
+         * the same as sphereAndHalfSpace gives, in the order of the
+         * spheres.
+         */
+        static unsigned sphereAndHalfSpaceBatch(
+            const CollisionSphereArray& spheres,
+            const CollisionPlane& plane,
+            CollisionData* data
+        );
+
+        /**
+         * Does a collision test on a collision box and a plane representing
+         * a half-space (i.e. the normal of the plane
+         * points out of the half-space).
+         */
+        static unsigned boxAndHalfSpace(
+            const CollisionBox& box,
+            const CollisionPlane& plane,
+            CollisionData* data
+        );
+
+        /**
+         * Does a collision test on two boxes. When a face of one box
+         * is the axis of least penetration, the incident face of the
+         * other box is clipped against it, giving up to four contacts
+         * so that resting boxes are stable. Edge-edge contacts give a
+         * single contact. If the data has a cache, the axis that
+         * separated the boxes last frame is tried on its own first.
+         */
+        static unsigned boxAndBox(
+            const CollisionBox& one,
+            const CollisionBox& two,
+            CollisionData* data
+        );
+
+        static unsigned boxAndPoint(
+            const CollisionBox& box,
+            const Vector3& point,
+            CollisionData* data
+        );
+
+        static unsigned boxAndSphere(
+            const CollisionBox& box,
+            const CollisionSphere& sphere,
+            CollisionData* data
+        );
+
+        /**
+         * Does a collision test on two convex shapes. GJK is used to
+         * find whether they overlap, then EPA finds the penetration
+         * depth and normal. If the data has a cache, the GJK simplex
+         * from the last frame is used as the starting point.
+         */
+        static unsigned convexAndConvex(
+            const CollisionConvex& one,
+            const CollisionConvex& two,
+            CollisionData* data
+        );
+
+        /**
+         * Does a collision test on a convex shape and a box, in the
+         * same way as convexAndConvex.
+         */
+        static unsigned convexAndBox(
+            const CollisionConvex& convex,
+            const CollisionBox& box,
+            CollisionData* data
+        );
+
+        /**
+         * Does a collision test on a convex shape and a sphere. The
+         * sphere is treated as its centre point with the radius as a
+         * margin, so EPA is only needed when the centre is inside the
+         * convex shape.
+         */
+        static unsigned convexAndSphere(
+            const CollisionConvex& convex,
+            const CollisionSphere& sphere,
+            CollisionData* data
+        );
+
+        /**
+         * Does a collision test on a convex shape and a capsule. The
+         * capsule is treated as its central segment with the radius
+         * as a margin, in the same way as convexAndSphere. A capsule
+         * lying along a face gets a contact at each end.
+         */
+        static unsigned convexAndCapsule(
+            const CollisionConvex& convex,
+            const CollisionCapsule& capsule,
+            CollisionData* data
+        );
+
+        /**
+         * Does a collision test on a convex shape and a half-space.
+         * As for boxes, each vertex below the plane gives a contact.
+         */
+        static unsigned convexAndHalfSpace(
+            const CollisionConvex& convex,
+            const CollisionPlane& plane,
+            CollisionData* data
+        );
+
+        /**
+         * Does a collision test on two capsules, using the closest
+         * points of their segments. Capsules lying side by side get
+         * a contact at each end of the overlap, so they can rest on
+         * one another.
+         */
+        static unsigned capsuleAndCapsule(
+            const CollisionCapsule& one,
+            const CollisionCapsule& two,
+            CollisionData* data
+        );
+
+        /**
+         * Does a collision test on a capsule and a sphere, by treating
+         * the sphere as touching the closest point on the segment.
+         */
+        static unsigned capsuleAndSphere(
+            const CollisionCapsule& capsule,
+            const CollisionSphere& sphere,
+            CollisionData* data
+        );
+
+        /**
+         * Does a collision test on a capsule and a box. The closest
+         * points are found between the segment and the box's faces
+         * and edges; if the segment passes into the box, the box
+         * axis of least penetration is used instead.
+         */
+        static unsigned capsuleAndBox(
+            const CollisionCapsule& capsule,
+            const CollisionBox& box,
+            CollisionData* data
+        );
+
+        /**
+         * Does a collision test on a capsule and a half-space. Each
+         * end of the segment can give a contact.
+         */
+        static unsigned capsuleAndHalfSpace(
+            const CollisionCapsule& capsule,
+            const CollisionPlane& plane,
+            CollisionData* data
+        );
+
+        /**
+         * Does a collision test on a sphere and a static triangle
+         * mesh. Contacts from neighbouring triangles are merged and
+         * reduced, so the mesh gives no more contacts than a single
+         * surface would.
+         */
+        static unsigned sphereAndTriangleMesh(
+            const CollisionSphere& sphere,
+            const CollisionTriangleMesh& mesh,
+            CollisionData* data
+        );
+
+        /**
+         * Does a collision test on a box and a static triangle mesh,
+         * in the same way as sphereAndTriangleMesh.
+         */
+        static unsigned boxAndTriangleMesh(
+            const CollisionBox& box,
+            const CollisionTriangleMesh& mesh,
+            CollisionData* data
+        );
+
+        /**
+         * Does a collision test on a capsule and a static triangle
+         * mesh, in the same way as sphereAndTriangleMesh.
+         */
+        static unsigned capsuleAndTriangleMesh(
+            const CollisionCapsule& capsule,
+            const CollisionTriangleMesh& mesh,
+            CollisionData* data
+        );
+
+        /**
+         * Does a collision test on a sphere and a heightfield. Only
+         * the cells under the sphere are tested, and their contacts
+         * are reduced as for a triangle mesh.
+         */
+        static unsigned sphereAndHeightfield(
+            const CollisionSphere& sphere,
+            const CollisionHeightfield& heightfield,
+            CollisionData* data
+        );
+
+        /**
+         * Does a collision test on a box and a heightfield, in the
+         * same way as sphereAndHeightfield.
+         */
+        static unsigned boxAndHeightfield(
+            const CollisionBox& box,
+            const CollisionHeightfield& heightfield,
+            CollisionData* data
+        );
+
+        /**
+         * Does a collision test on a capsule and a heightfield, in the
+         * same way as sphereAndHeightfield.
+         */
+        static unsigned capsuleAndHeightfield(
+            const CollisionCapsule& capsule,
+            const CollisionHeightfield& heightfield,
+            CollisionData* data
+        );
+
+        /**
+         * Does a collision test on a sphere and a distance field,
+         * using the distance at the centre of the sphere.
+         */
+        static unsigned sphereAndSDF(
+            const CollisionSphere& sphere,
+            const CollisionSDF& sdf,
+            CollisionData* data
+        );
+
+        /**
+         * Does a collision test on a box and a distance field, by
+         * sampling the field at the corners of the box and at points
+         * across its edges and faces. The contacts are reduced as for
+         * a triangle mesh.
+         */
+        static unsigned boxAndSDF(
+            const CollisionBox& box,
+            const CollisionSDF& sdf,
+            CollisionData* data
+        );
+
+        /**
+         * Does a collision test on a capsule and a distance field, by
+         * sampling the field at spheres along the capsule's segment.
+         */
+        static unsigned capsuleAndSDF(
+            const CollisionCapsule& capsule,
+            const CollisionSDF& sdf,
+            CollisionData* data
+        );
+
+        /**
+         * Does a collision test on a convex shape and a distance
+         * field, by sampling the field at the shape's vertices.
+         */
+        static unsigned convexAndSDF(
+            const CollisionConvex& convex,
+            const CollisionSDF& sdf,
+            CollisionData* data
+        );
+
+        /**
+         * Does a collision test on a compound and any other
+         * primitive, running the test for each child whose bounds
+         * overlap the primitive. Contacts from different children
+         * are given different feature ids.
+         */
+        static unsigned compoundAndPrimitive(
+            const CollisionCompound& compound,
+            const CollisionPrimitive& primitive,
+            CollisionData* data
+        );
+
+        /**
+         * Does a collision test on two compounds, pairing up only the
+         * children whose bounds overlap.
+         */
+        static unsigned compoundAndCompound(
+            const CollisionCompound& one,
+            const CollisionCompound& two,
+            CollisionData* data
+        );
+
+        /**
+         * Does a collision test on any two primitives, looking up the
+         * test to use from their types. Returns zero if there is no
+         * test for the pair. When testing many pairs, CollisionBatch
+         * avoids the lookup for each one.
+         */
+        static unsigned collide(
+            const CollisionPrimitive& one,
+            const CollisionPrimitive& two,
+            CollisionData* data
+        );
+
+        /**
+         * Checks if there is a collision test for the given pair of
+         * primitive types.
+         */
+        static bool canCollide(
+            CollisionPrimitive::Type one,
+            CollisionPrimitive::Type two
+        );
+
+    protected:
+        /**
+         * Does a collision test on a sphere and a single triangle of
+         * static geometry, giving at most one contact. This is used
+         * for spheres and for points along a capsule.
+         */
+        static unsigned sphereAndTriangle(
+            const Vector3& centre,
+            real radius,
+            RigidBody* body,
+            const CollisionTriangle& triangle,
+            CollisionData* data
+        );
+
+        /**
+         * Gives speculative contacts for two boxes the separating
+         * axis test found apart, if they are within the margin. Boxes
+         * facing one another get a contact for each corner of the
+         * clipped faces, as they would if they touched.
+         */
+        static unsigned boxAndBoxSpeculative(
+            const CollisionBox& one,
+            const CollisionBox& two,
+            CollisionData* data
+        );
+
+        /**
+         * Uses GJK to find the gap between two boxes that are apart,
+         * with the normal pointing towards box one and the point
+         * midway across the gap. Returns false if the boxes touch.
+         */
+        static bool boxAndBoxGap(
+            const CollisionBox& one,
+            const CollisionBox& two,
+            CollisionData* data,
+            Vector3* normal,
+            real* gap,
+            Vector3* point
+        );
+
+        /**
+         * Does a collision test on a box and a single triangle of
+         * static geometry. Corners of the box over the face give a
+         * contact each; otherwise the separating axis test gives one.
+         */
+        static unsigned boxAndTriangle(
+            const CollisionBox& box,
+            const CollisionTriangle& triangle,
+            CollisionData* data
+        );
+
+        /**
+         * Does a collision test on a capsule and a single triangle of
+         * static geometry.
+         */
+        static unsigned capsuleAndTriangle(
+            const CollisionCapsule& capsule,
+            const CollisionTriangle& triangle,
+            CollisionData* data
+        );
+
+        /**
+         * Reduces the given number of contacts, most recently added
+         * to the data, by merging those at the same place and then
+         * keeping only the deepest and most widely spread. Returns
+         * the number left.
+         */
+        static unsigned reduceContacts(CollisionData* data, unsigned count);
+
+        /**
+         * Does a collision test on a sphere (or a point, with zero
+         * radius) and a distance field, giving at most one contact.
+         */
+        static unsigned sphereAndSDFPoint(
+            const Vector3& centre,
+            real radius,
+            RigidBody* body,
+            const CollisionSDF& sdf,
+            unsigned featureId,
+            CollisionData* data
+        );
+    };
+
+    /**
+     * Collects the pairs of primitives that the coarse collision
+     * detector finds may be touching, and runs the fine collision
+     * tests on them. Pairs are sorted into buckets by the types of
+     * their primitives, and each bucket is processed in a loop that
+     * calls its test directly, so there is no choice to make per
+     * pair and each loop works on one kind of data.
+     */
+    class CollisionBatch
+    {
+    public:
+        /**
+         * Adds a pair of primitives to be tested. Every pair of types
+         * has a test; a pair without one asserts in debug builds and
+         * is ignored otherwise.
+         */
+        void add(const CollisionPrimitive* one, const CollisionPrimitive* two);
+
+        /**
+         * Runs the tests on every pair added, writing the contacts
+         * into the given data. Returns the number of contacts
+         * written. The pairs are kept, so call clear before adding
+         * the next frame's pairs.
+         */
+        unsigned generateContacts(CollisionData* data) const;
+
+        /**
+         * Runs the tests on every pair added, split between the given
+         * number of threads (including the calling one). Each thread
+         * writes into its own block of contacts, and the blocks are
+         * then copied into the given data in the order of the pairs,
+         * so the contacts are the same as generateContacts gives.
+         * The threads are kept between calls.
+         */
+        unsigned generateContactsParallel(CollisionData* data,
+            unsigned threadCount);
+
+        /**
+         * Removes all the pairs.
+         */
+        void clear();
+
+        /**
+         * Returns the number of pairs waiting to be tested.
+         */
+        unsigned getPairCount() const;
+
+    protected:
+        /**
+         * Holds a bucket for each ordered pair of types. Each bucket
+         * holds its pairs one after another, with the primitive of
+         * the lower type first. Only the buckets where the first type
+         * is no higher than the second are used.
+         */
+        std::vector<const CollisionPrimitive*> buckets
+            [CollisionPrimitive::TYPE_COUNT][CollisionPrimitive::TYPE_COUNT];
+
+        /**
+         * Holds where the contacts for one pair were written by the
+         * parallel tests.
+         */
+        struct PairContacts
+        {
+            unsigned thread;
+            unsigned first;
+            unsigned count;
+            unsigned truncatedQueries;
+
+            /**
+             * Holds where the cache entries this pair found were
+             * recorded in its thread's journal.
+             */
+            unsigned firstJournalEntry;
+            unsigned journalEntries;
+
+            /**
+             * Holds the cache entry found for this pair before the
+             * parallel pass, or NULL if its test uses none.
+             */
+            CollisionCache::Entry* cacheEntry;
+        };
+
+        /**
+         * Holds the contact block of each thread, and the contacts
+         * found for each pair, for generateContactsParallel. These
+         * are kept between frames so their memory is reused.
+         */
+        std::vector<std::vector<Contact> > threadContacts;
+        std::vector<PairContacts> pairContacts;
+
+        /**
+         * Holds the cache journal of each thread. A pair that has to
+         * be tested again after the parallel pass has its entries put
+         * back first, so the second test starts from the same entries
+         * the first did. An entry the first test created is left
+         * empty, which the tests treat the same as a missing one.
+         */
+        std::vector<CollisionCache::Journal> threadJournals;
+
+        /**
+         * Holds the threads that run generateContactsParallel.
+         */
+        WorkerPool workers;
+
+        /**
+         * Puts back the cache entries the given pair found during the
+         * last parallel pass, as they were before it.
+         */
+        void restoreCacheEntries(unsigned pair);
     };
 
 
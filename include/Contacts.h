@@ -3,6 +3,9 @@
 #define GRICS_CONTACTS_H
 
 #include "body.h"
+#include "Workers.h"
+#include <vector>
+#include <utility>
 
 namespace Grics {
 
@@ -11,6 +14,9 @@ namespace Grics {
      * documentation.
      */
     class ContactResolver;
+    class Joint;
+    class ContactSolver;
+    class ContactCache;
 
     /**
      * A contact represents two bodies in contact. Resolving a
@@ -40,6 +46,18 @@ namespace Grics {
          */
         friend class ContactResolver;
 
+        /**
+         * The sequential impulse solver reads the same internal data
+         * as the resolver.
+         */
+        friend class ContactSolver;
+
+        /**
+         * The contact cache reads and primes the accumulated impulse
+         * between frames.
+         */
+        friend class ContactCache;
+
     public:
         /**
          * Holds the bodies that are involved in the contact. The
@@ -70,13 +88,28 @@ namespace Grics {
         /**
          * Holds the depth of penetration at the contact point. If both
          * bodies are specified then the contact point should be midway
-         * between the inter-penetrating points.
+         * between the inter-penetrating points. A negative value is
+         * the gap between bodies that are not yet touching: such a
+         * speculative contact only stops them closing faster than
+         * would take up the gap in one step.
          */
         real penetration;
 
+        /**
+         * Identifies the pair of features (faces, edges or vertices)
+         * of the two primitives that generated this contact, so it
+         * can be matched with the same contact in the next frame.
+         * Contact generators that don't track features leave it at
+         * NO_FEATURE. Any other value, zero included, is a real id.
+         */
+        unsigned featureId;
+
+        enum { NO_FEATURE = 0xffffffff };
+
         /**
          * Sets the data that doesn't normally depend on the position
          * of the contact (i.e. the bodies, and their material properties).
+         * This also clears the feature id and accumulated impulse.
          */
         void setBodyData(RigidBody* one, RigidBody* two,
             real friction, real restitution);
@@ -109,6 +142,14 @@ namespace Grics {
          */
         Vector3 relativeContactPosition[2];
 
+        /**
+         * Holds the total impulse applied at this contact, in contact
+         * coordinates. The resolver adds to it each time the contact
+         * is resolved, and a ContactCache can prime it with the value
+         * from the previous frame to warm start the resolution.
+         */
+        Vector3 accumulatedImpulse;
+
     protected:
         /**
          * Calculates internal data from state data. This is called before
@@ -165,6 +206,14 @@ namespace Grics {
         void applyVelocityChange(Vector3 velocityChange[2],
             Vector3 rotationChange[2]);
 
+        /**
+         * Applies the impulse primed by the contact cache, limited so
+         * that it never does more than bring the contact to rest, and
+         * so that it stays inside the friction cone. This is the warm
+         * start for the velocity resolution.
+         */
+        void applyWarmStartImpulse();
+
         /**
          * Performs an inertia weighted penetration resolution of this
          * contact alone.
@@ -273,6 +322,13 @@ namespace Grics {
          */
         real positionEpsilon;
 
+        /**
+         * Holds the number of sweeps of the position stage, if the
+         * contacts are swept rather than resolved worst first. Zero
+         * (the default) resolves them worst first.
+         */
+        unsigned positionSweeps;
+
     public:
         /**
          * Stores the number of velocity iterations used in the
@@ -292,6 +348,46 @@ namespace Grics {
          */
         bool validSettings;
 
+    protected:
+        /**
+         * Holds, for each body in the contacts being resolved, a run
+         * of bodyContacts listing the contacts it is part of. Run i
+         * starts at bodyContactStart[i] and ends where run i+1
+         * starts.
+         */
+        std::vector<unsigned> bodyContactStart;
+        std::vector<unsigned> bodyContacts;
+
+        /**
+         * Holds, for each contact, the run for each of its two
+         * bodies.
+         */
+        std::vector<unsigned> contactBodyRun;
+
+        /**
+         * Holds each body of each contact, along with the contact's
+         * body slot, for sorting into runs.
+         */
+        std::vector<std::pair<RigidBody*, unsigned> > bodyEntries;
+
+        /**
+         * Holds a heap of the contacts, ordered by the value the
+         * current stage resolves, and the place in it of each
+         * contact. This lets each iteration find the worst contact
+         * without looking at them all.
+         */
+        std::vector<unsigned> heap;
+        std::vector<unsigned> heapPosition;
+
+        /**
+         * Holds, while the positions are swept, each contact point
+         * in the space of each of its bodies (or in world space for
+         * the scenery), and the penetration each contact started
+         * with.
+         */
+        std::vector<Vector3> positionAnchors;
+        std::vector<real> positionDepths;
+
     public:
         /**
          * Creates a new contact resolver with the given number of iterations
@@ -338,6 +434,18 @@ namespace Grics {
         void setEpsilon(real velocityEpsilon,
             real positionEpsilon);
 
+        /**
+         * Sets the number of sweeps of the position stage. With a
+         * non-zero number of sweeps, the position stage goes over
+         * every contact in order on each sweep, working out its
+         * penetration again from where its bodies are now (non-linear
+         * Gauss-Seidel), rather than resolving the worst contact
+         * first. A few sweeps are enough to stop a stack sinking,
+         * however many contacts it has. Zero goes back to resolving
+         * the worst contact first.
+         */
+        void setPositionSweeps(unsigned positionSweeps);
+
         /**
          * Resolves a set of contacts for both penetration and velocity.
          *
@@ -392,6 +500,616 @@ namespace Grics {
         void adjustPositions(Contact* contacts,
             unsigned numContacts,
             real duration);
+
+        /**
+         * Resolves the positional issues with the given array of
+         * constraints by sweeping over them all, using the given
+         * number of sweeps.
+         */
+        void sweepPositions(Contact* contacts,
+            unsigned numContacts);
+
+        /**
+         * Applies the impulses carried over from the previous frame
+         * and brings the contact velocities up to date. Contacts that
+         * have nothing carried over are left untouched.
+         */
+        void warmStart(Contact* contacts,
+            unsigned numContacts,
+            real duration);
+
+        /**
+         * Builds the runs of contacts for each body, so that the
+         * contacts affected by resolving one can be found without
+         * searching them all.
+         */
+        void buildAdjacency(Contact* contacts, unsigned numContacts);
+    };
+
+    /**
+     * A sequential impulse contact solver, for use in place of the
+     * contact resolver. Rather than repeatedly picking the worst
+     * contact, it sweeps over every contact in the same order a fixed
+     * number of times (projected Gauss-Seidel). At each contact it
+     * applies the change in impulse needed, then clamps the total
+     * impulse built up at that contact: the normal impulse can only
+     * push, and the friction impulse must stay inside the friction
+     * cone.
+     *
+     * Its cost depends only on the number of contacts and iterations,
+     * not on the state of the scene, and since every contact keeps
+     * working on the same impulse over the sweeps, it handles stacks
+     * much better than the resolver.
+     *
+     * Penetration is removed by asking each contact for a small
+     * separating velocity (Baumgarte stabilisation), rather than by
+     * moving the bodies directly, so deep penetration takes a few
+     * frames to go away.
+     *
+     * Warm starting works as for the resolver: the solver starts from
+     * the accumulated impulse in each contact, which a ContactCache
+     * can prime, and leaves the final impulse there to be stored.
+     *
+     * The solver can also colour the contacts into batches, where no
+     * two contacts in a batch share a body that can move. The
+     * contacts in a batch can then be solved in any order, so they
+     * are solved four at a time with SIMD, split across several
+     * threads. Bodies that can't move (the scenery, and bodies with
+     * infinite mass) are never changed, so they don't count.
+     *
+     * Rather than always making the same number of sweeps, the solver
+     * can stop once the largest change a sweep makes to any contact's
+     * velocity (the residual) is small enough, or once a time budget
+     * is spent. The contacts are split into islands that share no
+     * body that can move, and each island is swept on its own, so a
+     * settled island stops while a busy one carries on. The budget is
+     * shared between the islands by their number of contacts.
+     *
+     * Joints are solved in the same sweeps, each joint row just
+     * before the contacts of its island. Their rows are worked out
+     * fresh each frame, and warm started from the impulses the joint
+     * kept from the last one. In the parallel mode the joint rows are
+     * solved in order on one thread at the start of each sweep.
+     *
+     * Finally, the solver can split a frame into substeps. The
+     * contacts are set up once, then each substep the bodies are
+     * integrated, each contact works out its penetration again from
+     * how far its points on the bodies have moved, each joint works
+     * out its rows again, and the solver makes a single sweep, warm
+     * started from the last substep (with a sweep before it that
+     * doesn't correct, to stop the velocity used to push the contacts
+     * apart and pull the joints together building up). Many short
+     * steps with one sweep each converge much better on stacks and
+     * heavy bodies resting on light ones than a few long ones with
+     * many sweeps.
+     */
+    class ContactSolver
+    {
+    protected:
+        /**
+         * Holds the velocities of one body while it is being solved,
+         * along with the mass properties the solver needs.
+         */
+        struct SolverBody
+        {
+            RigidBody* body;
+            Vector3 velocity;
+            Vector3 rotation;
+            real inverseMass;
+            Matrix3 inverseInertiaTensor;
+        };
+
+        /**
+         * Holds a contact while it is being sorted into the order
+         * it will be solved in.
+         */
+        struct SolverContact
+        {
+            /** The contact this came from, NULL for padding. */
+            Contact* contact;
+
+            /** The solver bodies involved. Zero is the scenery. */
+            unsigned body[2];
+        };
+
+        /**
+         * Holds four contacts ready for solving, in the order they
+         * are solved in, with each value laid out a lane to a
+         * contact. Each contact has three rows: the normal, then the
+         * two friction directions. The sweeps read only these and
+         * the solver bodies, and each value of a block can be loaded
+         * straight into a SIMD register.
+         */
+        struct SolverBlock
+        {
+            /** The contact in each lane, NULL for padding. */
+            Contact* contact[4];
+
+            /** The solver bodies involved. Zero is the scenery. */
+            unsigned body[2][4];
+
+            /** The world direction of each row, by row then axis. */
+            real direction[3][3][4];
+
+            /**
+             * For each body, row and axis, the contact position
+             * crossed with the direction, and the change in rotation
+             * that a unit impulse along the row gives.
+             */
+            real angular[2][3][3][4];
+            real angularChange[2][3][3][4];
+
+            /** The impulse that gives a unit velocity change in each row. */
+            real effectiveMass[3][4];
+
+            /** The normal velocity the contact is aiming for. */
+            real bias[4];
+
+            real friction[4];
+
+            /** The total impulse applied, in contact coordinates. */
+            real impulse[3][4];
+        };
+
+        /**
+         * Holds a joint while it is being sorted into the order it
+         * will be solved in.
+         */
+        struct SolverJoint
+        {
+            Joint* joint;
+
+            /** The solver bodies involved. Zero is the scenery. */
+            unsigned body[2];
+        };
+
+        /**
+         * Holds one row of a joint ready for solving.
+         */
+        struct SolverJointRow
+        {
+            /** The joint this came from, and its row. */
+            Joint* joint;
+            unsigned slot;
+
+            /** The solver bodies involved. Zero is the scenery. */
+            unsigned body[2];
+
+            Vector3 linear;
+            Vector3 angular[2];
+            Vector3 angularChange[2];
+
+            /** The impulse that gives a unit velocity change. */
+            real effectiveMass;
+
+            /** The relative velocity the row is aiming for. */
+            real bias;
+
+            /** The bounds on the total impulse. */
+            real lower;
+            real upper;
+
+            /** The total impulse applied. */
+            real impulse;
+        };
+
+        /**
+         * Holds the number of sweeps over the contacts.
+         */
+        unsigned iterations;
+
+        /**
+         * Holds the proportion of the penetration removed each frame.
+         */
+        real positionCorrection;
+
+        /**
+         * Holds the depth of penetration that is left alone, so that
+         * resting contacts stay touching and don't jitter.
+         */
+        real penetrationSlop;
+
+        /**
+         * Holds the residual below which an island is taken as
+         * solved. Zero (the default) sweeps until the iterations
+         * run out.
+         */
+        real residualEpsilon;
+
+        /**
+         * Holds the time, in microseconds, that one call to solve
+         * contacts may spend sweeping. Zero (the default) means no
+         * limit.
+         */
+        unsigned timeBudget;
+
+        /**
+         * Holds the bodies and contacts being solved. These are kept
+         * between calls so that their memory is reused.
+         */
+        std::vector<SolverBody> bodies;
+        std::vector<SolverContact> constraints;
+        std::vector<SolverBlock> blocks;
+
+        /**
+         * Holds the joints being solved, their rows, and where the
+         * rows of each joint start.
+         */
+        std::vector<SolverJoint> jointConstraints;
+        std::vector<SolverJointRow> jointRows;
+        std::vector<unsigned> jointRowStart;
+
+        /**
+         * Holds each body of each contact and joint, along with its
+         * body slot, for sorting when gathering the bodies. The joints'
+         * slots come after the contacts'.
+         */
+        std::vector<std::pair<RigidBody*, unsigned> > bodyEntries;
+
+        /**
+         * Holds the colours used by the contacts of each body, one bit
+         * per colour, and the colour given to each contact, while
+         * colouring.
+         */
+        std::vector<unsigned long long> bodyColours;
+        std::vector<unsigned> contactColours;
+
+        /**
+         * Holds the contacts sorted into their batches, and where each
+         * batch starts. The last batch holds any contacts that
+         * couldn't be coloured, and is solved on one thread.
+         */
+        std::vector<SolverContact> batchedConstraints;
+        std::vector<unsigned> batchStart;
+
+        /**
+         * Holds the largest change each thread has made in the
+         * current sweep of solveContactsParallel.
+         */
+        std::vector<real> threadResiduals;
+
+        /**
+         * Holds the threads that run solveContactsParallel.
+         */
+        WorkerPool workers;
+
+        /**
+         * Holds, while finding the islands, the body each body is
+         * joined to, the number of the island each body heads, and
+         * the island of each contact and joint. Then holds where each
+         * island starts in the contacts and in the joints.
+         */
+        std::vector<unsigned> islandParent;
+        std::vector<unsigned> islandIndex;
+        std::vector<unsigned> contactIslands;
+        std::vector<unsigned> jointIslands;
+        std::vector<unsigned> islandStart;
+        std::vector<unsigned> jointIslandStart;
+        std::vector<SolverJoint> sortedJoints;
+
+        /**
+         * Holds the separating speed each contact bounces at, for
+         * working out its bias again in each substep.
+         */
+        std::vector<real> contactBounces;
+
+        /**
+         * Holds where each contact is on each of its bodies, in the
+         * body's space (or the world's, for the scenery), while
+         * substepping.
+         */
+        std::vector<Vector3> substepAnchors;
+
+        /**
+         * Holds the penetration of each contact at the current
+         * substep.
+         */
+        std::vector<real> substepPenetrations;
+
+        /**
+         * Holds the duration of each substep, and the proportion of
+         * the penetration each substep removes.
+         */
+        real substepDuration;
+        real substepCorrection;
+
+    public:
+        /**
+         * Stores the largest number of sweeps any island used in the
+         * last call to solve contacts (or the number of sweeps, for
+         * solveContactsParallel).
+         */
+        unsigned iterationsUsed;
+
+        /**
+         * Stores the largest residual left in any island by the last
+         * call to solve contacts.
+         */
+        real residual;
+
+        /**
+         * Creates a new solver with the given number of sweeps, and
+         * optional position correction settings.
+         */
+        ContactSolver(unsigned iterations = 10,
+            real positionCorrection = (real)0.2,
+            real penetrationSlop = (real)0.01);
+
+        /**
+         * Sets the number of sweeps over the contacts.
+         */
+        void setIterations(unsigned iterations);
+
+        /**
+         * Sets the proportion of penetration removed each frame, and
+         * the depth of penetration that is left alone.
+         */
+        void setPositionCorrection(real positionCorrection,
+            real penetrationSlop);
+
+        /**
+         * Sets the residual below which an island stops being swept.
+         * The residual is the largest change in velocity a sweep
+         * makes along any row of any contact.
+         */
+        void setResidualEpsilon(real residualEpsilon);
+
+        /**
+         * Sets the time, in microseconds, that one call to solve
+         * contacts may spend sweeping, or zero for no limit. Every
+         * island gets at least one sweep, however little time is left.
+         */
+        void setTimeBudget(unsigned timeBudget);
+
+        /**
+         * Solves a set of contacts for velocity, removing penetration
+         * over the following frames.
+         *
+         * @param contactArray Pointer to an array of contact objects.
+         *
+         * @param numContacts The number of contacts in the array to solve.
+         *
+         * @param duration The duration of the previous integration step.
+         *
+         * @param jointArray Pointer to an array of joints to solve
+         * along with the contacts, or NULL.
+         *
+         * @param numJoints The number of joints in the array.
+         */
+        void solveContacts(Contact* contactArray,
+            unsigned numContacts,
+            real duration,
+            Joint* const* jointArray = NULL,
+            unsigned numJoints = 0);
+
+        /**
+         * Solves a set of contacts as solveContacts does, but with the
+         * contacts coloured into batches, and each batch solved four
+         * contacts at a time split between the given number of
+         * threads (including the calling one). The contacts are swept
+         * batch by batch, so the result is not the same as
+         * solveContacts gives, but it doesn't depend on the number of
+         * threads. The threads are kept between calls. The contacts
+         * aren't split into islands, so the residual epsilon and the
+         * time budget apply to all of them at once: the sweeps stop
+         * when no row changes by more than the epsilon, or when the
+         * budget is gone.
+         */
+        void solveContactsParallel(Contact* contactArray,
+            unsigned numContacts,
+            real duration,
+            unsigned threadCount,
+            Joint* const* jointArray = NULL,
+            unsigned numJoints = 0);
+
+        /**
+         * Sets up a set of contacts and joints to be solved over a
+         * frame of the given duration, split into the given number of
+         * substeps. The bodies must not have been integrated over the
+         * first substep yet.
+         */
+        void beginSubsteps(Contact* contactArray,
+            unsigned numContacts,
+            real duration,
+            unsigned substeps,
+            Joint* const* jointArray = NULL,
+            unsigned numJoints = 0);
+
+        /**
+         * Solves the contacts and joints once the bodies have been
+         * integrated over a substep, and writes the velocities back to
+         * the bodies. This makes one sweep over the joints and
+         * contacts that takes out the velocity the last substep left
+         * correcting them, then one that corrects the error left.
+         */
+        void solveSubstep();
+
+        /**
+         * Writes the impulses back to the contacts and joints, after
+         * the last substep.
+         */
+        void endSubsteps();
+
+    protected:
+        /**
+         * Sets up the contacts and gathers the bodies they and the
+         * joints involve.
+         */
+        void prepareContacts(Contact* contactArray, unsigned numContacts,
+            Joint* const* jointArray, unsigned numJoints, real duration);
+
+        /**
+         * Works out the rows of each contact, in their final order,
+         * and the velocity each is aiming for, filling the blocks.
+         * Then works out the rows of each joint.
+         */
+        void bakeRows(real duration);
+
+        /**
+         * Works out the rows of each joint from where the bodies are
+         * now, removing the given proportion of their error.
+         */
+        void bakeJointRows(real duration, real correction);
+
+        /**
+         * Applies the impulse each contact and joint row starts with.
+         */
+        void warmStart();
+
+        /**
+         * Sorts the contacts and joints into islands with no body
+         * that can move in common, keeping their order within each
+         * island.
+         */
+        void buildIslands();
+
+        /**
+         * Makes one sweep over the given run of contacts, returning
+         * the residual.
+         */
+        real solveVelocities(unsigned start, unsigned end);
+
+        /**
+         * Applies the change in impulse needed by one contact,
+         * returning the largest change in velocity along any row.
+         */
+        real solveContact(unsigned index);
+
+        /**
+         * Makes one sweep over the given run of joint rows, returning
+         * the residual.
+         */
+        real solveJoints(unsigned start, unsigned end);
+
+        /**
+         * Applies the change in impulse needed by the four contacts
+         * starting at the given one, which must not share a body that
+         * can move. Returns the largest change in velocity along any
+         * of their rows.
+         */
+        real solveGroup(unsigned first);
+
+        /**
+         * Sorts the contacts into batches with no body that can move
+         * in common, each padded to a multiple of four contacts.
+         */
+        void colourContacts();
+
+        /**
+         * Solves the given thread's share of one batch, returning the
+         * largest change in velocity along any row.
+         */
+        real solveBatch(unsigned batch, unsigned thread,
+            unsigned threadCount);
+
+        /**
+         * Writes the velocities back to the bodies, and the impulses
+         * back to the contacts and joints.
+         */
+        void storeResults();
+
+        /**
+         * Writes the impulses back to the joints.
+         */
+        void storeJointImpulses();
+    };
+
+    /**
+     * Remembers the contacts resolved in one frame, so that the
+     * impulses found for them can be used to warm start the matching
+     * contacts in the next frame. Resting contacts need roughly the
+     * same impulse every frame, so starting from last frame's value
+     * leaves the resolver with very little to do.
+     *
+     * Contacts are grouped into manifolds by the pair of bodies they
+     * connect. A new contact is matched to a cached one in the same
+     * manifold with the same feature id, or failing that to the
+     * closest one within the match tolerance. Contacts whose normal
+     * has turned too far are never matched.
+     *
+     * Call retrieve after generating the contacts for a frame, and
+     * store after they have been resolved.
+     */
+    class ContactCache
+    {
+    protected:
+        /**
+         * Holds the details of one contact from the last frame.
+         */
+        struct CachedContact
+        {
+            RigidBody* body[2];
+            unsigned featureId;
+
+            /** The contact point in the first body's local space. */
+            Vector3 localPoint;
+
+            Vector3 contactNormal;
+
+            /** The accumulated impulse, in world coordinates. */
+            Vector3 impulse;
+        };
+
+        /**
+         * Holds the cached contacts, sorted by body pair so that the
+         * contacts of one manifold are adjacent.
+         */
+        std::vector<CachedContact> cached;
+
+        /**
+         * Contacts further apart than this (in the first body's local
+         * space) are never matched.
+         */
+        real matchTolerance;
+
+        /**
+         * The proportion of the cached impulse that is used to warm
+         * start a matching contact.
+         */
+        real warmStartFactor;
+
+        /**
+         * Orders cached contacts by their body pair.
+         */
+        static bool compareBodies(const CachedContact& a,
+            const CachedContact& b);
+
+    public:
+        /**
+         * Creates an empty cache with the given match tolerance and
+         * warm start factor.
+         */
+        ContactCache(real matchTolerance = (real)0.05,
+            real warmStartFactor = (real)1.0);
+
+        /**
+         * Sets the distance within which contacts are matched.
+         */
+        void setMatchTolerance(real matchTolerance);
+
+        /**
+         * Sets the proportion of cached impulse used when warm
+         * starting.
+         */
+        void setWarmStartFactor(real warmStartFactor);
+
+        /**
+         * Primes the accumulated impulse of each of the given contacts
+         * from its match in the last frame. Returns the number of
+         * contacts that were matched.
+         */
+        unsigned retrieve(Contact* contacts, unsigned numContacts);
+
+        /**
+         * Replaces the cached contacts with the given resolved
+         * contacts.
+         */
+        void store(const Contact* contacts, unsigned numContacts);
+
+        /**
+         * Forgets all cached contacts.
+         */
+        void clear();
     };
 
     /**
@@ -412,6 +1130,127 @@ namespace Grics {
         virtual unsigned addContact(Contact* contact, unsigned limit) const = 0;
     };
 
+    /**
+     * Holds the contacts generated in a frame. Contacts are written
+     * into chunks, and a new chunk is added when the current one
+     * fills up, so there is no fixed limit on the number of contacts.
+     * The chunks are kept from frame to frame, so once the arena has
+     * grown to fit the scene it allocates nothing more.
+     *
+     * Each chunk has one spare contact past its end, which a
+     * generator is given along with the room left. A generator that
+     * writes into it had more contacts than there was room for, so it
+     * is run again in a chunk twice the size, and this is counted as
+     * an overflow. When a frame spills over more than one chunk,
+     * getContacts gathers them into one chunk with room to spare,
+     * which the next frames use. No chunk is freed before the arena
+     * is, so the others are kept for frames that need them.
+     */
+    class ContactArena
+    {
+    public:
+        /**
+         * Creates an arena whose first chunk holds the given number
+         * of contacts. No memory is allocated until it is needed.
+         */
+        ContactArena(unsigned chunkSize = 256);
+
+        ~ContactArena();
+
+        /**
+         * Discards the contacts of the last frame, keeping the memory
+         * for the next.
+         */
+        void reset();
+
+        /**
+         * Runs the given generator, giving it the room left in the
+         * current chunk, and returns the number of contacts it
+         * added. If it has more contacts than there is room for, it
+         * is run again in a larger chunk, until they fit.
+         */
+        unsigned addContacts(const ContactGenerator* generator);
+
+        /**
+         * Returns the contacts added since the last reset, as a
+         * single array. This merges the chunks if the contacts have
+         * spilled over more than one, so call it once all the
+         * contacts are added.
+         */
+        Contact* getContacts();
+
+        /**
+         * Returns the number of contacts added since the last reset.
+         */
+        unsigned getContactCount() const
+        {
+            return contactCount;
+        }
+
+        /**
+         * Returns the number of contacts the arena can hold without
+         * allocating more memory.
+         */
+        unsigned getCapacity() const;
+
+        /**
+         * Returns the most contacts held in any frame so far.
+         */
+        unsigned getHighWaterMark() const
+        {
+            return highWaterMark;
+        }
+
+        /**
+         * Returns the number of times a generator ran out of room
+         * and was run again in a larger chunk.
+         */
+        unsigned getOverflowCount() const
+        {
+            return overflowCount;
+        }
+
+    protected:
+        /**
+         * A block of contacts, of which the first few are used. The
+         * block holds one more contact than its size, as the spare.
+         */
+        struct Chunk
+        {
+            Contact* contacts;
+            unsigned size;
+            unsigned used;
+        };
+
+        std::vector<Chunk> chunks;
+
+        /** Holds the index of the chunk being written into. */
+        unsigned currentChunk;
+
+        /** Holds the size of the first chunk allocated. */
+        unsigned chunkSize;
+
+        unsigned contactCount;
+        unsigned highWaterMark;
+        unsigned overflowCount;
+
+        /**
+         * Moves on to the next chunk, allocating it if needed, so
+         * that there is room for at least the given number of
+         * contacts.
+         */
+        void nextChunk(unsigned room);
+
+        /**
+         * Allocates an empty chunk of the given size.
+         */
+        static Chunk makeChunk(unsigned size);
+
+    private:
+        ContactArena(const ContactArena&);
+        ContactArena& operator=(const ContactArena&);
+    };
+
     // Dummy contact generator that keeps bodies above a plane at y=0
     class GroundContactGenerator : public Grics::ContactGenerator {
     public:
@@ -0,0 +1,209 @@
+#pragma once
+#ifndef GRICS_JOINTS_H
+#define GRICS_JOINTS_H
+
+#include "body.h"
+
+namespace Grics {
+
+    /**
+     * One row of a joint: a direction along which the relative
+     * velocity of the two bodies is driven to a target, with the
+     * total impulse along it kept between two bounds. The relative
+     * velocity along the row is
+     *
+     *   linear * v1 + angular[0] * w1 - linear * v2 - angular[1] * w2
+     *
+     * where v and w are the velocity and rotation of each body, the
+     * same form the contact solver uses for contact rows.
+     */
+    struct JointRow
+    {
+        /** The world direction of the linear part, zero for rows that only turn. */
+        Vector3 linear;
+
+        /** The angular part for each body. */
+        Vector3 angular[2];
+
+        /** The relative velocity the row is aiming for. */
+        real bias;
+
+        /** The bounds on the total impulse along the row. */
+        real lower;
+        real upper;
+
+        /** The joint's stored impulse this row warm starts from. */
+        unsigned slot;
+    };
+
+    /**
+     * A joint holds two rigid bodies together, removing some of their
+     * relative freedom. Unlike a stiff spring it is solved as a set of
+     * constraint rows alongside the contacts, so it stays stiff at any
+     * time step. The second body can be NULL, which joins the first
+     * to a fixed point in the world.
+     *
+     * A joint is set up from the bodies' current positions, so place
+     * the bodies where the joint is at rest first. Each kind of joint
+     * removes these freedoms:
+     *
+     * - BALL: the anchors stay together; the bodies turn freely.
+     * - HINGE: as BALL, and the bodies only turn about the hinge
+     *   axis. The angle about the axis can be limited and driven by
+     *   a motor.
+     * - SLIDER: the bodies don't turn, and the second anchor stays on
+     *   the line through the first along the slider axis. The
+     *   distance along the axis can be limited.
+     * - FIXED: the bodies don't move at all relative to each other.
+     *
+     * The total impulse along each row is kept between frames, to
+     * warm start the next frame.
+     */
+    class Joint
+    {
+        /**
+         * The contact solver reads the joint's rows and keeps its
+         * impulses.
+         */
+        friend class ContactSolver;
+
+    public:
+        /**
+         * Identifies the kind of joint.
+         */
+        enum Type
+        {
+            BALL,
+            HINGE,
+            SLIDER,
+            FIXED
+        };
+
+        /**
+         * The most rows any joint has.
+         */
+        enum { MAX_ROWS = 7 };
+
+        /**
+         * Holds the bodies joined. The second can be NULL, for a joint
+         * to the world.
+         */
+        RigidBody* body[2];
+
+        /**
+         * Creates a joint with no bodies. One of the set functions
+         * must be called before the joint is used.
+         */
+        Joint();
+
+        /**
+         * Sets up the joint as a ball joint at the given world point.
+         */
+        void setBall(RigidBody* one, RigidBody* two, const Vector3& anchor);
+
+        /**
+         * Sets up the joint as a hinge at the given world point, about
+         * the given world axis. Limits and the motor start off.
+         */
+        void setHinge(RigidBody* one, RigidBody* two,
+            const Vector3& anchor, const Vector3& axis);
+
+        /**
+         * Sets up the joint as a slider along the given world axis.
+         * The limits start off.
+         */
+        void setSlider(RigidBody* one, RigidBody* two, const Vector3& axis);
+
+        /**
+         * Sets up the joint to hold the bodies where they are.
+         */
+        void setFixed(RigidBody* one, RigidBody* two);
+
+        /**
+         * Limits the angle of a hinge (in radians, about the axis,
+         * positive when the first body turns anticlockwise about it
+         * relative to the second) or the distance along a slider (the
+         * first body's anchor ahead of the second's along the axis).
+         * Both start at zero.
+         */
+        void setLimits(real lower, real upper);
+
+        /**
+         * Turns the limits off.
+         */
+        void clearLimits();
+
+        /**
+         * Drives a hinge at the given relative speed (in radians per
+         * second, measured as for the limits), using no more than the
+         * given torque.
+         */
+        void setMotor(real speed, real maxTorque);
+
+        /**
+         * Turns the motor off.
+         */
+        void clearMotor();
+
+        Type getType() const;
+
+        /**
+         * Returns the current hinge angle or slider distance, as
+         * measured for the limits.
+         */
+        real getPosition() const;
+
+    protected:
+        Type type;
+
+        /**
+         * Holds the anchor in each body's local space (or in world
+         * space, if there is no second body).
+         */
+        Vector3 anchor[2];
+
+        /**
+         * Holds the hinge or slider axis in each body's local space,
+         * and a direction at right angles to it, for measuring the
+         * hinge angle.
+         */
+        Vector3 axis[2];
+        Vector3 reference[2];
+
+        /**
+         * Holds the orientation of the first body relative to the
+         * second when the joint was set up, for joints that stop the
+         * bodies turning.
+         */
+        Quaternion relativeOrientation;
+
+        bool limited;
+        real lower;
+        real upper;
+
+        bool motorised;
+        real motorSpeed;
+        real maxMotorTorque;
+
+        /**
+         * Holds the total impulse along each row in the last frame.
+         */
+        real impulse[MAX_ROWS];
+
+        /**
+         * Clears the stored impulses and the limits and motor, ready
+         * for setting up a new joint.
+         */
+        void reset(Type type, RigidBody* one, RigidBody* two);
+
+        /**
+         * Fills in the joint's rows for the current positions of the
+         * bodies, returning how many there are. The rows are given
+         * the proportion of their error to remove this step.
+         */
+        unsigned calculateRows(JointRow* rows, real duration,
+            real correction) const;
+    };
+}
+
+#endif
@@ -12,12 +12,16 @@
 
 
 namespace Grics {
+	class CollisionSDF;
+	class ConvexHull;
+
 	class Mesh {
 	public:
 		enum shapeType{
 			CUBE,
 			SPHERE,
 			CYLINDER,
+			CAPSULE,
 			CONE,
 			PLANE,
 			GRID
@@ -26,6 +30,22 @@ namespace Grics {
 		Mesh();
 		~Mesh();
 		void drawGeometry(shapeType, Shader& , const Vector3&, const Vector3&);
+
+		/**
+		 * Bakes a distance field from the given shape, placed and
+		 * scaled as it would be drawn, so complex static scenery can
+		 * be collided with. Returns false if the shape has no
+		 * triangles.
+		 */
+		bool bakeSDF(shapeType, const Vector3& position, const Vector3& scale,
+			real voxelSize, real bandWidth, CollisionSDF* sdf);
+
+		/**
+		 * Builds the convex hull of the shape's vertices, scaled as
+		 * it would be drawn, for use as a convex collider. Returns
+		 * false if the shape is flat.
+		 */
+		bool buildHull(shapeType, const Vector3& scale, ConvexHull* hull);
 		
 	private:
 		static GLuint VBO, VAO, EBO;
@@ -36,6 +56,7 @@ namespace Grics {
 		void initMesh();
 		void generateAllShapes();
 		void appendShape(const std::vector<real>& vertices, const std::vector<unsigned int>& indices, shapeType type);
+		void generateShape(shapeType type, std::vector<real>& vertices, std::vector<unsigned int>& indices);
 		std::vector<real> generateCube();
 		std::vector<unsigned int> generateCubeIndices();
 
@@ -45,6 +66,9 @@ namespace Grics {
 		std::vector<real> generateCylinder();
 		std::vector<unsigned int> generateCylinderIndices();
 
+		std::vector<real> generateCapsule();
+		std::vector<unsigned int> generateCapsuleIndices();
+
 		std::vector<real> generateCone();
 		std::vector<unsigned int> generateConeIndices();
 
@@ -0,0 +1,83 @@
+#pragma once
+#ifndef GRICS_WORKERS_H
+#define GRICS_WORKERS_H
+
+#include <vector>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <functional>
+
+namespace Grics {
+
+    /**
+     * A set of worker threads kept from one call to the next, for the
+     * parts of the engine that split their work between threads each
+     * frame. Starting threads costs far more than waking them, so the
+     * workers are started the first time they are needed and then
+     * sleep between jobs.
+     */
+    class WorkerPool
+    {
+    public:
+        /**
+         * The job each thread runs, given the number of the thread.
+         */
+        typedef std::function<void(unsigned)> Job;
+
+        WorkerPool();
+
+        /**
+         * Stops and joins the workers.
+         */
+        ~WorkerPool();
+
+        /**
+         * Runs the job on the given number of threads, including the
+         * calling one as thread zero, and returns once every thread
+         * has finished it. Workers are started as needed.
+         */
+        void run(unsigned threadCount, const Job& job);
+
+    protected:
+        /**
+         * Holds the workers. Worker i runs as thread i + 1.
+         */
+        std::vector<std::thread> workers;
+
+        /**
+         * Guards the job, and wakes the workers when there is a new
+         * one or the calling thread when they have finished it.
+         */
+        std::mutex lock;
+        std::condition_variable started;
+        std::condition_variable finished;
+
+        /** Holds the job being run, and the threads running it. */
+        const Job* job;
+        unsigned jobThreads;
+
+        /**
+         * Counts the jobs given out, so each worker can tell a new
+         * one from the one it last ran.
+         */
+        unsigned generation;
+
+        /** Holds the number of workers still running the job. */
+        unsigned remaining;
+
+        bool stopping;
+
+        /**
+         * Runs the jobs given to one worker until the pool stops,
+         * starting with the first one after the given job count.
+         */
+        void workerLoop(unsigned thread, unsigned seen);
+
+    private:
+        WorkerPool(const WorkerPool&);
+        WorkerPool& operator=(const WorkerPool&);
+    };
+}
+
+#endif
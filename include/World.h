@@ -4,6 +4,8 @@
 
 #include "body.h"
 #include "Contacts.h"
+#include "Joints.h"
+#include "Articulation.h"
 #include <vector>
 
 namespace Grics {
@@ -17,6 +19,33 @@ namespace Grics {
     public:
         typedef std::vector<RigidBody* > RigidBodies;
         typedef std::vector<ContactGenerator*> ContactGenerators;
+        typedef std::vector<Joint*> Joints;
+        typedef std::vector<Articulation*> Articulations;
+
+        /**
+         * Identifies which solver the world uses for its contacts.
+         */
+        enum SolverType
+        {
+            /** The contact resolver, which resolves the worst contact first. */
+            WORST_FIRST,
+
+            /** The sequential impulse solver, which sweeps the contacts in order. */
+            SEQUENTIAL_IMPULSE,
+
+            /**
+             * The sequential impulse solver with its contacts coloured
+             * into batches, solved with SIMD on several threads.
+             */
+            PARALLEL_IMPULSE,
+
+            /**
+             * The sequential impulse solver run over several substeps
+             * a frame. The contacts are found once a frame, then each
+             * substep integrates the bodies and makes one sweep.
+             */
+            SUBSTEPPED_IMPULSE
+        };
     private:
         // ... other World data as before ...
         /**
@@ -32,30 +61,75 @@ namespace Grics {
          */
         ContactResolver resolver;
 
+        /**
+         * Holds the sequential impulse solver, used in place of the
+         * resolver if it is selected.
+         */
+        ContactSolver solver;
+
+        /**
+         * Holds which solver is used for the contacts.
+         */
+        SolverType solverType;
+
+        /**
+         * Holds the number of threads the parallel solver uses.
+         */
+        unsigned solverThreads;
+
+        /**
+         * Holds the number of substeps a frame is split into by the
+         * substepped solver.
+         */
+        unsigned substeps;
+
+        /**
+         * Holds the contacts resolved in the last frame, used to warm
+         * start the resolver.
+         */
+        ContactCache contactCache;
+
+        /**
+         * True if the contact cache should be used to warm start the
+         * resolver each frame.
+         */
+        bool warmStarting;
+
         ContactGenerators contactGenerator;
 
         /**
-         * Holds an array of contacts, for filling by the contact
-         * generators.
+         * Holds the joints, which are solved along with the contacts.
+         */
+        Joints joints;
+
+        /**
+         * Holds the articulations. Their link bodies are integrated
+         * by the articulation, so they aren't in the list of bodies.
          */
-        Contact* contacts;
+        Articulations articulations;
 
         /**
-         * Holds the maximum number of contacts allowed (i.e. the size
-         * of the contacts array).
+         * Holds the contacts, for filling by the contact generators.
+         * It grows as needed, so no contacts are lost.
          */
-        unsigned maxContacts;
+        ContactArena contacts;
+
+        /**
+         * Processes the physics for the world with the substepped
+         * solver.
+         */
+        void runSubsteps(real dt);
 
     public:
         /**
-         * Creates a new simulator that can handle up to the given
-         * number of contacts per frame. You can also optionally give
+         * Creates a new simulator with room for the given number of
+         * contacts per frame to begin with; more room is added if a
+         * frame needs it. You can also optionally give
          * a number of contact-resolution iterations to use. If you
          * don't give a number of iterations, then four times the
          * number of detected contacts will be used for each frame.
          */
         World(unsigned maxContacts, unsigned iterations = 0);
-        ~World();
 
         /**
          * Calls each of the registered contact generators to report
@@ -76,9 +150,58 @@ namespace Grics {
          */
         void startFrame();
 
+        /**
+         * Turns warm starting of the contact resolver from the last
+         * frame's impulses on or off. It is on by default.
+         */
+        void setWarmStarting(bool warmStarting);
+
+        /**
+         * Picks the solver used for the contacts. The resolver is
+         * used by default.
+         */
+        void setSolverType(SolverType solverType);
+
+        SolverType getSolverType() const;
+
+        /**
+         * Returns the sequential impulse solver, to change its
+         * settings.
+         */
+        ContactSolver& getContactSolver();
+
+        /**
+         * Returns the contact resolver, to change its settings.
+         */
+        ContactResolver& getContactResolver();
+
+        /**
+         * Sets the number of threads the parallel solver uses,
+         * including the calling one. It defaults to the number of
+         * hardware threads.
+         */
+        void setSolverThreads(unsigned solverThreads);
+
+        /**
+         * Sets the number of substeps a frame is split into by the
+         * substepped solver. It defaults to four. The solver's number
+         * of iterations isn't used: each substep makes one sweep.
+         */
+        void setSubsteps(unsigned substeps);
+
         RigidBodies& getRigidBodies();
 
+        /**
+         * Returns the contact arena, to read how many contacts it has
+         * needed and how often it has had to grow.
+         */
+        const ContactArena& getContactArena() const;
+
         ContactGenerators& getContactGenerators();
+
+        Joints& getJoints();
+
+        Articulations& getArticulations();
     };
 }
 
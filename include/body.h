@@ -7,7 +7,11 @@
 
 namespace Grics {
 	class RigidBody {
-
+		/**
+		 * An articulation moves its links' bodies itself, and reads
+		 * back what the resolver has done to them.
+		 */
+		friend class Articulation;
 
 		bool isAwake;
 
@@ -135,8 +139,12 @@ namespace Grics {
 		 * This function uses a Newton-Euler integration method, which is a
 		 * linear approximation to the correct integral. For this reason it
 		 * may be inaccurate in some cases.
+		 *
+		 * The force and torque accumulators are cleared afterwards,
+		 * unless keepForces is set, so that the same forces can act
+		 * over several substeps of a frame.
 		 */
-		void integrate(real dt);
+		void integrate(real dt, bool keepForces = false);
 
 		/**
 		 * Returns true if the body is awake and responding to
@@ -10,10 +10,23 @@ namespace Grics {
     #define real_sqrt sqrtf
     #define real_pow powf
     #define real_abs fabsf
+    #define real_sin sinf
+    #define real_cos cosf
+    #define real_atan2 atan2f
     #define REAL_MAX FLT_MAX
     #define PI 3.1415926f
     #define real_epsilon DBL_EPSILON
 }
 
+/**
+ * Defined when the collision code can use SSE2 to work on four reals
+ * at once, which needs real to be float. Define GRICS_NO_SIMD to use
+ * the plain code everywhere.
+ */
+#if !defined(GRICS_NO_SIMD) && (defined(_M_X64) || \
+    (defined(_M_IX86_FP) && _M_IX86_FP >= 2) || defined(__SSE2__))
+#define GRICS_SSE
+#endif
+
 #endif
 
@@ -0,0 +1,640 @@
+#include <Articulation.h>
+#include <algorithm>
+#include <assert.h>
+
+using namespace Grics;
+
+/*
+ * This file holds the articulated body algorithm. All the spatial
+ * quantities are measured in world space at one point, the
+ * articulation's origin, so moving one from a link to its parent
+ * needs no change of frame.
+ */
+
+namespace {
+
+    Quaternion conjugate(const Quaternion& q)
+    {
+        return Quaternion(q.r, -q.i, -q.j, -q.k);
+    }
+
+    /*
+     * Turns a vector by the given orientation. The matrix that
+     * Matrix3::setOrientation gives turns the other way, as the
+     * inverse of the body transform.
+     */
+    Vector3 rotate(const Quaternion& q, const Vector3& vector)
+    {
+        Matrix3 matrix;
+        matrix.setOrientation(q);
+        return matrix.transformTranspose(vector);
+    }
+
+    /*
+     * Returns the turn by the given angle about the given unit axis.
+     */
+    Quaternion axisRotation(const Vector3& axis, real angle)
+    {
+        real s = real_sin(angle * (real)0.5);
+        return Quaternion(real_cos(angle * (real)0.5),
+            axis.x * s, axis.y * s, axis.z * s);
+    }
+
+    /*
+     * Returns the world inertia tensor of a body with the given
+     * orientation and body space tensor.
+     */
+    Matrix3 worldInertia(const Quaternion& orientation, const Matrix3& tensor)
+    {
+        Matrix3 turn;
+        turn.setOrientation(orientation);
+        return turn.transpose() * tensor * turn;
+    }
+
+    /*
+     * Reads the given component of a spatial vector, with the
+     * angular part first.
+     */
+    template <class Spatial>
+    inline real component(const Spatial& vector, unsigned i)
+    {
+        return i < 3 ? vector.angular[i] : vector.linear[i - 3];
+    }
+
+    template <class Spatial>
+    inline Spatial scaled(const Spatial& vector, real scale)
+    {
+        Spatial result;
+        result.angular = vector.angular * scale;
+        result.linear = vector.linear * scale;
+        return result;
+    }
+
+    template <class Spatial>
+    inline Spatial sum(const Spatial& one, const Spatial& two)
+    {
+        Spatial result;
+        result.angular = one.angular + two.angular;
+        result.linear = one.linear + two.linear;
+        return result;
+    }
+
+    /*
+     * Returns the power of a force acting on a motion.
+     */
+    template <class Spatial>
+    inline real dot(const Spatial& motion, const Spatial& force)
+    {
+        return motion.angular * force.angular + motion.linear * force.linear;
+    }
+
+    /*
+     * Returns the rate of change of a motion carried along with the
+     * given velocity.
+     */
+    template <class Spatial>
+    inline Spatial crossMotion(const Spatial& velocity, const Spatial& motion)
+    {
+        Spatial result;
+        result.angular = velocity.angular.vectorProduct(motion.angular);
+        result.linear = velocity.angular.vectorProduct(motion.linear) +
+            velocity.linear.vectorProduct(motion.angular);
+        return result;
+    }
+
+    /*
+     * Returns the rate of change of a force carried along with the
+     * given velocity.
+     */
+    template <class Spatial>
+    inline Spatial crossForce(const Spatial& velocity, const Spatial& force)
+    {
+        Spatial result;
+        result.angular = velocity.angular.vectorProduct(force.angular) +
+            velocity.linear.vectorProduct(force.linear);
+        result.linear = velocity.angular.vectorProduct(force.linear);
+        return result;
+    }
+
+    template <class Matrix, class Spatial>
+    inline Spatial multiply(const Matrix& matrix, const Spatial& vector)
+    {
+        real in[6], out[6];
+        for (unsigned i = 0; i < 6; i++) in[i] = component(vector, i);
+        for (unsigned row = 0; row < 6; row++)
+        {
+            out[row] = 0;
+            for (unsigned col = 0; col < 6; col++)
+            {
+                out[row] += matrix.data[row][col] * in[col];
+            }
+        }
+        Spatial result;
+        result.angular = Vector3(out[0], out[1], out[2]);
+        result.linear = Vector3(out[3], out[4], out[5]);
+        return result;
+    }
+
+    /*
+     * Solves matrix * result = vector by elimination, for the
+     * acceleration of a floating link.
+     */
+    template <class Matrix, class Spatial>
+    Spatial solve(Matrix matrix, const Spatial& vector)
+    {
+        real value[6];
+        for (unsigned i = 0; i < 6; i++) value[i] = component(vector, i);
+        for (unsigned col = 0; col < 6; col++)
+        {
+            unsigned pivot = col;
+            for (unsigned row = col + 1; row < 6; row++)
+            {
+                if (real_abs(matrix.data[row][col]) >
+                    real_abs(matrix.data[pivot][col])) pivot = row;
+            }
+            if (pivot != col)
+            {
+                for (unsigned k = 0; k < 6; k++)
+                {
+                    std::swap(matrix.data[col][k], matrix.data[pivot][k]);
+                }
+                std::swap(value[col], value[pivot]);
+            }
+            for (unsigned row = col + 1; row < 6; row++)
+            {
+                real factor = matrix.data[row][col] / matrix.data[col][col];
+                for (unsigned k = col; k < 6; k++)
+                {
+                    matrix.data[row][k] -= factor * matrix.data[col][k];
+                }
+                value[row] -= factor * value[col];
+            }
+        }
+        for (unsigned col = 6; col-- > 0;)
+        {
+            for (unsigned k = col + 1; k < 6; k++)
+            {
+                value[col] -= matrix.data[col][k] * value[k];
+            }
+            value[col] /= matrix.data[col][col];
+        }
+        Spatial result;
+        result.angular = Vector3(value[0], value[1], value[2]);
+        result.linear = Vector3(value[3], value[4], value[5]);
+        return result;
+    }
+
+    /*
+     * Copies a 3x3 block into one of the four blocks of a spatial
+     * matrix.
+     */
+    template <class Matrix>
+    void setBlock(Matrix& matrix, unsigned row, unsigned col,
+        const Matrix3& block)
+    {
+        for (unsigned i = 0; i < 3; i++)
+        {
+            for (unsigned j = 0; j < 3; j++)
+            {
+                matrix.data[row * 3 + i][col * 3 + j] = block.data[i * 3 + j];
+            }
+        }
+    }
+
+    /*
+     * Limits a joint rate to the given speed either way.
+     */
+    inline real clampRate(real rate, real maxRate)
+    {
+        if (rate > maxRate) return maxRate;
+        if (rate < -maxRate) return -maxRate;
+        return rate;
+    }
+}
+
+Articulation::Articulation()
+    : maxJointRate(100)
+{
+}
+
+unsigned Articulation::addLink(RigidBody* body, int parent, JointType type,
+    const Vector3& anchor, const Vector3& axis)
+{
+    assert(parent < (int)links.size());
+    assert(type != FLOATING || parent < 0);
+
+    Link link;
+    link.body = body;
+    link.parent = parent;
+    link.type = type;
+    link.position = link.rate = link.jointForce = 0;
+
+    body->calculateDerivedData();
+    link.mass = body->getMass();
+    body->getInertiaTensor(&link.inertiaTensor);
+
+    // The joint is measured from the parent's current place.
+    Quaternion parentOrientation;
+    Vector3 parentCentre;
+    if (parent >= 0)
+    {
+        parentOrientation = links[parent].orientation;
+        parentCentre = links[parent].centre;
+    }
+    Quaternion toParent = conjugate(parentOrientation);
+    link.parentAnchor = rotate(toParent, anchor - parentCentre);
+    link.childAnchor = body->getPointInLocalSpace(anchor);
+    Vector3 direction = axis;
+    if (type != FLOATING) direction.normalize();
+    link.axis = rotate(toParent, direction);
+    link.relativeOrientation = toParent;
+    link.relativeOrientation *= body->getOrientation();
+
+    link.rootPosition = body->getPosition();
+    link.rootOrientation = body->getOrientation();
+    link.rootVelocity = body->getVelocity();
+    link.rootRotation = body->getRotation();
+
+    // A link's body moves with the articulation, so it must never
+    // fall asleep on its own.
+    body->setCanSleep(false);
+    body->setAwake();
+
+    links.push_back(link);
+    calculateKinematics();
+    return (unsigned)links.size() - 1;
+}
+
+unsigned Articulation::getLinkCount() const
+{
+    return (unsigned)links.size();
+}
+
+RigidBody* Articulation::getLinkBody(unsigned link) const
+{
+    return links[link].body;
+}
+
+real Articulation::getJointPosition(unsigned link) const
+{
+    return links[link].position;
+}
+
+void Articulation::setJointPosition(unsigned link, real position)
+{
+    links[link].position = position;
+}
+
+real Articulation::getJointRate(unsigned link) const
+{
+    return links[link].rate;
+}
+
+void Articulation::setJointRate(unsigned link, real rate)
+{
+    links[link].rate = rate;
+}
+
+void Articulation::addJointForce(unsigned link, real force)
+{
+    links[link].jointForce += force;
+}
+
+void Articulation::setMaxJointRate(real maxJointRate)
+{
+    Articulation::maxJointRate = maxJointRate;
+}
+
+void Articulation::updateLinks()
+{
+    calculateKinematics();
+}
+
+void Articulation::calculateKinematics()
+{
+    if (links.empty()) return;
+
+    // Measure from the first link's anchor, or its centre if it is
+    // floating, rather than the world origin, so that the large
+    // terms in the inertias don't swamp the small ones when the
+    // articulation is far from the origin.
+    const Link& first = links[0];
+    origin = first.type == FLOATING ? first.rootPosition : first.parentAnchor;
+
+    // Parents always come before their children.
+    for (unsigned i = 0; i < links.size(); i++)
+    {
+        Link& link = links[i];
+        if (link.type == FLOATING)
+        {
+            link.rootOrientation.normalize();
+            link.orientation = link.rootOrientation;
+            link.centre = link.rootPosition;
+            link.arm = link.centre - origin;
+            link.motion = SpatialVector();
+            link.biasAcceleration = SpatialVector();
+            link.spatialVelocity.angular = link.rootRotation;
+            link.spatialVelocity.linear = link.rootVelocity -
+                link.rootRotation.vectorProduct(link.arm);
+        }
+        else
+        {
+            Quaternion parentOrientation;
+            Vector3 parentCentre;
+            SpatialVector parentVelocity;
+            if (link.parent >= 0)
+            {
+                const Link& parent = links[link.parent];
+                parentOrientation = parent.orientation;
+                parentCentre = parent.centre;
+                parentVelocity = parent.spatialVelocity;
+            }
+
+            // Place the link, and find the motion of its joint.
+            Vector3 axis = rotate(parentOrientation, link.axis);
+            Vector3 anchor = parentCentre +
+                rotate(parentOrientation, link.parentAnchor);
+            Quaternion orientation = parentOrientation;
+            if (link.type == REVOLUTE)
+            {
+                orientation *= axisRotation(link.axis, link.position);
+                link.motion.angular = axis;
+                link.motion.linear = (anchor - origin).vectorProduct(axis);
+            }
+            else
+            {
+                anchor.addScaledVector(axis, link.position);
+                link.motion.angular.clear();
+                link.motion.linear = axis;
+            }
+            orientation *= link.relativeOrientation;
+            orientation.normalize();
+            link.orientation = orientation;
+            link.centre = anchor - rotate(orientation, link.childAnchor);
+            link.arm = link.centre - origin;
+
+            SpatialVector jointVelocity = scaled(link.motion, link.rate);
+            link.spatialVelocity = sum(parentVelocity, jointVelocity);
+            link.biasAcceleration =
+                crossMotion(link.spatialVelocity, jointVelocity);
+        }
+        link.rotation = link.spatialVelocity.angular;
+        link.velocity = link.spatialVelocity.linear +
+            link.rotation.vectorProduct(link.arm);
+
+        // The inertia of the link measured at the origin.
+        Matrix3 cross, crossTranspose;
+        cross.setSkewSymmetric(link.arm);
+        crossTranspose.setTranspose(cross);
+        Matrix3 block = cross * crossTranspose;
+        block *= link.mass;
+        block += worldInertia(link.orientation, link.inertiaTensor);
+        setBlock(link.inertia, 0, 0, block);
+        block = cross;
+        block *= link.mass;
+        setBlock(link.inertia, 0, 1, block);
+        block = crossTranspose;
+        block *= link.mass;
+        setBlock(link.inertia, 1, 0, block);
+        block = Matrix3(link.mass, 0, 0, 0, link.mass, 0, 0, 0, link.mass);
+        setBlock(link.inertia, 1, 1, block);
+
+        RigidBody* body = link.body;
+        body->setPosition(link.centre);
+        body->setOrientation(link.orientation);
+        body->setVelocity(link.velocity);
+        body->setRotation(link.rotation);
+        body->calculateDerivedData();
+    }
+}
+
+void Articulation::calculateAccelerations(bool impulses)
+{
+    // Each link starts with its own inertia, and the force needed to
+    // keep it moving as it is less the force on it.
+    for (unsigned i = 0; i < links.size(); i++)
+    {
+        Link& link = links[i];
+        link.articulatedInertia = link.inertia;
+        link.articulatedForce = scaled(link.force, -1);
+        if (!impulses)
+        {
+            link.articulatedForce = sum(link.articulatedForce,
+                crossForce(link.spatialVelocity,
+                    multiply(link.inertia, link.spatialVelocity)));
+        }
+    }
+
+    // Working in from the leaves, add to each parent what its child
+    // passes on through the joint.
+    for (unsigned i = (unsigned)links.size(); i-- > 0;)
+    {
+        Link& link = links[i];
+        if (link.type == FLOATING) continue;
+
+        link.inertiaMotion = multiply(link.articulatedInertia, link.motion);
+        link.jointInertia = dot(link.motion, link.inertiaMotion);
+        link.jointBias = (impulses ? 0 : link.jointForce) -
+            dot(link.motion, link.articulatedForce);
+        if (link.parent < 0) continue;
+
+        SpatialMatrix passed = link.articulatedInertia;
+        real scale = ((real)1.0) / link.jointInertia;
+        for (unsigned row = 0; row < 6; row++)
+        {
+            real left = component(link.inertiaMotion, row) * scale;
+            for (unsigned col = 0; col < 6; col++)
+            {
+                passed.data[row][col] -=
+                    left * component(link.inertiaMotion, col);
+            }
+        }
+        SpatialVector force = sum(link.articulatedForce,
+            scaled(link.inertiaMotion, link.jointBias * scale));
+        if (!impulses)
+        {
+            force = sum(force, multiply(passed, link.biasAcceleration));
+        }
+
+        Link& parent = links[link.parent];
+        for (unsigned row = 0; row < 6; row++)
+        {
+            for (unsigned col = 0; col < 6; col++)
+            {
+                parent.articulatedInertia.data[row][col] +=
+                    passed.data[row][col];
+            }
+        }
+        parent.articulatedForce = sum(parent.articulatedForce, force);
+    }
+
+    // Then working out from the roots, find each joint's acceleration
+    // from its parent's.
+    for (unsigned i = 0; i < links.size(); i++)
+    {
+        Link& link = links[i];
+        if (link.type == FLOATING)
+        {
+            link.acceleration = solve(link.articulatedInertia,
+                scaled(link.articulatedForce, -1));
+            link.jointAcceleration = 0;
+            continue;
+        }
+
+        SpatialVector acceleration;
+        if (link.parent >= 0) acceleration = links[link.parent].acceleration;
+        if (!impulses)
+        {
+            acceleration = sum(acceleration, link.biasAcceleration);
+        }
+        link.jointAcceleration = (link.jointBias -
+            dot(acceleration, link.inertiaMotion)) / link.jointInertia;
+        link.acceleration = sum(acceleration,
+            scaled(link.motion, link.jointAcceleration));
+    }
+}
+
+void Articulation::integrate(real duration, bool keepForces)
+{
+    if (links.empty() || duration <= 0) return;
+    calculateKinematics();
+
+    // Gather the forces on each link, measured at the origin.
+    for (unsigned i = 0; i < links.size(); i++)
+    {
+        Link& link = links[i];
+        RigidBody* body = link.body;
+        Vector3 force = body->acceleration * link.mass + body->forceAccum;
+        link.force.linear = force;
+        link.force.angular = link.arm.vectorProduct(force) +
+            body->torqueAccum;
+    }
+
+    calculateAccelerations(false);
+
+    for (unsigned i = 0; i < links.size(); i++)
+    {
+        Link& link = links[i];
+        RigidBody* body = link.body;
+
+        // The acceleration of the body's centre, as the resolver
+        // expects to find it.
+        Vector3 angularAcceleration = link.acceleration.angular;
+        Vector3 linearAcceleration = link.acceleration.linear +
+            angularAcceleration.vectorProduct(link.arm) +
+            link.rotation.vectorProduct(link.velocity);
+        body->lastFrameAcceleration = linearAcceleration;
+
+        if (link.type == FLOATING)
+        {
+            link.rootVelocity.addScaledVector(linearAcceleration, duration);
+            link.rootRotation.addScaledVector(angularAcceleration, duration);
+            link.rootVelocity *= real_pow(body->linearDamping, duration);
+            link.rootRotation *= real_pow(body->angularDamping, duration);
+            link.rootPosition.addScaledVector(link.rootVelocity, duration);
+            link.rootOrientation.addScaledVector(link.rootRotation, duration);
+        }
+        else
+        {
+            link.rate += link.jointAcceleration * duration;
+            link.rate *= real_pow(link.type == REVOLUTE ?
+                body->angularDamping : body->linearDamping, duration);
+            link.rate = clampRate(link.rate, maxJointRate);
+            link.position += link.rate * duration;
+        }
+
+        if (!keepForces)
+        {
+            link.jointForce = 0;
+            body->clearAccumulators();
+        }
+        body->setAwake();
+    }
+
+    calculateKinematics();
+}
+
+void Articulation::applyBodyChanges()
+{
+    if (links.empty()) return;
+
+    // Find the impulse that gave each change in velocity: it is the
+    // link's own mass times the change, since that is all the
+    // resolver knew of.
+    bool changed = false;
+    for (unsigned i = 0; i < links.size(); i++)
+    {
+        Link& link = links[i];
+        Vector3 linear = (link.body->velocity - link.velocity) * link.mass;
+        Vector3 angular = worldInertia(link.orientation, link.inertiaTensor) *
+            (link.body->rotation - link.rotation);
+        link.force.linear = linear;
+        link.force.angular = angular + link.arm.vectorProduct(linear);
+        if (linear.squareMagnitude() > 0 || angular.squareMagnitude() > 0)
+        {
+            changed = true;
+        }
+    }
+    if (changed)
+    {
+        calculateAccelerations(true);
+        for (unsigned i = 0; i < links.size(); i++)
+        {
+            Link& link = links[i];
+            if (link.type == FLOATING)
+            {
+                link.rootRotation += link.acceleration.angular;
+                link.rootVelocity += link.acceleration.linear +
+                    link.acceleration.angular.vectorProduct(link.arm);
+            }
+            else
+            {
+                link.rate = clampRate(link.rate + link.jointAcceleration,
+                    maxJointRate);
+            }
+        }
+    }
+
+    // Then do the same for the changes in position, treating each
+    // small move as if it were a change in velocity over unit time.
+    bool moved = false;
+    for (unsigned i = 0; i < links.size(); i++)
+    {
+        Link& link = links[i];
+        Quaternion turn = link.body->orientation;
+        turn *= conjugate(link.orientation);
+        real sign = turn.r < 0 ? (real)-2.0 : (real)2.0;
+        Vector3 angle(turn.i * sign, turn.j * sign, turn.k * sign);
+
+        Vector3 linear = (link.body->position - link.centre) * link.mass;
+        Vector3 angular =
+            worldInertia(link.orientation, link.inertiaTensor) * angle;
+        link.force.linear = linear;
+        link.force.angular = angular + link.arm.vectorProduct(linear);
+        if (linear.squareMagnitude() > 0 || angular.squareMagnitude() > 0)
+        {
+            moved = true;
+        }
+    }
+    if (moved)
+    {
+        calculateAccelerations(true);
+        for (unsigned i = 0; i < links.size(); i++)
+        {
+            Link& link = links[i];
+            if (link.type == FLOATING)
+            {
+                link.rootOrientation.addScaledVector(
+                    link.acceleration.angular, 1);
+                link.rootPosition += link.acceleration.linear +
+                    link.acceleration.angular.vectorProduct(link.arm);
+            }
+            else
+            {
+                link.position += link.jointAcceleration;
+            }
+        }
+    }
+
+    if (changed || moved) calculateKinematics();
+}
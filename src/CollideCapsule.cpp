@@ -0,0 +1,632 @@
+#include <CollideFine.h>
+
+using namespace Grics;
+
+/*
+ * This file holds the collision tests for capsules. A capsule is a
+ * sphere swept along a segment, so every test comes down to finding
+ * the closest points between the segment and the other shape, then
+ * treating it like a sphere at that point.
+ */
+
+namespace {
+
+    const real segmentEpsilon = (real)0.000001;
+
+    // Contacts whose normals are at least this close (as a cosine)
+    // can share a manifold.
+    const real capsuleNormalTolerance = (real)0.95;
+
+    inline real clampUnit(real value)
+    {
+        if (value < 0) return 0;
+        if (value > 1) return 1;
+        return value;
+    }
+
+    /*
+     * Returns the parameter of the point on segment a-b closest to
+     * the given point.
+     */
+    real closestOnSegment(const Vector3& point,
+        const Vector3& a, const Vector3& b)
+    {
+        Vector3 ab = b - a;
+        real length = ab.squareMagnitude();
+        if (length <= segmentEpsilon) return 0;
+        return clampUnit(((point - a) * ab) / length);
+    }
+
+    /*
+     * Finds the closest points between segments p1-q1 and p2-q2,
+     * returning their parameters along each segment. This follows
+     * Ericson's closest point of two segments.
+     */
+    void closestSegmentSegment(
+        const Vector3& p1, const Vector3& q1,
+        const Vector3& p2, const Vector3& q2,
+        real* s, real* t)
+    {
+        Vector3 d1 = q1 - p1;
+        Vector3 d2 = q2 - p2;
+        Vector3 r = p1 - p2;
+        real a = d1 * d1;
+        real e = d2 * d2;
+        real f = d2 * r;
+
+        // Check if either segment is really a point.
+        if (a <= segmentEpsilon && e <= segmentEpsilon)
+        {
+            *s = *t = 0;
+            return;
+        }
+        if (a <= segmentEpsilon)
+        {
+            *s = 0;
+            *t = clampUnit(f / e);
+            return;
+        }
+
+        real c = d1 * r;
+        if (e <= segmentEpsilon)
+        {
+            *t = 0;
+            *s = clampUnit(-c / a);
+            return;
+        }
+
+        // For parallel segments any s will do, so pick the start.
+        real b = d1 * d2;
+        real denom = a * e - b * b;
+        *s = (denom != 0) ? clampUnit((b * f - c * e) / denom) : 0;
+
+        // Find the matching point on the second segment, and if it
+        // is off the end, clamp it and recompute the first.
+        *t = (b * (*s) + f) / e;
+        if (*t < 0)
+        {
+            *t = 0;
+            *s = clampUnit(-c / a);
+        }
+        else if (*t > 1)
+        {
+            *t = 1;
+            *s = clampUnit((b - c) / a);
+        }
+    }
+
+    /*
+     * Returns a unit vector at right angles to the given one.
+     */
+    Vector3 perpendicular(const Vector3& vector)
+    {
+        Vector3 result;
+        if (real_abs(vector.x) < real_abs(vector.y))
+        {
+            result = Vector3(0, vector.z, -vector.y);
+        }
+        else
+        {
+            result = Vector3(-vector.z, 0, vector.x);
+        }
+        if (result.squareMagnitude() <= 0) result = Vector3(1, 0, 0);
+        result.normalize();
+        return result;
+    }
+
+    /*
+     * Writes the contact between a sphere of radius radiusOne at
+     * pointOne and one of radius radiusTwo at pointTwo, if they
+     * touch or are within the margin of one another. The normal
+     * points towards the first sphere. If the
+     * centres are at the same place, the fallback normal is used.
+     */
+    unsigned sphereSweptContact(
+        const Vector3& pointOne, real radiusOne, RigidBody* bodyOne,
+        const Vector3& pointTwo, real radiusTwo, RigidBody* bodyTwo,
+        const Vector3& fallbackNormal,
+        unsigned featureId,
+        CollisionData* data)
+    {
+        if (data->contactsLeft <= 0) return 0;
+
+        Vector3 midline = pointOne - pointTwo;
+        real size = midline.magnitude();
+        if (size >= radiusOne + radiusTwo +
+            data->getMargin(bodyOne, bodyTwo)) return 0;
+
+        Vector3 normal = (size > 0) ?
+            midline * (((real)1.0) / size) : fallbackNormal;
+
+        Contact* contact = data->contacts;
+        contact->contactNormal = normal;
+        contact->penetration = radiusOne + radiusTwo - size;
+
+        // Put the contact half way between the two surfaces.
+        contact->contactPoint = pointTwo +
+            normal * (radiusTwo - contact->penetration * (real)0.5);
+        contact->setBodyData(bodyOne, bodyTwo,
+            data->friction, data->restitution);
+        contact->featureId = featureId;
+
+        data->addContacts(1);
+        return 1;
+    }
+
+    /*
+     * Clamps a point in a box's local space to the box.
+     */
+    Vector3 clampToBox(const Vector3& point, const Vector3& halfSize)
+    {
+        Vector3 result = point;
+        for (unsigned i = 0; i < 3; i++)
+        {
+            if (result[i] > halfSize[i]) result[i] = halfSize[i];
+            if (result[i] < -halfSize[i]) result[i] = -halfSize[i];
+        }
+        return result;
+    }
+
+    /*
+     * Checks if the segment a-b passes through the box, given in the
+     * box's local space, using the slab test.
+     */
+    bool segmentHitsBox(const Vector3& a, const Vector3& b,
+        const Vector3& halfSize)
+    {
+        Vector3 d = b - a;
+        real tMin = 0, tMax = 1;
+        for (unsigned i = 0; i < 3; i++)
+        {
+            if (real_abs(d[i]) <= segmentEpsilon)
+            {
+                if (a[i] < -halfSize[i] || a[i] > halfSize[i]) return false;
+                continue;
+            }
+            real inverse = ((real)1.0) / d[i];
+            real t1 = (-halfSize[i] - a[i]) * inverse;
+            real t2 = (halfSize[i] - a[i]) * inverse;
+            if (t1 > t2) { real temp = t1; t1 = t2; t2 = temp; }
+            if (t1 > tMin) tMin = t1;
+            if (t2 < tMax) tMax = t2;
+            if (tMin > tMax) return false;
+        }
+        return true;
+    }
+
+    /*
+     * A pair of closest points between a capsule's segment and a box,
+     * in the box's local space.
+     */
+    struct SegmentBoxFeature
+    {
+        Vector3 onSegment;
+        Vector3 onBox;
+        real t;
+        real distanceSquared;
+        unsigned featureId;
+    };
+}
+
+bool IntersectionTests::capsuleAndRay(
+    const CollisionCapsule& capsule,
+    const CollisionRay& ray,
+    real* distance,
+    Vector3* normal)
+{
+    Vector3 start = capsule.getEnd(1);
+    Vector3 end = capsule.getEnd(0);
+    real radiusSquared = capsule.radius * capsule.radius;
+
+    // A ray starting inside hits straight away.
+    Vector3 nearest = start + (end - start) *
+        closestOnSegment(ray.origin, start, end);
+    if ((ray.origin - nearest).squareMagnitude() <= radiusSquared)
+    {
+        if (distance) *distance = 0;
+        if (normal) *normal = ray.direction * -1.0f;
+        return true;
+    }
+
+    bool hit = false;
+    real bestDistance = ray.length;
+    Vector3 bestNormal;
+
+    // Test the side of the cylinder, working with the parts of the
+    // ray at right angles to the axis.
+    Vector3 axis = end - start;
+    real axisLength = axis.magnitude();
+    if (axisLength > segmentEpsilon)
+    {
+        axis *= ((real)1.0) / axisLength;
+        Vector3 m = ray.origin - start;
+        Vector3 mPerp = m - axis * (m * axis);
+        Vector3 dPerp = ray.direction - axis * (ray.direction * axis);
+
+        real a = dPerp * dPerp;
+        real b = mPerp * dPerp;
+        real c = mPerp * mPerp - radiusSquared;
+        real discriminant = b * b - a * c;
+        if (a > segmentEpsilon && discriminant >= 0)
+        {
+            real t = (-b - real_sqrt(discriminant)) / a;
+            real along = (m + ray.direction * t) * axis;
+            if (t >= 0 && t <= bestDistance &&
+                along >= 0 && along <= axisLength)
+            {
+                hit = true;
+                bestDistance = t;
+                bestNormal = (mPerp + dPerp * t) *
+                    (((real)1.0) / capsule.radius);
+            }
+        }
+    }
+
+    // Test the two hemispherical caps as whole spheres: the parts of
+    // them inside the cylinder can't be hit first.
+    for (unsigned i = 0; i < 2; i++)
+    {
+        Vector3 centre = capsule.getEnd(i);
+        Vector3 m = ray.origin - centre;
+        real b = m * ray.direction;
+        real c = m * m - radiusSquared;
+        if (c > 0 && b > 0) continue;
+
+        real discriminant = b * b - c;
+        if (discriminant < 0) continue;
+
+        real t = -b - real_sqrt(discriminant);
+        if (t < 0 || t > bestDistance) continue;
+
+        hit = true;
+        bestDistance = t;
+        bestNormal = (m + ray.direction * t) *
+            (((real)1.0) / capsule.radius);
+    }
+
+    if (!hit) return false;
+    if (distance) *distance = bestDistance;
+    if (normal) *normal = bestNormal;
+    return true;
+}
+
+unsigned CollisionDetector::capsuleAndHalfSpace(
+    const CollisionCapsule& capsule,
+    const CollisionPlane& plane,
+    CollisionData* data
+)
+{
+    // Make sure we have contacts
+    if (data->contactsLeft <= 0) return 0;
+
+    // Each end of the segment is treated like a sphere.
+    real margin = data->getMargin(capsule.body, NULL);
+    unsigned contactsUsed = 0;
+    Contact* contact = data->contacts;
+    for (unsigned i = 0; i < 2; i++)
+    {
+        Vector3 position = capsule.getEnd(i);
+        real ballDistance =
+            plane.direction * position -
+            capsule.radius - plane.offset;
+
+        if (ballDistance >= margin) continue;
+
+        contact->contactNormal = plane.direction;
+        contact->penetration = -ballDistance;
+        contact->contactPoint =
+            position - plane.direction * (ballDistance + capsule.radius);
+        contact->setBodyData(capsule.body, NULL,
+            data->friction, data->restitution);
+        contact->featureId = i;
+
+        contact++;
+        contactsUsed++;
+        if (contactsUsed == (unsigned)data->contactsLeft) break;
+    }
+
+    data->addContacts(contactsUsed);
+    return contactsUsed;
+}
+
+unsigned CollisionDetector::capsuleAndSphere(
+    const CollisionCapsule& capsule,
+    const CollisionSphere& sphere,
+    CollisionData* data
+)
+{
+    // Make sure we have contacts
+    if (data->contactsLeft <= 0) return 0;
+
+    Vector3 centre = sphere.getAxis(3);
+    Vector3 start = capsule.getEnd(1);
+    Vector3 end = capsule.getEnd(0);
+    Vector3 nearest = start + (end - start) *
+        closestOnSegment(centre, start, end);
+
+    return sphereSweptContact(
+        nearest, capsule.radius, capsule.body,
+        centre, sphere.radius, sphere.body,
+        perpendicular(capsule.getAxis(1)), 0, data);
+}
+
+unsigned CollisionDetector::capsuleAndCapsule(
+    const CollisionCapsule& one,
+    const CollisionCapsule& two,
+    CollisionData* data
+)
+{
+    // Make sure we have contacts
+    if (data->contactsLeft <= 0) return 0;
+
+    Vector3 startOne = one.getEnd(1), endOne = one.getEnd(0);
+    Vector3 startTwo = two.getEnd(1), endTwo = two.getEnd(0);
+    Vector3 axisOne = endOne - startOne;
+    Vector3 axisTwo = endTwo - startTwo;
+
+    // If the segments cross, there is no direction between them, so
+    // use the one at right angles to both.
+    Vector3 fallback = axisOne % axisTwo;
+    if (fallback.squareMagnitude() > segmentEpsilon) fallback.normalize();
+    else fallback = perpendicular(one.getAxis(1));
+
+    // Capsules lying side by side need a contact at each end of
+    // their overlap, or they would roll about a single point.
+    real lengthOne = axisOne.squareMagnitude();
+    real lengthTwo = axisTwo.squareMagnitude();
+    Vector3 cross = axisOne % axisTwo;
+    if (lengthOne > segmentEpsilon && lengthTwo > segmentEpsilon &&
+        cross.squareMagnitude() <= segmentEpsilon * lengthOne * lengthTwo)
+    {
+        // Find where the second segment's ends lie along the first.
+        real t0 = ((startTwo - startOne) * axisOne) / lengthOne;
+        real t1 = ((endTwo - startOne) * axisOne) / lengthOne;
+        if (t0 > t1) { real temp = t0; t0 = t1; t1 = temp; }
+        t0 = clampUnit(t0);
+        t1 = clampUnit(t1);
+
+        if (t1 - t0 > segmentEpsilon)
+        {
+            unsigned contactsUsed = 0;
+            real ends[2] = { t0, t1 };
+            for (unsigned i = 0; i < 2; i++)
+            {
+                Vector3 pointOne = startOne + axisOne * ends[i];
+                Vector3 pointTwo = startTwo + axisTwo *
+                    closestOnSegment(pointOne, startTwo, endTwo);
+                contactsUsed += sphereSweptContact(
+                    pointOne, one.radius, one.body,
+                    pointTwo, two.radius, two.body,
+                    fallback, i, data);
+            }
+            return contactsUsed;
+        }
+    }
+
+    // Otherwise a single contact at the closest points will do.
+    real s, t;
+    closestSegmentSegment(startOne, endOne, startTwo, endTwo, &s, &t);
+    return sphereSweptContact(
+        startOne + axisOne * s, one.radius, one.body,
+        startTwo + axisTwo * t, two.radius, two.body,
+        fallback, 0, data);
+}
+
+unsigned CollisionDetector::capsuleAndBox(
+    const CollisionCapsule& capsule,
+    const CollisionBox& box,
+    CollisionData* data
+)
+{
+    // Make sure we have contacts
+    if (data->contactsLeft <= 0) return 0;
+
+    // Work in the box's space, where it is axis aligned.
+    Vector3 start = box.transform.transformInverse(capsule.getEnd(1));
+    Vector3 end = box.transform.transformInverse(capsule.getEnd(0));
+    const Vector3& halfSize = box.halfSize;
+
+    if (segmentHitsBox(start, end, halfSize))
+    {
+        // The segment is inside the box, so push the capsule out
+        // along the box axis with the least penetration.
+        real best = REAL_MAX;
+        unsigned bestAxis = 0;
+        real bestSign = 1;
+        for (unsigned i = 0; i < 3; i++)
+        {
+            real low = start[i] < end[i] ? start[i] : end[i];
+            real high = start[i] < end[i] ? end[i] : start[i];
+
+            real positive = halfSize[i] + capsule.radius - low;
+            if (positive < best)
+            {
+                best = positive;
+                bestAxis = i;
+                bestSign = 1;
+            }
+            real negative = high + halfSize[i] + capsule.radius;
+            if (negative < best)
+            {
+                best = negative;
+                bestAxis = i;
+                bestSign = -1;
+            }
+        }
+
+        // The contact is at the deepest end of the segment.
+        const Vector3& deepest =
+            (start[bestAxis] * bestSign < end[bestAxis] * bestSign) ?
+            start : end;
+
+        Contact* contact = data->contacts;
+        contact->contactNormal = box.getAxis(bestAxis) * bestSign;
+        contact->penetration = best;
+        contact->contactPoint =
+            box.transform.transform(clampToBox(deepest, halfSize));
+        contact->setBodyData(capsule.body, box.body,
+            data->friction, data->restitution);
+
+        data->addContacts(1);
+        return 1;
+    }
+
+    // Otherwise the closest points are between an end of the segment
+    // and the box, or between the segment and one of the box's
+    // edges.
+    SegmentBoxFeature features[14];
+    unsigned featureCount = 0;
+    for (unsigned i = 0; i < 2; i++)
+    {
+        SegmentBoxFeature& feature = features[featureCount++];
+        feature.onSegment = i == 0 ? start : end;
+        feature.onBox = clampToBox(feature.onSegment, halfSize);
+        feature.t = (real)i;
+        feature.featureId = i;
+    }
+    for (unsigned axis = 0; axis < 3; axis++)
+    {
+        unsigned u = (axis + 1) % 3, v = (axis + 2) % 3;
+        for (unsigned corner = 0; corner < 4; corner++)
+        {
+            Vector3 edgeStart, edgeEnd;
+            edgeStart[axis] = -halfSize[axis];
+            edgeEnd[axis] = halfSize[axis];
+            edgeStart[u] = edgeEnd[u] = (corner & 1) ? halfSize[u] : -halfSize[u];
+            edgeStart[v] = edgeEnd[v] = (corner & 2) ? halfSize[v] : -halfSize[v];
+
+            real s, t;
+            closestSegmentSegment(start, end, edgeStart, edgeEnd, &s, &t);
+
+            SegmentBoxFeature& feature = features[featureCount++];
+            feature.onSegment = start + (end - start) * s;
+            feature.onBox = edgeStart + (edgeEnd - edgeStart) * t;
+            feature.t = s;
+            feature.featureId = 2 + axis * 4 + corner;
+        }
+    }
+
+    unsigned best = 0;
+    for (unsigned i = 0; i < featureCount; i++)
+    {
+        features[i].distanceSquared =
+            (features[i].onSegment - features[i].onBox).squareMagnitude();
+        if (features[i].distanceSquared < features[best].distanceSquared)
+        {
+            best = i;
+        }
+    }
+
+    real reach = capsule.radius + data->getMargin(capsule.body, box.body);
+    real radiusSquared = reach * reach;
+    if (features[best].distanceSquared >= radiusSquared) return 0;
+
+    Vector3 bestNormal = features[best].onSegment - features[best].onBox;
+    bestNormal.normalize();
+
+    // A capsule lying on the box needs a second contact, so look for
+    // the touching feature furthest along the segment that pushes
+    // the same way.
+    unsigned second = best;
+    real furthest = 0;
+    for (unsigned i = 0; i < featureCount; i++)
+    {
+        if (features[i].distanceSquared >= radiusSquared) continue;
+        real spread = real_abs(features[i].t - features[best].t);
+        if (spread <= furthest) continue;
+
+        Vector3 normal = features[i].onSegment - features[i].onBox;
+        normal.normalize();
+        if (normal * bestNormal < capsuleNormalTolerance) continue;
+
+        furthest = spread;
+        second = i;
+    }
+
+    unsigned contactsUsed = 0;
+    unsigned chosen[2] = { best, second };
+    unsigned chosenCount = (second != best) ? 2 : 1;
+    for (unsigned i = 0; i < chosenCount; i++)
+    {
+        const SegmentBoxFeature& feature = features[chosen[i]];
+        contactsUsed += sphereSweptContact(
+            box.transform.transform(feature.onSegment),
+            capsule.radius, capsule.body,
+            box.transform.transform(feature.onBox), 0, box.body,
+            box.transform.transformDirection(bestNormal),
+            feature.featureId, data);
+    }
+    return contactsUsed;
+}
+
+unsigned CollisionDetector::capsuleAndTriangle(
+    const CollisionCapsule& capsule,
+    const CollisionTriangle& triangle,
+    CollisionData* data
+)
+{
+    // Make sure we have contacts
+    if (data->contactsLeft <= 0) return 0;
+
+    // The closest point of the segment to the triangle is one of its
+    // ends, or the point closest to one of the triangle's edges. Each
+    // of these is tested as a sphere, which also gives a capsule
+    // lying on the triangle a contact at each end.
+    Vector3 start = capsule.getEnd(1);
+    Vector3 end = capsule.getEnd(0);
+    real candidates[5] = { 0, 1 };
+    unsigned candidateCount = 2;
+    for (unsigned i = 0; i < 3; i++)
+    {
+        real s, t;
+        closestSegmentSegment(start, end,
+            triangle.vertex[i], triangle.vertex[(i + 1) % 3], &s, &t);
+
+        bool repeated = false;
+        for (unsigned j = 0; j < candidateCount; j++)
+        {
+            if (real_abs(candidates[j] - s) < (real)0.01) repeated = true;
+        }
+        if (!repeated) candidates[candidateCount++] = s;
+    }
+
+    unsigned contactsUsed = 0;
+    for (unsigned i = 0; i < candidateCount; i++)
+    {
+        unsigned added = sphereAndTriangle(
+            start + (end - start) * candidates[i], capsule.radius,
+            capsule.body, triangle, data);
+        if (added) (data->contacts - 1)->featureId = i;
+        contactsUsed += added;
+    }
+
+    // A segment can also pass right through the face, with an end so
+    // far behind it that its sphere misses, and nowhere near an edge.
+    // Then the end behind is pushed back out through the face.
+    real heights[2] = {
+        (start - triangle.vertex[0]) * triangle.normal,
+        (end - triangle.vertex[0]) * triangle.normal
+    };
+    unsigned behind = heights[0] < heights[1] ? 0 : 1;
+    if (heights[behind] <= -capsule.radius && heights[1 - behind] > 0 &&
+        data->contactsLeft > 0)
+    {
+        real t = heights[0] / (heights[0] - heights[1]);
+        Vector3 crossing = start + (end - start) * t;
+        unsigned feature;
+        triangle.closestPoint(crossing, &feature);
+        if (feature == CollisionTriangle::FACE)
+        {
+            Contact* contact = data->contacts;
+            contact->contactNormal = triangle.normal;
+            contact->penetration = capsule.radius - heights[behind];
+            contact->contactPoint = crossing;
+            contact->setBodyData(capsule.body, NULL,
+                data->friction, data->restitution);
+            contact->featureId = 5;
+            data->addContacts(1);
+            contactsUsed++;
+        }
+    }
+    return contactsUsed;
+}
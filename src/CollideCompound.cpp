@@ -0,0 +1,385 @@
+#include <CollideFine.h>
+#include <assert.h>
+
+using namespace Grics;
+
+/*
+ * This file holds the compound primitive and its collision tests,
+ * along with the bounding boxes of each kind of primitive that the
+ * compound's hierarchy is built from.
+ */
+
+namespace {
+
+    // The most children a leaf of the compound hierarchy holds.
+    const unsigned compoundLeafSize = 2;
+
+    // The most nodes a query can have waiting to be visited. The
+    // hierarchy is built by halving, so this holds far more children
+    // than a compound can have.
+    const unsigned compoundQueryStackSize = 32;
+
+    // The most children one primitive is tested against. Primitives
+    // touching more than this are tested against the first ones, and
+    // the test is counted in the collision data's truncated queries.
+    const unsigned compoundQueryLimit = 64;
+
+    // Contacts from each child have the child's index (plus one)
+    // put into these bits of their feature id, so those from
+    // different children can be told apart. The outer compound of a
+    // pair of compounds uses the lower bits.
+    const unsigned compoundFeatureShift = 24;
+    const unsigned compoundOuterFeatureShift = 16;
+
+    /*
+     * Finds the bounds of a box with the given centre and half-size
+     * in its own space, once the transform has been applied.
+     */
+    void boxBounds(const Matrix4& transform, const Vector3& centre,
+        const Vector3& halfSize, Vector3* min, Vector3* max)
+    {
+        Vector3 position = transform.transform(centre);
+        for (unsigned i = 0; i < 3; i++)
+        {
+            const real* row = transform.data + i * 4;
+            real extent =
+                real_abs(row[0]) * halfSize.x +
+                real_abs(row[1]) * halfSize.y +
+                real_abs(row[2]) * halfSize.z;
+            (*min)[i] = position[i] - extent;
+            (*max)[i] = position[i] + extent;
+        }
+    }
+
+    /*
+     * Finds the bounds of the primitive as if it had the given
+     * transform.
+     */
+    void boundsWithTransform(const CollisionPrimitive& primitive,
+        const Matrix4& transform, Vector3* min, Vector3* max)
+    {
+        switch (primitive.getType())
+        {
+        case CollisionPrimitive::SPHERE:
+        {
+            real radius = static_cast<const CollisionSphere&>(primitive).radius;
+            Vector3 reach(radius, radius, radius);
+            *min = transform.getAxisVector(3) - reach;
+            *max = transform.getAxisVector(3) + reach;
+            break;
+        }
+
+        case CollisionPrimitive::BOX:
+            boxBounds(transform, Vector3(),
+                static_cast<const CollisionBox&>(primitive).halfSize, min, max);
+            break;
+
+        case CollisionPrimitive::CAPSULE:
+        {
+            const CollisionCapsule& capsule =
+                static_cast<const CollisionCapsule&>(primitive);
+            Vector3 centre = transform.getAxisVector(3);
+            Vector3 end = transform.getAxisVector(1) * capsule.halfHeight;
+            for (unsigned i = 0; i < 3; i++)
+            {
+                real extent = real_abs(end[i]) + capsule.radius;
+                (*min)[i] = centre[i] - extent;
+                (*max)[i] = centre[i] + extent;
+            }
+            break;
+        }
+
+        case CollisionPrimitive::CONVEX:
+        {
+            const CollisionConvex& convex =
+                static_cast<const CollisionConvex&>(primitive);
+            *min = *max = transform.getAxisVector(3);
+            for (unsigned v = 0; v < convex.vertexCount; v++)
+            {
+                Vector3 vertex = transform.transform(convex.vertices[v]);
+                for (unsigned i = 0; i < 3; i++)
+                {
+                    if (v == 0 || vertex[i] < (*min)[i]) (*min)[i] = vertex[i];
+                    if (v == 0 || vertex[i] > (*max)[i]) (*max)[i] = vertex[i];
+                }
+            }
+            break;
+        }
+
+        case CollisionPrimitive::COMPOUND:
+        {
+            Vector3 localMin, localMax;
+            static_cast<const CollisionCompound&>(primitive)
+                .getLocalBounds(&localMin, &localMax);
+            boxBounds(transform, (localMin + localMax) * (real)0.5,
+                (localMax - localMin) * (real)0.5, min, max);
+            break;
+        }
+
+        default:
+            *min = *max = transform.getAxisVector(3);
+            break;
+        }
+    }
+
+    /*
+     * Runs the tests between the primitive and each child of the
+     * compound it overlaps.
+     */
+    unsigned collideChildren(const CollisionCompound& compound,
+        const CollisionPrimitive& primitive, CollisionData* data,
+        unsigned featureShift)
+    {
+        Vector3 min, max;
+        primitive.getBounds(&min, &max);
+
+        // Widen the bounds to find children within the margin.
+        real margin = data->getMargin(compound.body, primitive.body);
+        Vector3 reach(margin, margin, margin);
+        min -= reach;
+        max += reach;
+
+        unsigned found[compoundQueryLimit];
+        bool truncated = false;
+        unsigned count = compound.query(min, max, found, compoundQueryLimit,
+            &truncated);
+        if (truncated) data->truncatedQueries++;
+
+        unsigned contactsUsed = 0;
+        for (unsigned i = 0; i < count; i++)
+        {
+            if (data->contactsLeft <= 0) break;
+
+            unsigned added = CollisionDetector::collide(
+                *compound.getChild(found[i]), primitive, data);
+            for (unsigned c = 1; c <= added; c++)
+            {
+                (data->contacts - c)->featureId |=
+                    (found[i] + 1) << featureShift;
+            }
+            contactsUsed += added;
+        }
+        return contactsUsed;
+    }
+}
+
+void CollisionPrimitive::getBounds(Vector3* min, Vector3* max) const
+{
+    boundsWithTransform(*this, transform, min, max);
+}
+
+void CollisionCompound::add(
+    CollisionPrimitive* child, const Matrix4& childOffset)
+{
+    Child entry;
+    entry.primitive = child;
+    entry.offset = childOffset;
+    children.push_back(entry);
+}
+
+void CollisionCompound::build()
+{
+    for (unsigned i = 0; i < children.size(); i++)
+    {
+        boundsWithTransform(*children[i].primitive, children[i].offset,
+            &children[i].min, &children[i].max);
+    }
+
+    nodes.clear();
+    if (children.empty()) return;
+    nodes.reserve(2 * (children.size() / compoundLeafSize + 1));
+    buildNode(0, (unsigned)children.size());
+}
+
+void CollisionCompound::clear()
+{
+    children.clear();
+    nodes.clear();
+}
+
+unsigned CollisionCompound::buildNode(unsigned start, unsigned count)
+{
+    unsigned index = (unsigned)nodes.size();
+    nodes.push_back(Node());
+
+    // Find the bounds of the children, and of their centres.
+    Node node;
+    Vector3 centreMin, centreMax;
+    for (unsigned i = start; i < start + count; i++)
+    {
+        Vector3 centre = (children[i].min + children[i].max) * (real)0.5;
+        for (unsigned j = 0; j < 3; j++)
+        {
+            bool first = (i == start);
+            if (first || children[i].min[j] < node.min[j])
+                node.min[j] = children[i].min[j];
+            if (first || children[i].max[j] > node.max[j])
+                node.max[j] = children[i].max[j];
+            if (first || centre[j] < centreMin[j]) centreMin[j] = centre[j];
+            if (first || centre[j] > centreMax[j]) centreMax[j] = centre[j];
+        }
+    }
+
+    if (count <= compoundLeafSize)
+    {
+        node.index = start;
+        node.count = count;
+        nodes[index] = node;
+        return index;
+    }
+
+    // Split the centres in half along their longest axis.
+    Vector3 extent = centreMax - centreMin;
+    unsigned axis = 0;
+    if (extent.y > extent[axis]) axis = 1;
+    if (extent.z > extent[axis]) axis = 2;
+    real split = (centreMin[axis] + centreMax[axis]) * (real)0.5;
+
+    unsigned middle = start;
+    for (unsigned i = start; i < start + count; i++)
+    {
+        real centre = (children[i].min[axis] + children[i].max[axis]) * (real)0.5;
+        if (centre < split)
+        {
+            std::swap(children[i], children[middle]);
+            middle++;
+        }
+    }
+
+    // If every centre is at the same place, just split the list.
+    if (middle == start || middle == start + count)
+    {
+        middle = start + count / 2;
+    }
+
+    buildNode(start, middle - start);
+    node.index = buildNode(middle, start + count - middle);
+    node.count = 0;
+    nodes[index] = node;
+    return index;
+}
+
+void CollisionCompound::calculateChildInternals()
+{
+    for (unsigned i = 0; i < children.size(); i++)
+    {
+        CollisionPrimitive* child = children[i].primitive;
+        child->body = body;
+        child->offset = offset * children[i].offset;
+        child->calculateInternals();
+    }
+}
+
+void CollisionCompound::getLocalBounds(Vector3* min, Vector3* max) const
+{
+    if (nodes.empty())
+    {
+        *min = *max = Vector3();
+        return;
+    }
+    *min = Vector3(nodes[0].min[0], nodes[0].min[1], nodes[0].min[2]);
+    *max = Vector3(nodes[0].max[0], nodes[0].max[1], nodes[0].max[2]);
+}
+
+unsigned CollisionCompound::query(
+    const Vector3& min, const Vector3& max,
+    unsigned* results, unsigned limit, bool* truncated) const
+{
+    if (nodes.empty()) return 0;
+
+    // Find the box in the compound's space that holds the given one.
+    Vector3 halfSize = (max - min) * (real)0.5;
+    Vector3 centre = transform.transformInverse((min + max) * (real)0.5);
+    Vector3 localMin, localMax;
+    for (unsigned i = 0; i < 3; i++)
+    {
+        real extent =
+            real_abs(transform.data[i]) * halfSize.x +
+            real_abs(transform.data[i + 4]) * halfSize.y +
+            real_abs(transform.data[i + 8]) * halfSize.z;
+        localMin[i] = centre[i] - extent;
+        localMax[i] = centre[i] + extent;
+    }
+
+    unsigned stack[compoundQueryStackSize];
+    unsigned stackSize = 0;
+    unsigned count = 0;
+    stack[stackSize++] = 0;
+
+    while (stackSize > 0)
+    {
+        unsigned index = stack[--stackSize];
+        const Node& node = nodes[index];
+
+        if (node.min[0] > localMax.x || node.max[0] < localMin.x ||
+            node.min[1] > localMax.y || node.max[1] < localMin.y ||
+            node.min[2] > localMax.z || node.max[2] < localMin.z)
+        {
+            continue;
+        }
+
+        if (node.count > 0)
+        {
+            for (unsigned i = node.index; i < node.index + node.count; i++)
+            {
+                const Child& child = children[i];
+                if (child.min.x > localMax.x || child.max.x < localMin.x ||
+                    child.min.y > localMax.y || child.max.y < localMin.y ||
+                    child.min.z > localMax.z || child.max.z < localMin.z)
+                {
+                    continue;
+                }
+                if (count == limit)
+                {
+                    if (truncated) *truncated = true;
+                    return count;
+                }
+                results[count++] = i;
+            }
+            continue;
+        }
+
+        // The stack can't run out for a hierarchy built by halving,
+        // but if it does the children left out are reported.
+        assert(stackSize + 2 <= compoundQueryStackSize);
+        if (stackSize + 2 > compoundQueryStackSize)
+        {
+            if (truncated) *truncated = true;
+            continue;
+        }
+        stack[stackSize++] = node.index;
+        stack[stackSize++] = index + 1;
+    }
+    return count;
+}
+
+unsigned CollisionDetector::compoundAndPrimitive(
+    const CollisionCompound& compound,
+    const CollisionPrimitive& primitive,
+    CollisionData* data
+)
+{
+    // Make sure we have contacts
+    if (data->contactsLeft <= 0) return 0;
+
+    if (primitive.getType() == CollisionPrimitive::COMPOUND)
+    {
+        return compoundAndCompound(compound,
+            static_cast<const CollisionCompound&>(primitive), data);
+    }
+    return collideChildren(compound, primitive, data, compoundFeatureShift);
+}
+
+unsigned CollisionDetector::compoundAndCompound(
+    const CollisionCompound& one,
+    const CollisionCompound& two,
+    CollisionData* data
+)
+{
+    // Make sure we have contacts
+    if (data->contactsLeft <= 0) return 0;
+
+    // Each child of one that overlaps two is tested against two,
+    // which in turn only tests its own children that overlap it.
+    return collideChildren(one, two, data, compoundOuterFeatureShift);
+}
@@ -0,0 +1,1160 @@
+#include <CollideFine.h>
+#include <assert.h>
+
+using namespace Grics;
+
+/*
+ * This file holds the collision tests for general convex shapes.
+ * They work on the Minkowski difference of the two shapes, which
+ * contains the origin exactly when the shapes overlap. GJK finds the
+ * point of the difference closest to the origin (giving the distance
+ * between the shapes, or telling us they overlap), and EPA expands
+ * GJK's final simplex to find the penetration depth and normal.
+ *
+ * Both algorithms only need the support function of each shape: the
+ * point furthest in a given direction.
+ */
+
+unsigned CollisionConvex::getSupportIndex(
+    const Vector3& direction, unsigned start) const
+{
+    // Search in local space, so we don't transform every vertex.
+    Vector3 localDirection = transform.transformInverseDirection(direction);
+    if (hull) return hull->getSupportIndex(localDirection, start);
+
+    unsigned best = 0;
+    real bestDistance = -REAL_MAX;
+    for (unsigned i = 0; i < vertexCount; i++)
+    {
+        real distance = vertices[i] * localDirection;
+        if (distance > bestDistance)
+        {
+            bestDistance = distance;
+            best = i;
+        }
+    }
+    return best;
+}
+
+namespace {
+
+    // GJK and EPA both work to a relative tolerance, since the shapes
+    // can be any size.
+    const real gjkTolerance = (real)0.0001;
+    const unsigned gjkMaxIterations = 32;
+
+    const real epaTolerance = (real)0.0001;
+    const unsigned epaMaxIterations = 48;
+    const unsigned epaMaxVertices = 4 + epaMaxIterations;
+    const unsigned epaMaxFaces = 2 * epaMaxVertices;
+    const unsigned epaMaxEdges = 3 * epaMaxFaces;
+
+    // The ends of a capsule whose normals are at least this close (as
+    // a cosine) to the normal of the whole segment are taken to be
+    // resting on the same face.
+    const real capsuleEndTolerance = (real)0.95;
+
+    /*
+     * Wraps any of the primitives that GJK understands, so that they
+     * can be used through a single support function. Each support
+     * point has an index, so the simplex can be stored between frames
+     * as indices and rebuilt with the current transforms. A sphere is
+     * treated as its centre point, and a capsule as its central
+     * segment, and their radius is added by the caller.
+     *
+     * Each support search on a convex hull starts from the last
+     * support point found, since the directions GJK and EPA ask for
+     * change little from one step to the next.
+     */
+    struct SupportShape
+    {
+        const CollisionConvex* convex;
+        const CollisionBox* box;
+        const CollisionCapsule* capsule;
+        Vector3 point;
+        mutable unsigned start;
+
+        explicit SupportShape(const CollisionConvex& convex)
+            : convex(&convex), box(NULL), capsule(NULL), start(0)
+        {
+        }
+
+        explicit SupportShape(const CollisionBox& box)
+            : convex(NULL), box(&box), capsule(NULL), start(0)
+        {
+        }
+
+        explicit SupportShape(const CollisionCapsule& capsule)
+            : convex(NULL), box(NULL), capsule(&capsule), start(0)
+        {
+        }
+
+        explicit SupportShape(const Vector3& point)
+            : convex(NULL), box(NULL), capsule(NULL), point(point), start(0)
+        {
+        }
+
+        /** Returns the index of the support point in the direction. */
+        unsigned supportIndex(const Vector3& direction) const
+        {
+            if (convex)
+            {
+                start = convex->getSupportIndex(direction, start);
+                return start;
+            }
+            if (box)
+            {
+                // The corners are numbered by the sign of each
+                // coordinate, one bit per axis.
+                unsigned index = 0;
+                for (unsigned i = 0; i < 3; i++)
+                {
+                    if (box->getAxis(i) * direction > 0) index |= 1 << i;
+                }
+                return index;
+            }
+            if (capsule)
+            {
+                // The ends are numbered as for CollisionCapsule::getEnd.
+                return capsule->getAxis(1) * direction > 0 ? 0 : 1;
+            }
+            return 0;
+        }
+
+        /** Returns the world position of the given support point. */
+        Vector3 vertex(unsigned index) const
+        {
+            if (convex) return convex->getVertex(index);
+            if (box)
+            {
+                Vector3 corner = box->halfSize;
+                if (!(index & 1)) corner.x = -corner.x;
+                if (!(index & 2)) corner.y = -corner.y;
+                if (!(index & 4)) corner.z = -corner.z;
+                return box->getTransform().transform(corner);
+            }
+            if (capsule) return capsule->getEnd(index);
+            return point;
+        }
+
+        /** Checks the index is still valid for the shape. */
+        bool validIndex(unsigned index) const
+        {
+            if (convex) return index < convex->vertexCount;
+            if (box) return index < 8;
+            if (capsule) return index < 2;
+            return index == 0;
+        }
+
+        /** Returns a point known to be inside the shape. */
+        Vector3 centre() const
+        {
+            if (convex) return convex->getAxis(3);
+            if (box) return box->getAxis(3);
+            if (capsule) return capsule->getAxis(3);
+            return point;
+        }
+    };
+
+    /*
+     * A point on the Minkowski difference, along with the points on
+     * each shape that made it.
+     */
+    struct SupportPoint
+    {
+        Vector3 w;
+        Vector3 a;
+        Vector3 b;
+        unsigned index[2];
+    };
+
+    SupportPoint makeSupportPoint(
+        const SupportShape& one, unsigned indexOne,
+        const SupportShape& two, unsigned indexTwo)
+    {
+        SupportPoint result;
+        result.index[0] = indexOne;
+        result.index[1] = indexTwo;
+        result.a = one.vertex(indexOne);
+        result.b = two.vertex(indexTwo);
+        result.w = result.a - result.b;
+        return result;
+    }
+
+    /*
+     * Returns the support point of the Minkowski difference (one - two)
+     * in the given direction.
+     */
+    SupportPoint support(
+        const SupportShape& one,
+        const SupportShape& two,
+        const Vector3& direction)
+    {
+        return makeSupportPoint(
+            one, one.supportIndex(direction),
+            two, two.supportIndex(direction * -1.0f));
+    }
+
+    /*
+     * Holds the GJK simplex: up to four points of the Minkowski
+     * difference, with the barycentric coordinates of the point on
+     * the simplex closest to the origin.
+     */
+    struct Simplex
+    {
+        SupportPoint vertex[4];
+        real weight[4];
+        unsigned count;
+
+        /** Returns the closest point, from the weights. */
+        Vector3 closest() const
+        {
+            Vector3 result;
+            for (unsigned i = 0; i < count; i++)
+            {
+                result.addScaledVector(vertex[i].w, weight[i]);
+            }
+            return result;
+        }
+
+        /** Returns the matching points on each shape. */
+        void witnessPoints(Vector3* pointOne, Vector3* pointTwo) const
+        {
+            pointOne->clear();
+            pointTwo->clear();
+            for (unsigned i = 0; i < count; i++)
+            {
+                pointOne->addScaledVector(vertex[i].a, weight[i]);
+                pointTwo->addScaledVector(vertex[i].b, weight[i]);
+            }
+        }
+    };
+
+    /*
+     * Finds the point closest to the origin on the triangle a, b, c,
+     * replacing the simplex with the smallest feature (vertex, edge or
+     * face) that holds it. This follows the Voronoi region tests of
+     * Ericson's closest point on triangle.
+     */
+    void closestOnTriangle(
+        const SupportPoint& a,
+        const SupportPoint& b,
+        const SupportPoint& c,
+        Simplex* simplex)
+    {
+        Vector3 ab = b.w - a.w;
+        Vector3 ac = c.w - a.w;
+
+        real d1 = ab * a.w * -1.0f;
+        real d2 = ac * a.w * -1.0f;
+        if (d1 <= 0 && d2 <= 0)
+        {
+            simplex->vertex[0] = a;
+            simplex->weight[0] = 1;
+            simplex->count = 1;
+            return;
+        }
+
+        real d3 = ab * b.w * -1.0f;
+        real d4 = ac * b.w * -1.0f;
+        if (d3 >= 0 && d4 <= d3)
+        {
+            simplex->vertex[0] = b;
+            simplex->weight[0] = 1;
+            simplex->count = 1;
+            return;
+        }
+
+        real vc = d1 * d4 - d3 * d2;
+        if (vc <= 0 && d1 >= 0 && d3 <= 0)
+        {
+            real v = d1 / (d1 - d3);
+            simplex->vertex[0] = a;
+            simplex->vertex[1] = b;
+            simplex->weight[0] = 1 - v;
+            simplex->weight[1] = v;
+            simplex->count = 2;
+            return;
+        }
+
+        real d5 = ab * c.w * -1.0f;
+        real d6 = ac * c.w * -1.0f;
+        if (d6 >= 0 && d5 <= d6)
+        {
+            simplex->vertex[0] = c;
+            simplex->weight[0] = 1;
+            simplex->count = 1;
+            return;
+        }
+
+        real vb = d5 * d2 - d1 * d6;
+        if (vb <= 0 && d2 >= 0 && d6 <= 0)
+        {
+            real w = d2 / (d2 - d6);
+            simplex->vertex[0] = a;
+            simplex->vertex[1] = c;
+            simplex->weight[0] = 1 - w;
+            simplex->weight[1] = w;
+            simplex->count = 2;
+            return;
+        }
+
+        real va = d3 * d6 - d5 * d4;
+        if (va <= 0 && (d4 - d3) >= 0 && (d5 - d6) >= 0)
+        {
+            real w = (d4 - d3) / ((d4 - d3) + (d5 - d6));
+            simplex->vertex[0] = b;
+            simplex->vertex[1] = c;
+            simplex->weight[0] = 1 - w;
+            simplex->weight[1] = w;
+            simplex->count = 2;
+            return;
+        }
+
+        // The origin projects inside the face.
+        real denom = ((real)1.0) / (va + vb + vc);
+        real v = vb * denom;
+        real w = vc * denom;
+        simplex->vertex[0] = a;
+        simplex->vertex[1] = b;
+        simplex->vertex[2] = c;
+        simplex->weight[0] = 1 - v - w;
+        simplex->weight[1] = v;
+        simplex->weight[2] = w;
+        simplex->count = 3;
+    }
+
+    /*
+     * Reduces the simplex to the smallest feature holding the point
+     * closest to the origin, and sets its weights. Returns false if
+     * the simplex is a tetrahedron containing the origin.
+     */
+    bool solveSimplex(Simplex* simplex)
+    {
+        switch (simplex->count)
+        {
+        case 1:
+            simplex->weight[0] = 1;
+            return true;
+
+        case 2:
+        {
+            const SupportPoint a = simplex->vertex[0];
+            const SupportPoint b = simplex->vertex[1];
+            Vector3 ab = b.w - a.w;
+            real length = ab.squareMagnitude();
+            real t = (length > 0) ? (ab * a.w * -1.0f) / length : 0;
+            if (t <= 0)
+            {
+                simplex->count = 1;
+                simplex->weight[0] = 1;
+            }
+            else if (t >= 1)
+            {
+                simplex->vertex[0] = b;
+                simplex->count = 1;
+                simplex->weight[0] = 1;
+            }
+            else
+            {
+                simplex->weight[0] = 1 - t;
+                simplex->weight[1] = t;
+            }
+            return true;
+        }
+
+        case 3:
+        {
+            const SupportPoint a = simplex->vertex[0];
+            const SupportPoint b = simplex->vertex[1];
+            const SupportPoint c = simplex->vertex[2];
+            closestOnTriangle(a, b, c, simplex);
+            return true;
+        }
+
+        default:
+        {
+            // Check each face of the tetrahedron, to see if the origin
+            // is on the far side of it from the fourth vertex.
+            const SupportPoint v[4] = {
+                simplex->vertex[0], simplex->vertex[1],
+                simplex->vertex[2], simplex->vertex[3]
+            };
+            static const unsigned faces[4][4] = {
+                {0, 1, 2, 3}, {0, 2, 3, 1}, {0, 3, 1, 2}, {1, 3, 2, 0}
+            };
+
+            Vector3 ab = v[1].w - v[0].w;
+            Vector3 ac = v[2].w - v[0].w;
+            Vector3 ad = v[3].w - v[0].w;
+            real volume = (ab % ac) * ad;
+            bool flat = real_abs(volume) <
+                gjkTolerance * (ab.squareMagnitude() + ac.squareMagnitude() +
+                    ad.squareMagnitude());
+
+            bool outside = false;
+            real bestDistance = REAL_MAX;
+            Simplex best;
+            for (unsigned i = 0; i < 4; i++)
+            {
+                const SupportPoint& p0 = v[faces[i][0]];
+                const SupportPoint& p1 = v[faces[i][1]];
+                const SupportPoint& p2 = v[faces[i][2]];
+                const SupportPoint& opposite = v[faces[i][3]];
+
+                // A flat tetrahedron can't contain the origin, so then
+                // we just take the closest of its faces.
+                if (!flat)
+                {
+                    Vector3 normal = (p1.w - p0.w) % (p2.w - p0.w);
+                    real originSide = normal * p0.w * -1.0f;
+                    real oppositeSide = normal * (opposite.w - p0.w);
+                    if (originSide * oppositeSide >= 0) continue;
+                }
+
+                outside = true;
+                Simplex candidate;
+                closestOnTriangle(p0, p1, p2, &candidate);
+                real distance = candidate.closest().squareMagnitude();
+                if (distance < bestDistance)
+                {
+                    bestDistance = distance;
+                    best = candidate;
+                }
+            }
+
+            if (!outside) return false;
+            *simplex = best;
+            return true;
+        }
+        }
+    }
+
+    /*
+     * Holds the result of a GJK query.
+     */
+    struct GJKResult
+    {
+        /** True if the shapes overlap (or touch). */
+        bool overlap;
+
+        /** The distance between the shapes, if they don't overlap. */
+        real distance;
+
+        /** The closest points on each shape, if they don't overlap. */
+        Vector3 pointOne;
+        Vector3 pointTwo;
+
+        /** The final simplex, used to start EPA. */
+        Simplex simplex;
+    };
+
+    /*
+     * Runs GJK on the two shapes. If a cache entry is given, its
+     * simplex is used as the starting point and the final simplex is
+     * written back to it. If earlyOut is set, the query stops as soon
+     * as a separating direction is found, so the distance and points
+     * are not valid.
+     */
+    void gjk(
+        const SupportShape& one,
+        const SupportShape& two,
+        CollisionCache::Entry* cacheEntry,
+        bool earlyOut,
+        GJKResult* result)
+    {
+        Simplex& simplex = result->simplex;
+        simplex.count = 0;
+
+        // Rebuild last frame's simplex, if we have one.
+        if (cacheEntry)
+        {
+            for (unsigned i = 0; i < cacheEntry->simplexCount; i++)
+            {
+                unsigned indexOne = cacheEntry->simplexIndex[i][0];
+                unsigned indexTwo = cacheEntry->simplexIndex[i][1];
+                if (!one.validIndex(indexOne) || !two.validIndex(indexTwo))
+                {
+                    simplex.count = 0;
+                    break;
+                }
+                simplex.vertex[simplex.count++] =
+                    makeSupportPoint(one, indexOne, two, indexTwo);
+
+                // Climb from where last frame's search ended.
+                one.start = indexOne;
+                two.start = indexTwo;
+            }
+        }
+
+        // Otherwise start from the direction between the centres.
+        if (simplex.count == 0)
+        {
+            Vector3 direction = one.centre() - two.centre();
+            if (direction.squareMagnitude() == 0) direction = Vector3(1, 0, 0);
+            simplex.vertex[0] = support(one, two, direction * -1.0f);
+            simplex.count = 1;
+        }
+
+        result->overlap = false;
+        for (unsigned iteration = 0; iteration < gjkMaxIterations; iteration++)
+        {
+            // Find the closest point on the current simplex.
+            if (!solveSimplex(&simplex))
+            {
+                result->overlap = true;
+                break;
+            }
+            Vector3 closest = simplex.closest();
+            real closestSquared = closest.squareMagnitude();
+
+            // The origin is (as near as we can tell) on the simplex.
+            if (closestSquared < gjkTolerance * gjkTolerance)
+            {
+                result->overlap = true;
+                break;
+            }
+
+            // Search towards the origin.
+            Vector3 direction = closest * -1.0f;
+            SupportPoint next = support(one, two, direction);
+
+            // If the new point doesn't reach the origin, the
+            // direction separates the shapes.
+            real progress = next.w * direction;
+            if (earlyOut && progress < 0) break;
+
+            // If we can't get any closer, we have the distance.
+            if (closestSquared + progress <= gjkTolerance * closestSquared)
+            {
+                break;
+            }
+
+            // A repeated vertex also means we can get no closer.
+            bool repeated = false;
+            for (unsigned i = 0; i < simplex.count; i++)
+            {
+                if (simplex.vertex[i].index[0] == next.index[0] &&
+                    simplex.vertex[i].index[1] == next.index[1])
+                {
+                    repeated = true;
+                }
+            }
+            if (repeated) break;
+
+            simplex.vertex[simplex.count++] = next;
+        }
+
+        if (!result->overlap)
+        {
+            simplex.witnessPoints(&result->pointOne, &result->pointTwo);
+            result->distance = (result->pointOne - result->pointTwo).magnitude();
+        }
+
+        // Remember where we got to for next frame.
+        if (cacheEntry)
+        {
+            cacheEntry->simplexCount = simplex.count;
+            for (unsigned i = 0; i < simplex.count; i++)
+            {
+                cacheEntry->simplexIndex[i][0] = simplex.vertex[i].index[0];
+                cacheEntry->simplexIndex[i][1] = simplex.vertex[i].index[1];
+            }
+        }
+    }
+
+    /*
+     * Grows a GJK simplex that contains the origin (but may have fewer
+     * than four vertices, if the origin was found on a face, edge or
+     * vertex) into a tetrahedron. Returns false if the Minkowski
+     * difference is flat, and so has no tetrahedron.
+     */
+    bool growToTetrahedron(
+        const SupportShape& one,
+        const SupportShape& two,
+        Simplex* simplex)
+    {
+        static const Vector3 axes[6] = {
+            Vector3(1, 0, 0), Vector3(-1, 0, 0),
+            Vector3(0, 1, 0), Vector3(0, -1, 0),
+            Vector3(0, 0, 1), Vector3(0, 0, -1)
+        };
+
+        if (simplex->count == 1)
+        {
+            for (unsigned i = 0; i < 6; i++)
+            {
+                SupportPoint next = support(one, two, axes[i]);
+                if ((next.w - simplex->vertex[0].w).squareMagnitude() >
+                    gjkTolerance)
+                {
+                    simplex->vertex[simplex->count++] = next;
+                    break;
+                }
+            }
+            if (simplex->count == 1) return false;
+        }
+
+        if (simplex->count == 2)
+        {
+            // Search at right angles to the edge.
+            Vector3 edge = simplex->vertex[1].w - simplex->vertex[0].w;
+            unsigned least = 0;
+            if (real_abs(edge.y) < real_abs(edge[least])) least = 1;
+            if (real_abs(edge.z) < real_abs(edge[least])) least = 2;
+            Vector3 side = edge % axes[least * 2];
+            Vector3 sides[4] = { side, side * -1.0f, edge % side, side % edge };
+
+            for (unsigned i = 0; i < 4; i++)
+            {
+                SupportPoint next = support(one, two, sides[i]);
+                Vector3 offLine = (next.w - simplex->vertex[0].w) % edge;
+                if (offLine.squareMagnitude() >
+                    gjkTolerance * edge.squareMagnitude())
+                {
+                    simplex->vertex[simplex->count++] = next;
+                    break;
+                }
+            }
+            if (simplex->count == 2) return false;
+        }
+
+        if (simplex->count == 3)
+        {
+            // Search along the face normal, both ways.
+            Vector3 normal =
+                (simplex->vertex[1].w - simplex->vertex[0].w) %
+                (simplex->vertex[2].w - simplex->vertex[0].w);
+            for (unsigned i = 0; i < 2; i++)
+            {
+                SupportPoint next = support(one, two, normal);
+                real offPlane = (next.w - simplex->vertex[0].w) * normal;
+                if (offPlane * offPlane >
+                    gjkTolerance * normal.squareMagnitude())
+                {
+                    simplex->vertex[simplex->count++] = next;
+                    break;
+                }
+                normal *= -1;
+            }
+            if (simplex->count == 3) return false;
+        }
+        return true;
+    }
+
+    /*
+     * A triangular face of the EPA polytope, wound so that its normal
+     * points away from the origin.
+     */
+    struct EPAFace
+    {
+        unsigned vertex[3];
+        Vector3 normal;
+        real distance;
+        bool removed;
+    };
+
+    /*
+     * Makes the face with the given vertices, returning false if it
+     * is degenerate.
+     */
+    bool makeFace(const SupportPoint* vertices,
+        unsigned a, unsigned b, unsigned c, EPAFace* face)
+    {
+        face->vertex[0] = a;
+        face->vertex[1] = b;
+        face->vertex[2] = c;
+        face->normal = (vertices[b].w - vertices[a].w) %
+            (vertices[c].w - vertices[a].w);
+        real length = face->normal.magnitude();
+        if (length <= 0) return false;
+        face->normal *= ((real)1.0) / length;
+        face->distance = face->normal * vertices[a].w;
+        face->removed = false;
+        return true;
+    }
+
+    /*
+     * Holds the result of an EPA query.
+     */
+    struct EPAResult
+    {
+        /**
+         * The direction to move shape one by depth to separate the
+         * shapes is the negative of this normal.
+         */
+        Vector3 normal;
+        real depth;
+        Vector3 pointOne;
+        Vector3 pointTwo;
+    };
+
+    /*
+     * Runs EPA, starting from a GJK simplex that contains the origin.
+     * Returns false if no penetration could be found.
+     */
+    bool epa(
+        const SupportShape& one,
+        const SupportShape& two,
+        Simplex simplex,
+        EPAResult* result)
+    {
+        if (!growToTetrahedron(one, two, &simplex)) return false;
+
+        SupportPoint vertices[epaMaxVertices];
+        unsigned vertexCount = 4;
+        for (unsigned i = 0; i < 4; i++) vertices[i] = simplex.vertex[i];
+
+        // Wind the tetrahedron so its normals point outwards.
+        if (((vertices[1].w - vertices[0].w) %
+            (vertices[2].w - vertices[0].w)) *
+            (vertices[3].w - vertices[0].w) > 0)
+        {
+            SupportPoint temp = vertices[1];
+            vertices[1] = vertices[2];
+            vertices[2] = temp;
+        }
+
+        EPAFace faces[epaMaxFaces];
+        unsigned faceCount = 0;
+        if (!makeFace(vertices, 0, 1, 2, &faces[faceCount++]) ||
+            !makeFace(vertices, 0, 3, 1, &faces[faceCount++]) ||
+            !makeFace(vertices, 0, 2, 3, &faces[faceCount++]) ||
+            !makeFace(vertices, 1, 3, 2, &faces[faceCount++]))
+        {
+            return false;
+        }
+
+        EPAFace* closest = NULL;
+        for (unsigned iteration = 0; iteration < epaMaxIterations; iteration++)
+        {
+            // Find the face closest to the origin.
+            closest = NULL;
+            for (unsigned i = 0; i < faceCount; i++)
+            {
+                if (faces[i].removed) continue;
+                if (!closest || faces[i].distance < closest->distance)
+                {
+                    closest = &faces[i];
+                }
+            }
+            if (!closest) return false;
+
+            // See if the polytope can be pushed out past this face.
+            SupportPoint next = support(one, two, closest->normal);
+            real reach = next.w * closest->normal;
+            if (reach - closest->distance <
+                epaTolerance * (((real)1.0) + closest->distance))
+            {
+                break;
+            }
+            if (vertexCount == epaMaxVertices) break;
+
+            unsigned newVertex = vertexCount;
+            vertices[vertexCount++] = next;
+
+            // Remove every face the new point can see, keeping the
+            // edges around the hole (the horizon).
+            unsigned edges[epaMaxEdges][2];
+            unsigned edgeCount = 0;
+            bool overflow = false;
+            for (unsigned i = 0; i < faceCount; i++)
+            {
+                EPAFace& face = faces[i];
+                if (face.removed) continue;
+                if (face.normal * (next.w - vertices[face.vertex[0]].w) <= 0)
+                {
+                    continue;
+                }
+                face.removed = true;
+
+                for (unsigned e = 0; e < 3; e++)
+                {
+                    unsigned from = face.vertex[e];
+                    unsigned to = face.vertex[(e + 1) % 3];
+
+                    // An edge shared by two removed faces is inside
+                    // the hole, so it isn't part of the horizon.
+                    bool shared = false;
+                    for (unsigned j = 0; j < edgeCount; j++)
+                    {
+                        if (edges[j][0] == to && edges[j][1] == from)
+                        {
+                            edges[j][0] = edges[edgeCount - 1][0];
+                            edges[j][1] = edges[edgeCount - 1][1];
+                            edgeCount--;
+                            shared = true;
+                            break;
+                        }
+                    }
+                    if (shared) continue;
+
+                    if (edgeCount == epaMaxEdges)
+                    {
+                        overflow = true;
+                        break;
+                    }
+                    edges[edgeCount][0] = from;
+                    edges[edgeCount][1] = to;
+                    edgeCount++;
+                }
+            }
+            if (overflow) break;
+
+            // Compact the face list, then fill the hole with faces
+            // joining the horizon to the new point.
+            unsigned kept = 0;
+            for (unsigned i = 0; i < faceCount; i++)
+            {
+                if (!faces[i].removed) faces[kept++] = faces[i];
+            }
+            faceCount = kept;
+
+            for (unsigned i = 0; i < edgeCount && faceCount < epaMaxFaces; i++)
+            {
+                EPAFace face;
+                if (makeFace(vertices, edges[i][0], edges[i][1], newVertex, &face))
+                {
+                    faces[faceCount++] = face;
+                }
+            }
+            closest = NULL;
+        }
+
+        // If we stopped on a limit, use the best face we have.
+        if (!closest)
+        {
+            for (unsigned i = 0; i < faceCount; i++)
+            {
+                if (faces[i].removed) continue;
+                if (!closest || faces[i].distance < closest->distance)
+                {
+                    closest = &faces[i];
+                }
+            }
+            if (!closest) return false;
+        }
+
+        result->normal = closest->normal;
+        result->depth = closest->distance;
+
+        // Find the barycentric coordinates of the origin's projection
+        // on the face, and use them to find the points on each shape.
+        const SupportPoint& a = vertices[closest->vertex[0]];
+        const SupportPoint& b = vertices[closest->vertex[1]];
+        const SupportPoint& c = vertices[closest->vertex[2]];
+        Vector3 projection = closest->normal * closest->distance;
+
+        Vector3 v0 = b.w - a.w;
+        Vector3 v1 = c.w - a.w;
+        Vector3 v2 = projection - a.w;
+        real d00 = v0 * v0;
+        real d01 = v0 * v1;
+        real d11 = v1 * v1;
+        real d20 = v2 * v0;
+        real d21 = v2 * v1;
+        real denom = d00 * d11 - d01 * d01;
+
+        real u = (real)1.0 / 3, v = (real)1.0 / 3, w = (real)1.0 / 3;
+        if (denom != 0)
+        {
+            v = (d11 * d20 - d01 * d21) / denom;
+            w = (d00 * d21 - d01 * d20) / denom;
+            u = 1 - v - w;
+        }
+        result->pointOne = a.a * u + b.a * v + c.a * w;
+        result->pointTwo = a.b * u + b.b * v + c.b * w;
+        return true;
+    }
+
+    /*
+     * Runs the full GJK then EPA test on the two shapes, and writes a
+     * single contact for their deepest point. The contact normal
+     * points towards shape one. Shapes that are apart, but within the
+     * margin, get a speculative contact between their closest points.
+     */
+    unsigned penetrationContact(
+        const SupportShape& one,
+        const SupportShape& two,
+        RigidBody* bodyOne,
+        RigidBody* bodyTwo,
+        CollisionCache::Entry* cacheEntry,
+        CollisionData* data)
+    {
+        GJKResult gjkResult;
+        gjk(one, two, cacheEntry, false, &gjkResult);
+
+        Contact* contact = data->contacts;
+        if (!gjkResult.overlap)
+        {
+            if (gjkResult.distance >= data->getMargin(bodyOne, bodyTwo) ||
+                gjkResult.distance <= 0) return 0;
+
+            contact->contactNormal = (gjkResult.pointOne - gjkResult.pointTwo) *
+                (((real)1.0) / gjkResult.distance);
+            contact->penetration = -gjkResult.distance;
+            contact->contactPoint =
+                (gjkResult.pointOne + gjkResult.pointTwo) * (real)0.5;
+            contact->setBodyData(bodyOne, bodyTwo,
+                data->friction, data->restitution);
+
+            data->addContacts(1);
+            return 1;
+        }
+
+        EPAResult epaResult;
+        if (!epa(one, two, gjkResult.simplex, &epaResult)) return 0;
+
+        contact->contactNormal = epaResult.normal * -1.0f;
+        contact->penetration = epaResult.depth;
+        contact->contactPoint =
+            (epaResult.pointOne + epaResult.pointTwo) * (real)0.5;
+        contact->setBodyData(bodyOne, bodyTwo,
+            data->friction, data->restitution);
+
+        data->addContacts(1);
+        return 1;
+    }
+}
+
+bool IntersectionTests::convexAndConvex(
+    const CollisionConvex& one,
+    const CollisionConvex& two)
+{
+    GJKResult result;
+    gjk(SupportShape(one), SupportShape(two), NULL, true, &result);
+    return result.overlap;
+}
+
+unsigned CollisionDetector::convexAndConvex(
+    const CollisionConvex& one,
+    const CollisionConvex& two,
+    CollisionData* data
+)
+{
+    // Make sure we have contacts
+    if (data->contactsLeft <= 0) return 0;
+
+    CollisionCache::Entry* cacheEntry = data->findCacheEntry(&one, &two);
+
+    return penetrationContact(SupportShape(one), SupportShape(two),
+        one.body, two.body, cacheEntry, data);
+}
+
+unsigned CollisionDetector::convexAndBox(
+    const CollisionConvex& convex,
+    const CollisionBox& box,
+    CollisionData* data
+)
+{
+    // Make sure we have contacts
+    if (data->contactsLeft <= 0) return 0;
+
+    CollisionCache::Entry* cacheEntry = data->findCacheEntry(&convex, &box);
+
+    return penetrationContact(SupportShape(convex), SupportShape(box),
+        convex.body, box.body, cacheEntry, data);
+}
+
+bool CollisionDetector::boxAndBoxGap(
+    const CollisionBox& one,
+    const CollisionBox& two,
+    CollisionData* data,
+    Vector3* normal,
+    real* gap,
+    Vector3* point
+)
+{
+    CollisionCache::Entry* cacheEntry = data->findCacheEntry(&one, &two);
+
+    GJKResult gjkResult;
+    gjk(SupportShape(one), SupportShape(two), cacheEntry, false, &gjkResult);
+    if (gjkResult.overlap || gjkResult.distance <= 0) return false;
+
+    *normal = (gjkResult.pointOne - gjkResult.pointTwo) *
+        (((real)1.0) / gjkResult.distance);
+    *gap = gjkResult.distance;
+    *point = (gjkResult.pointOne + gjkResult.pointTwo) * (real)0.5;
+    return true;
+}
+
+unsigned CollisionDetector::convexAndSphere(
+    const CollisionConvex& convex,
+    const CollisionSphere& sphere,
+    CollisionData* data
+)
+{
+    // Make sure we have contacts
+    if (data->contactsLeft <= 0) return 0;
+
+    CollisionCache::Entry* cacheEntry = data->findCacheEntry(&convex, &sphere);
+
+    // Find the distance from the convex shape to the sphere's centre.
+    Vector3 centre = sphere.getAxis(3);
+    SupportShape one(convex), two(centre);
+    GJKResult gjkResult;
+    gjk(one, two, cacheEntry, false, &gjkResult);
+
+    Contact* contact = data->contacts;
+    if (!gjkResult.overlap)
+    {
+        // The centre is outside, so this is just like a box and
+        // sphere: the closest point on the shape is the contact.
+        if (gjkResult.distance >= sphere.radius +
+            data->getMargin(convex.body, sphere.body) ||
+            gjkResult.distance <= 0) return 0;
+
+        contact->contactNormal =
+            (gjkResult.pointOne - centre) * (((real)1.0) / gjkResult.distance);
+        contact->penetration = sphere.radius - gjkResult.distance;
+        contact->contactPoint = gjkResult.pointOne;
+    }
+    else
+    {
+        // The centre is inside, so we need the way out.
+        EPAResult epaResult;
+        if (!epa(one, two, gjkResult.simplex, &epaResult)) return 0;
+
+        contact->contactNormal = epaResult.normal * -1.0f;
+        contact->penetration = epaResult.depth + sphere.radius;
+        contact->contactPoint = epaResult.pointOne;
+    }
+    contact->setBodyData(convex.body, sphere.body,
+        data->friction, data->restitution);
+
+    data->addContacts(1);
+    return 1;
+}
+
+unsigned CollisionDetector::convexAndCapsule(
+    const CollisionConvex& convex,
+    const CollisionCapsule& capsule,
+    CollisionData* data
+)
+{
+    // Make sure we have contacts
+    if (data->contactsLeft <= 0) return 0;
+
+    CollisionCache::Entry* cacheEntry = data->findCacheEntry(&convex, &capsule);
+
+    // Find the distance from the convex shape to the capsule's
+    // segment.
+    SupportShape one(convex), two(capsule);
+    GJKResult gjkResult;
+    gjk(one, two, cacheEntry, false, &gjkResult);
+
+    real reach = capsule.radius + data->getMargin(convex.body, capsule.body);
+    Contact* contact = data->contacts;
+    if (gjkResult.overlap)
+    {
+        // The segment passes into the shape, so we need the way out.
+        EPAResult epaResult;
+        if (!epa(one, two, gjkResult.simplex, &epaResult)) return 0;
+
+        contact->contactNormal = epaResult.normal * -1.0f;
+        contact->penetration = epaResult.depth + capsule.radius;
+        contact->contactPoint = epaResult.pointOne;
+        contact->setBodyData(convex.body, capsule.body,
+            data->friction, data->restitution);
+
+        data->addContacts(1);
+        return 1;
+    }
+    if (gjkResult.distance >= reach || gjkResult.distance <= 0) return 0;
+
+    Vector3 normal =
+        (gjkResult.pointOne - gjkResult.pointTwo) * (((real)1.0) / gjkResult.distance);
+
+    // A capsule lying on a face is as close at both ends, and needs a
+    // contact at each, or it would rock about the single closest
+    // point. Each end is tested as a sphere.
+    Vector3 endPoints[2];
+    real endDistances[2];
+    unsigned endsTouching = 0;
+    for (unsigned i = 0; i < 2; i++)
+    {
+        GJKResult endResult;
+        gjk(one, SupportShape(capsule.getEnd(i)), NULL, false, &endResult);
+        if (endResult.overlap || endResult.distance >= reach ||
+            endResult.distance <= 0) break;
+
+        Vector3 endNormal = (endResult.pointOne - endResult.pointTwo) *
+            (((real)1.0) / endResult.distance);
+        if (endNormal * normal < capsuleEndTolerance) break;
+
+        endPoints[i] = endResult.pointOne;
+        endDistances[i] = endResult.distance;
+        endsTouching++;
+    }
+
+    if (endsTouching < 2 || data->contactsLeft < 2)
+    {
+        contact->contactNormal = normal;
+        contact->penetration = capsule.radius - gjkResult.distance;
+        contact->contactPoint = gjkResult.pointOne;
+        contact->setBodyData(convex.body, capsule.body,
+            data->friction, data->restitution);
+
+        data->addContacts(1);
+        return 1;
+    }
+
+    for (unsigned i = 0; i < 2; i++)
+    {
+        contact->contactNormal = normal;
+        contact->penetration = capsule.radius - endDistances[i];
+        contact->contactPoint = endPoints[i];
+        contact->setBodyData(convex.body, capsule.body,
+            data->friction, data->restitution);
+        contact->featureId = i;
+        contact++;
+    }
+    data->addContacts(2);
+    return 2;
+}
+
+unsigned CollisionDetector::convexAndHalfSpace(
+    const CollisionConvex& convex,
+    const CollisionPlane& plane,
+    CollisionData* data
+)
+{
+    // Make sure we have contacts
+    if (data->contactsLeft <= 0) return 0;
+
+    // Early out if even the deepest vertex is above the plane (and
+    // further than the margin from it).
+    real limit = plane.offset + data->getMargin(convex.body, NULL);
+    unsigned deepest = convex.getSupportIndex(plane.direction * -1.0f);
+    if (convex.getVertex(deepest) * plane.direction > limit)
+    {
+        return 0;
+    }
+
+    // Otherwise every vertex below the limit is a contact, just as
+    // for a box.
+    Contact* contact = data->contacts;
+    unsigned contactsUsed = 0;
+    for (unsigned i = 0; i < convex.vertexCount; i++)
+    {
+        Vector3 vertexPos = convex.getVertex(i);
+        real vertexDistance = vertexPos * plane.direction;
+        if (vertexDistance > limit) continue;
+
+        contact->contactPoint = plane.direction;
+        contact->contactPoint *= (vertexDistance - plane.offset);
+        contact->contactPoint += vertexPos;
+        contact->contactNormal = plane.direction;
+        contact->penetration = plane.offset - vertexDistance;
+        contact->setBodyData(convex.body, NULL,
+            data->friction, data->restitution);
+        contact->featureId = i;
+
+        contact++;
+        contactsUsed++;
+        if (contactsUsed == (unsigned)data->contactsLeft) break;
+    }
+
+    data->addContacts(contactsUsed);
+    return contactsUsed;
+}
@@ -0,0 +1,486 @@
+#include <CollideFine.h>
+#include <assert.h>
+#include <atomic>
+
+using namespace Grics;
+
+/*
+ * This file holds the table that chooses the collision test for a
+ * pair of primitive types, and the batch that runs the tests bucket
+ * by bucket.
+ *
+ * Every entry of the table is made from a single template, given the
+ * two primitive classes and a test taking them in type order. Tests
+ * that take their primitives the other way round are wrapped in a
+ * small inline function, so the call inside each loop is still direct.
+ */
+
+namespace {
+
+    // The number of pairs a thread takes at a time in the parallel
+    // tests.
+    const unsigned parallelChunkSize = 16;
+
+    // The room each pair is given in its thread's block. A pair that
+    // fills it, or that comes when the output has less room than
+    // this, is run again straight into the output, so running out of
+    // room gives the same contacts as the serial tests.
+    const unsigned parallelPairContacts = 64;
+
+    typedef unsigned (*PairFunction)(
+        const CollisionPrimitive& one,
+        const CollisionPrimitive& two,
+        CollisionData* data);
+
+    typedef unsigned (*BucketFunction)(
+        const CollisionPrimitive* const* pairs,
+        unsigned count,
+        CollisionData* data);
+
+    inline unsigned sphereAndBox(const CollisionSphere& sphere,
+        const CollisionBox& box, CollisionData* data)
+    {
+        return CollisionDetector::boxAndSphere(box, sphere, data);
+    }
+
+    inline unsigned sphereAndCapsule(const CollisionSphere& sphere,
+        const CollisionCapsule& capsule, CollisionData* data)
+    {
+        return CollisionDetector::capsuleAndSphere(capsule, sphere, data);
+    }
+
+    inline unsigned sphereAndConvex(const CollisionSphere& sphere,
+        const CollisionConvex& convex, CollisionData* data)
+    {
+        return CollisionDetector::convexAndSphere(convex, sphere, data);
+    }
+
+    inline unsigned capsuleAndConvex(const CollisionCapsule& capsule,
+        const CollisionConvex& convex, CollisionData* data)
+    {
+        return CollisionDetector::convexAndCapsule(convex, capsule, data);
+    }
+
+    inline unsigned boxAndCapsule(const CollisionBox& box,
+        const CollisionCapsule& capsule, CollisionData* data)
+    {
+        return CollisionDetector::capsuleAndBox(capsule, box, data);
+    }
+
+    inline unsigned boxAndConvex(const CollisionBox& box,
+        const CollisionConvex& convex, CollisionData* data)
+    {
+        return CollisionDetector::convexAndBox(convex, box, data);
+    }
+
+    template <class One>
+    inline unsigned primitiveAndCompound(const One& primitive,
+        const CollisionCompound& compound, CollisionData* data)
+    {
+        return CollisionDetector::compoundAndPrimitive(
+            compound, primitive, data);
+    }
+
+    /*
+     * Runs the test on a single pair, for the table used by
+     * CollisionDetector::collide.
+     */
+    template <class One, class Two,
+        unsigned (*Test)(const One&, const Two&, CollisionData*)>
+    unsigned collidePair(
+        const CollisionPrimitive& one,
+        const CollisionPrimitive& two,
+        CollisionData* data)
+    {
+        return Test(static_cast<const One&>(one),
+            static_cast<const Two&>(two), data);
+    }
+
+    /*
+     * Runs the test on a bucket of pairs, given as an array of
+     * primitives two to a pair.
+     */
+    template <class One, class Two,
+        unsigned (*Test)(const One&, const Two&, CollisionData*)>
+    unsigned collideBucket(
+        const CollisionPrimitive* const* pairs,
+        unsigned count,
+        CollisionData* data)
+    {
+        unsigned contactsUsed = 0;
+        for (unsigned i = 0; i < count; i++)
+        {
+            if (data->contactsLeft <= 0) break;
+            contactsUsed += Test(
+                *static_cast<const One*>(pairs[i * 2]),
+                *static_cast<const Two*>(pairs[i * 2 + 1]),
+                data);
+        }
+        return contactsUsed;
+    }
+
+    /*
+     * Says which cache entry, if any, the test for a pair of types
+     * looks up: the one keyed with the pair in bucket order, or the
+     * one keyed with the pair swapped. Compounds look up entries for
+     * their children instead, which can't be known before the test.
+     */
+    enum CacheKey
+    {
+        NO_CACHE,
+        CACHE_IN_ORDER,
+        CACHE_SWAPPED
+    };
+
+    /*
+     * Holds the functions for one pair of types.
+     */
+    struct DispatchEntry
+    {
+        PairFunction pair;
+        BucketFunction bucket;
+        CacheKey cacheKey;
+    };
+
+#define GRICS_DISPATCH(One, Two, Test, Cache) \
+    { &collidePair<One, Two, Test>, &collideBucket<One, Two, Test>, Cache }
+#define GRICS_NO_DISPATCH { NULL, NULL, NO_CACHE }
+
+    /*
+     * The table of tests, indexed by the types of the two primitives
+     * with the lower type first. Entries below the diagonal are never
+     * used.
+     */
+    const DispatchEntry dispatchTable
+        [CollisionPrimitive::TYPE_COUNT][CollisionPrimitive::TYPE_COUNT] =
+    {
+        // Sphere with sphere, box, capsule, convex, compound
+        {
+            GRICS_DISPATCH(CollisionSphere, CollisionSphere,
+                CollisionDetector::sphereAndSphere, NO_CACHE),
+            GRICS_DISPATCH(CollisionSphere, CollisionBox, sphereAndBox,
+                NO_CACHE),
+            GRICS_DISPATCH(CollisionSphere, CollisionCapsule, sphereAndCapsule,
+                NO_CACHE),
+            GRICS_DISPATCH(CollisionSphere, CollisionConvex, sphereAndConvex,
+                CACHE_SWAPPED),
+            GRICS_DISPATCH(CollisionSphere, CollisionCompound,
+                primitiveAndCompound<CollisionSphere>, NO_CACHE)
+        },
+        // Box with box, capsule, convex, compound
+        {
+            GRICS_NO_DISPATCH,
+            GRICS_DISPATCH(CollisionBox, CollisionBox,
+                CollisionDetector::boxAndBox, CACHE_IN_ORDER),
+            GRICS_DISPATCH(CollisionBox, CollisionCapsule, boxAndCapsule,
+                NO_CACHE),
+            GRICS_DISPATCH(CollisionBox, CollisionConvex, boxAndConvex,
+                CACHE_SWAPPED),
+            GRICS_DISPATCH(CollisionBox, CollisionCompound,
+                primitiveAndCompound<CollisionBox>, NO_CACHE)
+        },
+        // Capsule with capsule, convex and compound
+        {
+            GRICS_NO_DISPATCH,
+            GRICS_NO_DISPATCH,
+            GRICS_DISPATCH(CollisionCapsule, CollisionCapsule,
+                CollisionDetector::capsuleAndCapsule, NO_CACHE),
+            GRICS_DISPATCH(CollisionCapsule, CollisionConvex, capsuleAndConvex,
+                CACHE_SWAPPED),
+            GRICS_DISPATCH(CollisionCapsule, CollisionCompound,
+                primitiveAndCompound<CollisionCapsule>, NO_CACHE)
+        },
+        // Convex with convex and compound
+        {
+            GRICS_NO_DISPATCH,
+            GRICS_NO_DISPATCH,
+            GRICS_NO_DISPATCH,
+            GRICS_DISPATCH(CollisionConvex, CollisionConvex,
+                CollisionDetector::convexAndConvex, CACHE_IN_ORDER),
+            GRICS_DISPATCH(CollisionConvex, CollisionCompound,
+                primitiveAndCompound<CollisionConvex>, NO_CACHE)
+        },
+        // Compound with compound
+        {
+            GRICS_NO_DISPATCH,
+            GRICS_NO_DISPATCH,
+            GRICS_NO_DISPATCH,
+            GRICS_NO_DISPATCH,
+            GRICS_DISPATCH(CollisionCompound, CollisionCompound,
+                CollisionDetector::compoundAndCompound, NO_CACHE)
+        }
+    };
+
+#undef GRICS_DISPATCH
+#undef GRICS_NO_DISPATCH
+}
+
+unsigned CollisionDetector::collide(
+    const CollisionPrimitive& one,
+    const CollisionPrimitive& two,
+    CollisionData* data
+)
+{
+    // Make sure we have contacts
+    if (data->contactsLeft <= 0) return 0;
+
+    if (one.getType() <= two.getType())
+    {
+        PairFunction test = dispatchTable[one.getType()][two.getType()].pair;
+        return test ? test(one, two, data) : 0;
+    }
+    else
+    {
+        PairFunction test = dispatchTable[two.getType()][one.getType()].pair;
+        return test ? test(two, one, data) : 0;
+    }
+}
+
+bool CollisionDetector::canCollide(
+    CollisionPrimitive::Type one,
+    CollisionPrimitive::Type two
+)
+{
+    if (one > two)
+    {
+        CollisionPrimitive::Type temp = one;
+        one = two;
+        two = temp;
+    }
+    return dispatchTable[one][two].pair != NULL;
+}
+
+void CollisionBatch::add(
+    const CollisionPrimitive* one, const CollisionPrimitive* two)
+{
+    if (one->getType() > two->getType())
+    {
+        const CollisionPrimitive* temp = one;
+        one = two;
+        two = temp;
+    }
+    // Every pair of types has a test, so a pair without one is a
+    // type added without its entries in the table.
+    if (!CollisionDetector::canCollide(one->getType(), two->getType()))
+    {
+        assert(false);
+        return;
+    }
+
+    std::vector<const CollisionPrimitive*>& bucket =
+        buckets[one->getType()][two->getType()];
+    bucket.push_back(one);
+    bucket.push_back(two);
+}
+
+unsigned CollisionBatch::generateContacts(CollisionData* data) const
+{
+    unsigned contactsUsed = 0;
+    for (unsigned one = 0; one < CollisionPrimitive::TYPE_COUNT; one++)
+    {
+        for (unsigned two = one; two < CollisionPrimitive::TYPE_COUNT; two++)
+        {
+            const std::vector<const CollisionPrimitive*>& bucket =
+                buckets[one][two];
+            if (bucket.empty()) continue;
+            if (data->contactsLeft <= 0) return contactsUsed;
+
+            contactsUsed += dispatchTable[one][two].bucket(
+                &bucket[0], (unsigned)bucket.size() / 2, data);
+        }
+    }
+    return contactsUsed;
+}
+
+void CollisionBatch::clear()
+{
+    for (unsigned one = 0; one < CollisionPrimitive::TYPE_COUNT; one++)
+    {
+        for (unsigned two = 0; two < CollisionPrimitive::TYPE_COUNT; two++)
+        {
+            buckets[one][two].clear();
+        }
+    }
+}
+
+unsigned CollisionBatch::generateContactsParallel(
+    CollisionData* data, unsigned threadCount)
+{
+    if (threadCount <= 1) return generateContacts(data);
+    if (data->contactsLeft <= 0) return 0;
+
+    // Number the pairs in the order generateContacts runs them.
+    struct Bucket
+    {
+        const CollisionPrimitive* const* pairs;
+        BucketFunction test;
+        CacheKey cacheKey;
+        unsigned firstPair;
+    };
+    Bucket order[CollisionPrimitive::TYPE_COUNT * CollisionPrimitive::TYPE_COUNT];
+    unsigned bucketCount = 0;
+    unsigned pairCount = 0;
+    for (unsigned one = 0; one < CollisionPrimitive::TYPE_COUNT; one++)
+    {
+        for (unsigned two = one; two < CollisionPrimitive::TYPE_COUNT; two++)
+        {
+            const std::vector<const CollisionPrimitive*>& bucket =
+                buckets[one][two];
+            if (bucket.empty()) continue;
+
+            Bucket& entry = order[bucketCount++];
+            entry.pairs = &bucket[0];
+            entry.test = dispatchTable[one][two].bucket;
+            entry.cacheKey = dispatchTable[one][two].cacheKey;
+            entry.firstPair = pairCount;
+            pairCount += (unsigned)bucket.size() / 2;
+        }
+    }
+    if (pairCount == 0) return 0;
+
+    threadContacts.resize(threadCount);
+    threadJournals.resize(threadCount);
+    pairContacts.resize(pairCount);
+    std::atomic<unsigned> nextChunk(0);
+
+    // Find every pair's cache entry here, on one thread, so the tests
+    // needn't lock the cache for them. Only the entries of compound
+    // children are left to be found (under the lock) in the pass.
+    for (unsigned i = 0; i < bucketCount; i++)
+    {
+        const Bucket& bucket = order[i];
+        unsigned end = i + 1 < bucketCount ? order[i + 1].firstPair : pairCount;
+        for (unsigned pair = bucket.firstPair; pair < end; pair++)
+        {
+            const CollisionPrimitive* const* primitives =
+                bucket.pairs + (pair - bucket.firstPair) * 2;
+            CollisionCache::Entry*& entry = pairContacts[pair].cacheEntry;
+            if (!data->cache || bucket.cacheKey == NO_CACHE) entry = NULL;
+            else if (bucket.cacheKey == CACHE_IN_ORDER)
+            {
+                entry = data->cache->find(primitives[0], primitives[1]);
+            }
+            else entry = data->cache->find(primitives[1], primitives[0]);
+        }
+    }
+
+    // Each thread takes chunks of pairs until there are none left,
+    // running each pair into its own room at the end of its block.
+    // A thread's chunks come in increasing order, so the bucket for
+    // each pair is found by moving on from the last one.
+    auto work = [&](unsigned thread)
+    {
+        std::vector<Contact>& block = threadContacts[thread];
+        CollisionCache::Journal& journal = threadJournals[thread];
+        journal.clear();
+        unsigned used = 0;
+        unsigned bucketIndex = 0;
+
+        for (;;)
+        {
+            unsigned first = nextChunk.fetch_add(parallelChunkSize);
+            if (first >= pairCount) break;
+            unsigned last = first + parallelChunkSize;
+            if (last > pairCount) last = pairCount;
+
+            for (unsigned pair = first; pair < last; pair++)
+            {
+                while (bucketIndex + 1 < bucketCount &&
+                    order[bucketIndex + 1].firstPair <= pair) bucketIndex++;
+                const Bucket& bucket = order[bucketIndex];
+
+                if (block.size() < used + parallelPairContacts)
+                {
+                    block.resize(used + parallelPairContacts * parallelChunkSize);
+                }
+
+                CollisionData local = *data;
+                local.contactArray = &block[used];
+                local.reset(parallelPairContacts);
+                local.cacheJournal = &journal;
+
+                PairContacts& result = pairContacts[pair];
+                const CollisionPrimitive* const* primitives =
+                    bucket.pairs + (pair - bucket.firstPair) * 2;
+                local.pairEntry = result.cacheEntry;
+                local.pairEntryOne = primitives[bucket.cacheKey == CACHE_SWAPPED];
+                local.pairEntryTwo = primitives[bucket.cacheKey != CACHE_SWAPPED];
+                result.thread = thread;
+                result.first = used;
+                result.firstJournalEntry = (unsigned)journal.size();
+                result.count = bucket.test(primitives, 1, &local);
+                result.truncatedQueries = local.truncatedQueries;
+                result.journalEntries =
+                    (unsigned)journal.size() - result.firstJournalEntry;
+                used += result.count;
+            }
+        }
+    };
+
+    workers.run(threadCount, work);
+
+    // Copy the blocks out in pair order.
+    unsigned contactsUsed = 0;
+    unsigned bucketIndex = 0;
+    for (unsigned pair = 0; pair < pairCount; pair++)
+    {
+        if (data->contactsLeft <= 0)
+        {
+            // generateContacts would never have reached the rest of
+            // the pairs, so leave their cache entries as they were.
+            for (; pair < pairCount; pair++) restoreCacheEntries(pair);
+            break;
+        }
+
+        const PairContacts& result = pairContacts[pair];
+        if (result.count < parallelPairContacts &&
+            data->contactsLeft >= (int)parallelPairContacts)
+        {
+            const Contact* source = &threadContacts[result.thread][result.first];
+            for (unsigned i = 0; i < result.count; i++)
+            {
+                data->contacts[i] = source[i];
+            }
+            data->addContacts(result.count);
+            data->truncatedQueries += result.truncatedQueries;
+            contactsUsed += result.count;
+            continue;
+        }
+
+        // The parallel test has already moved this pair's cache
+        // entries on, so put them back before testing it again.
+        restoreCacheEntries(pair);
+
+        while (bucketIndex + 1 < bucketCount &&
+            order[bucketIndex + 1].firstPair <= pair) bucketIndex++;
+        const Bucket& bucket = order[bucketIndex];
+        contactsUsed += bucket.test(
+            bucket.pairs + (pair - bucket.firstPair) * 2, 1, data);
+    }
+    return contactsUsed;
+}
+
+void CollisionBatch::restoreCacheEntries(unsigned pair)
+{
+    const PairContacts& result = pairContacts[pair];
+    const CollisionCache::Journal& journal = threadJournals[result.thread];
+    for (unsigned i = result.journalEntries; i > 0; i--)
+    {
+        const std::pair<CollisionCache::Entry*, CollisionCache::Entry>& old =
+            journal[result.firstJournalEntry + i - 1];
+        *old.first = old.second;
+    }
+}
+
+unsigned CollisionBatch::getPairCount() const
+{
+    size_t count = 0;
+    for (unsigned one = 0; one < CollisionPrimitive::TYPE_COUNT; one++)
+    {
+        for (unsigned two = 0; two < CollisionPrimitive::TYPE_COUNT; two++)
+        {
+            count += buckets[one][two].size();
+        }
+    }
+    return (unsigned)(count / 2);
+}
@@ -4,11 +4,73 @@
 #include <cstdlib>
 #include <cstdio>
 
+#ifdef GRICS_SSE
+#include <emmintrin.h>
+#endif
+
 using namespace Grics;
 
 void CollisionPrimitive::calculateInternals()
 {
     transform = body->getTransform() * offset;
+
+    // The primitives aren't virtual, so the compound's children are
+    // found by its type, as the collision tests are.
+    if (type == COMPOUND)
+    {
+        static_cast<CollisionCompound*>(this)->calculateChildInternals();
+    }
+}
+
+size_t CollisionCache::KeyHash::operator()(const Key& key) const
+{
+    size_t one = std::hash<const CollisionPrimitive*>()(key.first);
+    size_t two = std::hash<const CollisionPrimitive*>()(key.second);
+    return one ^ (two + 0x9e3779b9 + (one << 6) + (one >> 2));
+}
+
+CollisionCache::CollisionCache(unsigned maxAge)
+    :
+    frame(0),
+    maxAge(maxAge)
+{
+}
+
+CollisionCache::Entry* CollisionCache::find(
+    const CollisionPrimitive* one,
+    const CollisionPrimitive* two)
+{
+    std::lock_guard<std::mutex> guard(findLock);
+
+    Key key(one, two);
+    std::unordered_map<Key, Entry, KeyHash>::iterator i = entries.find(key);
+    if (i == entries.end())
+    {
+        Entry entry;
+        entry.simplexCount = 0;
+        entry.separatingAxis = Entry::NO_AXIS;
+        i = entries.insert(std::make_pair(key, entry)).first;
+    }
+    i->second.lastFrame = frame;
+    return &i->second;
+}
+
+void CollisionCache::newFrame()
+{
+    frame++;
+
+    // Remove the pairs that are no longer being tested.
+    std::unordered_map<Key, Entry, KeyHash>::iterator i = entries.begin();
+    while (i != entries.end())
+    {
+        if (frame - i->second.lastFrame > maxAge) i = entries.erase(i);
+        else i++;
+    }
+}
+
+void CollisionCache::clear()
+{
+    entries.clear();
 }
 
 bool IntersectionTests::sphereAndHalfSpace(
@@ -48,6 +110,115 @@ static inline real transformToAxis(
         box.halfSize.z * real_abs(axis * box.getAxis(2));
 }
 
+#ifdef GRICS_SSE
+/*
+ * The fifteen separating axes of a pair of boxes, held four to a
+ * register with one register for each component: the three axes of
+ * box one, the three of box two, and then the nine cross products of
+ * their axes. The sixteenth lane is never read.
+ */
+struct BoxBoxAxes
+{
+    __m128 x[4];
+    __m128 y[4];
+    __m128 z[4];
+};
+
+static inline __m128 absPacked(__m128 value)
+{
+    return _mm_andnot_ps(_mm_set1_ps(-0.0f), value);
+}
+
+/*
+ * Fills the axes for the two boxes. The cross products are found for
+ * all lanes at once, in the same order of operations as Vector3::%,
+ * and the face axes are then put into the first six lanes.
+ */
+static inline void fillBoxBoxAxes(
+    const CollisionBox& one,
+    const CollisionBox& two,
+    BoxBoxAxes& axes
+)
+{
+    Vector3 a[3] = { one.getAxis(0), one.getAxis(1), one.getAxis(2) };
+    Vector3 b[3] = { two.getAxis(0), two.getAxis(1), two.getAxis(2) };
+
+    // Lane i of group g holds cross product 4g + i - 6, so the
+    // first axis of the pair comes from a[(4g + i - 6) / 3] and the
+    // second from b[(4g + i - 6) % 3]. Lanes that aren't cross
+    // products are filled from a[0] and b[0], and the first two of
+    // them are replaced below.
+    static const unsigned first[16] =
+        { 0, 0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 2, 2, 2, 0 };
+    static const unsigned second[16] =
+        { 0, 0, 0, 0, 0, 0, 0, 1, 2, 0, 1, 2, 0, 1, 2, 0 };
+
+    for (unsigned g = 1; g < 4; g++)
+    {
+        const unsigned* f = first + g * 4;
+        const unsigned* s = second + g * 4;
+        __m128 ax = _mm_setr_ps(a[f[0]].x, a[f[1]].x, a[f[2]].x, a[f[3]].x);
+        __m128 ay = _mm_setr_ps(a[f[0]].y, a[f[1]].y, a[f[2]].y, a[f[3]].y);
+        __m128 az = _mm_setr_ps(a[f[0]].z, a[f[1]].z, a[f[2]].z, a[f[3]].z);
+        __m128 bx = _mm_setr_ps(b[s[0]].x, b[s[1]].x, b[s[2]].x, b[s[3]].x);
+        __m128 by = _mm_setr_ps(b[s[0]].y, b[s[1]].y, b[s[2]].y, b[s[3]].y);
+        __m128 bz = _mm_setr_ps(b[s[0]].z, b[s[1]].z, b[s[2]].z, b[s[3]].z);
+
+        axes.x[g] = _mm_sub_ps(_mm_mul_ps(ay, bz), _mm_mul_ps(az, by));
+        axes.y[g] = _mm_sub_ps(_mm_mul_ps(az, bx), _mm_mul_ps(ax, bz));
+        axes.z[g] = _mm_sub_ps(_mm_mul_ps(ax, by), _mm_mul_ps(ay, bx));
+    }
+
+    axes.x[0] = _mm_setr_ps(a[0].x, a[1].x, a[2].x, b[0].x);
+    axes.y[0] = _mm_setr_ps(a[0].y, a[1].y, a[2].y, b[0].y);
+    axes.z[0] = _mm_setr_ps(a[0].z, a[1].z, a[2].z, b[0].z);
+
+    const __m128 faceLanes = _mm_castsi128_ps(_mm_setr_epi32(-1, -1, 0, 0));
+    axes.x[1] = _mm_or_ps(_mm_and_ps(faceLanes,
+        _mm_setr_ps(b[1].x, b[2].x, 0, 0)), _mm_andnot_ps(faceLanes, axes.x[1]));
+    axes.y[1] = _mm_or_ps(_mm_and_ps(faceLanes,
+        _mm_setr_ps(b[1].y, b[2].y, 0, 0)), _mm_andnot_ps(faceLanes, axes.y[1]));
+    axes.z[1] = _mm_or_ps(_mm_and_ps(faceLanes,
+        _mm_setr_ps(b[1].z, b[2].z, 0, 0)), _mm_andnot_ps(faceLanes, axes.z[1]));
+}
+
+/*
+ * The packed form of transformToAxis, for four axes at once.
+ */
+static inline __m128 transformToAxes(
+    const CollisionBox& box,
+    __m128 x, __m128 y, __m128 z
+)
+{
+    __m128 result[3];
+    for (unsigned i = 0; i < 3; i++)
+    {
+        Vector3 axis = box.getAxis(i);
+        __m128 dot = _mm_add_ps(_mm_add_ps(
+            _mm_mul_ps(x, _mm_set1_ps(axis.x)),
+            _mm_mul_ps(y, _mm_set1_ps(axis.y))),
+            _mm_mul_ps(z, _mm_set1_ps(axis.z)));
+        result[i] = _mm_mul_ps(_mm_set1_ps(box.halfSize[i]), absPacked(dot));
+    }
+    return _mm_add_ps(_mm_add_ps(result[0], result[1]), result[2]);
+}
+
+/*
+ * The packed form of the distance between the centres along four
+ * axes at once.
+ */
+static inline __m128 distanceOnAxes(
+    const Vector3& toCentre,
+    __m128 x, __m128 y, __m128 z
+)
+{
+    return absPacked(_mm_add_ps(_mm_add_ps(
+        _mm_mul_ps(_mm_set1_ps(toCentre.x), x),
+        _mm_mul_ps(_mm_set1_ps(toCentre.y), y)),
+        _mm_mul_ps(_mm_set1_ps(toCentre.z), z)));
+}
+#endif
+
 /**
  * This function checks if the two boxes overlap
  * along the given axis. The final parameter toCentre
@@ -84,6 +255,24 @@ bool IntersectionTests::boxAndBox(
     // Find the vector between the two centres
     Vector3 toCentre = two.getAxis(3) - one.getAxis(3);
 
+#ifdef GRICS_SSE
+    // Project onto all fifteen axes four at a time, and check that
+    // every one of them overlaps.
+    BoxBoxAxes axes;
+    fillBoxBoxAxes(one, two, axes);
+
+    int overlapping = 0;
+    for (unsigned g = 0; g < 4; g++)
+    {
+        __m128 project = _mm_add_ps(
+            transformToAxes(one, axes.x[g], axes.y[g], axes.z[g]),
+            transformToAxes(two, axes.x[g], axes.y[g], axes.z[g]));
+        __m128 distance = distanceOnAxes(
+            toCentre, axes.x[g], axes.y[g], axes.z[g]);
+        overlapping |= _mm_movemask_ps(_mm_cmplt_ps(distance, project)) << (g * 4);
+    }
+    return (overlapping & 0x7fff) == 0x7fff;
+#else
     return (
         // Check on box one's axes first
         TEST_OVERLAP(one.getAxis(0)) &&
@@ -106,6 +295,7 @@ bool IntersectionTests::boxAndBox(
         TEST_OVERLAP(one.getAxis(2) % two.getAxis(1)) &&
         TEST_OVERLAP(one.getAxis(2) % two.getAxis(2))
         );
+#endif
 }
 #undef TEST_OVERLAP
 
@@ -142,8 +332,9 @@ unsigned CollisionDetector::sphereAndTruePlane(
     // Find the distance from the plane
     real centreDistance = plane.direction * position - plane.offset;
 
-    // Check if we're within radius
-    if (centreDistance * centreDistance > sphere.radius * sphere.radius)
+    // Check if we're within radius, allowing for the margin
+    real reach = sphere.radius + data->getMargin(sphere.body, NULL);
+    if (centreDistance * centreDistance > reach * reach)
     {
         return 0;
     }
@@ -187,7 +378,7 @@ unsigned CollisionDetector::sphereAndHalfSpace(
         plane.direction * position -
         sphere.radius - plane.offset;
 
-    if (ballDistance >= 0) return 0;
+    if (ballDistance >= data->getMargin(sphere.body, NULL)) return 0;
 
     // Create the contact - it has a normal in the plane direction.
     Contact* contact = data->contacts;
@@ -219,8 +410,9 @@ unsigned CollisionDetector::sphereAndSphere(
     Vector3 midline = positionOne - positionTwo;
     real size = midline.magnitude();
 
-    // See if it is large enough.
-    if (size <= 0.0f || size >= one.radius + two.radius)
+    // See if it is large enough, allowing for the margin.
+    if (size <= 0.0f || size >= one.radius + two.radius +
+        data->getMargin(one.body, two.body))
     {
         return 0;
     }
@@ -296,6 +488,105 @@ static inline bool tryAxis(
     return true;
 }
 
+#ifdef GRICS_SSE
+/*
+ * Does the work of tryAxis for all fifteen axes of the two boxes,
+ * four at a time. Returns false if any axis separates the boxes,
+ * setting separatingCase to the one that separates them most.
+ * Otherwise finds the axis with the smallest penetration, and the
+ * best of the face axes alone, choosing the same axis tryAxis would
+ * when called in order.
+ */
+static inline bool tryAllAxes(
+    const CollisionBox& one,
+    const CollisionBox& two,
+    const Vector3& toCentre,
+    real& smallestPenetration,
+    unsigned& smallestCase,
+    unsigned& smallestSingleAxis,
+    unsigned& separatingCase
+)
+{
+    BoxBoxAxes axes;
+    fillBoxBoxAxes(one, two, axes);
+
+    // tryAxis skips axes with a square magnitude below 0.0001. No
+    // float lies between this constant as a float and the true value,
+    // so skipping those not above it skips the same axes.
+    const __m128 parallel = _mm_set1_ps((real)0.0001);
+    const __m128 unit = _mm_set1_ps(1.0f);
+    const __m128 zero = _mm_setzero_ps();
+
+    float penetration[16];
+    int valid = 0;
+    int separating = 0;
+    for (unsigned g = 0; g < 4; g++)
+    {
+        __m128 x = axes.x[g], y = axes.y[g], z = axes.z[g];
+
+        // Normalize the axes, as Vector3::normalize does.
+        __m128 square = _mm_add_ps(_mm_add_ps(
+            _mm_mul_ps(x, x), _mm_mul_ps(y, y)), _mm_mul_ps(z, z));
+        __m128 usable = _mm_cmpgt_ps(square, parallel);
+        __m128 scale = _mm_div_ps(unit, _mm_sqrt_ps(square));
+        x = _mm_mul_ps(x, scale);
+        y = _mm_mul_ps(y, scale);
+        z = _mm_mul_ps(z, scale);
+
+        __m128 pen = _mm_sub_ps(_mm_add_ps(
+            transformToAxes(one, x, y, z),
+            transformToAxes(two, x, y, z)),
+            distanceOnAxes(toCentre, x, y, z));
+        _mm_storeu_ps(penetration + g * 4, pen);
+
+        valid |= _mm_movemask_ps(usable) << (g * 4);
+        separating |= _mm_movemask_ps(
+            _mm_and_ps(usable, _mm_cmplt_ps(pen, zero))) << (g * 4);
+    }
+
+    if (separating & 0x7fff)
+    {
+        real deepest = 0;
+        for (unsigned i = 0; i < 15; i++)
+        {
+            if ((separating & (1 << i)) && penetration[i] < deepest)
+            {
+                deepest = penetration[i];
+                separatingCase = i;
+            }
+        }
+        return false;
+    }
+
+    for (unsigned i = 0; i < 15; i++)
+    {
+        if (i == 6) smallestSingleAxis = smallestCase;
+        if (!(valid & (1 << i))) continue;
+        if (penetration[i] < smallestPenetration) {
+            smallestPenetration = penetration[i];
+            smallestCase = i;
+        }
+    }
+    return true;
+}
+#endif
+
+/*
+ * Returns the unnormalized axis with the given index, numbered as in
+ * boxAndBox.
+ */
+static inline Vector3 boxAndBoxAxis(
+    const CollisionBox& one,
+    const CollisionBox& two,
+    unsigned index
+)
+{
+    if (index < 3) return one.getAxis(index);
+    if (index < 6) return two.getAxis(index - 3);
+    index -= 6;
+    return one.getAxis(index / 3) % two.getAxis(index % 3);
+}
+
 void fillPointFaceBoxBox(
     const CollisionBox& one,
     const CollisionBox& two,
@@ -332,6 +623,296 @@ void fillPointFaceBoxBox(
     contact->contactPoint = two.getTransform() * vertex;
     contact->setBodyData(one.body, two.body,
         data->friction, data->restitution);
+
+    // The features are the face of one and the vertex of two.
+    contact->featureId = (best << 12) |
+        ((vertex.x > 0) ? 1 : 0) |
+        ((vertex.y > 0) ? 2 : 0) |
+        ((vertex.z > 0) ? 4 : 0);
+}
+
+/*
+ * Clips the given convex polygon against the plane with the given
+ * normal and offset, keeping the part of the polygon for which
+ * (point * normal) <= offset. This is one stage of the
+ * Sutherland-Hodgman algorithm. The number of vertices written to
+ * the output array is returned: it can be at most one more than the
+ * number of input vertices.
+ *
+ * Each vertex carries a feature id. Kept vertices keep theirs, and
+ * new crossing points are labelled with the clipping plane and the
+ * vertex the crossing edge started from, so the same crossing gets
+ * the same id from frame to frame.
+ */
+static unsigned clipPolygonToPlane(
+    const Vector3* input,
+    const unsigned* inputIds,
+    unsigned inputCount,
+    const Vector3& normal,
+    real offset,
+    unsigned plane,
+    Vector3* output,
+    unsigned* outputIds
+)
+{
+    if (inputCount == 0) return 0;
+
+    unsigned outputCount = 0;
+    Vector3 start = input[inputCount - 1];
+    unsigned startId = inputIds[inputCount - 1];
+    real startDistance = start * normal - offset;
+
+    for (unsigned i = 0; i < inputCount; i++)
+    {
+        Vector3 end = input[i];
+        real endDistance = end * normal - offset;
+        unsigned crossingId = ((plane + 1) << 4) | (startId & 0x0f);
+
+        if (startDistance <= 0)
+        {
+            // The start point is inside, so it is kept. If the
+            // edge leaves the plane we also keep the crossing point.
+            outputIds[outputCount] = startId;
+            output[outputCount++] = start;
+            if (endDistance > 0)
+            {
+                real t = startDistance / (startDistance - endDistance);
+                outputIds[outputCount] = crossingId;
+                output[outputCount++] = start + (end - start) * t;
+            }
+        }
+        else if (endDistance <= 0)
+        {
+            // The edge enters the plane, so keep the crossing point.
+            real t = startDistance / (startDistance - endDistance);
+            outputIds[outputCount] = crossingId;
+            output[outputCount++] = start + (end - start) * t;
+        }
+
+        start = end;
+        startId = inputIds[i];
+        startDistance = endDistance;
+    }
+    return outputCount;
+}
+
+/*
+ * Returns the signed area (times two) of the triangle a, b, c as seen
+ * looking along the given normal.
+ */
+static inline real signedArea(
+    const Vector3& a,
+    const Vector3& b,
+    const Vector3& c,
+    const Vector3& normal
+)
+{
+    return ((b - a) % (c - a)) * normal;
+}
+
+/*
+ * Reduces a contact manifold of more than four points to the four
+ * points that best describe it. The deepest point is always kept
+ * (it drives penetration resolution), followed by the point furthest
+ * from it, and then the two points that give the largest area on
+ * each side of the line through the first two. The chosen indices
+ * are written into the selected array, and the number of them is
+ * returned.
+ */
+static unsigned reduceManifold(
+    const Vector3* points,
+    const real* depths,
+    unsigned count,
+    const Vector3& normal,
+    unsigned selected[4]
+)
+{
+    if (count <= 4)
+    {
+        for (unsigned i = 0; i < count; i++) selected[i] = i;
+        return count;
+    }
+
+    // The deepest point.
+    unsigned a = 0;
+    for (unsigned i = 1; i < count; i++)
+    {
+        if (depths[i] > depths[a]) a = i;
+    }
+
+    // The point furthest from it.
+    unsigned b = a;
+    real best = -1;
+    for (unsigned i = 0; i < count; i++)
+    {
+        real distance = (points[i] - points[a]).squareMagnitude();
+        if (distance > best) { best = distance; b = i; }
+    }
+
+    // The point giving the largest triangle on one side...
+    unsigned c = a;
+    real bestArea = 0;
+    for (unsigned i = 0; i < count; i++)
+    {
+        if (i == a || i == b) continue;
+        real area = signedArea(points[a], points[b], points[i], normal);
+        if (c == a || real_abs(area) > real_abs(bestArea))
+        {
+            bestArea = area;
+            c = i;
+        }
+    }
+
+    // ...and the largest on the other side. If every point lies on
+    // the same side we take the one furthest from the others.
+    real side = (bestArea < 0) ? (real)1 : (real)-1;
+    unsigned d = a;
+    best = 0;
+    for (unsigned i = 0; i < count; i++)
+    {
+        if (i == a || i == b || i == c) continue;
+        real area = signedArea(points[a], points[b], points[i], normal) * side;
+        if (area > best) { best = area; d = i; }
+    }
+    if (d == a)
+    {
+        best = -1;
+        for (unsigned i = 0; i < count; i++)
+        {
+            if (i == a || i == b || i == c) continue;
+            real spread =
+                (points[i] - points[a]).squareMagnitude() +
+                (points[i] - points[b]).squareMagnitude() +
+                (points[i] - points[c]).squareMagnitude();
+            if (spread > best) { best = spread; d = i; }
+        }
+    }
+
+    selected[0] = a;
+    selected[1] = b;
+    selected[2] = c;
+    selected[3] = d;
+    return 4;
+}
+
+/*
+ * This method is called when we know that a face of box one is the
+ * axis of minimum penetration. Rather than using a single vertex of
+ * box two, it finds the face of box two that is most anti-parallel
+ * to the contact normal (the incident face), and clips it against the
+ * side planes of the face of box one (the reference face). Every
+ * clipped point below the reference face (or within the margin above
+ * it) becomes a contact, reduced to at most four. Returns the number
+ * of contacts written, which is zero if clipping found nothing (the
+ * caller should fall back to the single point case).
+ */
+static unsigned fillFaceFaceBoxBox(
+    const CollisionBox& one,
+    const CollisionBox& two,
+    const Vector3& toCentre,
+    CollisionData* data,
+    unsigned best,
+    real margin
+)
+{
+    // Work out which face of box one is the reference face. The
+    // normal points from box two towards box one.
+    Vector3 normal = one.getAxis(best);
+    if (normal * toCentre > 0)
+    {
+        normal = normal * -1.0f;
+    }
+    Vector3 referenceCentre =
+        one.getAxis(3) - normal * one.halfSize[best];
+
+    // Find the incident face on box two: the one whose outward
+    // normal points most directly back at box one.
+    unsigned incident = 0;
+    real incidentDot = 0;
+    for (unsigned i = 0; i < 3; i++)
+    {
+        real dot = two.getAxis(i) * normal;
+        if (real_abs(dot) > real_abs(incidentDot))
+        {
+            incidentDot = dot;
+            incident = i;
+        }
+    }
+    Vector3 incidentCentre = two.getAxis(3) +
+        two.getAxis(incident) *
+        ((incidentDot > 0) ? two.halfSize[incident] : -two.halfSize[incident]);
+
+    // Build the four corners of the incident face, in winding order.
+    unsigned i1 = (incident + 1) % 3;
+    unsigned i2 = (incident + 2) % 3;
+    Vector3 edgeOne = two.getAxis(i1) * two.halfSize[i1];
+    Vector3 edgeTwo = two.getAxis(i2) * two.halfSize[i2];
+
+    // The polygon can gain one vertex for each of the four planes.
+    Vector3 polygon[8], clipped[8];
+    unsigned polygonIds[8] = { 0, 1, 2, 3 }, clippedIds[8];
+    polygon[0] = incidentCentre + edgeOne + edgeTwo;
+    polygon[1] = incidentCentre - edgeOne + edgeTwo;
+    polygon[2] = incidentCentre - edgeOne - edgeTwo;
+    polygon[3] = incidentCentre + edgeOne - edgeTwo;
+    unsigned count = 4;
+
+    // Clip against the four side planes of the reference face.
+    unsigned r1 = (best + 1) % 3;
+    unsigned r2 = (best + 2) % 3;
+    Vector3 sides[2] = { one.getAxis(r1), one.getAxis(r2) };
+    real extents[2] = { one.halfSize[r1], one.halfSize[r2] };
+    for (unsigned i = 0; i < 2 && count > 0; i++)
+    {
+        real centreOffset = sides[i] * referenceCentre;
+
+        count = clipPolygonToPlane(polygon, polygonIds, count,
+            sides[i], centreOffset + extents[i], i * 2,
+            clipped, clippedIds);
+        count = clipPolygonToPlane(clipped, clippedIds, count,
+            sides[i] * -1.0f, extents[i] - centreOffset, i * 2 + 1,
+            polygon, polygonIds);
+    }
+
+    // The features are the reference face on one and the incident
+    // face on two, plus the vertex id within the clipped polygon.
+    unsigned faceIds = (best << 12) | ((normal * one.getAxis(best) > 0) << 11) |
+        (incident << 9) | ((incidentDot > 0) << 8);
+
+    // Keep only those points that are below the reference face, or
+    // close enough above it to be speculative.
+    Vector3 points[8];
+    real depths[8];
+    unsigned ids[8];
+    unsigned found = 0;
+    for (unsigned i = 0; i < count; i++)
+    {
+        real depth = (polygon[i] - referenceCentre) * normal;
+        if (depth < -margin) continue;
+        points[found] = polygon[i];
+        depths[found] = depth;
+        ids[found] = faceIds | polygonIds[i];
+        found++;
+    }
+    if (found == 0) return 0;
+
+    // Pick the most useful four, and write as many as will fit.
+    unsigned selected[4];
+    found = reduceManifold(points, depths, found, normal, selected);
+    if (found > (unsigned)data->contactsLeft) found = data->contactsLeft;
+
+    Contact* contact = data->contacts;
+    for (unsigned i = 0; i < found; i++)
+    {
+        contact->contactNormal = normal;
+        contact->penetration = depths[selected[i]];
+        contact->contactPoint = points[selected[i]];
+        contact->setBodyData(one.body, two.body,
+            data->friction, data->restitution);
+        contact->featureId = ids[selected[i]];
+        contact++;
+    }
+    return found;
 }
 
 static inline Vector3 contactPoint(
@@ -392,7 +973,11 @@ static inline Vector3 contactPoint(
 // This preprocessor definition is only used as a convenience
 // in the boxAndBox contact generation method.
 #define CHECK_OVERLAP(axis, index) \
-    if (!tryAxis(one, two, (axis), toCentre, (index), pen, best)) return 0;
+    if (!tryAxis(one, two, (axis), toCentre, (index), pen, best)) \
+    { \
+        if (cacheEntry) cacheEntry->separatingAxis = (index); \
+        return boxAndBoxSpeculative(one, two, data); \
+    }
 
 unsigned CollisionDetector::boxAndBox(
     const CollisionBox& one,
@@ -400,11 +985,30 @@ unsigned CollisionDetector::boxAndBox(
     CollisionData* data
 )
 {
+    // Make sure we have contacts
+    if (data->contactsLeft <= 0) return 0;
+
     //if (!IntersectionTests::boxAndBox(one, two)) return 0;
 
     // Find the vector between the two centres
     Vector3 toCentre = two.getAxis(3) - one.getAxis(3);
 
+    // If the boxes were apart last time, they are most likely still
+    // apart along the same axis, so try that one on its own first.
+    CollisionCache::Entry* cacheEntry = data->findCacheEntry(&one, &two);
+    if (cacheEntry &&
+        cacheEntry->separatingAxis != CollisionCache::Entry::NO_AXIS)
+    {
+        real cachedPen = REAL_MAX;
+        unsigned cachedCase;
+        if (!tryAxis(one, two,
+            boxAndBoxAxis(one, two, cacheEntry->separatingAxis),
+            toCentre, cacheEntry->separatingAxis, cachedPen, cachedCase))
+        {
+            return boxAndBoxSpeculative(one, two, data);
+        }
+    }
+
     // We start assuming there is no contact
     real pen = REAL_MAX;
     unsigned best = 0xffffff;
@@ -412,6 +1016,16 @@ unsigned CollisionDetector::boxAndBox(
     // Now we check each axes, returning if it gives us
     // a separating axis, and keeping track of the axis with
     // the smallest penetration otherwise.
+#ifdef GRICS_SSE
+    unsigned bestSingleAxis = 0xffffff;
+    unsigned separatingAxis = CollisionCache::Entry::NO_AXIS;
+    if (!tryAllAxes(one, two, toCentre, pen, best, bestSingleAxis,
+        separatingAxis))
+    {
+        if (cacheEntry) cacheEntry->separatingAxis = separatingAxis;
+        return boxAndBoxSpeculative(one, two, data);
+    }
+#else
     CHECK_OVERLAP(one.getAxis(0), 0);
     CHECK_OVERLAP(one.getAxis(1), 1);
     CHECK_OVERLAP(one.getAxis(2), 2);
@@ -433,6 +1047,10 @@ unsigned CollisionDetector::boxAndBox(
     CHECK_OVERLAP(one.getAxis(2) % two.getAxis(0), 12);
     CHECK_OVERLAP(one.getAxis(2) % two.getAxis(1), 13);
     CHECK_OVERLAP(one.getAxis(2) % two.getAxis(2), 14);
+#endif
+
+    // The boxes touch, so there is no axis to try next time.
+    if (cacheEntry) cacheEntry->separatingAxis = CollisionCache::Entry::NO_AXIS;
 
     // Make sure we've got a result.
     assert(best != 0xffffff);
@@ -443,20 +1061,34 @@ unsigned CollisionDetector::boxAndBox(
     // the case.
     if (best < 3)
     {
-        // We've got a vertex of box two on a face of box one.
-        fillPointFaceBoxBox(one, two, toCentre, data, best, pen);
-        data->addContacts(1);
-        return 1;
+        // We've got box two touching a face of box one. Clip its
+        // incident face to get a full manifold, falling back to
+        // the single deepest vertex if clipping finds nothing.
+        unsigned used = fillFaceFaceBoxBox(one, two, toCentre, data, best,
+            data->getMargin(one.body, two.body));
+        if (used == 0)
+        {
+            fillPointFaceBoxBox(one, two, toCentre, data, best, pen);
+            used = 1;
+        }
+        data->addContacts(used);
+        return used;
     }
     else if (best < 6)
     {
-        // We've got a vertex of box one on a face of box two.
+        // We've got box one touching a face of box two.
         // We use the same algorithm as above, but swap around
         // one and two (and therefore also the vector between their
         // centres).
-        fillPointFaceBoxBox(two, one, toCentre * -1.0f, data, best - 3, pen);
-        data->addContacts(1);
-        return 1;
+        unsigned used = fillFaceFaceBoxBox(two, one, toCentre * -1.0f,
+            data, best - 3, data->getMargin(one.body, two.body));
+        if (used == 0)
+        {
+            fillPointFaceBoxBox(two, one, toCentre * -1.0f, data, best - 3, pen);
+            used = 1;
+        }
+        data->addContacts(used);
+        return used;
     }
     else
     {
@@ -511,6 +1143,7 @@ unsigned CollisionDetector::boxAndBox(
         contact->contactPoint = vertex;
         contact->setBodyData(one.body, two.body,
             data->friction, data->restitution);
+        contact->featureId = 0x8000 | (oneAxisIndex << 2) | twoAxisIndex;
         data->addContacts(1);
         return 1;
     }
@@ -518,6 +1151,62 @@ unsigned CollisionDetector::boxAndBox(
 }
 #undef CHECK_OVERLAP
 
+/*
+ * A speculative gap whose normal is within this (as a cosine) of a
+ * box axis is treated as being across that box's face.
+ */
+static const real speculativeFaceTolerance = (real)0.99;
+
+unsigned CollisionDetector::boxAndBoxSpeculative(
+    const CollisionBox& one,
+    const CollisionBox& two,
+    CollisionData* data
+)
+{
+    // There is nothing to do unless the boxes could meet.
+    real margin = data->getMargin(one.body, two.body);
+    if (margin <= 0) return 0;
+
+    Vector3 normal, point;
+    real gap;
+    if (!boxAndBoxGap(one, two, data, &normal, &gap, &point)) return 0;
+    if (gap >= margin) return 0;
+
+    // If the gap is across a face of either box, clip the faces as
+    // we would for boxes that touch. The normal stands in for the
+    // vector between the centres, since it is the more reliable
+    // guide to which face is nearest.
+    for (unsigned i = 0; i < 3; i++)
+    {
+        unsigned used = 0;
+        if (real_abs(one.getAxis(i) * normal) > speculativeFaceTolerance)
+        {
+            used = fillFaceFaceBoxBox(
+                one, two, normal * -1.0f, data, i, margin);
+        }
+        else if (real_abs(two.getAxis(i) * normal) > speculativeFaceTolerance)
+        {
+            used = fillFaceFaceBoxBox(two, one, normal, data, i, margin);
+        }
+        if (used > 0)
+        {
+            data->addContacts(used);
+            return used;
+        }
+    }
+
+    // Otherwise the nearest features are edges or corners, and a
+    // single contact across the gap will do.
+    Contact* contact = data->contacts;
+    contact->contactNormal = normal;
+    contact->penetration = -gap;
+    contact->contactPoint = point;
+    contact->setBodyData(one.body, two.body,
+        data->friction, data->restitution);
+    data->addContacts(1);
+    return 1;
+}
+
 
 
 
@@ -581,9 +1270,10 @@ unsigned CollisionDetector::boxAndSphere(
     Vector3 relCentre = box.transform.transformInverse(centre);
 
     // Early out check to see if we can exclude the contact
-    if (real_abs(relCentre.x) - sphere.radius > box.halfSize.x ||
-        real_abs(relCentre.y) - sphere.radius > box.halfSize.y ||
-        real_abs(relCentre.z) - sphere.radius > box.halfSize.z)
+    real reach = sphere.radius + data->getMargin(box.body, sphere.body);
+    if (real_abs(relCentre.x) - reach > box.halfSize.x ||
+        real_abs(relCentre.y) - reach > box.halfSize.y ||
+        real_abs(relCentre.z) - reach > box.halfSize.z)
     {
         return 0;
     }
@@ -609,7 +1299,7 @@ unsigned CollisionDetector::boxAndSphere(
 
     // Check we're in contact
     dist = (closestPt - relCentre).squareMagnitude();
-    if (dist > sphere.radius * sphere.radius) return 0;
+    if (dist > reach * reach) return 0;
 
     // Compile the contact
     Vector3 closestPtWorld = box.transform.transform(closestPt);
@@ -635,8 +1325,11 @@ unsigned CollisionDetector::boxAndHalfSpace(
     // Make sure we have contacts
     if (data->contactsLeft <= 0) return 0;
 
-    // Check for intersection
-    if (!IntersectionTests::boxAndHalfSpace(box, plane))
+    // Check for intersection, allowing for the margin
+    real margin = data->getMargin(box.body, NULL);
+    real projectedRadius = transformToAxis(box, plane.direction);
+    if (plane.direction * box.getAxis(3) - projectedRadius >
+        plane.offset + margin)
     {
         return 0;
     }
@@ -662,7 +1355,7 @@ unsigned CollisionDetector::boxAndHalfSpace(
         real vertexDistance = vertexPos * plane.direction;
 
         // Compare this to the plane's distance
-        if (vertexDistance <= plane.offset)
+        if (vertexDistance <= plane.offset + margin)
         {
             // Create the contact data.
 
@@ -678,6 +1371,7 @@ unsigned CollisionDetector::boxAndHalfSpace(
             // Write the appropriate data
             contact->setBodyData(box.body, NULL,
                 data->friction, data->restitution);
+            contact->featureId = i;
 
             // Move onto the next contact
             contact++;
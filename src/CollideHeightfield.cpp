@@ -0,0 +1,476 @@
+#include <CollideFine.h>
+#include <math.h>
+
+using namespace Grics;
+
+/*
+ * This file holds the heightfield and its collision tests. Each cell
+ * of the grid is split into two triangles along the diagonal from its
+ * lowest corner, and the tests run the single triangle tests on the
+ * triangles of the cells under the object.
+ */
+
+namespace {
+
+    // Edges that bend by less than this (as a sine) are treated as
+    // flat, as for triangle meshes.
+    const real heightfieldConvexTolerance = (real)0.01;
+
+    const real heightfieldRayEpsilon = (real)0.000001;
+
+    /*
+     * Checks if the edge of the triangle that has the given point on
+     * the far side is convex: that is, if the neighbouring triangle
+     * bends away behind this one.
+     */
+    bool isConvexEdge(const CollisionTriangle& triangle,
+        unsigned edge, const Vector3& opposite)
+    {
+        Vector3 toOpposite = opposite - triangle.vertex[edge];
+        return toOpposite * triangle.normal <
+            -heightfieldConvexTolerance * toOpposite.magnitude();
+    }
+
+    /*
+     * Intersects a ray with the front of a triangle, after Moller
+     * and Trumbore. Returns the distance along the ray, or a negative
+     * number if it misses.
+     */
+    real rayAndTriangle(const CollisionRay& ray,
+        const CollisionTriangle& triangle)
+    {
+        Vector3 edgeOne = triangle.vertex[1] - triangle.vertex[0];
+        Vector3 edgeTwo = triangle.vertex[2] - triangle.vertex[0];
+        Vector3 p = ray.direction.vectorProduct(edgeTwo);
+        real determinant = edgeOne * p;
+
+        // Parallel, or hitting the back.
+        if (determinant <= heightfieldRayEpsilon) return -1;
+
+        real inverse = ((real)1.0) / determinant;
+        Vector3 t = ray.origin - triangle.vertex[0];
+        real u = (t * p) * inverse;
+        if (u < 0 || u > 1) return -1;
+
+        Vector3 q = t.vectorProduct(edgeOne);
+        real v = (ray.direction * q) * inverse;
+        if (v < 0 || u + v > 1) return -1;
+
+        return (edgeTwo * q) * inverse;
+    }
+}
+
+CollisionHeightfield::CollisionHeightfield()
+    : cellSize(1), columns(0), rows(0), heightOffset(0), heightScale(0)
+{
+}
+
+void CollisionHeightfield::build(
+    const real* heights, unsigned newColumns, unsigned newRows)
+{
+    columns = newColumns;
+    rows = newRows;
+
+    unsigned count = columns * rows;
+    real lowest = REAL_MAX, highest = -REAL_MAX;
+    for (unsigned i = 0; i < count; i++)
+    {
+        if (heights[i] < lowest) lowest = heights[i];
+        if (heights[i] > highest) highest = heights[i];
+    }
+
+    // Spread the samples over the full 16 bit range, rounding each
+    // to the nearest step.
+    heightOffset = lowest;
+    heightScale = (highest > lowest) ? (highest - lowest) / 65535 : 0;
+
+    samples.resize(count);
+    for (unsigned i = 0; i < count; i++)
+    {
+        real step = (heightScale > 0) ?
+            (heights[i] - lowest) / heightScale : 0;
+        samples[i] = (unsigned short)(step + (real)0.5);
+    }
+}
+
+void CollisionHeightfield::getTriangle(
+    unsigned column, unsigned row, unsigned half,
+    CollisionTriangle* triangle) const
+{
+    // Half 0 is above the diagonal (towards higher Z), half 1 below.
+    Vector3 lowCorner = getPoint(column, row);
+    Vector3 highCorner = getPoint(column + 1, row + 1);
+    if (half == 0)
+    {
+        triangle->vertex[0] = lowCorner;
+        triangle->vertex[1] = getPoint(column, row + 1);
+        triangle->vertex[2] = highCorner;
+    }
+    else
+    {
+        triangle->vertex[0] = lowCorner;
+        triangle->vertex[1] = highCorner;
+        triangle->vertex[2] = getPoint(column + 1, row);
+    }
+    triangle->normal = (triangle->vertex[1] - triangle->vertex[0]) %
+        (triangle->vertex[2] - triangle->vertex[0]);
+    triangle->normal.normalize();
+
+    // Work out which edges are real edges of the terrain, from the
+    // far vertex of the triangle on the other side of each. Edges on
+    // the boundary have nothing on the other side, so are real.
+    triangle->convexEdges = 0;
+    if (half == 0)
+    {
+        // Left edge, top edge, then the diagonal.
+        if (column == 0 || isConvexEdge(*triangle, 0,
+            getPoint(column - 1, row)))
+        {
+            triangle->convexEdges |= 1;
+        }
+        if (row + 2 >= rows || isConvexEdge(*triangle, 1,
+            getPoint(column + 1, row + 2)))
+        {
+            triangle->convexEdges |= 2;
+        }
+        if (isConvexEdge(*triangle, 2, getPoint(column + 1, row)))
+        {
+            triangle->convexEdges |= 4;
+        }
+    }
+    else
+    {
+        // The diagonal, right edge, then the bottom edge.
+        if (isConvexEdge(*triangle, 0, getPoint(column, row + 1)))
+        {
+            triangle->convexEdges |= 1;
+        }
+        if (column + 2 >= columns || isConvexEdge(*triangle, 1,
+            getPoint(column + 2, row + 1)))
+        {
+            triangle->convexEdges |= 2;
+        }
+        if (row == 0 || isConvexEdge(*triangle, 2,
+            getPoint(column, row - 1)))
+        {
+            triangle->convexEdges |= 4;
+        }
+    }
+}
+
+bool CollisionHeightfield::getCellRange(
+    const Vector3& min, const Vector3& max,
+    unsigned* firstColumn, unsigned* firstRow,
+    unsigned* lastColumn, unsigned* lastRow) const
+{
+    if (columns < 2 || rows < 2) return false;
+
+    real inverse = ((real)1.0) / cellSize;
+    real lowX = floor((min.x - origin.x) * inverse);
+    real lowZ = floor((min.z - origin.z) * inverse);
+    real highX = floor((max.x - origin.x) * inverse);
+    real highZ = floor((max.z - origin.z) * inverse);
+
+    // Check the box is over the grid at all.
+    if (highX < 0 || highZ < 0 ||
+        lowX > (real)(columns - 2) || lowZ > (real)(rows - 2))
+    {
+        return false;
+    }
+
+    *firstColumn = lowX < 0 ? 0 : (unsigned)lowX;
+    *firstRow = lowZ < 0 ? 0 : (unsigned)lowZ;
+    *lastColumn = highX > (real)(columns - 2) ? columns - 2 : (unsigned)highX;
+    *lastRow = highZ > (real)(rows - 2) ? rows - 2 : (unsigned)highZ;
+    return true;
+}
+
+real CollisionHeightfield::getCellTop(unsigned column, unsigned row) const
+{
+    unsigned short top = samples[row * columns + column];
+    unsigned short other = samples[row * columns + column + 1];
+    if (other > top) top = other;
+    other = samples[(row + 1) * columns + column];
+    if (other > top) top = other;
+    other = samples[(row + 1) * columns + column + 1];
+    if (other > top) top = other;
+    return heightOffset + heightScale * top;
+}
+
+bool IntersectionTests::heightfieldAndRay(
+    const CollisionHeightfield& heightfield,
+    const CollisionRay& ray,
+    real* distance,
+    Vector3* normal)
+{
+    unsigned columns = heightfield.getColumns();
+    unsigned rows = heightfield.getRows();
+    if (columns < 2 || rows < 2) return false;
+
+    // Work in cell units, relative to the grid.
+    real inverseSize = ((real)1.0) / heightfield.cellSize;
+    real startX = (ray.origin.x - heightfield.origin.x) * inverseSize;
+    real startZ = (ray.origin.z - heightfield.origin.z) * inverseSize;
+    real stepX = ray.direction.x * inverseSize;
+    real stepZ = ray.direction.z * inverseSize;
+
+    // Clip the ray to the grid, so the walk starts on it.
+    real enter = 0, leave = ray.length;
+    real starts[2] = { startX, startZ };
+    real steps[2] = { stepX, stepZ };
+    real limits[2] = { (real)(columns - 1), (real)(rows - 1) };
+    for (unsigned i = 0; i < 2; i++)
+    {
+        if (real_abs(steps[i]) < heightfieldRayEpsilon)
+        {
+            if (starts[i] < 0 || starts[i] > limits[i]) return false;
+            continue;
+        }
+        real t1 = -starts[i] / steps[i];
+        real t2 = (limits[i] - starts[i]) / steps[i];
+        if (t1 > t2) { real temp = t1; t1 = t2; t2 = temp; }
+        if (t1 > enter) enter = t1;
+        if (t2 < leave) leave = t2;
+    }
+    if (enter > leave) return false;
+
+    // Find the first cell, clamped since the entry point can be on
+    // the far boundary.
+    real x = startX + stepX * enter;
+    real z = startZ + stepZ * enter;
+    int column = (int)floor(x);
+    int row = (int)floor(z);
+    if (column > (int)columns - 2) column = columns - 2;
+    if (row > (int)rows - 2) row = rows - 2;
+    if (column < 0) column = 0;
+    if (row < 0) row = 0;
+
+    // Set up the walk: the distance along the ray to the next cell
+    // boundary on each axis, and between boundaries.
+    int directionX = stepX > 0 ? 1 : -1;
+    int directionZ = stepZ > 0 ? 1 : -1;
+    real nextX = REAL_MAX, nextZ = REAL_MAX;
+    real deltaX = REAL_MAX, deltaZ = REAL_MAX;
+    if (real_abs(stepX) >= heightfieldRayEpsilon)
+    {
+        deltaX = real_abs(((real)1.0) / stepX);
+        real boundary = (real)(column + (directionX > 0 ? 1 : 0));
+        nextX = (boundary - startX) / stepX;
+    }
+    if (real_abs(stepZ) >= heightfieldRayEpsilon)
+    {
+        deltaZ = real_abs(((real)1.0) / stepZ);
+        real boundary = (real)(row + (directionZ > 0 ? 1 : 0));
+        nextZ = (boundary - startZ) / stepZ;
+    }
+
+    real cellEnter = enter;
+    CollisionTriangle triangle;
+    while (true)
+    {
+        real cellLeave = nextX < nextZ ? nextX : nextZ;
+        if (cellLeave > leave) cellLeave = leave;
+
+        // Only test the triangles if the ray gets below the top of
+        // the cell while over it.
+        real lowest = ray.origin.y + ray.direction.y *
+            (ray.direction.y < 0 ? cellLeave : cellEnter);
+        if (lowest <= heightfield.origin.y +
+            heightfield.getCellTop(column, row))
+        {
+            real best = -1;
+            for (unsigned half = 0; half < 2; half++)
+            {
+                heightfield.getTriangle(column, row, half, &triangle);
+                real t = rayAndTriangle(ray, triangle);
+                if (t < 0 || t > ray.length) continue;
+                if (best < 0 || t < best)
+                {
+                    best = t;
+                    if (normal) *normal = triangle.normal;
+                }
+            }
+            if (best >= 0)
+            {
+                if (distance) *distance = best;
+                return true;
+            }
+        }
+
+        // Step to the next cell.
+        if (cellLeave >= leave) return false;
+        cellEnter = cellLeave;
+        if (nextX < nextZ)
+        {
+            column += directionX;
+            nextX += deltaX;
+            if (column < 0 || column > (int)columns - 2) return false;
+        }
+        else
+        {
+            row += directionZ;
+            nextZ += deltaZ;
+            if (row < 0 || row > (int)rows - 2) return false;
+        }
+    }
+}
+
+unsigned CollisionDetector::sphereAndHeightfield(
+    const CollisionSphere& sphere,
+    const CollisionHeightfield& heightfield,
+    CollisionData* data
+)
+{
+    // Make sure we have contacts
+    if (data->contactsLeft <= 0) return 0;
+
+    Vector3 centre = sphere.getAxis(3);
+    real reach = sphere.radius + data->getMargin(sphere.body, NULL);
+    Vector3 extent(reach, reach, reach);
+    Vector3 min = centre - extent;
+    unsigned firstColumn, firstRow, lastColumn, lastRow;
+    if (!heightfield.getCellRange(min, centre + extent,
+        &firstColumn, &firstRow, &lastColumn, &lastRow))
+    {
+        return 0;
+    }
+
+    unsigned contactsUsed = 0;
+    CollisionTriangle triangle;
+    for (unsigned row = firstRow; row <= lastRow; row++)
+    {
+        for (unsigned column = firstColumn; column <= lastColumn; column++)
+        {
+            // Skip cells wholly below the sphere.
+            if (heightfield.origin.y +
+                heightfield.getCellTop(column, row) < min.y)
+            {
+                continue;
+            }
+
+            for (unsigned half = 0; half < 2; half++)
+            {
+                heightfield.getTriangle(column, row, half, &triangle);
+                unsigned added = sphereAndTriangle(centre, sphere.radius,
+                    sphere.body, triangle, data);
+                if (added)
+                {
+                    unsigned cell = row * heightfield.getColumns() + column;
+                    (data->contacts - 1)->featureId |= (cell * 2 + half) << 4;
+                }
+                contactsUsed += added;
+            }
+        }
+    }
+    return reduceContacts(data, contactsUsed);
+}
+
+unsigned CollisionDetector::boxAndHeightfield(
+    const CollisionBox& box,
+    const CollisionHeightfield& heightfield,
+    CollisionData* data
+)
+{
+    // Make sure we have contacts
+    if (data->contactsLeft <= 0) return 0;
+
+    // Find the box's bounds in world space.
+    Vector3 centre = box.getAxis(3);
+    Vector3 extent;
+    for (unsigned i = 0; i < 3; i++)
+    {
+        Vector3 axis = box.getAxis(i) * box.halfSize[i];
+        extent.x += real_abs(axis.x);
+        extent.y += real_abs(axis.y);
+        extent.z += real_abs(axis.z);
+    }
+    Vector3 min = centre - extent;
+    unsigned firstColumn, firstRow, lastColumn, lastRow;
+    if (!heightfield.getCellRange(min, centre + extent,
+        &firstColumn, &firstRow, &lastColumn, &lastRow))
+    {
+        return 0;
+    }
+
+    unsigned contactsUsed = 0;
+    CollisionTriangle triangle;
+    for (unsigned row = firstRow; row <= lastRow; row++)
+    {
+        for (unsigned column = firstColumn; column <= lastColumn; column++)
+        {
+            // Skip cells wholly below the box.
+            if (heightfield.origin.y +
+                heightfield.getCellTop(column, row) < min.y)
+            {
+                continue;
+            }
+
+            for (unsigned half = 0; half < 2; half++)
+            {
+                heightfield.getTriangle(column, row, half, &triangle);
+                unsigned added = boxAndTriangle(box, triangle, data);
+                unsigned cell = row * heightfield.getColumns() + column;
+                for (unsigned i = 1; i <= added; i++)
+                {
+                    (data->contacts - i)->featureId |= (cell * 2 + half) << 4;
+                }
+                contactsUsed += added;
+            }
+        }
+    }
+    return reduceContacts(data, contactsUsed);
+}
+
+unsigned CollisionDetector::capsuleAndHeightfield(
+    const CollisionCapsule& capsule,
+    const CollisionHeightfield& heightfield,
+    CollisionData* data
+)
+{
+    // Make sure we have contacts
+    if (data->contactsLeft <= 0) return 0;
+
+    // Find the capsule's bounds in world space.
+    Vector3 one = capsule.getEnd(0), two = capsule.getEnd(1);
+    real reach = capsule.radius + data->getMargin(capsule.body, NULL);
+    Vector3 min, max;
+    for (unsigned i = 0; i < 3; i++)
+    {
+        min[i] = (one[i] < two[i] ? one[i] : two[i]) - reach;
+        max[i] = (one[i] < two[i] ? two[i] : one[i]) + reach;
+    }
+    unsigned firstColumn, firstRow, lastColumn, lastRow;
+    if (!heightfield.getCellRange(min, max,
+        &firstColumn, &firstRow, &lastColumn, &lastRow))
+    {
+        return 0;
+    }
+
+    unsigned contactsUsed = 0;
+    CollisionTriangle triangle;
+    for (unsigned row = firstRow; row <= lastRow; row++)
+    {
+        for (unsigned column = firstColumn; column <= lastColumn; column++)
+        {
+            // Skip cells wholly below the capsule.
+            if (heightfield.origin.y +
+                heightfield.getCellTop(column, row) < min.y)
+            {
+                continue;
+            }
+
+            for (unsigned half = 0; half < 2; half++)
+            {
+                heightfield.getTriangle(column, row, half, &triangle);
+                unsigned added = capsuleAndTriangle(capsule, triangle, data);
+                unsigned cell = row * heightfield.getColumns() + column;
+                for (unsigned i = 1; i <= added; i++)
+                {
+                    (data->contacts - i)->featureId |= (cell * 2 + half) << 4;
+                }
+                contactsUsed += added;
+            }
+        }
+    }
+    return reduceContacts(data, contactsUsed);
+}
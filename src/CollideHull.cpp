@@ -0,0 +1,522 @@
+#include <CollideFine.h>
+#include <map>
+
+using namespace Grics;
+
+/*
+ * This file holds the convex hull builder and the hull's support
+ * function. The builder is Quickhull: it starts from a tetrahedron of
+ * extreme points, and repeatedly takes the point furthest outside
+ * some face, removes every face that point can see, and fills the
+ * hole with a fan of new faces from the point to the edge of the
+ * hole (the horizon). Each remaining outside point is given to one
+ * face it is in front of, so only those points are ever checked.
+ *
+ * The build works on triangles, each knowing its three neighbours.
+ * Once it is done, coplanar triangles are merged and the result is
+ * turned into half-edges.
+ */
+
+namespace {
+
+    // Points closer than this to a face (relative to the size of the
+    // point cloud) are treated as being on it.
+    const real hullTolerance = (real)0.00001;
+
+    // Neighbouring triangles whose normals are closer than this are
+    // merged into one face.
+    const real hullCoplanarCosine = (real)0.99999;
+
+    /*
+     * A triangle of the hull while it is being built. Edge i runs
+     * from vertex i to vertex i + 1, and neighbour i is the triangle
+     * on the other side of it.
+     */
+    struct BuildFace
+    {
+        unsigned vertex[3];
+        unsigned neighbour[3];
+        Vector3 normal;
+        real offset;
+        std::vector<unsigned> outside;
+        bool removed;
+
+        // The pass in which this face was last checked for being
+        // visible, and whether it was.
+        unsigned visitPass;
+        bool visible;
+    };
+
+    /*
+     * An edge on the horizon: an edge of a visible face whose
+     * neighbour is not visible.
+     */
+    struct HorizonEdge
+    {
+        unsigned from;
+        unsigned to;
+        unsigned face;
+        unsigned faceEdge;
+    };
+
+    class HullBuilder
+    {
+    public:
+        const Vector3* points;
+        unsigned pointCount;
+        real tolerance;
+        std::vector<BuildFace> faces;
+
+        HullBuilder(const Vector3* points, unsigned pointCount)
+            : points(points), pointCount(pointCount), pass(0)
+        {
+            real scale = 0;
+            for (unsigned i = 0; i < pointCount; i++)
+            {
+                real size = real_abs(points[i].x) +
+                    real_abs(points[i].y) + real_abs(points[i].z);
+                if (size > scale) scale = size;
+            }
+            tolerance = scale * hullTolerance;
+        }
+
+        /*
+         * Runs Quickhull, returning false if the points are flat.
+         */
+        bool run()
+        {
+            if (!makeTetrahedron()) return false;
+
+            while (!pending.empty())
+            {
+                unsigned f = pending.back();
+                pending.pop_back();
+                while (!faces[f].removed && !faces[f].outside.empty())
+                {
+                    addPoint(f);
+                }
+            }
+            return true;
+        }
+
+    protected:
+        unsigned pass;
+        std::vector<HorizonEdge> horizon;
+        std::vector<unsigned> visibleFaces;
+        std::vector<unsigned> orphans;
+
+        // Faces that have been given outside points since they were
+        // last worked on.
+        std::vector<unsigned> pending;
+
+        real distance(const BuildFace& face, unsigned point) const
+        {
+            return face.normal * points[point] - face.offset;
+        }
+
+        unsigned makeFace(unsigned a, unsigned b, unsigned c)
+        {
+            BuildFace face;
+            face.vertex[0] = a;
+            face.vertex[1] = b;
+            face.vertex[2] = c;
+            face.neighbour[0] = face.neighbour[1] = face.neighbour[2] = 0;
+            face.normal = (points[b] - points[a]) % (points[c] - points[a]);
+            face.normal.normalize();
+            face.offset = face.normal * points[a];
+            face.removed = false;
+            face.visitPass = 0;
+            face.visible = false;
+            faces.push_back(face);
+            return (unsigned)faces.size() - 1;
+        }
+
+        /*
+         * Gives the point to the face if it is in front of it.
+         */
+        bool assign(unsigned point, unsigned face)
+        {
+            if (faces[face].removed) return false;
+            if (distance(faces[face], point) <= tolerance) return false;
+            if (faces[face].outside.empty()) pending.push_back(face);
+            faces[face].outside.push_back(point);
+            return true;
+        }
+
+        bool makeTetrahedron()
+        {
+            if (pointCount < 4) return false;
+
+            // Take the two extreme points furthest apart.
+            unsigned extreme[6];
+            for (unsigned j = 0; j < 6; j++) extreme[j] = 0;
+            for (unsigned i = 1; i < pointCount; i++)
+            {
+                for (unsigned j = 0; j < 3; j++)
+                {
+                    if (points[i][j] < points[extreme[j * 2]][j]) extreme[j * 2] = i;
+                    if (points[i][j] > points[extreme[j * 2 + 1]][j]) extreme[j * 2 + 1] = i;
+                }
+            }
+            unsigned v[4];
+            real best = -1;
+            for (unsigned j = 0; j < 3; j++)
+            {
+                real size = (points[extreme[j * 2 + 1]] -
+                    points[extreme[j * 2]]).squareMagnitude();
+                if (size > best)
+                {
+                    best = size;
+                    v[0] = extreme[j * 2];
+                    v[1] = extreme[j * 2 + 1];
+                }
+            }
+            if (best <= tolerance * tolerance) return false;
+
+            // Then the point furthest from the line between them.
+            Vector3 line = points[v[1]] - points[v[0]];
+            best = 0;
+            for (unsigned i = 0; i < pointCount; i++)
+            {
+                real size = ((points[i] - points[v[0]]) % line).squareMagnitude();
+                if (size > best)
+                {
+                    best = size;
+                    v[2] = i;
+                }
+            }
+            if (best <= tolerance * tolerance * line.squareMagnitude()) return false;
+
+            // And the point furthest from their plane.
+            Vector3 normal = line % (points[v[2]] - points[v[0]]);
+            normal.normalize();
+            best = 0;
+            for (unsigned i = 0; i < pointCount; i++)
+            {
+                real size = real_abs(normal * (points[i] - points[v[0]]));
+                if (size > best)
+                {
+                    best = size;
+                    v[3] = i;
+                }
+            }
+            if (best <= tolerance) return false;
+
+            // Wind each face so the fourth point is behind it.
+            static const unsigned sides[4][4] = {
+                {0, 1, 2, 3}, {0, 3, 1, 2}, {0, 2, 3, 1}, {1, 3, 2, 0}
+            };
+            for (unsigned f = 0; f < 4; f++)
+            {
+                unsigned a = v[sides[f][0]], b = v[sides[f][1]], c = v[sides[f][2]];
+                unsigned index = makeFace(a, b, c);
+                if (distance(faces[index], v[sides[f][3]]) > 0)
+                {
+                    faces.pop_back();
+                    makeFace(a, c, b);
+                }
+            }
+
+            // Each edge is shared with the face that runs it the
+            // other way.
+            for (unsigned f = 0; f < 4; f++)
+            for (unsigned e = 0; e < 3; e++)
+            {
+                unsigned from = faces[f].vertex[e];
+                unsigned to = faces[f].vertex[(e + 1) % 3];
+                for (unsigned g = 0; g < 4; g++)
+                for (unsigned h = 0; h < 3; h++)
+                {
+                    if (faces[g].vertex[h] == to &&
+                        faces[g].vertex[(h + 1) % 3] == from)
+                    {
+                        faces[f].neighbour[e] = g;
+                    }
+                }
+            }
+
+            for (unsigned i = 0; i < pointCount; i++)
+            {
+                if (i == v[0] || i == v[1] || i == v[2] || i == v[3]) continue;
+                for (unsigned f = 0; f < 4; f++)
+                {
+                    if (assign(i, f)) break;
+                }
+            }
+            return true;
+        }
+
+        /*
+         * Adds the furthest outside point of the face to the hull.
+         */
+        void addPoint(unsigned faceIndex)
+        {
+            // Take the point furthest out.
+            const std::vector<unsigned>& outside = faces[faceIndex].outside;
+            unsigned eye = outside[0];
+            real best = distance(faces[faceIndex], eye);
+            for (unsigned i = 1; i < outside.size(); i++)
+            {
+                real size = distance(faces[faceIndex], outside[i]);
+                if (size > best)
+                {
+                    best = size;
+                    eye = outside[i];
+                }
+            }
+
+            // Find the faces the point can see, spreading out from
+            // this one, and the edges around them.
+            pass++;
+            horizon.clear();
+            visibleFaces.clear();
+            visibleFaces.push_back(faceIndex);
+            faces[faceIndex].visitPass = pass;
+            faces[faceIndex].visible = true;
+            for (unsigned next = 0; next < visibleFaces.size(); next++)
+            {
+                unsigned f = visibleFaces[next];
+                for (unsigned e = 0; e < 3; e++)
+                {
+                    unsigned n = faces[f].neighbour[e];
+                    BuildFace& neighbour = faces[n];
+                    if (neighbour.visitPass != pass)
+                    {
+                        neighbour.visitPass = pass;
+                        neighbour.visible = distance(neighbour, eye) > -tolerance;
+                        if (neighbour.visible) visibleFaces.push_back(n);
+                    }
+                    if (neighbour.visible) continue;
+
+                    HorizonEdge edge;
+                    edge.from = faces[f].vertex[e];
+                    edge.to = faces[f].vertex[(e + 1) % 3];
+                    edge.face = n;
+                    for (unsigned ne = 0; ne < 3; ne++)
+                    {
+                        if (neighbour.vertex[ne] == edge.to) edge.faceEdge = ne;
+                    }
+                    horizon.push_back(edge);
+                }
+            }
+
+            // Take the visible faces away, keeping their other points.
+            orphans.clear();
+            for (unsigned i = 0; i < visibleFaces.size(); i++)
+            {
+                BuildFace& face = faces[visibleFaces[i]];
+                face.removed = true;
+                for (unsigned p = 0; p < face.outside.size(); p++)
+                {
+                    if (face.outside[p] != eye) orphans.push_back(face.outside[p]);
+                }
+                std::vector<unsigned>().swap(face.outside);
+            }
+
+            // Fill the hole with a fan from the point. Each new face
+            // (from, to, eye) meets the new faces starting at its to
+            // vertex and ending at its from vertex.
+            unsigned firstNew = (unsigned)faces.size();
+            std::map<unsigned, unsigned> startingAt, endingAt;
+            for (unsigned i = 0; i < horizon.size(); i++)
+            {
+                const HorizonEdge& edge = horizon[i];
+                unsigned index = makeFace(edge.from, edge.to, eye);
+                faces[index].neighbour[0] = edge.face;
+                faces[edge.face].neighbour[edge.faceEdge] = index;
+                startingAt[edge.from] = index;
+                endingAt[edge.to] = index;
+            }
+            for (unsigned f = firstNew; f < faces.size(); f++)
+            {
+                faces[f].neighbour[1] = startingAt[faces[f].vertex[1]];
+                faces[f].neighbour[2] = endingAt[faces[f].vertex[0]];
+            }
+
+            // Give the other points to the new faces. Points in front
+            // of none of them are inside the hull, and are dropped,
+            // unless rounding has left them in front of a face on the
+            // horizon; where the faces are almost flat that can be by
+            // more than the tolerance.
+            for (unsigned i = 0; i < orphans.size(); i++)
+            {
+                bool assigned = false;
+                for (unsigned f = firstNew; f < faces.size() && !assigned; f++)
+                {
+                    assigned = assign(orphans[i], f);
+                }
+                for (unsigned h = 0; h < horizon.size() && !assigned; h++)
+                {
+                    assigned = assign(orphans[i], horizon[h].face);
+                }
+            }
+        }
+    };
+}
+
+bool ConvexHull::build(const Vector3* points, unsigned pointCount)
+{
+    clear();
+
+    HullBuilder builder(points, pointCount);
+    if (!builder.run()) return false;
+    const std::vector<BuildFace>& built = builder.faces;
+
+    // Merge neighbouring triangles that lie in the plane of the
+    // first triangle of each face. Comparing with the first rather
+    // than with each neighbour stops a gently curved run of
+    // triangles from being merged into one face. The face's normal
+    // is the area weighted normal of its triangles.
+    std::vector<unsigned> faceIndex(built.size(), 0xffffffff);
+    std::vector<unsigned> stack;
+    for (unsigned first = 0; first < built.size(); first++)
+    {
+        if (built[first].removed || faceIndex[first] != 0xffffffff) continue;
+        const BuildFace& plane = built[first];
+
+        Face face;
+        face.edge = 0;
+        face.offset = 0;
+        faceIndex[first] = (unsigned)faces.size();
+        stack.push_back(first);
+        while (!stack.empty())
+        {
+            const BuildFace& triangle = built[stack.back()];
+            stack.pop_back();
+
+            const unsigned* v = triangle.vertex;
+            face.normal +=
+                (points[v[1]] - points[v[0]]) % (points[v[2]] - points[v[0]]);
+
+            for (unsigned e = 0; e < 3; e++)
+            {
+                unsigned n = triangle.neighbour[e];
+                if (faceIndex[n] != 0xffffffff) continue;
+                if (built[n].normal * plane.normal < hullCoplanarCosine) continue;
+
+                bool flat = true;
+                for (unsigned j = 0; j < 3; j++)
+                {
+                    real distance = plane.normal * points[built[n].vertex[j]] -
+                        plane.offset;
+                    if (real_abs(distance) > builder.tolerance) flat = false;
+                }
+                if (!flat) continue;
+
+                faceIndex[n] = (unsigned)faces.size();
+                stack.push_back(n);
+            }
+        }
+        faces.push_back(face);
+    }
+
+    // Only edges between different faces are kept, and only the
+    // vertices at their ends.
+    std::map<std::pair<unsigned, unsigned>, unsigned> edgeFrom, edgeBetween;
+    std::vector<unsigned> vertexIndex(pointCount, 0xffffffff);
+    std::vector<unsigned> edgeEnd;
+    for (unsigned f = 0; f < built.size(); f++)
+    {
+        if (built[f].removed) continue;
+        for (unsigned e = 0; e < 3; e++)
+        {
+            if (faceIndex[built[f].neighbour[e]] == faceIndex[f]) continue;
+
+            unsigned ends[2] = { built[f].vertex[e], built[f].vertex[(e + 1) % 3] };
+            for (unsigned j = 0; j < 2; j++)
+            {
+                if (vertexIndex[ends[j]] != 0xffffffff) continue;
+                vertexIndex[ends[j]] = (unsigned)vertices.size();
+                vertices.push_back(points[ends[j]]);
+            }
+
+            HalfEdge edge;
+            edge.vertex = vertexIndex[ends[0]];
+            edge.face = faceIndex[f];
+            edge.twin = edge.next = 0;
+            edgeFrom[std::make_pair(edge.face, edge.vertex)] =
+                (unsigned)edges.size();
+            edgeBetween[std::make_pair(edge.vertex, vertexIndex[ends[1]])] =
+                (unsigned)edges.size();
+            edgeEnd.push_back(vertexIndex[ends[1]]);
+            edges.push_back(edge);
+        }
+    }
+
+    // Link each edge to the next around its face, and to the edge
+    // running the other way.
+    vertexEdges.resize(vertices.size());
+    for (unsigned i = 0; i < edges.size(); i++)
+    {
+        HalfEdge& edge = edges[i];
+        edge.next = edgeFrom[std::make_pair(edge.face, edgeEnd[i])];
+        edge.twin = edgeBetween[std::make_pair(edgeEnd[i], edge.vertex)];
+        vertexEdges[edge.vertex] = i;
+        faces[edge.face].edge = i;
+    }
+
+    // Put each face's plane through the vertex furthest along its
+    // normal, so no vertex is outside it even where rounding has
+    // left the normal of a thin triangle slightly out.
+    for (unsigned f = 0; f < faces.size(); f++)
+    {
+        Face& face = faces[f];
+        face.normal.normalize();
+        unsigned furthest = getSupportIndex(face.normal,
+            edges[face.edge].vertex);
+        face.offset = face.normal * vertices[furthest];
+    }
+    return true;
+}
+
+bool ConvexHull::build(const real* coordinates, unsigned pointCount)
+{
+    std::vector<Vector3> points(pointCount);
+    for (unsigned i = 0; i < pointCount; i++)
+    {
+        points[i] = Vector3(coordinates[i * 3],
+            coordinates[i * 3 + 1], coordinates[i * 3 + 2]);
+    }
+    if (pointCount == 0) return build((const Vector3*)NULL, 0);
+    return build(&points[0], pointCount);
+}
+
+void ConvexHull::clear()
+{
+    vertices.clear();
+    edges.clear();
+    faces.clear();
+    vertexEdges.clear();
+}
+
+unsigned ConvexHull::getSupportIndex(
+    const Vector3& direction, unsigned start) const
+{
+    if (vertices.empty()) return 0;
+    unsigned current = start < vertices.size() ? start : 0;
+    real best = vertices[current] * direction;
+
+    // The hull is convex, so a vertex no neighbour is further along
+    // from is the furthest of all. Each step moves strictly further,
+    // so no vertex is visited twice.
+    for (;;)
+    {
+        unsigned first = vertexEdges[current];
+        unsigned edge = first;
+        unsigned next = current;
+        do
+        {
+            const HalfEdge& twin = edges[edges[edge].twin];
+            real distance = vertices[twin.vertex] * direction;
+            if (distance > best)
+            {
+                best = distance;
+                next = twin.vertex;
+            }
+            edge = twin.next;
+        } while (edge != first);
+
+        if (next == current) return current;
+        current = next;
+    }
+}
@@ -0,0 +1,805 @@
+#include <CollideFine.h>
+#include <map>
+
+using namespace Grics;
+
+/*
+ * This file holds the static triangle mesh and the collision tests
+ * against single triangles, which are shared by every kind of static
+ * triangle geometry.
+ */
+
+namespace {
+
+    // The most triangles a leaf of the mesh hierarchy holds.
+    const unsigned meshLeafSize = 4;
+
+    // The most nodes a query can have waiting to be visited. The
+    // hierarchy is built by halving, so this is plenty.
+    const unsigned meshQueryStackSize = 64;
+
+    // The most triangles one object is tested against. Objects
+    // touching more than this are tested against the first ones, and
+    // the test is counted in the collision data's truncated queries.
+    const unsigned meshQueryLimit = 128;
+
+    // The most contacts one object gets from the mesh, after the
+    // contacts from neighbouring triangles have been merged.
+    const unsigned meshMaxContacts = 4;
+
+    // Contacts closer than this (with similar normals) are merged.
+    const real meshMergeDistance = (real)0.02;
+    const real meshNormalTolerance = (real)0.95;
+
+    // Edges that bend by less than this (as a sine) are treated as
+    // flat, and so are not real edges of the surface.
+    const real meshConvexTolerance = (real)0.01;
+
+    /*
+     * Marks the contacts just added as coming from the given
+     * triangle, so they can be told apart from one frame to the
+     * next.
+     */
+    void tagContacts(CollisionData* data, unsigned count, unsigned triangle)
+    {
+        for (unsigned i = 1; i <= count; i++)
+        {
+            (data->contacts - i)->featureId |= triangle << 4;
+        }
+    }
+}
+
+Vector3 CollisionTriangle::closestPoint(
+    const Vector3& point, unsigned* feature) const
+{
+    // This follows Ericson's closest point on triangle, working out
+    // which Voronoi region of the triangle the point is in.
+    const Vector3& a = vertex[0];
+    const Vector3& b = vertex[1];
+    const Vector3& c = vertex[2];
+    Vector3 ab = b - a;
+    Vector3 ac = c - a;
+    Vector3 ap = point - a;
+
+    real d1 = ab * ap;
+    real d2 = ac * ap;
+    if (d1 <= 0 && d2 <= 0)
+    {
+        *feature = VERTEX + 0;
+        return a;
+    }
+
+    Vector3 bp = point - b;
+    real d3 = ab * bp;
+    real d4 = ac * bp;
+    if (d3 >= 0 && d4 <= d3)
+    {
+        *feature = VERTEX + 1;
+        return b;
+    }
+
+    real vc = d1 * d4 - d3 * d2;
+    if (vc <= 0 && d1 >= 0 && d3 <= 0)
+    {
+        *feature = EDGE + 0;
+        return a + ab * (d1 / (d1 - d3));
+    }
+
+    Vector3 cp = point - c;
+    real d5 = ab * cp;
+    real d6 = ac * cp;
+    if (d6 >= 0 && d5 <= d6)
+    {
+        *feature = VERTEX + 2;
+        return c;
+    }
+
+    real vb = d5 * d2 - d1 * d6;
+    if (vb <= 0 && d2 >= 0 && d6 <= 0)
+    {
+        *feature = EDGE + 2;
+        return a + ac * (d2 / (d2 - d6));
+    }
+
+    real va = d3 * d6 - d5 * d4;
+    if (va <= 0 && (d4 - d3) >= 0 && (d5 - d6) >= 0)
+    {
+        *feature = EDGE + 1;
+        return b + (c - b) * ((d4 - d3) / ((d4 - d3) + (d5 - d6)));
+    }
+
+    real denom = ((real)1.0) / (va + vb + vc);
+    *feature = FACE;
+    return a + ab * (vb * denom) + ac * (vc * denom);
+}
+
+bool CollisionTriangle::isInternalFeature(unsigned feature) const
+{
+    if (feature >= VERTEX)
+    {
+        // A vertex is internal if neither edge that meets there is a
+        // real edge.
+        unsigned index = feature - VERTEX;
+        unsigned edges = (1u << index) | (1u << ((index + 2) % 3));
+        return (convexEdges & edges) == 0;
+    }
+    if (feature >= EDGE)
+    {
+        return (convexEdges & (1u << (feature - EDGE))) == 0;
+    }
+    return false;
+}
+
+CollisionTriangleMesh::CollisionTriangleMesh()
+{
+}
+
+void CollisionTriangleMesh::build(
+    const Vector3* vertexData, unsigned vertexCount,
+    const unsigned* indices, unsigned triangleCount)
+{
+    vertices.assign(vertexData, vertexData + vertexCount);
+
+    triangles.resize(triangleCount);
+    for (unsigned i = 0; i < triangleCount; i++)
+    {
+        Triangle& triangle = triangles[i];
+        for (unsigned j = 0; j < 3; j++)
+        {
+            triangle.vertex[j] = indices[i * 3 + j];
+        }
+        const Vector3& a = vertices[triangle.vertex[0]];
+        const Vector3& b = vertices[triangle.vertex[1]];
+        const Vector3& c = vertices[triangle.vertex[2]];
+        triangle.normal = (b - a) % (c - a);
+        triangle.normal.normalize();
+        triangle.convexEdges = 7;
+    }
+    findConvexEdges();
+
+    // Build the hierarchy from the triangle centres.
+    nodes.clear();
+    if (triangleCount == 0) return;
+    nodes.reserve(2 * (triangleCount / meshLeafSize + 1));
+
+    std::vector<Vector3> centres(triangleCount);
+    for (unsigned i = 0; i < triangleCount; i++)
+    {
+        const Triangle& triangle = triangles[i];
+        centres[i] = (vertices[triangle.vertex[0]] +
+            vertices[triangle.vertex[1]] +
+            vertices[triangle.vertex[2]]) * ((real)1.0 / 3);
+    }
+    buildNode(centres, 0, triangleCount);
+}
+
+unsigned CollisionTriangleMesh::buildNode(
+    std::vector<Vector3>& centres, unsigned start, unsigned count)
+{
+    unsigned index = (unsigned)nodes.size();
+    nodes.push_back(Node());
+
+    // Find the bounds of the triangles, and of their centres.
+    Node node;
+    Vector3 centreMin = centres[start], centreMax = centres[start];
+    for (unsigned j = 0; j < 3; j++)
+    {
+        node.min[j] = REAL_MAX;
+        node.max[j] = -REAL_MAX;
+    }
+    for (unsigned i = start; i < start + count; i++)
+    {
+        for (unsigned v = 0; v < 3; v++)
+        {
+            const Vector3& vertex = vertices[triangles[i].vertex[v]];
+            for (unsigned j = 0; j < 3; j++)
+            {
+                if (vertex[j] < node.min[j]) node.min[j] = vertex[j];
+                if (vertex[j] > node.max[j]) node.max[j] = vertex[j];
+            }
+        }
+        for (unsigned j = 0; j < 3; j++)
+        {
+            if (centres[i][j] < centreMin[j]) centreMin[j] = centres[i][j];
+            if (centres[i][j] > centreMax[j]) centreMax[j] = centres[i][j];
+        }
+    }
+
+    if (count <= meshLeafSize)
+    {
+        node.index = start;
+        node.count = count;
+        nodes[index] = node;
+        return index;
+    }
+
+    // Split the centres in half along their longest axis.
+    Vector3 extent = centreMax - centreMin;
+    unsigned axis = 0;
+    if (extent.y > extent[axis]) axis = 1;
+    if (extent.z > extent[axis]) axis = 2;
+    real split = (centreMin[axis] + centreMax[axis]) * (real)0.5;
+
+    unsigned middle = start;
+    for (unsigned i = start; i < start + count; i++)
+    {
+        if (centres[i][axis] < split)
+        {
+            std::swap(centres[i], centres[middle]);
+            std::swap(triangles[i], triangles[middle]);
+            middle++;
+        }
+    }
+
+    // If every centre is at the same place, just split the list.
+    if (middle == start || middle == start + count)
+    {
+        middle = start + count / 2;
+    }
+
+    // The first child follows this node, so only the second's index
+    // needs keeping.
+    buildNode(centres, start, middle - start);
+    node.index = buildNode(centres, middle, start + count - middle);
+    node.count = 0;
+    nodes[index] = node;
+    return index;
+}
+
+void CollisionTriangleMesh::findConvexEdges()
+{
+    // Match up the edges of each triangle with those of its
+    // neighbours, by their vertex indices.
+    typedef std::pair<unsigned, unsigned> Edge;
+    std::map<Edge, unsigned> firstUse;
+
+    for (unsigned i = 0; i < triangles.size(); i++)
+    {
+        for (unsigned e = 0; e < 3; e++)
+        {
+            unsigned from = triangles[i].vertex[e];
+            unsigned to = triangles[i].vertex[(e + 1) % 3];
+            Edge edge(from < to ? from : to, from < to ? to : from);
+
+            std::map<Edge, unsigned>::iterator found = firstUse.find(edge);
+            if (found == firstUse.end())
+            {
+                firstUse[edge] = i * 3 + e;
+                continue;
+            }
+
+            // The edge is convex if the other triangle's far vertex
+            // is behind this one.
+            Triangle& other = triangles[found->second / 3];
+            unsigned otherEdge = found->second % 3;
+            const Vector3& opposite =
+                vertices[other.vertex[(otherEdge + 2) % 3]];
+            Vector3 toOpposite = opposite - vertices[from];
+            real height = toOpposite * triangles[i].normal;
+
+            if (height >= -meshConvexTolerance * toOpposite.magnitude())
+            {
+                triangles[i].convexEdges &= ~(1u << e);
+                other.convexEdges &= ~(1u << otherEdge);
+            }
+        }
+    }
+}
+
+void CollisionTriangleMesh::getTriangle(
+    unsigned index, CollisionTriangle* triangle) const
+{
+    const Triangle& stored = triangles[index];
+    for (unsigned i = 0; i < 3; i++)
+    {
+        triangle->vertex[i] = vertices[stored.vertex[i]];
+    }
+    triangle->normal = stored.normal;
+    triangle->convexEdges = stored.convexEdges;
+}
+
+unsigned CollisionTriangleMesh::query(
+    const Vector3& min, const Vector3& max,
+    unsigned* results, unsigned limit, bool* truncated) const
+{
+    if (nodes.empty()) return 0;
+
+    unsigned stack[meshQueryStackSize];
+    unsigned stackSize = 0;
+    unsigned count = 0;
+    stack[stackSize++] = 0;
+
+    while (stackSize > 0)
+    {
+        unsigned index = stack[--stackSize];
+        const Node& node = nodes[index];
+
+        if (node.min[0] > max.x || node.max[0] < min.x ||
+            node.min[1] > max.y || node.max[1] < min.y ||
+            node.min[2] > max.z || node.max[2] < min.z)
+        {
+            continue;
+        }
+
+        if (node.count > 0)
+        {
+            for (unsigned i = node.index; i < node.index + node.count; i++)
+            {
+                if (count == limit)
+                {
+                    if (truncated) *truncated = true;
+                    return count;
+                }
+                results[count++] = i;
+            }
+            continue;
+        }
+
+        if (stackSize + 2 > meshQueryStackSize)
+        {
+            if (truncated) *truncated = true;
+            continue;
+        }
+        stack[stackSize++] = node.index;
+        stack[stackSize++] = index + 1;
+    }
+    return count;
+}
+
+unsigned CollisionDetector::sphereAndTriangle(
+    const Vector3& centre,
+    real radius,
+    RigidBody* body,
+    const CollisionTriangle& triangle,
+    CollisionData* data
+)
+{
+    // Make sure we have contacts
+    if (data->contactsLeft <= 0) return 0;
+
+    // Triangles are one sided, so check the sphere is at least
+    // partly in front, and not clear by more than the margin.
+    real reach = radius + data->getMargin(body, NULL);
+    real height = (centre - triangle.vertex[0]) * triangle.normal;
+    if (height <= -radius || height >= reach) return 0;
+
+    unsigned feature;
+    Vector3 closest = triangle.closestPoint(centre, &feature);
+
+    Vector3 normal;
+    real penetration;
+    if (height < 0)
+    {
+        // The centre is behind, so only push it out if it is over
+        // the face: otherwise it belongs to a neighbour.
+        if (feature != CollisionTriangle::FACE) return 0;
+        normal = triangle.normal;
+        penetration = radius - height;
+        closest = centre - normal * height;
+    }
+    else
+    {
+        Vector3 offset = centre - closest;
+        real distance = offset.magnitude();
+        if (distance >= reach) return 0;
+
+        // Contacts with the inside edges of a smooth surface use the
+        // face normal, so the sphere rolls over them without a bump.
+        if (feature == CollisionTriangle::FACE || distance <= 0 ||
+            triangle.isInternalFeature(feature))
+        {
+            normal = triangle.normal;
+            penetration = radius - height;
+            closest = centre - normal * height;
+        }
+        else
+        {
+            normal = offset * (((real)1.0) / distance);
+            penetration = radius - distance;
+        }
+    }
+
+    Contact* contact = data->contacts;
+    contact->contactNormal = normal;
+    contact->penetration = penetration;
+    contact->contactPoint = closest;
+    contact->setBodyData(body, NULL,
+        data->friction, data->restitution);
+    contact->featureId = feature;
+
+    data->addContacts(1);
+    return 1;
+}
+
+unsigned CollisionDetector::boxAndTriangle(
+    const CollisionBox& box,
+    const CollisionTriangle& triangle,
+    CollisionData* data
+)
+{
+    // Make sure we have contacts
+    if (data->contactsLeft <= 0) return 0;
+
+    Vector3 centre = box.getAxis(3);
+    Vector3 boxAxes[3] = { box.getAxis(0), box.getAxis(1), box.getAxis(2) };
+    Vector3 edges[3] = {
+        triangle.vertex[1] - triangle.vertex[0],
+        triangle.vertex[2] - triangle.vertex[1],
+        triangle.vertex[0] - triangle.vertex[2]
+    };
+
+    // Check the triangle's face first. It is one sided, so the box
+    // must be pushed out of the front.
+    real planeOffset = triangle.normal * triangle.vertex[0];
+    real boxRadius = 0;
+    for (unsigned i = 0; i < 3; i++)
+    {
+        boxRadius += box.halfSize[i] * real_abs(boxAxes[i] * triangle.normal);
+    }
+    real centreHeight = triangle.normal * centre - planeOffset;
+    if (centreHeight <= -boxRadius || centreHeight >= boxRadius) return 0;
+
+    real faceOverlap = boxRadius - centreHeight;
+    real bestOverlap = faceOverlap;
+    Vector3 bestAxis = triangle.normal;
+    unsigned bestEdge = 3;
+
+    // Then the box's axes and the cross products of the edges.
+    for (unsigned i = 0; i < 12; i++)
+    {
+        Vector3 axis;
+        unsigned edge = 3;
+        if (i < 3)
+        {
+            axis = boxAxes[i];
+        }
+        else
+        {
+            edge = (i - 3) % 3;
+            axis = boxAxes[(i - 3) / 3] % edges[edge];
+            real length = axis.magnitude();
+            if (length < (real)0.0001) continue;
+            axis *= ((real)1.0) / length;
+        }
+
+        real radius = 0;
+        for (unsigned j = 0; j < 3; j++)
+        {
+            radius += box.halfSize[j] * real_abs(boxAxes[j] * axis);
+        }
+        real boxCentre = axis * centre;
+
+        real triangleMin = REAL_MAX, triangleMax = -REAL_MAX;
+        for (unsigned j = 0; j < 3; j++)
+        {
+            real projection = axis * triangle.vertex[j];
+            if (projection < triangleMin) triangleMin = projection;
+            if (projection > triangleMax) triangleMax = projection;
+        }
+
+        // Work out the overlap pushing the box each way along the
+        // axis, and keep the smaller.
+        real positive = triangleMax - (boxCentre - radius);
+        real negative = (boxCentre + radius) - triangleMin;
+        if (positive <= 0 || negative <= 0) return 0;
+
+        real overlap = positive < negative ? positive : negative;
+        if (overlap < bestOverlap * (real)0.95)
+        {
+            bestOverlap = overlap;
+            bestAxis = positive < negative ? axis : axis * -1.0f;
+            bestEdge = edge;
+        }
+    }
+
+    // If the face is the axis of least penetration, each corner of
+    // the box over the face and below it is a contact.
+    Contact* contact = data->contacts;
+    unsigned contactsUsed = 0;
+    if (bestEdge == 3 && bestAxis * triangle.normal > 0)
+    {
+        for (unsigned i = 0; i < 8; i++)
+        {
+            Vector3 corner = box.halfSize;
+            if (!(i & 1)) corner.x = -corner.x;
+            if (!(i & 2)) corner.y = -corner.y;
+            if (!(i & 4)) corner.z = -corner.z;
+            corner = box.transform.transform(corner);
+
+            real height = triangle.normal * corner - planeOffset;
+            if (height >= 0) continue;
+
+            // Check the corner is over the face (allowing for corners
+            // exactly over an edge or vertex).
+            unsigned feature;
+            Vector3 onFace = corner - triangle.normal * height;
+            Vector3 closest = triangle.closestPoint(corner, &feature);
+            if (feature != CollisionTriangle::FACE &&
+                (closest - onFace).squareMagnitude() >
+                meshMergeDistance * meshMergeDistance)
+            {
+                continue;
+            }
+
+            contact->contactNormal = triangle.normal;
+            contact->penetration = -height;
+            contact->contactPoint = onFace;
+            contact->setBodyData(box.body, NULL,
+                data->friction, data->restitution);
+            contact->featureId = i;
+
+            contact++;
+            contactsUsed++;
+            if (contactsUsed == (unsigned)data->contactsLeft) break;
+        }
+
+        // A triangle smaller than the box may have no corners over
+        // it, in which case its own vertices under the box are the
+        // contacts.
+        if (contactsUsed == 0)
+        {
+            for (unsigned i = 0; i < 3; i++)
+            {
+                Vector3 local =
+                    box.transform.transformInverse(triangle.vertex[i]);
+                if (real_abs(local.x) > box.halfSize.x ||
+                    real_abs(local.y) > box.halfSize.y ||
+                    real_abs(local.z) > box.halfSize.z)
+                {
+                    continue;
+                }
+
+                // The vertex is as deep as the box reaches past it,
+                // against the normal.
+                Vector3 down = box.transform.transformInverseDirection(
+                    triangle.normal * -1.0f);
+                real depth = faceOverlap;
+                for (unsigned j = 0; j < 3; j++)
+                {
+                    if (real_abs(down[j]) < (real)0.0001) continue;
+                    real side = down[j] > 0 ? box.halfSize[j] : -box.halfSize[j];
+                    real reach = (side - local[j]) / down[j];
+                    if (reach < depth) depth = reach;
+                }
+
+                contact->contactNormal = triangle.normal;
+                contact->penetration = depth;
+                contact->contactPoint = triangle.vertex[i];
+                contact->setBodyData(box.body, NULL,
+                    data->friction, data->restitution);
+                contact->featureId = 9 + i;
+
+                contact++;
+                contactsUsed++;
+                if (contactsUsed == (unsigned)data->contactsLeft) break;
+            }
+        }
+
+        if (contactsUsed > 0)
+        {
+            data->addContacts(contactsUsed);
+            return contactsUsed;
+        }
+    }
+
+    // Otherwise make a single contact along the best axis. An axis
+    // from an edge inside a smooth surface is replaced by the face,
+    // so the box doesn't catch on it.
+    if (bestEdge < 3 && !(triangle.convexEdges & (1u << bestEdge)))
+    {
+        bestAxis = triangle.normal;
+        bestOverlap = faceOverlap;
+    }
+
+    // The contact is on the triangle, nearest the box's deepest
+    // corner.
+    Vector3 deepest = centre;
+    for (unsigned i = 0; i < 3; i++)
+    {
+        real sign = (boxAxes[i] * bestAxis > 0) ? -1.0f : 1.0f;
+        deepest += boxAxes[i] * (box.halfSize[i] * sign);
+    }
+    unsigned feature;
+    contact->contactNormal = bestAxis;
+    contact->penetration = bestOverlap;
+    contact->contactPoint = triangle.closestPoint(deepest, &feature);
+    contact->setBodyData(box.body, NULL,
+        data->friction, data->restitution);
+    contact->featureId = 8;
+
+    data->addContacts(1);
+    return 1;
+}
+
+unsigned CollisionDetector::reduceContacts(CollisionData* data, unsigned count)
+{
+    if (count <= 1) return count;
+    Contact* first = data->contacts - count;
+
+    // Neighbouring triangles give the same contact at their shared
+    // edges and vertices, so merge contacts at the same place,
+    // keeping the deepest.
+    unsigned kept = 0;
+    for (unsigned i = 0; i < count; i++)
+    {
+        bool merged = false;
+        for (unsigned j = 0; j < kept; j++)
+        {
+            Vector3 offset = first[i].contactPoint - first[j].contactPoint;
+            if (offset.squareMagnitude() > meshMergeDistance * meshMergeDistance ||
+                first[i].contactNormal * first[j].contactNormal < meshNormalTolerance)
+            {
+                continue;
+            }
+            if (first[i].penetration > first[j].penetration)
+            {
+                first[j] = first[i];
+            }
+            merged = true;
+            break;
+        }
+        if (!merged)
+        {
+            if (kept != i) first[kept] = first[i];
+            kept++;
+        }
+    }
+
+    // If there are still too many, keep the deepest, then each time
+    // the contact furthest from those already kept. When several are
+    // equally deep (as for something resting flat), the one furthest
+    // out is taken, so the first pick is on the edge of the patch.
+    if (kept > meshMaxContacts)
+    {
+        Vector3 centre;
+        for (unsigned i = 0; i < kept; i++)
+        {
+            centre += first[i].contactPoint;
+        }
+        centre *= ((real)1.0) / kept;
+
+        unsigned deepest = 0;
+        for (unsigned i = 1; i < kept; i++)
+        {
+            real deeper = first[i].penetration - first[deepest].penetration;
+            if (deeper > meshMergeDistance * (real)0.1 ||
+                (deeper > -meshMergeDistance * (real)0.1 &&
+                (first[i].contactPoint - centre).squareMagnitude() >
+                (first[deepest].contactPoint - centre).squareMagnitude()))
+            {
+                deepest = i;
+            }
+        }
+        std::swap(first[0], first[deepest]);
+
+        for (unsigned k = 1; k < meshMaxContacts; k++)
+        {
+            unsigned furthest = k;
+            real furthestDistance = -1;
+            for (unsigned i = k; i < kept; i++)
+            {
+                real nearest = REAL_MAX;
+                for (unsigned j = 0; j < k; j++)
+                {
+                    real distance = (first[i].contactPoint -
+                        first[j].contactPoint).squareMagnitude();
+                    if (distance < nearest) nearest = distance;
+                }
+                if (nearest > furthestDistance)
+                {
+                    furthestDistance = nearest;
+                    furthest = i;
+                }
+            }
+            std::swap(first[k], first[furthest]);
+        }
+        kept = meshMaxContacts;
+    }
+
+    data->removeContacts(count - kept);
+    return kept;
+}
+
+unsigned CollisionDetector::sphereAndTriangleMesh(
+    const CollisionSphere& sphere,
+    const CollisionTriangleMesh& mesh,
+    CollisionData* data
+)
+{
+    // Make sure we have contacts
+    if (data->contactsLeft <= 0) return 0;
+
+    Vector3 centre = sphere.getAxis(3);
+    real reach = sphere.radius + data->getMargin(sphere.body, NULL);
+    Vector3 extent(reach, reach, reach);
+    unsigned found[meshQueryLimit];
+    bool truncated = false;
+    unsigned foundCount = mesh.query(centre - extent, centre + extent,
+        found, meshQueryLimit, &truncated);
+    if (truncated) data->truncatedQueries++;
+
+    unsigned contactsUsed = 0;
+    CollisionTriangle triangle;
+    for (unsigned i = 0; i < foundCount; i++)
+    {
+        mesh.getTriangle(found[i], &triangle);
+        unsigned added = sphereAndTriangle(centre, sphere.radius,
+            sphere.body, triangle, data);
+        tagContacts(data, added, found[i]);
+        contactsUsed += added;
+    }
+    return reduceContacts(data, contactsUsed);
+}
+
+unsigned CollisionDetector::boxAndTriangleMesh(
+    const CollisionBox& box,
+    const CollisionTriangleMesh& mesh,
+    CollisionData* data
+)
+{
+    // Make sure we have contacts
+    if (data->contactsLeft <= 0) return 0;
+
+    // Find the box's bounds in world space.
+    Vector3 centre = box.getAxis(3);
+    Vector3 extent;
+    for (unsigned i = 0; i < 3; i++)
+    {
+        Vector3 axis = box.getAxis(i) * box.halfSize[i];
+        extent.x += real_abs(axis.x);
+        extent.y += real_abs(axis.y);
+        extent.z += real_abs(axis.z);
+    }
+    unsigned found[meshQueryLimit];
+    bool truncated = false;
+    unsigned foundCount = mesh.query(centre - extent, centre + extent,
+        found, meshQueryLimit, &truncated);
+    if (truncated) data->truncatedQueries++;
+
+    unsigned contactsUsed = 0;
+    CollisionTriangle triangle;
+    for (unsigned i = 0; i < foundCount; i++)
+    {
+        mesh.getTriangle(found[i], &triangle);
+        unsigned added = boxAndTriangle(box, triangle, data);
+        tagContacts(data, added, found[i]);
+        contactsUsed += added;
+    }
+    return reduceContacts(data, contactsUsed);
+}
+
+unsigned CollisionDetector::capsuleAndTriangleMesh(
+    const CollisionCapsule& capsule,
+    const CollisionTriangleMesh& mesh,
+    CollisionData* data
+)
+{
+    // Make sure we have contacts
+    if (data->contactsLeft <= 0) return 0;
+
+    // Find the capsule's bounds in world space.
+    Vector3 one = capsule.getEnd(0), two = capsule.getEnd(1);
+    real reach = capsule.radius + data->getMargin(capsule.body, NULL);
+    Vector3 min, max;
+    for (unsigned i = 0; i < 3; i++)
+    {
+        min[i] = (one[i] < two[i] ? one[i] : two[i]) - reach;
+        max[i] = (one[i] < two[i] ? two[i] : one[i]) + reach;
+    }
+    unsigned found[meshQueryLimit];
+    bool truncated = false;
+    unsigned foundCount = mesh.query(min, max, found, meshQueryLimit,
+        &truncated);
+    if (truncated) data->truncatedQueries++;
+
+    unsigned contactsUsed = 0;
+    CollisionTriangle triangle;
+    for (unsigned i = 0; i < foundCount; i++)
+    {
+        mesh.getTriangle(found[i], &triangle);
+        unsigned added = capsuleAndTriangle(capsule, triangle, data);
+        tagContacts(data, added, found[i]);
+        contactsUsed += added;
+    }
+    return reduceContacts(data, contactsUsed);
+}
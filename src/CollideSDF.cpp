@@ -0,0 +1,494 @@
+#include <CollideFine.h>
+#include <map>
+#include <math.h>
+
+using namespace Grics;
+
+/*
+ * This file holds the signed distance field, its baker, and the
+ * collision tests against it. The tests sample the field at points
+ * on the other object, each point giving at most one contact.
+ */
+
+namespace {
+
+    const unsigned brickSize = CollisionSDF::BRICK_SIZE;
+    const unsigned samplesPerBrick = brickSize * brickSize * brickSize;
+
+    // Each brick covers one cell fewer than it has samples, since
+    // neighbouring bricks share their border samples.
+    const unsigned brickCells = brickSize - 1;
+
+    // The number of points sampled along each edge of a box, ends
+    // included, and the most spheres sampled along a capsule.
+    const unsigned sdfBoxEdgePoints = 3;
+    const unsigned sdfCapsuleMaxSpheres = 8;
+
+    // Triangles with less than this squared (doubled) area are
+    // dropped when baking.
+    const real sdfDegenerateArea = (real)1e-12;
+
+    /*
+     * Swaps the winding of the given triangle.
+     */
+    void flipTriangle(std::vector<unsigned>& indices, unsigned triangle)
+    {
+        std::swap(indices[triangle * 3 + 1], indices[triangle * 3 + 2]);
+    }
+
+    /*
+     * Copies the triangles, without those that have no area, and
+     * winds them consistently with their normals pointing out. Each
+     * connected piece is wound to agree with its first triangle, by
+     * walking across shared edges, and then turned inside out if it
+     * encloses a negative volume.
+     */
+    void orientTriangles(const Vector3* vertices, const unsigned* indices,
+        unsigned triangleCount, std::vector<unsigned>& result)
+    {
+        result.clear();
+        for (unsigned i = 0; i < triangleCount; i++)
+        {
+            const Vector3& a = vertices[indices[i * 3]];
+            const Vector3& b = vertices[indices[i * 3 + 1]];
+            const Vector3& c = vertices[indices[i * 3 + 2]];
+            if (((b - a) % (c - a)).squareMagnitude() <= sdfDegenerateArea)
+            {
+                continue;
+            }
+            result.insert(result.end(), indices + i * 3, indices + i * 3 + 3);
+        }
+        unsigned count = (unsigned)result.size() / 3;
+
+        typedef std::pair<unsigned, unsigned> Edge;
+        std::map<Edge, std::vector<unsigned> > edgeTriangles;
+        for (unsigned i = 0; i < count; i++)
+        {
+            for (unsigned e = 0; e < 3; e++)
+            {
+                unsigned from = result[i * 3 + e];
+                unsigned to = result[i * 3 + (e + 1) % 3];
+                edgeTriangles[Edge(from < to ? from : to, from < to ? to : from)]
+                    .push_back(i);
+            }
+        }
+
+        std::vector<bool> visited(count, false);
+        std::vector<unsigned> piece;
+        for (unsigned first = 0; first < count; first++)
+        {
+            if (visited[first]) continue;
+
+            // Walk the piece, winding each neighbour to run the shared
+            // edge the other way.
+            piece.clear();
+            piece.push_back(first);
+            visited[first] = true;
+            for (unsigned next = 0; next < piece.size(); next++)
+            {
+                unsigned triangle = piece[next];
+                for (unsigned e = 0; e < 3; e++)
+                {
+                    unsigned from = result[triangle * 3 + e];
+                    unsigned to = result[triangle * 3 + (e + 1) % 3];
+                    const std::vector<unsigned>& sharing = edgeTriangles[
+                        Edge(from < to ? from : to, from < to ? to : from)];
+
+                    for (unsigned s = 0; s < sharing.size(); s++)
+                    {
+                        unsigned other = sharing[s];
+                        if (visited[other]) continue;
+                        for (unsigned oe = 0; oe < 3; oe++)
+                        {
+                            if (result[other * 3 + oe] == from &&
+                                result[other * 3 + (oe + 1) % 3] == to)
+                            {
+                                flipTriangle(result, other);
+                                break;
+                            }
+                        }
+                        visited[other] = true;
+                        piece.push_back(other);
+                    }
+                }
+            }
+
+            real volume = 0;
+            for (unsigned i = 0; i < piece.size(); i++)
+            {
+                const unsigned* t = &result[piece[i] * 3];
+                volume += vertices[t[0]] *
+                    vertices[t[1]].vectorProduct(vertices[t[2]]);
+            }
+            if (volume < 0)
+            {
+                for (unsigned i = 0; i < piece.size(); i++)
+                {
+                    flipTriangle(result, piece[i]);
+                }
+            }
+        }
+    }
+
+    /*
+     * Finds the signed distance from the point to the nearest of the
+     * given triangles. Where several triangles are equally near, as
+     * at an edge or corner, the sign comes from the one that faces
+     * the point most directly.
+     */
+    real signedDistance(const std::vector<CollisionTriangle>& triangles,
+        const Vector3& point)
+    {
+        real nearest = REAL_MAX;
+        real facing = 0;
+        real sign = 1;
+        for (unsigned i = 0; i < triangles.size(); i++)
+        {
+            unsigned feature;
+            Vector3 offset = point - triangles[i].closestPoint(point, &feature);
+            real distance = offset.squareMagnitude();
+            if (distance > nearest * (real)1.0001 + sdfDegenerateArea) continue;
+
+            real alignment = offset * triangles[i].normal;
+            if (distance > 0) alignment /= real_sqrt(distance);
+
+            if (distance < nearest * (real)0.9999 - sdfDegenerateArea ||
+                real_abs(alignment) > facing)
+            {
+                facing = real_abs(alignment);
+                sign = alignment < 0 ? (real)-1 : (real)1;
+            }
+            if (distance < nearest) nearest = distance;
+        }
+        return sign * real_sqrt(nearest);
+    }
+
+    /*
+     * Fills in the triangles of the mesh that overlap the given box.
+     */
+    void findTriangles(const CollisionTriangleMesh& mesh,
+        const Vector3& centre, real reach,
+        std::vector<unsigned>& found,
+        std::vector<CollisionTriangle>& triangles)
+    {
+        Vector3 extent(reach, reach, reach);
+        unsigned count = mesh.query(centre - extent, centre + extent,
+            &found[0], (unsigned)found.size());
+        triangles.resize(count);
+        for (unsigned i = 0; i < count; i++)
+        {
+            mesh.getTriangle(found[i], &triangles[i]);
+        }
+    }
+}
+
+CollisionSDF::CollisionSDF()
+    :
+    voxelSize(1)
+{
+    bricks[0] = bricks[1] = bricks[2] = 0;
+}
+
+void CollisionSDF::bake(
+    const Vector3* vertices, unsigned vertexCount,
+    const unsigned* indices, unsigned triangleCount,
+    real voxel, real bandWidth)
+{
+    voxelSize = voxel;
+    bricks[0] = bricks[1] = bricks[2] = 0;
+    brickSamples.clear();
+    brickDistance.clear();
+    samples.clear();
+
+    std::vector<unsigned> oriented;
+    orientTriangles(vertices, indices, triangleCount, oriented);
+    unsigned count = (unsigned)oriented.size() / 3;
+    if (count == 0) return;
+
+    CollisionTriangleMesh mesh;
+    mesh.build(vertices, vertexCount, &oriented[0], count);
+
+    // Cover the mesh with a margin of the band and one voxel.
+    Vector3 min = vertices[oriented[0]], max = min;
+    for (unsigned i = 0; i < oriented.size(); i++)
+    {
+        const Vector3& vertex = vertices[oriented[i]];
+        for (unsigned j = 0; j < 3; j++)
+        {
+            if (vertex[j] < min[j]) min[j] = vertex[j];
+            if (vertex[j] > max[j]) max[j] = vertex[j];
+        }
+    }
+    real margin = bandWidth + voxelSize;
+    origin = min - Vector3(margin, margin, margin);
+    real brickWidth = brickCells * voxelSize;
+    for (unsigned j = 0; j < 3; j++)
+    {
+        real width = max[j] - min[j] + 2 * margin;
+        bricks[j] = (unsigned)ceil(width / brickWidth);
+        if (bricks[j] == 0) bricks[j] = 1;
+    }
+
+    unsigned brickCount = bricks[0] * bricks[1] * bricks[2];
+    brickSamples.assign(brickCount, EMPTY_BRICK);
+    brickDistance.assign(brickCount, 0);
+
+    real halfDiagonal = brickWidth * (real)0.5 * real_sqrt((real)3);
+    std::vector<unsigned> found(count);
+    std::vector<CollisionTriangle> triangles;
+
+    unsigned brick = 0;
+    for (unsigned z = 0; z < bricks[2]; z++)
+    for (unsigned y = 0; y < bricks[1]; y++)
+    for (unsigned x = 0; x < bricks[0]; x++, brick++)
+    {
+        Vector3 corner = origin + Vector3((real)x, (real)y, (real)z) * brickWidth;
+        Vector3 centre = corner + Vector3(1, 1, 1) * (brickWidth * (real)0.5);
+
+        // Find the distance at the centre, growing the search until
+        // it is sure to hold the nearest triangle.
+        real reach = 2 * halfDiagonal + bandWidth;
+        real distance;
+        for (;;)
+        {
+            findTriangles(mesh, centre, reach, found, triangles);
+            if (triangles.empty())
+            {
+                reach *= 2;
+                continue;
+            }
+            distance = signedDistance(triangles, centre);
+            if (real_abs(distance) <= reach) break;
+            reach = real_abs(distance);
+        }
+        brickDistance[brick] = distance;
+
+        // Only bricks the surface's band passes through get samples.
+        if (real_abs(distance) > halfDiagonal + bandWidth) continue;
+
+        // Every sample's nearest triangle is within this reach of the
+        // centre.
+        findTriangles(mesh, centre,
+            2 * halfDiagonal + real_abs(distance), found, triangles);
+
+        brickSamples[brick] = (unsigned)samples.size();
+        samples.resize(samples.size() + samplesPerBrick);
+        real* sample = &samples[brickSamples[brick]];
+        for (unsigned k = 0; k < brickSize; k++)
+        for (unsigned j = 0; j < brickSize; j++)
+        for (unsigned i = 0; i < brickSize; i++)
+        {
+            Vector3 point = corner +
+                Vector3((real)i, (real)j, (real)k) * voxelSize;
+            *sample++ = signedDistance(triangles, point);
+        }
+    }
+}
+
+unsigned CollisionSDF::findCell(const Vector3& point,
+    unsigned cell[3], real fraction[3]) const
+{
+    unsigned brick[3];
+    for (unsigned j = 0; j < 3; j++)
+    {
+        unsigned cells = bricks[j] * brickCells;
+        real position = (point[j] - origin[j]) / voxelSize;
+        if (!(position >= 0 && position <= (real)cells)) return EMPTY_BRICK;
+
+        unsigned whole = (unsigned)position;
+        if (whole >= cells) whole = cells - 1;
+        fraction[j] = position - (real)whole;
+        brick[j] = whole / brickCells;
+        cell[j] = whole - brick[j] * brickCells;
+    }
+    return (brick[2] * bricks[1] + brick[1]) * bricks[0] + brick[0];
+}
+
+bool CollisionSDF::sample(const Vector3& point,
+    real* distance, Vector3* normal) const
+{
+    unsigned cell[3];
+    real f[3];
+    unsigned brick = findCell(point, cell, f);
+
+    // Outside the grid, go from the nearest point on it. Everything
+    // out there is outside the geometry.
+    if (brick == EMPTY_BRICK)
+    {
+        if (brickSamples.empty())
+        {
+            *distance = REAL_MAX;
+            return false;
+        }
+        Vector3 inside = point;
+        for (unsigned j = 0; j < 3; j++)
+        {
+            real top = origin[j] + bricks[j] * brickCells * voxelSize;
+            if (inside[j] < origin[j]) inside[j] = origin[j];
+            if (inside[j] > top) inside[j] = top;
+        }
+        bool found = sample(inside, distance, normal);
+        *distance += (point - inside).magnitude();
+        return found;
+    }
+
+    if (brickSamples[brick] == EMPTY_BRICK)
+    {
+        *distance = brickDistance[brick];
+        return false;
+    }
+
+    // Pick out the corners of the cell, and interpolate between them.
+    const real* s = &samples[brickSamples[brick]] +
+        (cell[2] * brickSize + cell[1]) * brickSize + cell[0];
+    const unsigned dy = brickSize, dz = brickSize * brickSize;
+    real c000 = s[0], c100 = s[1];
+    real c010 = s[dy], c110 = s[dy + 1];
+    real c001 = s[dz], c101 = s[dz + 1];
+    real c011 = s[dz + dy], c111 = s[dz + dy + 1];
+
+    real gx = 1 - f[0], gy = 1 - f[1], gz = 1 - f[2];
+    real x00 = c000 * gx + c100 * f[0];
+    real x10 = c010 * gx + c110 * f[0];
+    real x01 = c001 * gx + c101 * f[0];
+    real x11 = c011 * gx + c111 * f[0];
+    real y0 = x00 * gy + x10 * f[1];
+    real y1 = x01 * gy + x11 * f[1];
+    *distance = y0 * gz + y1 * f[2];
+
+    // The gradient of the same interpolation.
+    Vector3 gradient(
+        ((c100 - c000) * gy + (c110 - c010) * f[1]) * gz +
+        ((c101 - c001) * gy + (c111 - c011) * f[1]) * f[2],
+        (x10 - x00) * gz + (x11 - x01) * f[2],
+        y1 - y0);
+    if (gradient.squareMagnitude() <= 0) return false;
+    gradient.normalize();
+    *normal = gradient;
+    return true;
+}
+
+real CollisionSDF::getDistance(const Vector3& point) const
+{
+    real distance;
+    Vector3 normal;
+    sample(point, &distance, &normal);
+    return distance;
+}
+
+unsigned CollisionDetector::sphereAndSDFPoint(
+    const Vector3& centre,
+    real radius,
+    RigidBody* body,
+    const CollisionSDF& sdf,
+    unsigned featureId,
+    CollisionData* data
+)
+{
+    // Make sure we have contacts
+    if (data->contactsLeft <= 0) return 0;
+
+    real distance;
+    Vector3 normal;
+    if (!sdf.sample(centre, &distance, &normal)) return 0;
+    if (distance - radius >= data->getMargin(body, NULL)) return 0;
+
+    // The contact is on the surface, below the centre.
+    Contact* contact = data->contacts;
+    contact->contactNormal = normal;
+    contact->contactPoint = centre - normal * distance;
+    contact->penetration = radius - distance;
+    contact->setBodyData(body, NULL, data->friction, data->restitution);
+    contact->featureId = featureId;
+
+    data->addContacts(1);
+    return 1;
+}
+
+unsigned CollisionDetector::sphereAndSDF(
+    const CollisionSphere& sphere,
+    const CollisionSDF& sdf,
+    CollisionData* data
+)
+{
+    return sphereAndSDFPoint(sphere.getAxis(3), sphere.radius,
+        sphere.body, sdf, 0, data);
+}
+
+unsigned CollisionDetector::boxAndSDF(
+    const CollisionBox& box,
+    const CollisionSDF& sdf,
+    CollisionData* data
+)
+{
+    // Make sure we have contacts
+    if (data->contactsLeft <= 0) return 0;
+
+    // Sample a grid of points over the surface of the box: the
+    // corners, and points along the edges and across the faces.
+    const unsigned last = sdfBoxEdgePoints - 1;
+    unsigned contactsUsed = 0;
+    unsigned point = 0;
+    for (unsigned i = 0; i <= last; i++)
+    for (unsigned j = 0; j <= last; j++)
+    for (unsigned k = 0; k <= last; k++, point++)
+    {
+        // Only points on the surface of the box.
+        if (i != 0 && i != last && j != 0 && j != last &&
+            k != 0 && k != last) continue;
+
+        Vector3 local(
+            box.halfSize.x * ((real)(2 * i) / last - 1),
+            box.halfSize.y * ((real)(2 * j) / last - 1),
+            box.halfSize.z * ((real)(2 * k) / last - 1));
+        contactsUsed += sphereAndSDFPoint(box.getTransform().transform(local),
+            0, box.body, sdf, point + 1, data);
+    }
+    return reduceContacts(data, contactsUsed);
+}
+
+unsigned CollisionDetector::capsuleAndSDF(
+    const CollisionCapsule& capsule,
+    const CollisionSDF& sdf,
+    CollisionData* data
+)
+{
+    // Make sure we have contacts
+    if (data->contactsLeft <= 0) return 0;
+
+    // Space the spheres no further apart than the radius.
+    Vector3 one = capsule.getEnd(0), two = capsule.getEnd(1);
+    unsigned spheres = 2;
+    if (capsule.radius > 0)
+    {
+        spheres += (unsigned)(2 * capsule.halfHeight / capsule.radius);
+    }
+    if (spheres > sdfCapsuleMaxSpheres) spheres = sdfCapsuleMaxSpheres;
+
+    unsigned contactsUsed = 0;
+    for (unsigned i = 0; i < spheres; i++)
+    {
+        real t = (real)i / (spheres - 1);
+        contactsUsed += sphereAndSDFPoint(one + (two - one) * t,
+            capsule.radius, capsule.body, sdf, i + 1, data);
+    }
+    return reduceContacts(data, contactsUsed);
+}
+
+unsigned CollisionDetector::convexAndSDF(
+    const CollisionConvex& convex,
+    const CollisionSDF& sdf,
+    CollisionData* data
+)
+{
+    // Make sure we have contacts
+    if (data->contactsLeft <= 0) return 0;
+
+    unsigned contactsUsed = 0;
+    for (unsigned i = 0; i < convex.vertexCount; i++)
+    {
+        contactsUsed += sphereAndSDFPoint(convex.getVertex(i),
+            0, convex.body, sdf, i + 1, data);
+    }
+    return reduceContacts(data, contactsUsed);
+}
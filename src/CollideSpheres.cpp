@@ -0,0 +1,320 @@
+#include <CollideFine.h>
+
+#ifdef GRICS_SSE
+#include <emmintrin.h>
+#endif
+
+using namespace Grics;
+
+/*
+ * This file holds the packed sphere array and the batch sphere tests.
+ * Each test works on a group of spheres at a time, finding the
+ * contact data for every lane of the group and a mask of the lanes
+ * that touch. The touching lanes are then written out one after
+ * another, so the contact array has no gaps.
+ *
+ * With SSE2 a group is two registers of four lanes. The sums are
+ * done in the same order as the single pair tests, so the contacts
+ * are the same either way.
+ */
+
+namespace {
+
+    const unsigned groupSize = CollisionSphereArray::GROUP_SIZE;
+
+    /*
+     * Holds the results of a test on one group of spheres. The
+     * margin for each lane is filled in before the test.
+     */
+    struct GroupContacts
+    {
+        real margin[groupSize];
+        real normal[3][groupSize];
+        real point[3][groupSize];
+        real penetration[groupSize];
+
+        // Bit i is set if lane i is touching.
+        unsigned touching;
+    };
+
+    /*
+     * Writes the contact for one lane of the group.
+     */
+    inline void writeContact(const GroupContacts& group, unsigned lane,
+        RigidBody* one, RigidBody* two, CollisionData* data)
+    {
+        Contact* contact = data->contacts;
+        contact->contactNormal = Vector3(group.normal[0][lane],
+            group.normal[1][lane], group.normal[2][lane]);
+        contact->contactPoint = Vector3(group.point[0][lane],
+            group.point[1][lane], group.point[2][lane]);
+        contact->penetration = group.penetration[lane];
+        contact->setBodyData(one, two, data->friction, data->restitution);
+        data->addContacts(1);
+    }
+
+#ifdef GRICS_SSE
+    inline __m128 gather(const std::vector<real>& values,
+        const unsigned* indices)
+    {
+        return _mm_setr_ps(values[indices[0]], values[indices[1]],
+            values[indices[2]], values[indices[3]]);
+    }
+
+    inline void store(real* destination, __m128 value)
+    {
+        _mm_storeu_ps(destination, value);
+    }
+#endif
+
+    /*
+     * Tests the pairs of spheres with the given indices, filling
+     * the contact data for each lane.
+     */
+    void sphereAndSphereGroup(const CollisionSphereArray& spheres,
+        const unsigned* one, const unsigned* two, GroupContacts& group)
+    {
+        group.touching = 0;
+
+#ifdef GRICS_SSE
+        const __m128 zero = _mm_setzero_ps();
+        const __m128 unit = _mm_set1_ps(1.0f);
+        const __m128 half = _mm_set1_ps(0.5f);
+
+        for (unsigned lane = 0; lane < groupSize; lane += 4)
+        {
+            __m128 x = gather(spheres.x, one + lane);
+            __m128 y = gather(spheres.y, one + lane);
+            __m128 z = gather(spheres.z, one + lane);
+
+            // Find the vector between the objects
+            __m128 mx = _mm_sub_ps(x, gather(spheres.x, two + lane));
+            __m128 my = _mm_sub_ps(y, gather(spheres.y, two + lane));
+            __m128 mz = _mm_sub_ps(z, gather(spheres.z, two + lane));
+            __m128 size = _mm_sqrt_ps(_mm_add_ps(_mm_add_ps(
+                _mm_mul_ps(mx, mx), _mm_mul_ps(my, my)), _mm_mul_ps(mz, mz)));
+            __m128 reach = _mm_add_ps(gather(spheres.radius, one + lane),
+                gather(spheres.radius, two + lane));
+
+            // See if it is large enough, allowing for the margin.
+            __m128 limit = _mm_add_ps(reach,
+                _mm_loadu_ps(group.margin + lane));
+            __m128 touching = _mm_and_ps(
+                _mm_cmpgt_ps(size, zero), _mm_cmplt_ps(size, limit));
+            group.touching |= _mm_movemask_ps(touching) << lane;
+
+            __m128 scale = _mm_div_ps(unit, size);
+            store(group.normal[0] + lane, _mm_mul_ps(mx, scale));
+            store(group.normal[1] + lane, _mm_mul_ps(my, scale));
+            store(group.normal[2] + lane, _mm_mul_ps(mz, scale));
+            store(group.point[0] + lane, _mm_add_ps(x, _mm_mul_ps(mx, half)));
+            store(group.point[1] + lane, _mm_add_ps(y, _mm_mul_ps(my, half)));
+            store(group.point[2] + lane, _mm_add_ps(z, _mm_mul_ps(mz, half)));
+            store(group.penetration + lane, _mm_sub_ps(reach, size));
+        }
+#else
+        for (unsigned lane = 0; lane < groupSize; lane++)
+        {
+            unsigned a = one[lane];
+            unsigned b = two[lane];
+            Vector3 positionOne(spheres.x[a], spheres.y[a], spheres.z[a]);
+            Vector3 midline = positionOne -
+                Vector3(spheres.x[b], spheres.y[b], spheres.z[b]);
+            real size = midline.magnitude();
+            real reach = spheres.radius[a] + spheres.radius[b];
+
+            if (size <= 0.0f || size >= reach + group.margin[lane]) continue;
+            group.touching |= 1 << lane;
+
+            Vector3 normal = midline * (((real)1.0) / size);
+            Vector3 point = positionOne + midline * (real)0.5;
+            for (unsigned i = 0; i < 3; i++)
+            {
+                group.normal[i][lane] = normal[i];
+                group.point[i][lane] = point[i];
+            }
+            group.penetration[lane] = reach - size;
+        }
+#endif
+    }
+
+    /*
+     * Tests the group of spheres starting at the given index against
+     * the half-space, filling the contact data for each lane.
+     */
+    void sphereAndHalfSpaceGroup(const CollisionSphereArray& spheres,
+        unsigned first, const CollisionPlane& plane, GroupContacts& group)
+    {
+        group.touching = 0;
+
+#ifdef GRICS_SSE
+        const __m128 dx = _mm_set1_ps(plane.direction.x);
+        const __m128 dy = _mm_set1_ps(plane.direction.y);
+        const __m128 dz = _mm_set1_ps(plane.direction.z);
+        const __m128 offset = _mm_set1_ps(plane.offset);
+        const __m128 zero = _mm_setzero_ps();
+
+        for (unsigned lane = 0; lane < groupSize; lane += 4)
+        {
+            __m128 x = _mm_loadu_ps(&spheres.x[first + lane]);
+            __m128 y = _mm_loadu_ps(&spheres.y[first + lane]);
+            __m128 z = _mm_loadu_ps(&spheres.z[first + lane]);
+            __m128 radius = _mm_loadu_ps(&spheres.radius[first + lane]);
+
+            // Find the distance from the plane
+            __m128 distance = _mm_sub_ps(_mm_sub_ps(_mm_add_ps(_mm_add_ps(
+                _mm_mul_ps(dx, x), _mm_mul_ps(dy, y)), _mm_mul_ps(dz, z)),
+                radius), offset);
+            group.touching |= _mm_movemask_ps(_mm_cmplt_ps(distance,
+                _mm_loadu_ps(group.margin + lane))) << lane;
+
+            __m128 depth = _mm_add_ps(distance, radius);
+            store(group.normal[0] + lane, dx);
+            store(group.normal[1] + lane, dy);
+            store(group.normal[2] + lane, dz);
+            store(group.point[0] + lane, _mm_sub_ps(x, _mm_mul_ps(dx, depth)));
+            store(group.point[1] + lane, _mm_sub_ps(y, _mm_mul_ps(dy, depth)));
+            store(group.point[2] + lane, _mm_sub_ps(z, _mm_mul_ps(dz, depth)));
+            store(group.penetration + lane, _mm_sub_ps(zero, distance));
+        }
+#else
+        for (unsigned lane = 0; lane < groupSize; lane++)
+        {
+            unsigned index = first + lane;
+            Vector3 position(spheres.x[index], spheres.y[index],
+                spheres.z[index]);
+            real radius = spheres.radius[index];
+            real ballDistance =
+                plane.direction * position - radius - plane.offset;
+
+            if (ballDistance >= group.margin[lane]) continue;
+            group.touching |= 1 << lane;
+
+            Vector3 point =
+                position - plane.direction * (ballDistance + radius);
+            for (unsigned i = 0; i < 3; i++)
+            {
+                group.normal[i][lane] = plane.direction[i];
+                group.point[i][lane] = point[i];
+            }
+            group.penetration[lane] = -ballDistance;
+        }
+#endif
+    }
+}
+
+unsigned CollisionSphereArray::add(
+    RigidBody* body, const Vector3& centre, real radius)
+{
+    // Grow the arrays a whole group at a time, so the padding is
+    // always there.
+    if (count % groupSize == 0)
+    {
+        size_t size = count + groupSize;
+        x.resize(size, 0);
+        y.resize(size, 0);
+        z.resize(size, 0);
+        CollisionSphereArray::radius.resize(size, 0);
+        CollisionSphereArray::body.resize(size, NULL);
+    }
+
+    unsigned index = count++;
+    setCentre(index, centre);
+    CollisionSphereArray::radius[index] = radius;
+    CollisionSphereArray::body[index] = body;
+    return index;
+}
+
+void CollisionSphereArray::clear()
+{
+    x.clear();
+    y.clear();
+    z.clear();
+    radius.clear();
+    body.clear();
+    count = 0;
+}
+
+unsigned CollisionDetector::sphereAndSphereBatch(
+    const CollisionSphereArray& spheres,
+    const unsigned* pairs,
+    unsigned pairCount,
+    CollisionData* data
+)
+{
+    // Make sure we have contacts
+    if (data->contactsLeft <= 0) return 0;
+    if (pairCount == 0) return 0;
+
+    unsigned contactsUsed = 0;
+    GroupContacts group;
+    unsigned one[groupSize];
+    unsigned two[groupSize];
+
+    for (unsigned first = 0; first < pairCount; first += groupSize)
+    {
+        // Fill the group, repeating the first pair past the end.
+        unsigned lanes = pairCount - first;
+        if (lanes > groupSize) lanes = groupSize;
+        for (unsigned lane = 0; lane < groupSize; lane++)
+        {
+            const unsigned* pair =
+                pairs + (first + (lane < lanes ? lane : 0)) * 2;
+            one[lane] = pair[0];
+            two[lane] = pair[1];
+            group.margin[lane] = data->getMargin(
+                spheres.body[one[lane]], spheres.body[two[lane]]);
+        }
+
+        sphereAndSphereGroup(spheres, one, two, group);
+
+        unsigned touching = group.touching & ((1u << lanes) - 1);
+        for (unsigned lane = 0; touching != 0; lane++, touching >>= 1)
+        {
+            if (!(touching & 1)) continue;
+            if (data->contactsLeft <= 0) return contactsUsed;
+            writeContact(group, lane,
+                spheres.body[one[lane]], spheres.body[two[lane]], data);
+            contactsUsed++;
+        }
+    }
+    return contactsUsed;
+}
+
+unsigned CollisionDetector::sphereAndHalfSpaceBatch(
+    const CollisionSphereArray& spheres,
+    const CollisionPlane& plane,
+    CollisionData* data
+)
+{
+    // Make sure we have contacts
+    if (data->contactsLeft <= 0) return 0;
+
+    unsigned count = spheres.getCount();
+    unsigned contactsUsed = 0;
+    GroupContacts group;
+
+    for (unsigned first = 0; first < count; first += groupSize)
+    {
+        // The arrays are padded, so the last group can be read whole.
+        unsigned lanes = count - first;
+        if (lanes > groupSize) lanes = groupSize;
+        for (unsigned lane = 0; lane < groupSize; lane++)
+        {
+            group.margin[lane] = data->getMargin(
+                spheres.body[first + lane], NULL);
+        }
+
+        sphereAndHalfSpaceGroup(spheres, first, plane, group);
+
+        unsigned touching = group.touching & ((1u << lanes) - 1);
+        for (unsigned lane = 0; touching != 0; lane++, touching >>= 1)
+        {
+            if (!(touching & 1)) continue;
+            if (data->contactsLeft <= 0) return contactsUsed;
+            writeContact(group, lane, spheres.body[first + lane], NULL, data);
+            contactsUsed++;
+        }
+    }
+    return contactsUsed;
+}
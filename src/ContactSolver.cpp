@@ -0,0 +1,1275 @@
+#include "Contacts.h"
+#include "Joints.h"
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <thread>
+
+#ifdef GRICS_SSE
+#include <xmmintrin.h>
+#endif
+
+using namespace Grics;
+
+/*
+ * This file holds the sequential impulse contact solver. The bodies'
+ * velocities are copied into a packed array at the start, so that the
+ * sweeps touch only the solver's own data, and are written back at the
+ * end.
+ */
+
+namespace {
+
+    /*
+     * Closing velocities slower than this don't bounce, just as for
+     * the resolver.
+     */
+    const real restitutionThreshold = (real)0.25;
+
+    /*
+     * The contact coordinate axes, for finding the row directions.
+     */
+    const Vector3 contactAxes[3] = {
+        Vector3(1, 0, 0), Vector3(0, 1, 0), Vector3(0, 0, 1)
+    };
+
+    /*
+     * The most colours the contacts are sorted into. Contacts that
+     * would need more go into one last batch, solved on one thread.
+     */
+    const unsigned colourLimit = 64;
+
+    /*
+     * The number of four contact groups a thread takes at a time
+     * from a batch.
+     */
+    const unsigned chunkGroups = 16;
+
+    /*
+     * Marks a body that is not yet in an island.
+     */
+    const unsigned noIsland = 0xffffffff;
+
+    /*
+     * The clock the time budget is measured with.
+     */
+    typedef std::chrono::steady_clock SolverClock;
+
+    /*
+     * Returns the normal velocity a contact aims for at the given
+     * penetration: part of the penetration pushed out over the
+     * duration, or the given bounce if that is faster.
+     */
+    inline real contactBias(real penetration, real bounce, real duration,
+        real positionCorrection, real penetrationSlop)
+    {
+        // A speculative contact may close as fast as would just take
+        // up the gap, and doesn't bounce.
+        if (penetration < 0) return penetration / duration;
+
+        real depth = penetration - penetrationSlop;
+        real bias = depth > 0 ? positionCorrection * depth / duration : 0;
+        return bounce > bias ? bounce : bias;
+    }
+
+    /*
+     * Finds the body at the root of the island a body is in, and
+     * shortens the path to it on the way.
+     */
+    unsigned findIsland(std::vector<unsigned>& parent, unsigned body)
+    {
+        while (parent[body] != body)
+        {
+            parent[body] = parent[parent[body]];
+            body = parent[body];
+        }
+        return body;
+    }
+
+    /*
+     * Applies an impulse along one row of a contact to its two
+     * solver bodies. Bodies that can't move are left alone, so that
+     * they are only ever read while the batches are being solved.
+     */
+    template <class Body>
+    inline void applyRowImpulse(Body& one, Body& two,
+        const Vector3& direction,
+        const Vector3& rotationOne, const Vector3& rotationTwo,
+        real impulse)
+    {
+        if (one.inverseMass > 0)
+        {
+            one.velocity.addScaledVector(direction, impulse * one.inverseMass);
+            one.rotation.addScaledVector(rotationOne, impulse);
+        }
+        if (two.inverseMass > 0)
+        {
+            two.velocity.addScaledVector(direction, -impulse * two.inverseMass);
+            two.rotation.addScaledVector(rotationTwo, -impulse);
+        }
+    }
+
+    /*
+     * A barrier for the threads solving the batches. The threads
+     * spin (yielding) rather than sleep, since the batches are short.
+     */
+    class SpinBarrier
+    {
+        unsigned count;
+        std::atomic<unsigned> waiting;
+        std::atomic<unsigned> generation;
+
+    public:
+        explicit SpinBarrier(unsigned count)
+            : count(count), waiting(0), generation(0)
+        {
+        }
+
+        /* Waits until every thread has reached the barrier. */
+        void wait()
+        {
+            if (count <= 1) return;
+
+            unsigned current = generation.load();
+            if (waiting.fetch_add(1) + 1 == count)
+            {
+                waiting.store(0);
+                generation.fetch_add(1);
+                return;
+            }
+            while (generation.load() == current)
+            {
+                std::this_thread::yield();
+            }
+        }
+    };
+
+    /*
+     * Reads one lane's vector from a solver block.
+     */
+    inline Vector3 loadRow(const real axes[3][4], unsigned lane)
+    {
+        return Vector3(axes[0][lane], axes[1][lane], axes[2][lane]);
+    }
+
+#ifdef GRICS_SSE
+    /*
+     * Holds four vectors as one register for each component.
+     */
+    struct Vector3x4
+    {
+        __m128 x, y, z;
+
+        /* Loads the four vectors at the given places. */
+        void load(const Vector3& a, const Vector3& b,
+            const Vector3& c, const Vector3& d)
+        {
+            __m128 r0 = _mm_loadu_ps(&a.x);
+            __m128 r1 = _mm_loadu_ps(&b.x);
+            __m128 r2 = _mm_loadu_ps(&c.x);
+            __m128 r3 = _mm_loadu_ps(&d.x);
+            _MM_TRANSPOSE4_PS(r0, r1, r2, r3);
+            x = r0;
+            y = r1;
+            z = r2;
+        }
+
+        /* Loads the four lanes of a vector in a solver block. */
+        void loadRows(const real axes[3][4])
+        {
+            x = _mm_loadu_ps(axes[0]);
+            y = _mm_loadu_ps(axes[1]);
+            z = _mm_loadu_ps(axes[2]);
+        }
+
+        /* Splits the vectors back out, one register each. */
+        void unpack(__m128 out[4]) const
+        {
+            __m128 r0 = x, r1 = y, r2 = z, r3 = _mm_setzero_ps();
+            _MM_TRANSPOSE4_PS(r0, r1, r2, r3);
+            out[0] = r0;
+            out[1] = r1;
+            out[2] = r2;
+            out[3] = r3;
+        }
+
+        __m128 dot(const Vector3x4& other) const
+        {
+            return _mm_add_ps(_mm_add_ps(
+                _mm_mul_ps(x, other.x), _mm_mul_ps(y, other.y)),
+                _mm_mul_ps(z, other.z));
+        }
+
+        void addScaled(const Vector3x4& other, __m128 scale)
+        {
+            x = _mm_add_ps(x, _mm_mul_ps(other.x, scale));
+            y = _mm_add_ps(y, _mm_mul_ps(other.y, scale));
+            z = _mm_add_ps(z, _mm_mul_ps(other.z, scale));
+        }
+    };
+#endif
+}
+
+ContactSolver::ContactSolver(unsigned iterations,
+    real positionCorrection,
+    real penetrationSlop)
+    : substepDuration(0), substepCorrection(0),
+    iterationsUsed(0), residual(0)
+{
+    setIterations(iterations);
+    setPositionCorrection(positionCorrection, penetrationSlop);
+    setResidualEpsilon(0);
+    setTimeBudget(0);
+}
+
+void ContactSolver::setIterations(unsigned iterations)
+{
+    ContactSolver::iterations = iterations;
+}
+
+void ContactSolver::setPositionCorrection(real positionCorrection,
+    real penetrationSlop)
+{
+    ContactSolver::positionCorrection = positionCorrection;
+    ContactSolver::penetrationSlop = penetrationSlop;
+}
+
+void ContactSolver::setResidualEpsilon(real residualEpsilon)
+{
+    ContactSolver::residualEpsilon = residualEpsilon;
+}
+
+void ContactSolver::setTimeBudget(unsigned timeBudget)
+{
+    ContactSolver::timeBudget = timeBudget;
+}
+
+void ContactSolver::solveContacts(Contact* contacts,
+    unsigned numContacts,
+    real duration,
+    Joint* const* joints,
+    unsigned numJoints)
+{
+    // Make sure we have something to do.
+    iterationsUsed = 0;
+    residual = 0;
+    if (numContacts + numJoints == 0 || duration <= 0) return;
+
+    // Prepare the contacts for processing
+    prepareContacts(contacts, numContacts, joints, numJoints, duration);
+    if (constraints.empty() && jointConstraints.empty()) return;
+    buildIslands();
+    bakeRows(duration);
+
+    // Start from the impulses we already have
+    warmStart();
+
+    // Sweep each island in order until it settles or its share of
+    // the budget is gone. Islands share no body that can move, so
+    // this gives the same result as sweeping all the contacts.
+    SolverClock::time_point start = SolverClock::now();
+    SolverClock::duration budget = std::chrono::microseconds(timeBudget);
+    unsigned remaining =
+        (unsigned)(constraints.size() + jointConstraints.size());
+    for (unsigned island = 0; island + 1 < islandStart.size(); island++)
+    {
+        unsigned first = islandStart[island];
+        unsigned last = islandStart[island + 1];
+        unsigned firstJoint = jointIslandStart[island];
+        unsigned lastJoint = jointIslandStart[island + 1];
+        unsigned size = last - first + lastJoint - firstJoint;
+
+        // The island gets its share of the time that is left, so
+        // time saved by earlier islands goes to later ones.
+        SolverClock::time_point deadline = SolverClock::now();
+        if (timeBudget > 0)
+        {
+            SolverClock::duration left = budget - (deadline - start);
+            if (left > SolverClock::duration::zero())
+            {
+                deadline += left * size / remaining;
+            }
+        }
+        remaining -= size;
+
+        // The joints go first, so the contacts see where they leave
+        // the bodies.
+        unsigned sweeps = 0;
+        real islandResidual = 0;
+        while (sweeps < iterations)
+        {
+            islandResidual = solveJoints(jointRowStart[firstJoint],
+                jointRowStart[lastJoint]);
+            real contactResidual = solveVelocities(first, last);
+            if (contactResidual > islandResidual)
+            {
+                islandResidual = contactResidual;
+            }
+            sweeps++;
+
+            if (islandResidual <= residualEpsilon) break;
+            if (timeBudget > 0 && SolverClock::now() >= deadline) break;
+        }
+
+        if (sweeps > iterationsUsed) iterationsUsed = sweeps;
+        if (islandResidual > residual) residual = islandResidual;
+    }
+
+    storeResults();
+}
+
+void ContactSolver::solveContactsParallel(Contact* contacts,
+    unsigned numContacts,
+    real duration,
+    unsigned threadCount,
+    Joint* const* joints,
+    unsigned numJoints)
+{
+    // Make sure we have something to do.
+    iterationsUsed = 0;
+    residual = 0;
+    if (numContacts + numJoints == 0 || duration <= 0) return;
+    if (threadCount == 0) threadCount = 1;
+
+    // Prepare the contacts and sort them into batches
+    prepareContacts(contacts, numContacts, joints, numJoints, duration);
+    if (constraints.empty() && jointConstraints.empty()) return;
+    colourContacts();
+    bakeRows(duration);
+
+    // Start from the impulses we already have
+    warmStart();
+
+    // Each thread sweeps its share of every batch, and waits for the
+    // others before moving on to the next, since the next batch may
+    // use the same bodies. The joint rows aren't coloured, so they
+    // are solved in order on the calling thread before the batches.
+    // The batches aren't islands, so the residual and the time budget
+    // apply to the sweep as a whole.
+    SolverClock::time_point deadline =
+        SolverClock::now() + std::chrono::microseconds(timeBudget);
+    unsigned batches = (unsigned)batchStart.size() - 1;
+    unsigned rows = (unsigned)jointRows.size();
+    threadResiduals.assign(threadCount, 0);
+    bool stop = false;
+    SpinBarrier barrier(threadCount);
+    auto work = [&](unsigned thread)
+    {
+        for (unsigned sweep = 0; sweep < iterations; sweep++)
+        {
+            // Each thread posts the largest change it has made so
+            // far before each barrier, so after the last one thread
+            // zero has them all.
+            real largest = 0;
+            if (rows > 0)
+            {
+                if (thread == 0) largest = solveJoints(0, rows);
+                threadResiduals[thread] = largest;
+                barrier.wait();
+            }
+            for (unsigned batch = 0; batch < batches; batch++)
+            {
+                if (batchStart[batch] == batchStart[batch + 1]) continue;
+                real change = solveBatch(batch, thread, threadCount);
+                if (change > largest) largest = change;
+                threadResiduals[thread] = largest;
+                barrier.wait();
+            }
+
+            // Thread zero decides whether to stop, and the others wait
+            // to hear.
+            if (thread == 0)
+            {
+                residual = 0;
+                for (unsigned i = 0; i < threadCount; i++)
+                {
+                    if (threadResiduals[i] > residual) residual = threadResiduals[i];
+                }
+                iterationsUsed = sweep + 1;
+                stop = residual <= residualEpsilon ||
+                    (timeBudget > 0 && SolverClock::now() >= deadline);
+            }
+            barrier.wait();
+            if (stop) break;
+        }
+    };
+
+    workers.run(threadCount, work);
+
+    storeResults();
+}
+
+void ContactSolver::beginSubsteps(Contact* contacts,
+    unsigned numContacts,
+    real duration,
+    unsigned substeps,
+    Joint* const* joints,
+    unsigned numJoints)
+{
+    // Make sure we have something to do.
+    iterationsUsed = 0;
+    residual = 0;
+    constraints.clear();
+    jointConstraints.clear();
+    jointRows.clear();
+    if (numContacts + numJoints == 0 || duration <= 0) return;
+
+    // Each substep removes the proportion of the penetration that,
+    // over all the substeps, comes to the proportion removed each
+    // frame. Removing the whole proportion every substep pushes the
+    // bodies apart much faster than the other solvers do, and they
+    // fly off.
+    if (substeps == 0) substeps = 1;
+    substepDuration = duration / substeps;
+    substepCorrection = 1 - real_pow(1 - positionCorrection,
+        ((real)1.0) / substeps);
+    duration = substepDuration;
+
+    // The contact rows are worked out once, from where the bodies are
+    // now. Islands and colours aren't needed, since each substep
+    // sweeps all the contacts in order.
+    prepareContacts(contacts, numContacts, joints, numJoints, duration);
+    if (constraints.empty() && jointConstraints.empty()) return;
+    bakeRows(duration);
+
+    // Remember where each contact is on each of its bodies, so its
+    // penetration can be followed as the bodies move.
+    substepAnchors.resize(constraints.size() * 2);
+    substepPenetrations.resize(constraints.size());
+    for (unsigned i = 0; i < constraints.size(); i++)
+    {
+        const Contact& contact = *constraints[i].contact;
+        for (unsigned b = 0; b < 2; b++)
+        {
+            substepAnchors[i * 2 + b] = contact.body[b] ?
+                contact.body[b]->getPointInLocalSpace(contact.contactPoint) :
+                contact.contactPoint;
+        }
+    }
+}
+
+void ContactSolver::solveSubstep()
+{
+    if (constraints.empty() && jointConstraints.empty()) return;
+    real duration = substepDuration;
+
+    // Pick up the velocities the bodies have been integrated to, and
+    // their inertia as they are turned now, for the joints' rows.
+    for (unsigned i = 1; i < bodies.size(); i++)
+    {
+        SolverBody& body = bodies[i];
+        body.velocity = body.body->getVelocity();
+        body.rotation = body.body->getRotation();
+        if (body.body->hasFiniteMass())
+        {
+            body.body->getInverseInertiaTensorWorld(&body.inverseInertiaTensor);
+        }
+    }
+
+    // Each contact keeps its directions, but works out its
+    // penetration again from how far its point on each body has moved
+    // along the normal.
+    for (unsigned i = 0; i < constraints.size(); i++)
+    {
+        SolverBlock& block = blocks[i / 4];
+        unsigned lane = i % 4;
+        const Contact& contact = *constraints[i].contact;
+        Vector3 normal = loadRow(block.direction[0], lane);
+        real separation = 0;
+        for (unsigned b = 0; b < 2; b++) if (contact.body[b])
+        {
+            Vector3 moved = contact.body[b]->getPointInWorldSpace(
+                substepAnchors[i * 2 + b]) - contact.contactPoint;
+            separation += b ? -(moved * normal) : moved * normal;
+        }
+        substepPenetrations[i] = contact.penetration - separation;
+        block.bias[lane] = contactBias(substepPenetrations[i],
+            contactBounces[i], duration, 0, penetrationSlop);
+    }
+
+    // The joints' rows turn with the bodies, so ask the joints for
+    // them again before their impulses are applied along them. They
+    // have no correction yet.
+    storeJointImpulses();
+    bakeJointRows(duration, 0);
+
+    // Each substep needs much the same impulses as the last, so start
+    // from them. The velocity the last substep used to push the
+    // contacts apart and pull the joints together has already moved
+    // the bodies, so a sweep that doesn't correct takes it out again,
+    // before it can build up.
+    warmStart();
+    solveJoints(0, (unsigned)jointRows.size());
+    solveVelocities(0, (unsigned)constraints.size());
+
+    // Then make one sweep that corrects what error is left.
+    for (unsigned i = 0; i < constraints.size(); i++)
+    {
+        blocks[i / 4].bias[i % 4] = contactBias(substepPenetrations[i],
+            contactBounces[i], duration, substepCorrection, penetrationSlop);
+    }
+    storeJointImpulses();
+    bakeJointRows(duration, substepCorrection);
+    residual = solveJoints(0, (unsigned)jointRows.size());
+    real contactResidual = solveVelocities(0, (unsigned)constraints.size());
+    if (contactResidual > residual) residual = contactResidual;
+    iterationsUsed++;
+
+    for (unsigned i = 1; i < bodies.size(); i++)
+    {
+        bodies[i].body->setVelocity(bodies[i].velocity);
+        bodies[i].body->setRotation(bodies[i].rotation);
+    }
+    storeJointImpulses();
+}
+
+void ContactSolver::endSubsteps()
+{
+    if (constraints.empty() && jointConstraints.empty()) return;
+    storeResults();
+}
+
+void ContactSolver::prepareContacts(Contact* contacts,
+    unsigned numContacts,
+    Joint* const* joints,
+    unsigned numJoints,
+    real duration)
+{
+    constraints.clear();
+    jointConstraints.clear();
+    bodyEntries.clear();
+    for (unsigned i = 0; i < numContacts; i++)
+    {
+        Contact& contact = contacts[i];
+        contact.calculateInternals(duration);
+
+        // A contact with a sleeping body wakes it if the other body is
+        // awake. If both are still asleep there is nothing to do.
+        contact.matchAwakeState();
+        if (!contact.body[0]->getAwake()) continue;
+
+        SolverContact constraint;
+        constraint.contact = &contact;
+        constraint.body[0] = constraint.body[1] = 0;
+
+        unsigned index = (unsigned)constraints.size();
+        for (unsigned b = 0; b < 2; b++) if (contact.body[b])
+        {
+            bodyEntries.push_back(std::make_pair(contact.body[b], index * 2 + b));
+        }
+        constraints.push_back(constraint);
+    }
+
+    // Joints wake their bodies in the same way. Their body slots come
+    // after all the contacts'.
+    unsigned contactSlots = (unsigned)constraints.size() * 2;
+    for (unsigned i = 0; i < numJoints; i++)
+    {
+        Joint* joint = joints[i];
+        RigidBody* one = joint->body[0];
+        RigidBody* two = joint->body[1];
+        if (!one->getAwake() && !(two && two->getAwake())) continue;
+        if (!one->getAwake()) one->setAwake();
+        if (two && !two->getAwake()) two->setAwake();
+
+        SolverJoint constraint;
+        constraint.joint = joint;
+        constraint.body[0] = constraint.body[1] = 0;
+
+        unsigned index = (unsigned)jointConstraints.size();
+        for (unsigned b = 0; b < 2; b++) if (joint->body[b])
+        {
+            bodyEntries.push_back(std::make_pair(joint->body[b],
+                contactSlots + index * 2 + b));
+        }
+        jointConstraints.push_back(constraint);
+    }
+    if (constraints.empty() && jointConstraints.empty()) return;
+
+    // Gather each body once, however many contacts it is in. Slot
+    // zero is the scenery, which has no mass properties, so impulses
+    // applied to it have no effect.
+    std::sort(bodyEntries.begin(), bodyEntries.end());
+    bodies.resize(1);
+    bodies[0].body = NULL;
+    bodies[0].velocity.clear();
+    bodies[0].rotation.clear();
+    bodies[0].inverseMass = 0;
+    bodies[0].inverseInertiaTensor = Matrix3();
+    for (unsigned k = 0; k < bodyEntries.size(); k++)
+    {
+        if (k == 0 || bodyEntries[k].first != bodyEntries[k - 1].first)
+        {
+            RigidBody* body = bodyEntries[k].first;
+            SolverBody solverBody;
+            solverBody.body = body;
+            solverBody.velocity = body->getVelocity();
+            solverBody.rotation = body->getRotation();
+            solverBody.inverseMass = body->getInverseMass();
+            body->getInverseInertiaTensorWorld(&solverBody.inverseInertiaTensor);
+            if (!body->hasFiniteMass())
+            {
+                // A body that can't be pushed can't be turned either.
+                solverBody.inverseMass = 0;
+                solverBody.inverseInertiaTensor = Matrix3();
+            }
+            bodies.push_back(solverBody);
+        }
+        unsigned slot = bodyEntries[k].second;
+        unsigned index = (unsigned)bodies.size() - 1;
+        if (slot < contactSlots)
+        {
+            constraints[slot / 2].body[slot % 2] = index;
+        }
+        else
+        {
+            slot -= contactSlots;
+            jointConstraints[slot / 2].body[slot % 2] = index;
+        }
+    }
+}
+
+void ContactSolver::bakeRows(real duration)
+{
+    unsigned count = (unsigned)constraints.size();
+    blocks.resize((count + 3) / 4);
+    contactBounces.resize(count);
+
+    // Work out the rows of each contact, and the velocity it wants.
+    // The last block is filled out with padding.
+    for (unsigned i = 0; i < blocks.size() * 4; i++)
+    {
+        SolverBlock& block = blocks[i / 4];
+        unsigned lane = i % 4;
+        Contact* source = i < count ? constraints[i].contact : NULL;
+        block.contact[lane] = source;
+        for (unsigned b = 0; b < 2; b++)
+        {
+            block.body[b][lane] = source ? constraints[i].body[b] : 0;
+        }
+
+        // Padding has empty rows, so it changes nothing.
+        Vector3 direction[3], angular[2][3], angularChange[2][3];
+        real effectiveMass[3] = { 0, 0, 0 };
+        Vector3 impulse;
+        real bias = 0, bounce = 0, friction = 0;
+        if (source)
+        {
+            const Contact& contact = *source;
+            const SolverBody& one = bodies[block.body[0][lane]];
+            const SolverBody& two = bodies[block.body[1][lane]];
+
+            for (unsigned row = 0; row < 3; row++)
+            {
+                direction[row] =
+                    contact.contactToWorld.transform(contactAxes[row]);
+
+                real inverseMass = 0;
+                for (unsigned b = 0; b < 2; b++) if (contact.body[b])
+                {
+                    const SolverBody& body = b ? two : one;
+                    angular[b][row] = contact.relativeContactPosition[b].
+                        vectorProduct(direction[row]);
+                    angularChange[b][row] =
+                        body.inverseInertiaTensor.transform(angular[b][row]);
+                    inverseMass += body.inverseMass +
+                        angular[b][row] * angularChange[b][row];
+                }
+                effectiveMass[row] =
+                    inverseMass > 0 ? ((real)1.0) / inverseMass : 0;
+            }
+            impulse = contact.accumulatedImpulse;
+            friction = contact.friction;
+
+            // The normal velocity the bodies have coming into the
+            // contact, positive if they are separating.
+            real normalVelocity =
+                direction[0] * one.velocity +
+                angular[0][0] * one.rotation -
+                direction[0] * two.velocity -
+                angular[1][0] * two.rotation;
+
+            // Push out part of the penetration, or bounce if that is
+            // faster.
+            if (-normalVelocity > restitutionThreshold)
+            {
+                bounce = -contact.restitution * normalVelocity;
+            }
+            bias = contactBias(contact.penetration, bounce, duration,
+                positionCorrection, penetrationSlop);
+            contactBounces[i] = bounce;
+        }
+
+        // Spread the values out into their lanes.
+        for (unsigned row = 0; row < 3; row++)
+        {
+            for (unsigned axis = 0; axis < 3; axis++)
+            {
+                block.direction[row][axis][lane] = direction[row][axis];
+                for (unsigned b = 0; b < 2; b++)
+                {
+                    block.angular[b][row][axis][lane] = angular[b][row][axis];
+                    block.angularChange[b][row][axis][lane] =
+                        angularChange[b][row][axis];
+                }
+            }
+            block.effectiveMass[row][lane] = effectiveMass[row];
+            block.impulse[row][lane] = impulse[row];
+        }
+        block.bias[lane] = bias;
+        block.friction[lane] = friction;
+    }
+
+    bakeJointRows(duration, positionCorrection);
+}
+
+void ContactSolver::bakeJointRows(real duration, real correction)
+{
+    // Ask each joint for its rows. The joint's impulses are cleared
+    // once read, so a row that isn't used this frame (a limit that
+    // isn't reached, say) starts again from nothing.
+    jointRows.clear();
+    jointRowStart.resize(jointConstraints.size() + 1);
+    jointRowStart[0] = 0;
+    for (unsigned j = 0; j < jointConstraints.size(); j++)
+    {
+        const SolverJoint& constraint = jointConstraints[j];
+        Joint* joint = constraint.joint;
+        JointRow rows[Joint::MAX_ROWS];
+        unsigned count = joint->calculateRows(rows, duration, correction);
+        for (unsigned r = 0; r < count; r++)
+        {
+            SolverJointRow row;
+            row.joint = joint;
+            row.slot = rows[r].slot;
+            real inverseMass = 0;
+            for (unsigned b = 0; b < 2; b++)
+            {
+                const SolverBody& body = bodies[constraint.body[b]];
+                row.body[b] = constraint.body[b];
+                row.angular[b] = rows[r].angular[b];
+                row.angularChange[b] =
+                    body.inverseInertiaTensor.transform(row.angular[b]);
+                inverseMass += body.inverseMass *
+                    (rows[r].linear * rows[r].linear) +
+                    row.angular[b] * row.angularChange[b];
+            }
+            row.linear = rows[r].linear;
+            row.effectiveMass =
+                inverseMass > 0 ? ((real)1.0) / inverseMass : 0;
+            row.bias = rows[r].bias;
+            row.lower = rows[r].lower;
+            row.upper = rows[r].upper;
+            row.impulse = joint->impulse[row.slot];
+            if (row.impulse < row.lower) row.impulse = row.lower;
+            if (row.impulse > row.upper) row.impulse = row.upper;
+            jointRows.push_back(row);
+        }
+        for (unsigned r = 0; r < Joint::MAX_ROWS; r++) joint->impulse[r] = 0;
+        jointRowStart[j + 1] = (unsigned)jointRows.size();
+    }
+}
+
+void ContactSolver::warmStart()
+{
+    for (unsigned i = 0; i < constraints.size(); i++)
+    {
+        SolverBlock& block = blocks[i / 4];
+        unsigned lane = i % 4;
+        SolverBody& one = bodies[block.body[0][lane]];
+        SolverBody& two = bodies[block.body[1][lane]];
+
+        for (unsigned row = 0; row < 3; row++)
+        {
+            real impulse = block.impulse[row][lane];
+            if (impulse == 0) continue;
+
+            applyRowImpulse(one, two, loadRow(block.direction[row], lane),
+                loadRow(block.angularChange[0][row], lane),
+                loadRow(block.angularChange[1][row], lane), impulse);
+        }
+    }
+
+    for (unsigned i = 0; i < jointRows.size(); i++)
+    {
+        const SolverJointRow& row = jointRows[i];
+        if (row.impulse == 0) continue;
+        applyRowImpulse(bodies[row.body[0]], bodies[row.body[1]],
+            row.linear, row.angularChange[0], row.angularChange[1],
+            row.impulse);
+    }
+}
+
+void ContactSolver::buildIslands()
+{
+    // Join the bodies that can move through each contact and joint.
+    islandParent.resize(bodies.size());
+    for (unsigned i = 0; i < bodies.size(); i++) islandParent[i] = i;
+    auto join = [&](const unsigned body[2])
+    {
+        unsigned one = body[0];
+        unsigned two = body[1];
+        if (bodies[one].inverseMass <= 0 || bodies[two].inverseMass <= 0)
+        {
+            return;
+        }
+        one = findIsland(islandParent, one);
+        two = findIsland(islandParent, two);
+        if (one != two) islandParent[std::max(one, two)] = std::min(one, two);
+    };
+    for (unsigned i = 0; i < constraints.size(); i++)
+    {
+        join(constraints[i].body);
+    }
+    for (unsigned i = 0; i < jointConstraints.size(); i++)
+    {
+        join(jointConstraints[i].body);
+    }
+
+    // Number the islands in the order their first joint comes, then
+    // their first contact, so islands of joints alone are numbered
+    // too. Anything with nothing that can move goes with the scenery.
+    islandIndex.assign(bodies.size(), noIsland);
+    islandStart.assign(1, 0);
+    jointIslandStart.assign(1, 0);
+    auto islandOf = [&](const unsigned body[2])
+    {
+        unsigned slot = body[0];
+        if (bodies[slot].inverseMass <= 0) slot = body[1];
+        if (bodies[slot].inverseMass <= 0) slot = 0;
+        unsigned root = findIsland(islandParent, slot);
+        if (islandIndex[root] == noIsland)
+        {
+            islandIndex[root] = (unsigned)islandStart.size() - 1;
+            islandStart.push_back(0);
+            jointIslandStart.push_back(0);
+        }
+        return islandIndex[root];
+    };
+    jointIslands.resize(jointConstraints.size());
+    for (unsigned i = 0; i < jointConstraints.size(); i++)
+    {
+        jointIslands[i] = islandOf(jointConstraints[i].body);
+        jointIslandStart[jointIslands[i] + 1]++;
+    }
+    contactIslands.resize(constraints.size());
+    for (unsigned i = 0; i < constraints.size(); i++)
+    {
+        contactIslands[i] = islandOf(constraints[i].body);
+        islandStart[contactIslands[i] + 1]++;
+    }
+
+    // Sort the contacts and joints by island, keeping their order.
+    for (unsigned island = 1; island < islandStart.size(); island++)
+    {
+        islandStart[island] += islandStart[island - 1];
+        jointIslandStart[island] += jointIslandStart[island - 1];
+    }
+    batchedConstraints.resize(constraints.size());
+    std::vector<unsigned> next(islandStart.begin(), islandStart.end() - 1);
+    for (unsigned i = 0; i < constraints.size(); i++)
+    {
+        batchedConstraints[next[contactIslands[i]]++] = constraints[i];
+    }
+    constraints.swap(batchedConstraints);
+
+    sortedJoints.resize(jointConstraints.size());
+    next.assign(jointIslandStart.begin(), jointIslandStart.end() - 1);
+    for (unsigned i = 0; i < jointConstraints.size(); i++)
+    {
+        sortedJoints[next[jointIslands[i]]++] = jointConstraints[i];
+    }
+    jointConstraints.swap(sortedJoints);
+}
+
+real ContactSolver::solveVelocities(unsigned start, unsigned end)
+{
+    real largest = 0;
+    for (unsigned i = start; i < end; i++)
+    {
+        real change = solveContact(i);
+        if (change > largest) largest = change;
+    }
+    return largest;
+}
+
+real ContactSolver::solveContact(unsigned index)
+{
+    SolverBlock& block = blocks[index / 4];
+    unsigned lane = index % 4;
+    SolverBody& one = bodies[block.body[0][lane]];
+    SolverBody& two = bodies[block.body[1][lane]];
+
+    // Find the change in impulse each friction row needs to stop
+    // the sliding.
+    real change[3];
+    for (unsigned row = 1; row < 3; row++)
+    {
+        real velocity =
+            loadRow(block.direction[row], lane) * one.velocity +
+            loadRow(block.angular[0][row], lane) * one.rotation -
+            loadRow(block.direction[row], lane) * two.velocity -
+            loadRow(block.angular[1][row], lane) * two.rotation;
+        change[row] = -velocity * block.effectiveMass[row][lane];
+    }
+
+    // Friction goes first, limited by the normal impulse we
+    // already have, since staying apart matters more than
+    // sliding.
+    Vector3 previous = loadRow(block.impulse, lane);
+    real maxFriction = block.friction[lane] * previous.x;
+    real frictionY = previous.y + change[1];
+    real frictionZ = previous.z + change[2];
+    real planar = real_sqrt(frictionY * frictionY + frictionZ * frictionZ);
+    if (planar > maxFriction)
+    {
+        real scale = planar > 0 ? maxFriction / planar : 0;
+        frictionY *= scale;
+        frictionZ *= scale;
+    }
+    block.impulse[1][lane] = frictionY;
+    block.impulse[2][lane] = frictionZ;
+
+    real largest = 0;
+    for (unsigned row = 1; row < 3; row++)
+    {
+        real delta = block.impulse[row][lane] - previous[row];
+        if (delta == 0) continue;
+
+        applyRowImpulse(one, two, loadRow(block.direction[row], lane),
+            loadRow(block.angularChange[0][row], lane),
+            loadRow(block.angularChange[1][row], lane), delta);
+
+        real velocityChange = real_abs(delta) / block.effectiveMass[row][lane];
+        if (velocityChange > largest) largest = velocityChange;
+    }
+
+    // Then the normal, whose velocity the friction may have
+    // changed. Its total impulse can only push.
+    real velocity =
+        loadRow(block.direction[0], lane) * one.velocity +
+        loadRow(block.angular[0][0], lane) * one.rotation -
+        loadRow(block.direction[0], lane) * two.velocity -
+        loadRow(block.angular[1][0], lane) * two.rotation;
+    real normal = previous.x +
+        (block.bias[lane] - velocity) * block.effectiveMass[0][lane];
+    if (normal < 0) normal = 0;
+    block.impulse[0][lane] = normal;
+
+    real delta = normal - previous.x;
+    if (delta == 0) return largest;
+
+    applyRowImpulse(one, two, loadRow(block.direction[0], lane),
+        loadRow(block.angularChange[0][0], lane),
+        loadRow(block.angularChange[1][0], lane), delta);
+
+    real velocityChange = real_abs(delta) / block.effectiveMass[0][lane];
+    return velocityChange > largest ? velocityChange : largest;
+}
+
+real ContactSolver::solveJoints(unsigned start, unsigned end)
+{
+    real largest = 0;
+    for (unsigned i = start; i < end; i++)
+    {
+        SolverJointRow& row = jointRows[i];
+        SolverBody& one = bodies[row.body[0]];
+        SolverBody& two = bodies[row.body[1]];
+
+        // Move the total impulse toward the one that gives the
+        // velocity the row wants, within its bounds.
+        real velocity =
+            row.linear * one.velocity + row.angular[0] * one.rotation -
+            row.linear * two.velocity - row.angular[1] * two.rotation;
+        real previous = row.impulse;
+        real impulse = previous + (row.bias - velocity) * row.effectiveMass;
+        if (impulse < row.lower) impulse = row.lower;
+        if (impulse > row.upper) impulse = row.upper;
+        row.impulse = impulse;
+
+        real delta = impulse - previous;
+        if (delta == 0) continue;
+        applyRowImpulse(one, two, row.linear,
+            row.angularChange[0], row.angularChange[1], delta);
+        real velocityChange = real_abs(delta) / row.effectiveMass;
+        if (velocityChange > largest) largest = velocityChange;
+    }
+    return largest;
+}
+
+real ContactSolver::solveGroup(unsigned first)
+{
+#ifdef GRICS_SSE
+    SolverBlock& block = blocks[first / 4];
+    SolverBody* one[4];
+    SolverBody* two[4];
+    for (unsigned lane = 0; lane < 4; lane++)
+    {
+        one[lane] = &bodies[block.body[0][lane]];
+        two[lane] = &bodies[block.body[1][lane]];
+    }
+
+    // Gather the bodies, one lane each. The rows are already laid
+    // out a lane to a contact.
+    Vector3x4 velocityOne, rotationOne, velocityTwo, rotationTwo;
+    velocityOne.load(one[0]->velocity, one[1]->velocity,
+        one[2]->velocity, one[3]->velocity);
+    rotationOne.load(one[0]->rotation, one[1]->rotation,
+        one[2]->rotation, one[3]->rotation);
+    velocityTwo.load(two[0]->velocity, two[1]->velocity,
+        two[2]->velocity, two[3]->velocity);
+    rotationTwo.load(two[0]->rotation, two[1]->rotation,
+        two[2]->rotation, two[3]->rotation);
+    __m128 inverseMassOne = _mm_setr_ps(one[0]->inverseMass,
+        one[1]->inverseMass, one[2]->inverseMass, one[3]->inverseMass);
+    __m128 inverseMassTwo = _mm_setr_ps(two[0]->inverseMass,
+        two[1]->inverseMass, two[2]->inverseMass, two[3]->inverseMass);
+
+    Vector3x4 direction[3], angular[2][3], angularChange[2][3];
+    __m128 effectiveMass[3];
+    for (unsigned row = 0; row < 3; row++)
+    {
+        direction[row].loadRows(block.direction[row]);
+        for (unsigned b = 0; b < 2; b++)
+        {
+            angular[b][row].loadRows(block.angular[b][row]);
+            angularChange[b][row].loadRows(block.angularChange[b][row]);
+        }
+        effectiveMass[row] = _mm_loadu_ps(block.effectiveMass[row]);
+    }
+    __m128 bias = _mm_loadu_ps(block.bias);
+    __m128 friction = _mm_loadu_ps(block.friction);
+
+    Vector3x4 previous;
+    previous.loadRows(block.impulse);
+
+    // Friction goes first, clamped to the circle the normal impulse
+    // allows, as in solveContact.
+    __m128 impulse[3] = { previous.x, previous.y, previous.z };
+    for (unsigned row = 1; row < 3; row++)
+    {
+        __m128 velocity = _mm_sub_ps(
+            _mm_add_ps(direction[row].dot(velocityOne),
+                angular[0][row].dot(rotationOne)),
+            _mm_add_ps(direction[row].dot(velocityTwo),
+                angular[1][row].dot(rotationTwo)));
+        impulse[row] = _mm_sub_ps(impulse[row],
+            _mm_mul_ps(velocity, effectiveMass[row]));
+    }
+    __m128 maxFriction = _mm_mul_ps(friction, previous.x);
+    __m128 planar = _mm_sqrt_ps(_mm_add_ps(
+        _mm_mul_ps(impulse[1], impulse[1]),
+        _mm_mul_ps(impulse[2], impulse[2])));
+    __m128 clamp = _mm_cmpgt_ps(planar, maxFriction);
+    __m128 scale = _mm_or_ps(
+        _mm_and_ps(clamp, _mm_div_ps(maxFriction, planar)),
+        _mm_andnot_ps(clamp, _mm_set1_ps(1.0f)));
+    impulse[1] = _mm_mul_ps(impulse[1], scale);
+    impulse[2] = _mm_mul_ps(impulse[2], scale);
+
+    for (unsigned row = 1; row < 3; row++)
+    {
+        __m128 delta = _mm_sub_ps(impulse[row],
+            row == 1 ? previous.y : previous.z);
+        velocityOne.addScaled(direction[row], _mm_mul_ps(delta, inverseMassOne));
+        rotationOne.addScaled(angularChange[0][row], delta);
+        delta = _mm_sub_ps(_mm_setzero_ps(), delta);
+        velocityTwo.addScaled(direction[row], _mm_mul_ps(delta, inverseMassTwo));
+        rotationTwo.addScaled(angularChange[1][row], delta);
+    }
+
+    // Then the normal, which can only push.
+    __m128 velocity = _mm_sub_ps(
+        _mm_add_ps(direction[0].dot(velocityOne),
+            angular[0][0].dot(rotationOne)),
+        _mm_add_ps(direction[0].dot(velocityTwo),
+            angular[1][0].dot(rotationTwo)));
+    impulse[0] = _mm_max_ps(_mm_setzero_ps(), _mm_add_ps(previous.x,
+        _mm_mul_ps(_mm_sub_ps(bias, velocity), effectiveMass[0])));
+
+    __m128 delta = _mm_sub_ps(impulse[0], previous.x);
+    velocityOne.addScaled(direction[0], _mm_mul_ps(delta, inverseMassOne));
+    rotationOne.addScaled(angularChange[0][0], delta);
+    delta = _mm_sub_ps(_mm_setzero_ps(), delta);
+    velocityTwo.addScaled(direction[0], _mm_mul_ps(delta, inverseMassTwo));
+    rotationTwo.addScaled(angularChange[1][0], delta);
+
+    // Find the largest change in velocity along any row, as
+    // solveContact does. Padding has no effective mass, and is left
+    // out rather than divided by zero.
+    __m128 before[3] = { previous.x, previous.y, previous.z };
+    __m128 sign = _mm_set1_ps(-0.0f);
+    __m128 largest = _mm_setzero_ps();
+    for (unsigned row = 0; row < 3; row++)
+    {
+        __m128 change = _mm_div_ps(
+            _mm_andnot_ps(sign, _mm_sub_ps(impulse[row], before[row])),
+            effectiveMass[row]);
+        change = _mm_and_ps(change,
+            _mm_cmpgt_ps(effectiveMass[row], _mm_setzero_ps()));
+        largest = _mm_max_ps(largest, change);
+    }
+    largest = _mm_max_ps(largest,
+        _mm_shuffle_ps(largest, largest, _MM_SHUFFLE(1, 0, 3, 2)));
+    largest = _mm_max_ps(largest,
+        _mm_shuffle_ps(largest, largest, _MM_SHUFFLE(2, 3, 0, 1)));
+
+    // Store the results. Bodies that can't move are shared between
+    // lanes and threads, so they are never written.
+    for (unsigned row = 0; row < 3; row++)
+    {
+        _mm_storeu_ps(block.impulse[row], impulse[row]);
+    }
+    __m128 out[4][4];
+    velocityOne.unpack(out[0]);
+    rotationOne.unpack(out[1]);
+    velocityTwo.unpack(out[2]);
+    rotationTwo.unpack(out[3]);
+    for (unsigned lane = 0; lane < 4; lane++)
+    {
+        if (one[lane]->inverseMass > 0)
+        {
+            _mm_storeu_ps(&one[lane]->velocity.x, out[0][lane]);
+            _mm_storeu_ps(&one[lane]->rotation.x, out[1][lane]);
+        }
+        if (two[lane]->inverseMass > 0)
+        {
+            _mm_storeu_ps(&two[lane]->velocity.x, out[2][lane]);
+            _mm_storeu_ps(&two[lane]->rotation.x, out[3][lane]);
+        }
+    }
+    return _mm_cvtss_f32(largest);
+#else
+    real largest = 0;
+    for (unsigned lane = 0; lane < 4; lane++)
+    {
+        real change = solveContact(first + lane);
+        if (change > largest) largest = change;
+    }
+    return largest;
+#endif
+}
+
+void ContactSolver::colourContacts()
+{
+    // Give each contact the lowest colour none of its moving bodies
+    // has yet, so the colours used are always the lowest ones.
+    bodyColours.assign(bodies.size(), 0);
+    contactColours.resize(constraints.size());
+    unsigned colours = 0;
+    for (unsigned i = 0; i < constraints.size(); i++)
+    {
+        const SolverContact& constraint = constraints[i];
+        unsigned long long used = 0;
+        for (unsigned b = 0; b < 2; b++)
+        {
+            unsigned slot = constraint.body[b];
+            if (bodies[slot].inverseMass > 0) used |= bodyColours[slot];
+        }
+
+        unsigned colour = 0;
+        while (colour < colourLimit && (used & (1ULL << colour))) colour++;
+        contactColours[i] = colour;
+        if (colour == colourLimit) continue;
+
+        if (colour + 1 > colours) colours = colour + 1;
+        for (unsigned b = 0; b < 2; b++)
+        {
+            unsigned slot = constraint.body[b];
+            if (bodies[slot].inverseMass > 0) bodyColours[slot] |= 1ULL << colour;
+        }
+    }
+
+    // Sort the contacts by colour, keeping their order within each
+    // batch. Any that couldn't be coloured go in a last batch. Each
+    // batch is padded out to a whole number of groups with contacts
+    // between the scenery and itself, which change nothing.
+    batchStart.assign(colours + 2, 0);
+    for (unsigned i = 0; i < constraints.size(); i++)
+    {
+        unsigned colour = contactColours[i];
+        if (colour == colourLimit) colour = colours;
+        batchStart[colour + 1]++;
+    }
+    for (unsigned batch = 0; batch <= colours; batch++)
+    {
+        batchStart[batch + 1] = batchStart[batch] +
+            (batchStart[batch + 1] + 3) / 4 * 4;
+    }
+
+    SolverContact padding;
+    padding.contact = NULL;
+    padding.body[0] = padding.body[1] = 0;
+    batchedConstraints.assign(batchStart.back(), padding);
+
+    std::vector<unsigned> next(batchStart.begin(), batchStart.end() - 1);
+    for (unsigned i = 0; i < constraints.size(); i++)
+    {
+        unsigned colour = contactColours[i];
+        if (colour == colourLimit) colour = colours;
+        batchedConstraints[next[colour]++] = constraints[i];
+    }
+    constraints.swap(batchedConstraints);
+}
+
+real ContactSolver::solveBatch(unsigned batch, unsigned thread,
+    unsigned threadCount)
+{
+    unsigned start = batchStart[batch];
+    unsigned end = batchStart[batch + 1];
+
+    // The last batch may have contacts sharing bodies, so it is
+    // solved in order on one thread.
+    if (batch + 2 == batchStart.size())
+    {
+        if (thread != 0) return 0;
+        return solveVelocities(start, end);
+    }
+
+    // Deal out the groups of four in fixed chunks, so which thread
+    // solves a contact doesn't change the result.
+    unsigned groups = (end - start) / 4;
+    unsigned chunks = (groups + chunkGroups - 1) / chunkGroups;
+    real largest = 0;
+    for (unsigned chunk = thread; chunk < chunks; chunk += threadCount)
+    {
+        unsigned first = chunk * chunkGroups;
+        unsigned last = std::min(first + chunkGroups, groups);
+        for (unsigned g = first; g < last; g++)
+        {
+            real change = solveGroup(start + g * 4);
+            if (change > largest) largest = change;
+        }
+    }
+    return largest;
+}
+
+void ContactSolver::storeResults()
+{
+    // Slot zero is the scenery, which has no body.
+    for (unsigned i = 1; i < bodies.size(); i++)
+    {
+        bodies[i].body->setVelocity(bodies[i].velocity);
+        bodies[i].body->setRotation(bodies[i].rotation);
+    }
+
+    // Keep the impulses, for the contact cache. Padding has no
+    // contact.
+    for (unsigned i = 0; i < constraints.size(); i++)
+    {
+        SolverBlock& block = blocks[i / 4];
+        unsigned lane = i % 4;
+        if (!block.contact[lane]) continue;
+        block.contact[lane]->accumulatedImpulse = loadRow(block.impulse, lane);
+    }
+
+    storeJointImpulses();
+}
+
+void ContactSolver::storeJointImpulses()
+{
+    for (unsigned i = 0; i < jointRows.size(); i++)
+    {
+        jointRows[i].joint->impulse[jointRows[i].slot] = jointRows[i].impulse;
+    }
+}
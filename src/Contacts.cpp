@@ -1,6 +1,8 @@
 #include "Contacts.h"
 #include "memory"
 #include "assert.h"
+#include <algorithm>
+#include <functional>
 
 using namespace Grics;
 
@@ -13,6 +15,8 @@ void Contact::setBodyData(RigidBody* one, RigidBody* two,
     Contact::body[1] = two;
     Contact::friction = friction;
     Contact::restitution = restitution;
+    featureId = NO_FEATURE;
+    accumulatedImpulse.clear();
 }
 
 void Contact::matchAwakeState()
@@ -137,6 +141,15 @@ void Contact::calculateDesiredDeltaVelocity(real duration)
 {
     const static real velocityLimit = (real)0.25f;
 
+    // A speculative contact isn't touching yet, so the bodies may
+    // close as fast as would just take up the gap this frame, and
+    // they don't bounce.
+    if (penetration < 0)
+    {
+        desiredDeltaVelocity = -contactVelocity.x + penetration / duration;
+        return;
+    }
+
     // Calculate the acceleration induced velocity accumulated this frame
     real velocityFromAcc = 0;
 
@@ -205,9 +218,10 @@ void Contact::applyVelocityChange(Vector3 velocityChange[2],
     // We will calculate the impulse for each contact axis
     Vector3 impulseContact;
 
-    if (friction == (real)0.0)
+    if (friction == (real)0.0 || penetration < 0)
     {
-        // Use the short format for frictionless contacts
+        // Use the short format for frictionless contacts, and for
+        // speculative ones, which have no grip until they touch.
         impulseContact = calculateFrictionlessImpulse(inverseInertiaTensor);
     }
     else
@@ -217,6 +231,9 @@ void Contact::applyVelocityChange(Vector3 velocityChange[2],
         impulseContact = calculateFrictionImpulse(inverseInertiaTensor);
     }
 
+    // Keep track of the total, for warm starting the next frame.
+    accumulatedImpulse += impulseContact;
+
     // Convert impulse to world coordinates
     Vector3 impulse = contactToWorld.transform(impulseContact);
 
@@ -244,6 +261,55 @@ void Contact::applyVelocityChange(Vector3 velocityChange[2],
     }
 }
 
+void Contact::applyWarmStartImpulse()
+{
+    Matrix3 inverseInertiaTensor[2];
+    body[0]->getInverseInertiaTensorWorld(&inverseInertiaTensor[0]);
+    if (body[1])
+        body[1]->getInverseInertiaTensorWorld(&inverseInertiaTensor[1]);
+
+    // The resolver can only ever push, so we never push harder than
+    // is needed to bring the contact to rest. A contact that was
+    // separating would otherwise be launched by last frame's impulse.
+    Vector3 impulseContact = accumulatedImpulse;
+    real restingImpulse =
+        calculateFrictionlessImpulse(inverseInertiaTensor).x;
+    if (impulseContact.x > restingImpulse) impulseContact.x = restingImpulse;
+    if (impulseContact.x <= 0)
+    {
+        accumulatedImpulse.clear();
+        return;
+    }
+
+    // Keep the friction impulse inside the friction cone.
+    real planarImpulse = real_sqrt(
+        impulseContact.y * impulseContact.y +
+        impulseContact.z * impulseContact.z
+    );
+    real maxPlanarImpulse = impulseContact.x * friction;
+    if (planarImpulse > maxPlanarImpulse)
+    {
+        real scale = maxPlanarImpulse / planarImpulse;
+        impulseContact.y *= scale;
+        impulseContact.z *= scale;
+    }
+    accumulatedImpulse = impulseContact;
+
+    // Apply it in the same way as a resolved impulse.
+    Vector3 impulse = contactToWorld.transform(impulseContact);
+
+    Vector3 impulsiveTorque = relativeContactPosition[0] % impulse;
+    body[0]->addVelocity(impulse * body[0]->getInverseMass());
+    body[0]->addRotation(inverseInertiaTensor[0].transform(impulsiveTorque));
+
+    if (body[1])
+    {
+        impulsiveTorque = impulse % relativeContactPosition[1];
+        body[1]->addVelocity(impulse * -body[1]->getInverseMass());
+        body[1]->addRotation(inverseInertiaTensor[1].transform(impulsiveTorque));
+    }
+}
+
 inline
 Vector3 Contact::calculateFrictionlessImpulse(Matrix3* inverseInertiaTensor)
 {
@@ -497,12 +563,129 @@ void Contact::applyPositionChange(Vector3 linearChange[2],
 
 // Contact resolver implementation
 
+namespace {
+
+    /*
+     * Marks a contact body slot with no body in it.
+     */
+    const unsigned noRun = 0xffffffff;
+
+    /*
+     * Finds the penetration of a contact from where its bodies are
+     * now, given its point in the space of each body and the
+     * penetration it had when the point was fixed there.
+     */
+    real currentPenetration(const Contact& contact,
+        const Vector3 anchors[2], real depth)
+    {
+        Vector3 point[2];
+        for (unsigned b = 0; b < 2; b++)
+        {
+            point[b] = contact.body[b] ?
+                contact.body[b]->getPointInWorldSpace(anchors[b]) :
+                anchors[b];
+        }
+
+        // Moving the first body along the normal takes it out.
+        Vector3 separation = point[0] - point[1];
+        return depth - separation.scalarProduct(contact.contactNormal);
+    }
+
+    /*
+     * An indexed max-heap over an array of contacts, ordered by one
+     * of their values. Ties go to the contact that comes first, just
+     * as they would in a search through the array. When a contact's
+     * value changes it is moved up or down to its new place, so
+     * finding the worst contact costs nothing, and updating one costs
+     * only the log of the number of contacts.
+     */
+    class ContactHeap
+    {
+        Contact* contacts;
+        real Contact::* key;
+        std::vector<unsigned>& heap;
+        std::vector<unsigned>& position;
+
+        /* Returns true if contact a should come out of the heap before b. */
+        bool before(unsigned a, unsigned b) const
+        {
+            real keyA = contacts[a].*key;
+            real keyB = contacts[b].*key;
+            return keyA > keyB || (keyA == keyB && a < b);
+        }
+
+        void place(unsigned slot, unsigned contact)
+        {
+            heap[slot] = contact;
+            position[contact] = slot;
+        }
+
+        void siftUp(unsigned slot)
+        {
+            unsigned contact = heap[slot];
+            while (slot > 0)
+            {
+                unsigned parent = (slot - 1) / 2;
+                if (!before(contact, heap[parent])) break;
+                place(slot, heap[parent]);
+                slot = parent;
+            }
+            place(slot, contact);
+        }
+
+        void siftDown(unsigned slot)
+        {
+            unsigned count = (unsigned)heap.size();
+            unsigned contact = heap[slot];
+            for (;;)
+            {
+                unsigned child = slot * 2 + 1;
+                if (child >= count) break;
+                if (child + 1 < count && before(heap[child + 1], heap[child]))
+                {
+                    child++;
+                }
+                if (!before(heap[child], contact)) break;
+                place(slot, heap[child]);
+                slot = child;
+            }
+            place(slot, contact);
+        }
+
+    public:
+        ContactHeap(Contact* contacts, unsigned numContacts,
+            real Contact::* key,
+            std::vector<unsigned>& heap, std::vector<unsigned>& position)
+            : contacts(contacts), key(key), heap(heap), position(position)
+        {
+            heap.resize(numContacts);
+            position.resize(numContacts);
+            for (unsigned i = 0; i < numContacts; i++) place(i, i);
+            for (unsigned slot = numContacts / 2; slot-- > 0;) siftDown(slot);
+        }
+
+        /* Returns the contact with the largest value. */
+        unsigned top() const
+        {
+            return heap[0];
+        }
+
+        /* Moves the contact to its place after its value has changed. */
+        void update(unsigned contact)
+        {
+            siftUp(position[contact]);
+            siftDown(position[contact]);
+        }
+    };
+}
+
 ContactResolver::ContactResolver(unsigned iterations,
     real velocityEpsilon,
     real positionEpsilon)
 {
     setIterations(iterations, iterations);
     setEpsilon(velocityEpsilon, positionEpsilon);
+    setPositionSweeps(0);
 }
 
 ContactResolver::ContactResolver(unsigned velocityIterations,
@@ -512,6 +695,7 @@ ContactResolver::ContactResolver(unsigned velocityIterations,
 {
     setIterations(velocityIterations);
     setEpsilon(velocityEpsilon, positionEpsilon);
+    setPositionSweeps(0);
 }
 
 void ContactResolver::setIterations(unsigned iterations)
@@ -533,6 +717,11 @@ void ContactResolver::setEpsilon(real velocityEpsilon,
     ContactResolver::positionEpsilon = positionEpsilon;
 }
 
+void ContactResolver::setPositionSweeps(unsigned positionSweeps)
+{
+    ContactResolver::positionSweeps = positionSweeps;
+}
+
 void ContactResolver::resolveContacts(Contact* contacts,
     unsigned numContacts,
     real duration)
@@ -544,8 +733,12 @@ void ContactResolver::resolveContacts(Contact* contacts,
     // Prepare the contacts for processing
     prepareContacts(contacts, numContacts, duration);
 
+    // Reapply any impulses carried over from the last frame.
+    warmStart(contacts, numContacts, duration);
+
     // Resolve the interpenetration problems with the contacts.
-    adjustPositions(contacts, numContacts, duration);
+    if (positionSweeps > 0) sweepPositions(contacts, numContacts);
+    else adjustPositions(contacts, numContacts, duration);
 
     // Resolve the velocity problems with the contacts.
     adjustVelocities(contacts, numContacts, duration);
@@ -562,6 +755,42 @@ void ContactResolver::prepareContacts(Contact* contacts,
         // Calculate the internal contact data (inertia, basis, etc).
         contact->calculateInternals(duration);
     }
+
+    // Now the bodies are in their final slots, find which contacts
+    // each is part of.
+    buildAdjacency(contacts, numContacts);
+}
+
+void ContactResolver::buildAdjacency(Contact* contacts,
+    unsigned numContacts)
+{
+    // Sort the bodies of every contact, so each body's contacts end
+    // up together, in the order they appear in the array.
+    bodyEntries.clear();
+    for (unsigned i = 0; i < numContacts; i++)
+    {
+        for (unsigned b = 0; b < 2; b++) if (contacts[i].body[b])
+        {
+            bodyEntries.push_back(std::make_pair(contacts[i].body[b], i * 2 + b));
+        }
+    }
+    std::sort(bodyEntries.begin(), bodyEntries.end());
+
+    // Each new body starts a new run.
+    contactBodyRun.assign(numContacts * 2, noRun);
+    bodyContacts.resize(bodyEntries.size());
+    bodyContactStart.clear();
+    for (unsigned k = 0; k < bodyEntries.size(); k++)
+    {
+        if (k == 0 || bodyEntries[k].first != bodyEntries[k - 1].first)
+        {
+            bodyContactStart.push_back(k);
+        }
+        bodyContacts[k] = bodyEntries[k].second / 2;
+        contactBodyRun[bodyEntries[k].second] =
+            (unsigned)bodyContactStart.size() - 1;
+    }
+    bodyContactStart.push_back((unsigned)bodyEntries.size());
 }
 
 void ContactResolver::adjustVelocities(Contact* c,
@@ -571,22 +800,17 @@ void ContactResolver::adjustVelocities(Contact* c,
     Vector3 velocityChange[2], rotationChange[2];
     Vector3 deltaVel;
 
+    // Order the contacts by the velocity change they need.
+    ContactHeap order(c, numContacts, &Contact::desiredDeltaVelocity,
+        heap, heapPosition);
+
     // iteratively handle impacts in order of severity.
     velocityIterationsUsed = 0;
     while (velocityIterationsUsed < velocityIterations)
     {
         // Find contact with maximum magnitude of probable velocity change.
-        real max = velocityEpsilon;
-        unsigned index = numContacts;
-        for (unsigned i = 0; i < numContacts; i++)
-        {
-            if (c[i].desiredDeltaVelocity > max)
-            {
-                max = c[i].desiredDeltaVelocity;
-                index = i;
-            }
-        }
-        if (index == numContacts) break;
+        unsigned index = order.top();
+        if (c[index].desiredDeltaVelocity <= velocityEpsilon) break;
 
         // Match the awake state at the contact
         c[index].matchAwakeState();
@@ -596,30 +820,34 @@ void ContactResolver::adjustVelocities(Contact* c,
 
         // With the change in velocity of the two bodies, the update of
         // contact velocities means that some of the relative closing
-        // velocities need recomputing.
-        for (unsigned i = 0; i < numContacts; i++)
+        // velocities need recomputing. Only the contacts that share a
+        // body with the resolved one can have changed.
+        for (unsigned d = 0; d < 2; d++)
         {
-            // Check each body in the contact
-            for (unsigned b = 0; b < 2; b++) if (c[i].body[b])
+            unsigned run = contactBodyRun[index * 2 + d];
+            if (run == noRun) continue;
+            RigidBody* body = c[index].body[d];
+
+            for (unsigned k = bodyContactStart[run];
+                k < bodyContactStart[run + 1]; k++)
             {
-                // Check for a match with each body in the newly
-                // resolved contact
-                for (unsigned d = 0; d < 2; d++)
+                unsigned i = bodyContacts[k];
+
+                // Check which body in the contact it is
+                for (unsigned b = 0; b < 2; b++) if (c[i].body[b] == body)
                 {
-                    if (c[i].body[b] == c[index].body[d])
-                    {
-                        deltaVel = velocityChange[d] +
-                            rotationChange[d].vectorProduct(
-                                c[i].relativeContactPosition[b]);
-
-                        // The sign of the change is negative if we're dealing
-                        // with the second body in a contact.
-                        c[i].contactVelocity +=
-                            c[i].contactToWorld.transformTranspose(deltaVel)
-                            * (b ? -1 : 1);
-                        c[i].calculateDesiredDeltaVelocity(duration);
-                    }
+                    deltaVel = velocityChange[d] +
+                        rotationChange[d].vectorProduct(
+                            c[i].relativeContactPosition[b]);
+
+                    // The sign of the change is negative if we're dealing
+                    // with the second body in a contact.
+                    c[i].contactVelocity +=
+                        c[i].contactToWorld.transformTranspose(deltaVel)
+                        * (b ? -1 : 1);
+                    c[i].calculateDesiredDeltaVelocity(duration);
                 }
+                order.update(i);
             }
         }
         velocityIterationsUsed++;
@@ -630,27 +858,23 @@ void ContactResolver::adjustPositions(Contact* c,
     unsigned numContacts,
     real duration)
 {
-    unsigned i, index;
+    unsigned index;
     Vector3 linearChange[2], angularChange[2];
     real max;
     Vector3 deltaPosition;
 
+    // Order the contacts by their penetration.
+    ContactHeap order(c, numContacts, &Contact::penetration,
+        heap, heapPosition);
+
     // iteratively resolve interpenetrations in order of severity.
     positionIterationsUsed = 0;
     while (positionIterationsUsed < positionIterations)
     {
         // Find biggest penetration
-        max = positionEpsilon;
-        index = numContacts;
-        for (i = 0; i < numContacts; i++)
-        {
-            if (c[i].penetration > max)
-            {
-                max = c[i].penetration;
-                index = i;
-            }
-        }
-        if (index == numContacts) break;
+        index = order.top();
+        max = c[index].penetration;
+        if (max <= positionEpsilon) break;
 
         // Match the awake state at the contact
         c[index].matchAwakeState();
@@ -662,33 +886,405 @@ void ContactResolver::adjustPositions(Contact* c,
             max);
 
         // Again this action may have changed the penetration of other
-        // bodies, so we update contacts.
-        for (i = 0; i < numContacts; i++)
+        // bodies, so we update the contacts that share a body with it.
+        for (unsigned d = 0; d < 2; d++)
         {
-            // Check each body in the contact
-            for (unsigned b = 0; b < 2; b++) if (c[i].body[b])
+            unsigned run = contactBodyRun[index * 2 + d];
+            if (run == noRun) continue;
+            RigidBody* body = c[index].body[d];
+
+            for (unsigned k = bodyContactStart[run];
+                k < bodyContactStart[run + 1]; k++)
             {
-                // Check for a match with each body in the newly
-                // resolved contact
-                for (unsigned d = 0; d < 2; d++)
+                unsigned i = bodyContacts[k];
+
+                // Check which body in the contact it is
+                for (unsigned b = 0; b < 2; b++) if (c[i].body[b] == body)
                 {
-                    if (c[i].body[b] == c[index].body[d])
-                    {
-                        deltaPosition = linearChange[d] +
-                            angularChange[d].vectorProduct(
-                                c[i].relativeContactPosition[b]);
-
-                        // The sign of the change is positive if we're
-                        // dealing with the second body in a contact
-                        // and negative otherwise (because we're
-                        // subtracting the resolution)..
-                        c[i].penetration +=
-                            deltaPosition.scalarProduct(c[i].contactNormal)
-                            * (b ? 1 : -1);
-                    }
+                    deltaPosition = linearChange[d] +
+                        angularChange[d].vectorProduct(
+                            c[i].relativeContactPosition[b]);
+
+                    // The sign of the change is positive if we're
+                    // dealing with the second body in a contact
+                    // and negative otherwise (because we're
+                    // subtracting the resolution)..
+                    c[i].penetration +=
+                        deltaPosition.scalarProduct(c[i].contactNormal)
+                        * (b ? 1 : -1);
                 }
+                order.update(i);
+            }
+        }
+        positionIterationsUsed++;
+    }
+}
+
+void ContactResolver::sweepPositions(Contact* c,
+    unsigned numContacts)
+{
+    Vector3 linearChange[2], angularChange[2];
+
+    // Fix each contact point in both of its bodies, so its
+    // penetration can be found again wherever the bodies move to.
+    positionAnchors.resize(numContacts * 2);
+    positionDepths.resize(numContacts);
+    for (unsigned i = 0; i < numContacts; i++)
+    {
+        for (unsigned b = 0; b < 2; b++)
+        {
+            positionAnchors[i * 2 + b] = c[i].body[b] ?
+                c[i].body[b]->getPointInLocalSpace(c[i].contactPoint) :
+                c[i].contactPoint;
+        }
+        positionDepths[i] = c[i].penetration;
+    }
+
+    // Sweep the contacts in order, resolving each from the
+    // positions the earlier ones left, until none is penetrating.
+    positionIterationsUsed = 0;
+    while (positionIterationsUsed < positionSweeps)
+    {
+        bool moved = false;
+        for (unsigned i = 0; i < numContacts; i++)
+        {
+            real penetration = currentPenetration(c[i],
+                &positionAnchors[i * 2], positionDepths[i]);
+            if (penetration <= positionEpsilon) continue;
+
+            // Match the awake state at the contact
+            c[i].matchAwakeState();
+
+            // Resolve the penetration, and bring the bodies' transforms
+            // up to date for the contacts that follow.
+            c[i].applyPositionChange(linearChange, angularChange, penetration);
+            for (unsigned b = 0; b < 2; b++) if (c[i].body[b])
+            {
+                c[i].body[b]->calculateDerivedData();
             }
+            moved = true;
         }
+        if (!moved) break;
         positionIterationsUsed++;
     }
-}
\ No newline at end of file
+
+    // Leave each contact with the penetration it has now, as the
+    // worst first stage does.
+    for (unsigned i = 0; i < numContacts; i++)
+    {
+        c[i].penetration = currentPenetration(c[i],
+            &positionAnchors[i * 2], positionDepths[i]);
+    }
+}
+
+void ContactResolver::warmStart(Contact* c,
+    unsigned numContacts,
+    real duration)
+{
+    bool warmStarted = false;
+    for (unsigned i = 0; i < numContacts; i++)
+    {
+        if (c[i].accumulatedImpulse.squareMagnitude() == 0) continue;
+
+        // Earlier warm starts may have moved these bodies, so bring
+        // this contact up to date before limiting its impulse.
+        c[i].contactVelocity = c[i].calculateLocalVelocity(0, duration);
+        if (c[i].body[1]) {
+            c[i].contactVelocity -= c[i].calculateLocalVelocity(1, duration);
+        }
+        c[i].calculateDesiredDeltaVelocity(duration);
+
+        c[i].matchAwakeState();
+        c[i].applyWarmStartImpulse();
+        warmStarted = true;
+    }
+    if (!warmStarted) return;
+
+    // The bodies have all changed velocity, so it is cheaper to
+    // recalculate every contact velocity than to track which
+    // contacts were affected.
+    for (unsigned i = 0; i < numContacts; i++)
+    {
+        c[i].contactVelocity = c[i].calculateLocalVelocity(0, duration);
+        if (c[i].body[1]) {
+            c[i].contactVelocity -= c[i].calculateLocalVelocity(1, duration);
+        }
+        c[i].calculateDesiredDeltaVelocity(duration);
+    }
+}
+
+
+
+// Contact cache implementation
+
+/*
+ * Contacts whose normals are further apart than this (as a cosine)
+ * are treated as different contacts.
+ */
+static const real cacheNormalTolerance = (real)0.95;
+
+ContactCache::ContactCache(real matchTolerance, real warmStartFactor)
+    :
+    matchTolerance(matchTolerance),
+    warmStartFactor(warmStartFactor)
+{
+}
+
+void ContactCache::setMatchTolerance(real matchTolerance)
+{
+    ContactCache::matchTolerance = matchTolerance;
+}
+
+void ContactCache::setWarmStartFactor(real warmStartFactor)
+{
+    ContactCache::warmStartFactor = warmStartFactor;
+}
+
+bool ContactCache::compareBodies(const CachedContact& a,
+    const CachedContact& b)
+{
+    std::less<RigidBody*> less;
+    if (a.body[0] != b.body[0]) return less(a.body[0], b.body[0]);
+    return less(a.body[1], b.body[1]);
+}
+
+void ContactCache::clear()
+{
+    cached.clear();
+}
+
+unsigned ContactCache::retrieve(Contact* contacts, unsigned numContacts)
+{
+    if (cached.empty()) return 0;
+
+    real toleranceSquared = matchTolerance * matchTolerance;
+    unsigned matched = 0;
+    Contact* lastContact = contacts + numContacts;
+    for (Contact* contact = contacts; contact < lastContact; contact++)
+    {
+        // Put the bodies in the order the resolver will use.
+        if (!contact->body[0]) contact->swapBodies();
+        if (!contact->body[0]) continue;
+
+        CachedContact key;
+        key.body[0] = contact->body[0];
+        key.body[1] = contact->body[1];
+        auto manifold = std::equal_range(
+            cached.begin(), cached.end(), key, compareBodies);
+        if (manifold.first == manifold.second) continue;
+
+        // Prefer the same features, otherwise take the closest.
+        Vector3 localPoint =
+            contact->body[0]->getPointInLocalSpace(contact->contactPoint);
+        const CachedContact* match = NULL;
+        real closest = toleranceSquared;
+        for (auto i = manifold.first; i != manifold.second; i++)
+        {
+            if (i->contactNormal * contact->contactNormal <
+                cacheNormalTolerance) continue;
+
+            real distance = (i->localPoint - localPoint).squareMagnitude();
+            if (distance > toleranceSquared) continue;
+
+            if (contact->featureId != Contact::NO_FEATURE &&
+                i->featureId == contact->featureId)
+            {
+                match = &*i;
+                break;
+            }
+            if (distance < closest)
+            {
+                closest = distance;
+                match = &*i;
+            }
+        }
+
+        if (match)
+        {
+            // The impulse is kept in world coordinates, since a small
+            // change in the normal can give the contact quite different
+            // tangents. Turn it into this contact's coordinates.
+            contact->calculateContactBasis();
+            contact->accumulatedImpulse =
+                contact->contactToWorld.transformTranspose(match->impulse) *
+                warmStartFactor;
+            matched++;
+        }
+    }
+    return matched;
+}
+
+void ContactCache::store(const Contact* contacts, unsigned numContacts)
+{
+    // Clearing keeps the capacity, so there is no allocation once
+    // the cache has grown to the size of the scene.
+    cached.clear();
+
+    const Contact* lastContact = contacts + numContacts;
+    for (const Contact* contact = contacts; contact < lastContact; contact++)
+    {
+        // Only contacts that pushed have anything worth keeping.
+        if (!contact->body[0] || contact->accumulatedImpulse.x <= 0) continue;
+
+        CachedContact entry;
+        entry.body[0] = contact->body[0];
+        entry.body[1] = contact->body[1];
+        entry.featureId = contact->featureId;
+        entry.localPoint =
+            contact->body[0]->getPointInLocalSpace(contact->contactPoint);
+        entry.contactNormal = contact->contactNormal;
+        entry.impulse =
+            contact->contactToWorld.transform(contact->accumulatedImpulse);
+        cached.push_back(entry);
+    }
+
+    // Sorting groups each manifold together for retrieve.
+    std::sort(cached.begin(), cached.end(), compareBodies);
+}
+
+ContactArena::ContactArena(unsigned chunkSize)
+    :
+    currentChunk(0),
+    chunkSize(chunkSize > 0 ? chunkSize : 1),
+    contactCount(0),
+    highWaterMark(0),
+    overflowCount(0)
+{
+}
+
+ContactArena::~ContactArena()
+{
+    for (unsigned i = 0; i < chunks.size(); i++)
+    {
+        delete[] chunks[i].contacts;
+    }
+}
+
+void ContactArena::reset()
+{
+    for (unsigned i = 0; i < chunks.size(); i++)
+    {
+        chunks[i].used = 0;
+    }
+    currentChunk = 0;
+    contactCount = 0;
+}
+
+void ContactArena::nextChunk(unsigned room)
+{
+    // The chunks from here on are unused, so any of them that is big
+    // enough can be moved up to be the next.
+    if (!chunks.empty() && chunks[currentChunk].used > 0) currentChunk++;
+    for (unsigned i = currentChunk; i < chunks.size(); i++)
+    {
+        if (chunks[i].size < room) continue;
+        std::swap(chunks[currentChunk], chunks[i]);
+        return;
+    }
+
+    // Otherwise make a new one, at least as big as the biggest.
+    unsigned size = chunkSize;
+    for (unsigned i = 0; i < chunks.size(); i++)
+    {
+        if (chunks[i].size > size) size = chunks[i].size;
+    }
+    while (size < room) size *= 2;
+    chunks.insert(chunks.begin() + currentChunk, makeChunk(size));
+}
+
+ContactArena::Chunk ContactArena::makeChunk(unsigned size)
+{
+    Chunk chunk;
+    chunk.contacts = new Contact[size + 1];
+    chunk.size = size;
+    chunk.used = 0;
+    return chunk;
+}
+
+unsigned ContactArena::addContacts(const ContactGenerator* generator)
+{
+    if (chunks.empty() || chunks[currentChunk].used == chunks[currentChunk].size)
+    {
+        nextChunk(1);
+    }
+
+    for (;;)
+    {
+        // The generator is given the spare contact at the end of the
+        // chunk as well, so we can tell if it had more to add than
+        // there is room for.
+        Chunk& chunk = chunks[currentChunk];
+        unsigned room = chunk.size - chunk.used;
+        unsigned used = generator->addContact(chunk.contacts + chunk.used, room + 1);
+
+        if (used <= room)
+        {
+            chunk.used += used;
+            contactCount += used;
+            if (contactCount > highWaterMark) highWaterMark = contactCount;
+            return used;
+        }
+
+        // It didn't fit, so run it again with twice the room.
+        overflowCount++;
+        nextChunk(room * 2);
+    }
+}
+
+Contact* ContactArena::getContacts()
+{
+    if (chunks.empty()) return NULL;
+
+    // If only one chunk has contacts, they are already together.
+    unsigned usedChunks = 0;
+    Contact* first = chunks[0].contacts;
+    for (unsigned i = 0; i < chunks.size(); i++)
+    {
+        if (chunks[i].used == 0) continue;
+        if (usedChunks++ == 0) first = chunks[i].contacts;
+    }
+    if (usedChunks <= 1) return first;
+
+    // The contacts are spread over several chunks, so gather them
+    // into an unused chunk that holds them all, or a new one with a
+    // chunk to spare. The other chunks are kept for later frames.
+    Chunk merged;
+    unsigned spare = 0;
+    while (spare < chunks.size() &&
+        (chunks[spare].used > 0 || chunks[spare].size < contactCount))
+    {
+        spare++;
+    }
+    if (spare < chunks.size())
+    {
+        merged = chunks[spare];
+        chunks.erase(chunks.begin() + spare);
+    }
+    else
+    {
+        merged = makeChunk((contactCount / chunkSize + 2) * chunkSize);
+    }
+
+    for (unsigned i = 0; i < chunks.size(); i++)
+    {
+        for (unsigned c = 0; c < chunks[i].used; c++)
+        {
+            merged.contacts[merged.used++] = chunks[i].contacts[c];
+        }
+        chunks[i].used = 0;
+    }
+
+    chunks.insert(chunks.begin(), merged);
+    currentChunk = 0;
+    return merged.contacts;
+}
+
+unsigned ContactArena::getCapacity() const
+{
+    unsigned capacity = 0;
+    for (unsigned i = 0; i < chunks.size(); i++)
+    {
+        capacity += chunks[i].size;
+    }
+    return capacity;
+}
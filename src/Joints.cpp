@@ -0,0 +1,348 @@
+#include <Joints.h>
+
+using namespace Grics;
+
+/*
+ * This file holds the joints. Each joint only works out its rows from
+ * where the bodies are; the contact solver solves them along with the
+ * contacts.
+ */
+
+namespace {
+
+    /*
+     * The row each part of a joint uses for its stored impulse.
+     */
+    const unsigned limitSlot = 5;
+    const unsigned motorSlot = 6;
+
+    /*
+     * The world axes, for the rows that hold a point or an
+     * orientation.
+     */
+    const Vector3 worldAxes[3] = {
+        Vector3(1, 0, 0), Vector3(0, 1, 0), Vector3(0, 0, 1)
+    };
+
+    /*
+     * Finds two unit directions at right angles to the given unit
+     * axis and to each other.
+     */
+    void perpendiculars(const Vector3& axis, Vector3* one, Vector3* two)
+    {
+        // Start from the world axis least in line with it.
+        unsigned least = 0;
+        for (unsigned i = 1; i < 3; i++)
+        {
+            if (real_abs(axis[i]) < real_abs(axis[least])) least = i;
+        }
+        Vector3 start = worldAxes[least];
+
+        *one = axis.vectorProduct(start);
+        one->normalize();
+        *two = axis.vectorProduct(*one);
+    }
+
+    Quaternion conjugate(const Quaternion& q)
+    {
+        return Quaternion(q.r, -q.i, -q.j, -q.k);
+    }
+
+    /*
+     * Returns the orientation of the body, or no rotation for the
+     * world.
+     */
+    Quaternion orientationOf(RigidBody* body)
+    {
+        return body ? body->getOrientation() : Quaternion();
+    }
+
+    /*
+     * Converts a direction in a body's space to world space, or
+     * leaves it for the world.
+     */
+    Vector3 directionInWorld(RigidBody* body, const Vector3& direction)
+    {
+        return body ? body->getDirectionInWorldSpace(direction) : direction;
+    }
+
+    Vector3 directionInBody(RigidBody* body, const Vector3& direction)
+    {
+        return body ? body->getDirectionInLocalSpace(direction) : direction;
+    }
+
+    Vector3 pointInWorld(RigidBody* body, const Vector3& point)
+    {
+        return body ? body->getPointInWorldSpace(point) : point;
+    }
+
+    Vector3 pointInBody(RigidBody* body, const Vector3& point)
+    {
+        return body ? body->getPointInLocalSpace(point) : point;
+    }
+
+    /*
+     * Fills in a row with no bounds on its impulse.
+     */
+    void setRow(JointRow& row, const Vector3& linear,
+        const Vector3& angularOne, const Vector3& angularTwo,
+        real bias, unsigned slot)
+    {
+        row.linear = linear;
+        row.angular[0] = angularOne;
+        row.angular[1] = angularTwo;
+        row.bias = bias;
+        row.lower = -REAL_MAX;
+        row.upper = REAL_MAX;
+        row.slot = slot;
+    }
+}
+
+Joint::Joint()
+{
+    reset(BALL, NULL, NULL);
+}
+
+void Joint::reset(Type type, RigidBody* one, RigidBody* two)
+{
+    Joint::type = type;
+    body[0] = one;
+    body[1] = two;
+    relativeOrientation = Quaternion();
+    clearLimits();
+    clearMotor();
+    for (unsigned i = 0; i < MAX_ROWS; i++) impulse[i] = 0;
+}
+
+void Joint::setBall(RigidBody* one, RigidBody* two, const Vector3& anchor)
+{
+    reset(BALL, one, two);
+    for (unsigned b = 0; b < 2; b++)
+    {
+        Joint::anchor[b] = pointInBody(body[b], anchor);
+    }
+}
+
+void Joint::setHinge(RigidBody* one, RigidBody* two,
+    const Vector3& anchor, const Vector3& axis)
+{
+    setBall(one, two, anchor);
+    type = HINGE;
+
+    Vector3 direction = axis;
+    direction.normalize();
+    Vector3 across, unused;
+    perpendiculars(direction, &across, &unused);
+    for (unsigned b = 0; b < 2; b++)
+    {
+        Joint::axis[b] = directionInBody(body[b], direction);
+        reference[b] = directionInBody(body[b], across);
+    }
+}
+
+void Joint::setSlider(RigidBody* one, RigidBody* two, const Vector3& axis)
+{
+    setFixed(one, two);
+    type = SLIDER;
+
+    Vector3 direction = axis;
+    direction.normalize();
+    for (unsigned b = 0; b < 2; b++)
+    {
+        Joint::axis[b] = directionInBody(body[b], direction);
+    }
+}
+
+void Joint::setFixed(RigidBody* one, RigidBody* two)
+{
+    setBall(one, two, one->getPosition());
+    type = FIXED;
+
+    // The first body's orientation is the second's turned by this.
+    relativeOrientation = conjugate(orientationOf(two));
+    relativeOrientation *= orientationOf(one);
+}
+
+void Joint::setLimits(real lower, real upper)
+{
+    limited = true;
+    Joint::lower = lower;
+    Joint::upper = upper;
+}
+
+void Joint::clearLimits()
+{
+    limited = false;
+    lower = upper = 0;
+}
+
+void Joint::setMotor(real speed, real maxTorque)
+{
+    motorised = true;
+    motorSpeed = speed;
+    maxMotorTorque = maxTorque;
+}
+
+void Joint::clearMotor()
+{
+    motorised = false;
+    motorSpeed = maxMotorTorque = 0;
+}
+
+Joint::Type Joint::getType() const
+{
+    return type;
+}
+
+real Joint::getPosition() const
+{
+    if (type == HINGE)
+    {
+        // The angle from the second body's reference direction to the
+        // first's, about the first body's axis.
+        Vector3 direction = directionInWorld(body[0], axis[0]);
+        Vector3 one = directionInWorld(body[0], reference[0]);
+        Vector3 two = directionInWorld(body[1], reference[1]);
+        return real_atan2(two.vectorProduct(one) * direction, two * one);
+    }
+    if (type == SLIDER)
+    {
+        Vector3 direction = directionInWorld(body[0], axis[0]);
+        return (pointInWorld(body[0], anchor[0]) -
+            pointInWorld(body[1], anchor[1])) * direction;
+    }
+    return 0;
+}
+
+unsigned Joint::calculateRows(JointRow* rows, real duration,
+    real correction) const
+{
+    unsigned count = 0;
+    real scale = correction / duration;
+
+    // Find where the anchors are now, and each body's lever arm to
+    // the second anchor, which is where the bodies are held together.
+    Vector3 position[2], relative[2];
+    for (unsigned b = 0; b < 2; b++)
+    {
+        position[b] = pointInWorld(body[b], anchor[b]);
+    }
+    for (unsigned b = 0; b < 2; b++)
+    {
+        if (body[b]) relative[b] = position[1] - body[b]->getPosition();
+    }
+    Vector3 error = position[0] - position[1];
+
+    if (type == SLIDER)
+    {
+        // The second anchor stays on the line along the axis.
+        Vector3 direction = directionInWorld(body[0], axis[0]);
+        Vector3 across[2];
+        perpendiculars(direction, &across[0], &across[1]);
+        for (unsigned i = 0; i < 2; i++)
+        {
+            setRow(rows[count++], across[i],
+                relative[0].vectorProduct(across[i]),
+                relative[1].vectorProduct(across[i]),
+                -scale * (error * across[i]), i);
+        }
+
+        if (limited)
+        {
+            real distance = error * direction;
+            JointRow& row = rows[count];
+            setRow(row, direction,
+                relative[0].vectorProduct(direction),
+                relative[1].vectorProduct(direction), 0, limitSlot);
+            if (distance <= lower)
+            {
+                row.bias = -scale * (distance - lower);
+                row.lower = 0;
+                count++;
+            }
+            else if (distance >= upper)
+            {
+                row.bias = -scale * (distance - upper);
+                row.upper = 0;
+                count++;
+            }
+        }
+    }
+    else
+    {
+        // The anchors stay together.
+        for (unsigned i = 0; i < 3; i++)
+        {
+            setRow(rows[count++], worldAxes[i],
+                relative[0].vectorProduct(worldAxes[i]),
+                relative[1].vectorProduct(worldAxes[i]),
+                -scale * error[i], i);
+        }
+    }
+
+    if (type == SLIDER || type == FIXED)
+    {
+        // The bodies keep their orientation. The error is the small
+        // rotation taking the first body from where it should be to
+        // where it is.
+        Quaternion target = orientationOf(body[1]);
+        target *= relativeOrientation;
+        Quaternion turn = orientationOf(body[0]);
+        turn *= conjugate(target);
+        real sign = turn.r < 0 ? (real)-2.0 : (real)2.0;
+        Vector3 turnError(turn.i * sign, turn.j * sign, turn.k * sign);
+
+        unsigned first = type == SLIDER ? 2 : 3;
+        for (unsigned i = 0; i < 3; i++)
+        {
+            setRow(rows[count++], Vector3(), worldAxes[i], worldAxes[i],
+                -scale * turnError[i], first + i);
+        }
+    }
+    else if (type == HINGE)
+    {
+        // The axes stay in line. Turning the first body about a
+        // direction at right angles to its axis changes the cross
+        // product of the axes in that direction.
+        Vector3 direction = directionInWorld(body[0], axis[0]);
+        Vector3 other = directionInWorld(body[1], axis[1]);
+        Vector3 across[2];
+        perpendiculars(direction, &across[0], &across[1]);
+        Vector3 misalignment = other.vectorProduct(direction);
+        for (unsigned i = 0; i < 2; i++)
+        {
+            setRow(rows[count++], Vector3(), across[i], across[i],
+                -scale * (misalignment * across[i]), 3 + i);
+        }
+
+        real angle = getPosition();
+        if (limited)
+        {
+            JointRow& row = rows[count];
+            setRow(row, Vector3(), direction, direction, 0, limitSlot);
+            if (angle <= lower)
+            {
+                row.bias = -scale * (angle - lower);
+                row.lower = 0;
+                count++;
+            }
+            else if (angle >= upper)
+            {
+                row.bias = -scale * (angle - upper);
+                row.upper = 0;
+                count++;
+            }
+        }
+
+        if (motorised)
+        {
+            JointRow& row = rows[count++];
+            setRow(row, Vector3(), direction, direction,
+                motorSpeed, motorSlot);
+            row.lower = -maxMotorTorque * duration;
+            row.upper = maxMotorTorque * duration;
+        }
+    }
+
+    return count;
+}
@@ -1,4 +1,5 @@
 #include "Mesh.h"
+#include "CollideFine.h"
 
 using namespace Grics;
 
@@ -78,6 +79,8 @@ void Grics::Mesh::generateAllShapes()
     appendShape(generateCone(), generateConeIndices(), shapeType::CONE);
     // Cylinder
     appendShape(generateCylinder(), generateCylinderIndices(), shapeType::CYLINDER);
+    // Capsule
+    appendShape(generateCapsule(), generateCapsuleIndices(), shapeType::CAPSULE);
     // Sphere
     appendShape(generateSphere(), generateSphereIndices(), shapeType::SPHERE);
     // Grid
@@ -178,6 +181,62 @@ std::vector<unsigned int> Mesh::generateCylinderIndices()
     return std::vector<unsigned int>();
 }
 
+std::vector<real> Mesh::generateCapsule()
+{
+    // A capsule of radius 1 around a segment from y = -1 to y = 1,
+    // matching CollisionCapsule's local space. It is built like the
+    // sphere, with the two halves pulled apart along the Y axis.
+    int stackCount = 32;
+    int sectorCount = 64;
+    real radius = 1.0f;
+    real halfHeight = 1.0f;
+    std::vector<real> capsuleVertices;
+    for (int i = 0; i <= stackCount + 1; ++i) {
+        // The top half uses rings 0 to stackCount/2, the bottom half
+        // repeats the equator ring and carries on down.
+        int ring = (i <= stackCount / 2) ? i : i - 1;
+        real stackAngle = PI/2 - ring * PI/stackCount;
+        real xz = radius * cosf(stackAngle);
+        real y = radius * sinf(stackAngle) +
+            ((i <= stackCount / 2) ? halfHeight : -halfHeight);
+
+        for (int j = 0; j <= sectorCount; ++j) {
+            real sectorAngle = j * 2 * PI/sectorCount;
+
+            capsuleVertices.push_back(xz * cosf(sectorAngle));
+            capsuleVertices.push_back(y);
+            capsuleVertices.push_back(xz * sinf(sectorAngle));
+        }
+    }
+    return capsuleVertices;
+}
+
+std::vector<unsigned int> Mesh::generateCapsuleIndices()
+{
+    int stackCount = 32;
+    int sectorCount = 64;
+    int ringCount = stackCount + 2;
+    std::vector<unsigned int> capsuleIndices;
+    for (int i = 0; i < ringCount - 1; ++i) {
+        int k1 = i * (sectorCount + 1);
+        int k2 = k1 + sectorCount + 1;
+
+        for (int j = 0; j < sectorCount; ++j, ++k1, ++k2) {
+            if (i != 0) {
+                capsuleIndices.push_back(k1);
+                capsuleIndices.push_back(k2);
+                capsuleIndices.push_back(k1 + 1);
+            }
+            if (i != (ringCount - 2)) {
+                capsuleIndices.push_back(k1 + 1);
+                capsuleIndices.push_back(k2);
+                capsuleIndices.push_back(k2 + 1);
+            }
+        }
+    }
+    return capsuleIndices;
+}
+
 std::vector<real> Mesh::generateCone()
 {
     return std::vector<real>();
@@ -245,3 +304,54 @@ void Mesh::drawGeometry(shapeType geometryType, Shader& shader, const Vector3& p
     //glDrawArrays(GL_TRIANGLES, 0, count);
     glDrawElements(GL_TRIANGLES, count, GL_UNSIGNED_INT, (void*)(offset * sizeof(unsigned int)));
 }
+
+void Mesh::generateShape(shapeType type, std::vector<real>& vertices, std::vector<unsigned int>& indices)
+{
+    switch (type) {
+    case CUBE:     vertices = generateCube();     indices = generateCubeIndices();     break;
+    case SPHERE:   vertices = generateSphere();   indices = generateSphereIndices();   break;
+    case CYLINDER: vertices = generateCylinder(); indices = generateCylinderIndices(); break;
+    case CAPSULE:  vertices = generateCapsule();  indices = generateCapsuleIndices();  break;
+    case CONE:     vertices = generateCone();     indices = generateConeIndices();     break;
+    case PLANE:    vertices = generatePlane();    indices = generatePlaneIndices();    break;
+    case GRID:     vertices = generateGrid();     indices = generateGridIndices();     break;
+    }
+}
+
+bool Mesh::bakeSDF(shapeType geometryType, const Vector3& position, const Vector3& scale,
+    real voxelSize, real bandWidth, CollisionSDF* sdf)
+{
+    std::vector<real> vertices;
+    std::vector<unsigned int> indices;
+    generateShape(geometryType, vertices, indices);
+    if (indices.size() < 3) return false;
+
+    // Place the vertices in the world, as drawGeometry would.
+    std::vector<Vector3> points(vertices.size() / 3);
+    for (size_t i = 0; i < points.size(); i++) {
+        points[i] = position + Vector3(vertices[i * 3], vertices[i * 3 + 1],
+            vertices[i * 3 + 2]).componentProduct(scale);
+    }
+
+    sdf->bake(&points[0], (unsigned)points.size(), &indices[0],
+        (unsigned)(indices.size() / 3), voxelSize, bandWidth);
+    return true;
+}
+
+bool Mesh::buildHull(shapeType geometryType, const Vector3& scale, ConvexHull* hull)
+{
+    std::vector<real> vertices;
+    std::vector<unsigned int> indices;
+    generateShape(geometryType, vertices, indices);
+
+    for (size_t i = 0; i < vertices.size(); i += 3) {
+        vertices[i] *= scale.x;
+        vertices[i + 1] *= scale.y;
+        vertices[i + 2] *= scale.z;
+    }
+    if (vertices.empty()) {
+        hull->clear();
+        return false;
+    }
+    return hull->build(&vertices[0], (unsigned)(vertices.size() / 3));
+}
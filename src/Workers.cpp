@@ -0,0 +1,81 @@
+#include <Workers.h>
+
+using namespace Grics;
+
+WorkerPool::WorkerPool()
+    :
+    job(NULL),
+    jobThreads(0),
+    generation(0),
+    remaining(0),
+    stopping(false)
+{
+}
+
+WorkerPool::~WorkerPool()
+{
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        stopping = true;
+    }
+    started.notify_all();
+    for (unsigned i = 0; i < workers.size(); i++)
+    {
+        workers[i].join();
+    }
+}
+
+void WorkerPool::run(unsigned threadCount, const Job& job)
+{
+    if (threadCount <= 1)
+    {
+        job(0);
+        return;
+    }
+
+    // Start any workers we don't have yet. They are given the job
+    // count from before this job, so they run it as soon as they
+    // get the lock.
+    {
+        std::unique_lock<std::mutex> guard(lock);
+        while (workers.size() + 1 < threadCount)
+        {
+            workers.push_back(std::thread(&WorkerPool::workerLoop, this,
+                (unsigned)workers.size() + 1, generation));
+        }
+
+        WorkerPool::job = &job;
+        jobThreads = threadCount;
+        remaining = threadCount - 1;
+        generation++;
+    }
+    started.notify_all();
+
+    // The calling thread does its share as thread zero.
+    job(0);
+
+    std::unique_lock<std::mutex> guard(lock);
+    while (remaining > 0) finished.wait(guard);
+    WorkerPool::job = NULL;
+}
+
+void WorkerPool::workerLoop(unsigned thread, unsigned seen)
+{
+    std::unique_lock<std::mutex> guard(lock);
+    for (;;)
+    {
+        while (!stopping && generation == seen) started.wait(guard);
+        if (stopping) return;
+        seen = generation;
+
+        // Workers beyond the number the job wants sit it out.
+        if (thread >= jobThreads) continue;
+
+        const Job* current = job;
+        guard.unlock();
+        (*current)(thread);
+        guard.lock();
+
+        if (--remaining == 0) finished.notify_one();
+    }
+}
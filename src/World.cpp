@@ -1,20 +1,20 @@
 #include <cstdlib>
 #include <World.h>
+#include <thread>
 
 using namespace Grics;
 
 World::World(unsigned maxContacts, unsigned iterations)
     :
     resolver(iterations),
-    maxContacts(maxContacts)
+    solverType(WORST_FIRST),
+    solverThreads(std::thread::hardware_concurrency()),
+    substeps(4),
+    warmStarting(true),
+    contacts(maxContacts)
 {
-    contacts = new Contact[maxContacts];
     calculateIterations = (iterations == 0);
-}
-
-World::~World()
-{
-    delete[] contacts;
+    if (solverThreads == 0) solverThreads = 1;
 }
 
 void World::startFrame()
@@ -27,38 +27,88 @@ void World::startFrame()
     }
 }
 
+void World::setWarmStarting(bool warmStarting)
+{
+    World::warmStarting = warmStarting;
+    if (!warmStarting) contactCache.clear();
+}
+
+void World::setSolverType(SolverType solverType)
+{
+    World::solverType = solverType;
+}
+
+World::SolverType World::getSolverType() const
+{
+    return solverType;
+}
+
+ContactSolver& World::getContactSolver()
+{
+    return solver;
+}
+
+ContactResolver& World::getContactResolver()
+{
+    return resolver;
+}
+
+void World::setSolverThreads(unsigned solverThreads)
+{
+    World::solverThreads = solverThreads > 0 ? solverThreads : 1;
+}
+
+void World::setSubsteps(unsigned substeps)
+{
+    World::substeps = substeps > 0 ? substeps : 1;
+}
+
 World::RigidBodies& World::getRigidBodies()
 {
     return bodies;
 }
 
+const ContactArena& World::getContactArena() const
+{
+    return contacts;
+}
+
 World::ContactGenerators& World::getContactGenerators()
 {
     return contactGenerator;
 }
 
+World::Joints& World::getJoints()
+{
+    return joints;
+}
+
+World::Articulations& World::getArticulations()
+{
+    return articulations;
+}
+
 unsigned World::generateContacts()
 {
-    unsigned limit = maxContacts;
-    Contact* nextContact = contacts;
+    contacts.reset();
 
     for (ContactGenerators::iterator i = contactGenerator.begin(); i != contactGenerator.end();i++)
     {
-        unsigned used = (*i)->addContact(nextContact, limit);
-        limit -= used;
-        nextContact += used;
-
-        // We've run out of contacts to fill. This means we're missing
-        // contacts.
-        if (limit <= 0) break;
+        contacts.addContacts(*i);
     }
 
     // Return the number of contacts used.
-    return maxContacts - limit;
+    return contacts.getContactCount();
 }
 
 void World::runPhysics(real dt)
 {
+    if (solverType == SUBSTEPPED_IMPULSE)
+    {
+        runSubsteps(dt);
+        return;
+    }
+
     // First apply the force generators
     //registry.updateForces(duration);
 
@@ -67,11 +117,93 @@ void World::runPhysics(real dt)
         (*i)->integrate(dt);
 
     }
+    for (Articulations::iterator i = articulations.begin();
+        i != articulations.end(); i++)
+    {
+        (*i)->integrate(dt);
+    }
 
     // Generate contacts
     unsigned usedContacts = generateContacts();
+    Contact* contactArray = contacts.getContacts();
 
-    // And process them
-    if (calculateIterations) resolver.setIterations(usedContacts * 4);
-    resolver.resolveContacts(contacts, usedContacts, dt);
-}
\ No newline at end of file
+    // Prime them with last frame's impulses
+    if (warmStarting) contactCache.retrieve(contactArray, usedContacts);
+
+    // And process them, with the joints
+    Joint* const* jointArray = joints.empty() ? NULL : &joints[0];
+    unsigned numJoints = (unsigned)joints.size();
+    if (solverType == SEQUENTIAL_IMPULSE)
+    {
+        solver.solveContacts(contactArray, usedContacts, dt,
+            jointArray, numJoints);
+    }
+    else if (solverType == PARALLEL_IMPULSE)
+    {
+        solver.solveContactsParallel(contactArray, usedContacts, dt,
+            solverThreads, jointArray, numJoints);
+    }
+    else
+    {
+        // The resolver has no joints, so they are solved on their
+        // own afterwards. The resolver moves the bodies as well as
+        // changing their velocities, so joints solved first would be
+        // pulled apart again.
+        if (calculateIterations) resolver.setIterations(usedContacts * 4);
+        resolver.resolveContacts(contactArray, usedContacts, dt);
+        if (numJoints > 0) solver.solveContacts(NULL, 0, dt, jointArray, numJoints);
+    }
+
+    // Pass what the contacts did to the links on to the articulations
+    for (Articulations::iterator i = articulations.begin();
+        i != articulations.end(); i++)
+    {
+        (*i)->applyBodyChanges();
+    }
+
+    // Remember the impulses for the next frame
+    if (warmStarting) contactCache.store(contactArray, usedContacts);
+}
+
+void World::runSubsteps(real dt)
+{
+    // Generate contacts once, from where the bodies are at the start
+    // of the frame
+    unsigned usedContacts = generateContacts();
+    Contact* contactArray = contacts.getContacts();
+    if (warmStarting) contactCache.retrieve(contactArray, usedContacts);
+
+    Joint* const* jointArray = joints.empty() ? NULL : &joints[0];
+    unsigned numJoints = (unsigned)joints.size();
+    real step = dt / substeps;
+    solver.beginSubsteps(contactArray, usedContacts, dt, substeps,
+        jointArray, numJoints);
+
+    // Then integrate and sweep once per substep. The forces apply to
+    // every substep, so they are only cleared after the last.
+    for (unsigned s = 0; s < substeps; s++)
+    {
+        bool keepForces = s + 1 < substeps;
+        for (RigidBodies::iterator i = bodies.begin(); i != bodies.end(); i++)
+        {
+            (*i)->integrate(step, keepForces);
+        }
+        for (Articulations::iterator i = articulations.begin();
+            i != articulations.end(); i++)
+        {
+            (*i)->integrate(step, keepForces);
+        }
+
+        solver.solveSubstep();
+
+        for (Articulations::iterator i = articulations.begin();
+            i != articulations.end(); i++)
+        {
+            (*i)->applyBodyChanges();
+        }
+    }
+    solver.endSubsteps();
+
+    // Remember the impulses for the next frame
+    if (warmStarting) contactCache.store(contactArray, usedContacts);
+}
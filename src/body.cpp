@@ -121,7 +121,7 @@ void RigidBody::addForce(const Vector3& force)
 	forceAccum += force;
 }
 
-void RigidBody::integrate(real dt)
+void RigidBody::integrate(real dt, bool keepForces)
 {
 	if (!isAwake) return;
 	//Calculate linear Acceleration from force inputs
@@ -154,7 +154,7 @@ void RigidBody::integrate(real dt)
 	calculateDerivedData();
 
 	//Clear Accumulators
-	clearAccumulators();
+	if (!keepForces) clearAccumulators();
 
 	// Update the kinetic energy store, and possibly put the body to
 	// sleep.